@@ -0,0 +1,341 @@
+#define _POSIX_C_SOURCE 200112L /* clock_gettime support */
+
+#include "font_rsrc.h"
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OK FONT_NO_ERROR
+
+/* Number of runs of a benchmark. Its median run is reported */
+#define NRUNS 7
+
+/* Number of loads of the font per run of the load benchmark */
+#define NLOADS 16
+
+struct workload {
+  const char* name;
+  wchar_t* chars;
+  size_t nchars;
+};
+
+/* Output of a benchmark run */
+struct run {
+  int64_t time; /* In nanoseconds */
+  size_t nops;
+};
+
+static int64_t
+time_ns(void)
+{
+  struct timespec t;
+  CHECK(clock_gettime(CLOCK_MONOTONIC, &t), 0);
+  return (int64_t)t.tv_sec * 1000000000 + (int64_t)t.tv_nsec;
+}
+
+static int
+cmp_runs(const void* a, const void* b)
+{
+  const struct run* run_a = a;
+  const struct run* run_b = b;
+  return (run_a->time > run_b->time) - (run_a->time < run_b->time);
+}
+
+/* Print the CSV record of the median run of a benchmark */
+static void
+report
+  (const char* font,
+   const char* workload,
+   const int size,
+   const char* bench,
+   struct run runs[NRUNS])
+{
+  const struct run* median = NULL;
+  double ns_per_op = 0;
+
+  qsort(runs, NRUNS, sizeof(struct run), cmp_runs);
+  median = runs + NRUNS / 2;
+  ns_per_op = median->nops ? (double)median->time / (double)median->nops : 0;
+  printf("%s,%s,%d,%s,%lu,%.1f,%.0f\n", font, workload, size, bench,
+    (unsigned long)median->nops, ns_per_op,
+    ns_per_op > 0 ? 1.e9 / ns_per_op : 0);
+}
+
+static void
+bench_load(struct font_rsrc* font, const char* path, struct run* run)
+{
+  int64_t t0 = 0;
+  int i = 0;
+
+  t0 = time_ns();
+  for(i = 0; i < NLOADS; ++i)
+    CHECK(font_rsrc_load(font, path), OK);
+  run->time = time_ns() - t0;
+  run->nops = NLOADS;
+}
+
+/* Get and release the glyphs of the workload */
+static void
+bench_get_glyph
+  (struct font_rsrc* font,
+   const struct workload* work,
+   struct run* run)
+{
+  int64_t t0 = 0;
+  size_t i = 0;
+
+  t0 = time_ns();
+  for(i = 0; i < work->nchars; ++i) {
+    struct font_glyph* glyph = NULL;
+    if(font_rsrc_get_glyph(font, work->chars[i], &glyph) == OK)
+      CHECK(font_glyph_ref_put(glyph), OK);
+  }
+  run->time = time_ns() - t0;
+  run->nops = work->nchars;
+}
+
+static void
+bench_get_glyph_descs
+  (struct font_rsrc* font,
+   const struct workload* work,
+   struct font_glyph_desc* descs,
+   struct run* run)
+{
+  int64_t t0 = 0;
+
+  t0 = time_ns();
+  CHECK(font_rsrc_get_glyph_descs(font, work->chars, work->nchars, descs), OK);
+  run->time = time_ns() - t0;
+  run->nops = work->nchars;
+}
+
+/* Query the metrics of the workload without hinting, never cached */
+static void
+bench_get_unhinted_glyph_descs
+  (struct font_rsrc* font,
+   const struct workload* work,
+   struct font_glyph_desc* descs,
+   struct run* run)
+{
+  int64_t t0 = 0;
+
+  t0 = time_ns();
+  CHECK(font_rsrc_get_unhinted_glyph_descs
+    (font, work->chars, work->nchars, descs), OK);
+  run->time = time_ns() - t0;
+  run->nops = work->nchars;
+}
+
+static void
+bench_get_glyph_advances
+  (struct font_rsrc* font,
+   const struct workload* work,
+   int* advances,
+   struct run* run)
+{
+  int64_t t0 = 0;
+
+  t0 = time_ns();
+  CHECK(font_rsrc_get_glyph_advances
+    (font, work->chars, work->nchars, advances), OK);
+  run->time = time_ns() - t0;
+  run->nops = work->nchars;
+}
+
+/* Rasterize the freshly loaded glyphs of the workload and then copy their
+ * bitmaps into `buffer' */
+static void
+bench_bitmaps
+  (struct font_rsrc* font,
+   const struct workload* work,
+   const bool antialiasing,
+   struct font_glyph** glyphs,
+   unsigned char* buffer,
+   struct run* raster_run,
+   struct run* copy_run)
+{
+  int64_t t0 = 0;
+  size_t nglyphs = 0;
+  size_t i = 0;
+
+  /* The glyph cache is disabled: the glyphs are not rasterized yet */
+  for(i = 0; i < work->nchars; ++i) {
+    if(font_rsrc_get_glyph(font, work->chars[i], glyphs + nglyphs) == OK)
+      ++nglyphs;
+  }
+
+  t0 = time_ns();
+  for(i = 0; i < nglyphs; ++i) {
+    CHECK(font_glyph_get_bitmap
+      (glyphs[i], antialiasing, NULL, NULL, NULL, NULL), OK);
+  }
+  raster_run->time = time_ns() - t0;
+  raster_run->nops = nglyphs;
+
+  t0 = time_ns();
+  for(i = 0; i < nglyphs; ++i) {
+    CHECK(font_glyph_get_bitmap
+      (glyphs[i], antialiasing, NULL, NULL, NULL, buffer), OK);
+  }
+  copy_run->time = time_ns() - t0;
+  copy_run->nops = nglyphs;
+
+  for(i = 0; i < nglyphs; ++i)
+    CHECK(font_glyph_ref_put(glyphs[i]), OK);
+}
+
+static void
+bench_workload
+  (struct font_rsrc* font,
+   const char* name,
+   const struct workload* work,
+   const int size)
+{
+  struct run runs[NRUNS];
+  struct run runs2[NRUNS];
+  struct font_glyph** glyphs = NULL;
+  struct font_glyph_desc* descs = NULL;
+  int* advances = NULL;
+  unsigned char* buffer = NULL;
+  size_t max_size = 0;
+  size_t i = 0;
+  int irun = 0;
+
+  glyphs = MEM_CALLOC(&mem_default_allocator, work->nchars, sizeof(*glyphs));
+  descs = MEM_CALLOC(&mem_default_allocator, work->nchars, sizeof(*descs));
+  advances = MEM_CALLOC(&mem_default_allocator, work->nchars, sizeof(int));
+  NCHECK(glyphs, NULL);
+  NCHECK(descs, NULL);
+  NCHECK(advances, NULL);
+
+  /* Size the copy buffer to the largest bitmap of the workload */
+  for(i = 0; i < work->nchars; ++i) {
+    struct font_glyph* glyph = NULL;
+    int w = 0, h = 0, Bpp = 0;
+    if(font_rsrc_get_glyph(font, work->chars[i], &glyph) != OK)
+      continue;
+    CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, NULL), OK);
+    if((size_t)(w * h * Bpp) > max_size)
+      max_size = (size_t)(w * h * Bpp);
+    CHECK(font_glyph_ref_put(glyph), OK);
+  }
+  buffer = MEM_ALLOC(&mem_default_allocator, max_size + 1);
+  NCHECK(buffer, NULL);
+
+  /* Cold glyphs are loaded on each request */
+  CHECK(font_rsrc_set_glyph_cache_size(font, 0), OK);
+  for(irun = 0; irun < NRUNS; ++irun)
+    bench_get_glyph(font, work, runs + irun);
+  report(name, work->name, size, "get_glyph_cold", runs);
+  for(irun = 0; irun < NRUNS; ++irun)
+    bench_get_unhinted_glyph_descs(font, work, descs, runs + irun);
+  report(name, work->name, size, "get_unhinted_glyph_descs", runs);
+  for(irun = 0; irun < NRUNS; ++irun)
+    bench_get_glyph_advances(font, work, advances, runs + irun);
+  report(name, work->name, size, "get_glyph_advances", runs);
+
+  for(irun = 0; irun < NRUNS; ++irun)
+    bench_bitmaps(font, work, false, glyphs, buffer, runs+irun, runs2+irun);
+  report(name, work->name, size, "rasterize_mono", runs);
+  report(name, work->name, size, "copy_bitmap_mono", runs2);
+  for(irun = 0; irun < NRUNS; ++irun)
+    bench_bitmaps(font, work, true, glyphs, buffer, runs+irun, runs2+irun);
+  report(name, work->name, size, "rasterize_aa", runs);
+  report(name, work->name, size, "copy_bitmap_aa", runs2);
+
+  /* Warm glyphs are returned by the glyph cache */
+  CHECK(font_rsrc_set_glyph_cache_size(font, SIZE_MAX), OK);
+  bench_get_glyph(font, work, runs); /* Fill the cache */
+  for(irun = 0; irun < NRUNS; ++irun)
+    bench_get_glyph(font, work, runs + irun);
+  report(name, work->name, size, "get_glyph_warm", runs);
+  for(irun = 0; irun < NRUNS; ++irun)
+    bench_get_glyph_descs(font, work, descs, runs + irun);
+  report(name, work->name, size, "get_glyph_descs", runs);
+
+  MEM_FREE(&mem_default_allocator, buffer);
+  MEM_FREE(&mem_default_allocator, advances);
+  MEM_FREE(&mem_default_allocator, descs);
+  MEM_FREE(&mem_default_allocator, glyphs);
+}
+
+int
+main(int argc, char** argv)
+{
+  const int sizes[] = { 12, 24, 48 };
+  struct workload works[2];
+  struct font_system* sys = NULL;
+  int iarg = 0;
+  size_t i = 0;
+
+  if(argc < 2) {
+    printf("usage: %s FONT [FONT ...]\n", argv[0]);
+    goto error;
+  }
+
+  CHECK(font_system_create(NULL, &sys), OK);
+  printf("font,workload,size,benchmark,ops,ns_per_op,ops_per_sec\n");
+
+  for(iarg = 1; iarg < argc; ++iarg) {
+    struct run runs[NRUNS];
+    struct font_rsrc* font = NULL;
+    const char* name = NULL;
+    size_t iwork = 0;
+    int irun = 0;
+    int ch = 0;
+    bool is_scalable = false;
+
+    name = strrchr(argv[iarg], '/');
+    name = name ? name + 1 : argv[iarg];
+    CHECK(font_rsrc_create(sys, argv[iarg], &font), OK);
+
+    for(irun = 0; irun < NRUNS; ++irun)
+      bench_load(font, argv[iarg], runs + irun);
+    report(name, "-", 0, "load", runs);
+
+    /* Printable ASCII characters and every BMP character of the font */
+    works[0].name = "ascii";
+    works[1].name = "bmp";
+    works[0].nchars = works[1].nchars = 0;
+    works[0].chars = MEM_ALLOC(&mem_default_allocator, 95 * sizeof(wchar_t));
+    works[1].chars = MEM_ALLOC(&mem_default_allocator, 65536*sizeof(wchar_t));
+    NCHECK(works[0].chars, NULL);
+    NCHECK(works[1].chars, NULL);
+    for(ch = 0; ch < 65536; ++ch) {
+      bool has_char = false;
+      CHECK(font_rsrc_has_char(font, (wchar_t)ch, &has_char), OK);
+      if(!has_char)
+        continue;
+      if(ch >= 32 && ch < 127)
+        works[0].chars[works[0].nchars++] = (wchar_t)ch;
+      works[1].chars[works[1].nchars++] = (wchar_t)ch;
+    }
+
+    CHECK(font_rsrc_is_scalable(font, &is_scalable), OK);
+    for(iwork = 0; iwork < 2; ++iwork) {
+      if(!is_scalable) { /* Bitmap fonts have a single size */
+        bench_workload(font, name, works + iwork, 0);
+        continue;
+      }
+      for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+        CHECK(font_rsrc_set_size(font, sizes[i], sizes[i]), OK);
+        bench_workload(font, name, works + iwork, sizes[i]);
+      }
+    }
+    MEM_FREE(&mem_default_allocator, works[0].chars);
+    MEM_FREE(&mem_default_allocator, works[1].chars);
+    CHECK(font_rsrc_ref_put(font), OK);
+  }
+  CHECK(font_system_ref_put(sys), OK);
+
+  CHECK(MEM_ALLOCATED_SIZE(&mem_default_allocator), 0);
+  return 0;
+
+error:
+  return -1;
+}
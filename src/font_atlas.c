@@ -0,0 +1,1258 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Number of empty pixels between two packed glyphs. It prevents the texture
+ * filtering of a glyph to bleed over its neighbours. */
+#define ATLAS_GLYPH_PADDING 1
+
+#define ATLAS_NIL ((size_t)-1)
+
+/* Maximum number of dirty rectangles per page. Once reached, new rectangles
+ * are merged with the rectangle whose bounding box grows the least. */
+#define ATLAS_MAX_DIRTY_RECTS 8
+
+/* Atlas file. The file stores the index and the pages of the atlas in the
+ * memory layout of the host so that they are used in place once the file is
+ * mapped. Its sections are aligned on ATLAS_FILE_ALIGNMENT bytes. */
+#define ATLAS_FILE_MAGIC "FONTATL"
+#define ATLAS_FILE_VERSION 2
+#define ATLAS_FILE_ALIGNMENT 64
+
+/* Horizontal segment of the skyline of a page. The skyline is the upper
+ * envelope of the glyphs packed into the page. */
+struct skyline_node {
+  int x;
+  int y;
+  int width;
+};
+
+struct atlas_rect {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+struct atlas_page {
+  unsigned char* pixels; /* 1 byte per pixel */
+  struct skyline_node* nodes; /* Sorted in ascending x */
+  size_t nnodes;
+  size_t max_nodes;
+  /* Disjoint rectangles written since the last flush */
+  struct atlas_rect dirty[ATLAS_MAX_DIRTY_RECTS];
+  size_t ndirty;
+};
+
+struct atlas_key {
+  size_t font_id; /* Index of the font in the font list of the atlas */
+  wchar_t character;
+  FT_Fixed x_scale; /* Scale of the font size */
+  FT_Fixed y_scale;
+  bool antialiasing;
+  int sdf_spread; /* Spread of the signed distance field. 0 for a bitmap */
+};
+
+struct atlas_entry {
+  struct atlas_key key;
+  struct font_atlas_glyph glyph;
+  size_t next; /* Next entry in the hash bucket */
+};
+
+struct atlas_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size; /* sizeof(struct atlas_entry) */
+  int32_t page_width;
+  int32_t page_height;
+  uint64_t npages;
+  uint64_t nfonts;
+  uint64_t nentries;
+  uint64_t nbuckets;
+  /* Offsets in bytes from the beginning of the file */
+  uint64_t fonts_offset; /* Hash of the data of each font */
+  uint64_t entries_offset;
+  uint64_t buckets_offset;
+  uint64_t pages_offset;
+};
+
+struct font_atlas {
+  struct atomic_ref ref;
+  struct font_system* sys;
+  pthread_mutex_t lock; /* Serialize the lookup and the packing of glyphs */
+  int page_width;
+  int page_height;
+
+  struct atlas_page* pages;
+  size_t npages;
+  size_t max_pages;
+
+  struct font_rsrc** fonts; /* Fonts of the packed glyphs */
+  size_t nfonts;
+  size_t max_fonts;
+
+  struct atlas_entry* entries;
+  size_t nentries;
+  size_t max_entries;
+  size_t* buckets; /* Hash table of the entries. Power of 2 sized */
+  size_t nbuckets;
+
+  /* File mapped by font_atlas_load. Its pages are read only and new glyphs
+   * are thus packed into new pages. Its index is copied on the first
+   * glyph insertion. */
+  const unsigned char* file;
+  size_t file_size;
+  size_t nmapped_pages; /* The first pages of the atlas lie in the file */
+  bool is_index_mapped; /* The entries and the buckets lie in the file */
+};
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static size_t
+hash_atlas_key(const struct atlas_key* key)
+{
+  /* 32-bits FNV-1a hash of the key fields. */
+  const uint32_t fields[6] = {
+    (uint32_t)key->font_id,
+    (uint32_t)key->character,
+    (uint32_t)key->x_scale,
+    (uint32_t)key->y_scale,
+    (uint32_t)key->antialiasing,
+    (uint32_t)key->sdf_spread
+  };
+  const unsigned char* bytes = (const unsigned char*)fields;
+  uint32_t hash = 2166136261u;
+  size_t i = 0;
+
+  for(i = 0; i < sizeof(fields); ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return (size_t)hash;
+}
+
+static bool
+atlas_key_eq(const struct atlas_key* a, const struct atlas_key* b)
+{
+  return a->font_id == b->font_id
+      && a->character == b->character
+      && a->x_scale == b->x_scale
+      && a->y_scale == b->y_scale
+      && a->antialiasing == b->antialiasing
+      && a->sdf_spread == b->sdf_spread;
+}
+
+/* Grow the array `*data' of `*capacity' elements of `size' bytes in order to
+ * store at least `count' elements. */
+static enum font_error
+reserve
+  (struct mem_allocator* allocator,
+   void** data,
+   size_t* capacity,
+   const size_t count,
+   const size_t size)
+{
+  void* mem = NULL;
+  size_t new_capacity = 0;
+  ASSERT(allocator && data && capacity);
+
+  if(count <= *capacity)
+    return FONT_NO_ERROR;
+  new_capacity = *capacity ? *capacity : 16;
+  while(new_capacity < count)
+    new_capacity *= 2;
+  mem = MEM_REALLOC(allocator, *data, new_capacity * size);
+  if(!mem)
+    return FONT_MEMORY_ERROR;
+  *data = mem;
+  *capacity = new_capacity;
+  return FONT_NO_ERROR;
+}
+
+static size_t
+atlas_find(const struct font_atlas* atlas, const struct atlas_key* key)
+{
+  size_t id = ATLAS_NIL;
+  ASSERT(atlas && key);
+
+  if(!atlas->nbuckets)
+    return ATLAS_NIL;
+  id = atlas->buckets[hash_atlas_key(key) & (atlas->nbuckets - 1)];
+  while(id != ATLAS_NIL && !atlas_key_eq(&atlas->entries[id].key, key))
+    id = atlas->entries[id].next;
+  return id;
+}
+
+static enum font_error
+atlas_rehash(struct font_atlas* atlas, const size_t nbuckets)
+{
+  size_t* buckets = NULL;
+  size_t i = 0;
+  ASSERT(atlas && nbuckets && !(nbuckets & (nbuckets - 1)));
+
+  buckets = MEM_ALLOC(atlas->sys->allocator, nbuckets * sizeof(size_t));
+  if(!buckets)
+    return FONT_MEMORY_ERROR;
+  for(i = 0; i < nbuckets; ++i)
+    buckets[i] = ATLAS_NIL;
+  for(i = 0; i < atlas->nentries; ++i) {
+    const size_t id = hash_atlas_key(&atlas->entries[i].key) & (nbuckets - 1);
+    atlas->entries[i].next = buckets[id];
+    buckets[id] = i;
+  }
+  if(atlas->buckets)
+    MEM_FREE(atlas->sys->allocator, atlas->buckets);
+  atlas->buckets = buckets;
+  atlas->nbuckets = nbuckets;
+  return FONT_NO_ERROR;
+}
+
+/* Copy the index mapped from an atlas file in memory before its update */
+static enum font_error
+atlas_unmap_index(struct font_atlas* atlas)
+{
+  struct atlas_entry* entries = NULL;
+  size_t* buckets = NULL;
+  ASSERT(atlas);
+
+  if(!atlas->is_index_mapped)
+    return FONT_NO_ERROR;
+
+  if(atlas->nentries) {
+    entries = MEM_ALLOC
+      (atlas->sys->allocator, atlas->nentries * sizeof(struct atlas_entry));
+    if(!entries)
+      goto error;
+    memcpy(entries, atlas->entries,
+      atlas->nentries * sizeof(struct atlas_entry));
+  }
+  if(atlas->nbuckets) {
+    buckets = MEM_ALLOC(atlas->sys->allocator, atlas->nbuckets*sizeof(size_t));
+    if(!buckets)
+      goto error;
+    memcpy(buckets, atlas->buckets, atlas->nbuckets * sizeof(size_t));
+  }
+  atlas->entries = entries;
+  atlas->max_entries = atlas->nentries;
+  atlas->buckets = buckets;
+  atlas->is_index_mapped = false;
+  return FONT_NO_ERROR;
+error:
+  if(entries)
+    MEM_FREE(atlas->sys->allocator, entries);
+  return FONT_MEMORY_ERROR;
+}
+
+static size_t
+align_file_offset(const size_t offset)
+{
+  return (offset + ATLAS_FILE_ALIGNMENT - 1) & ~(size_t)(ATLAS_FILE_ALIGNMENT-1);
+}
+
+/* Write `size' bytes at the current end of the file whose offset is updated.
+ * The data are written from the next aligned offset. */
+static bool
+write_section
+  (FILE* fp,
+   const void* data,
+   const size_t size,
+   size_t* offset)
+{
+  static const unsigned char zeros[ATLAS_FILE_ALIGNMENT] = { 0 };
+  const size_t begin = align_file_offset(*offset);
+  ASSERT(fp && offset && (data || !size));
+
+  if(begin != *offset
+  && fwrite(zeros, 1, begin - *offset, fp) != begin - *offset)
+    return false;
+  if(size && fwrite(data, 1, size, fp) != size)
+    return false;
+  *offset = begin + size;
+  return true;
+}
+
+/* Check that the content of a mapped atlas file is consistent with the atlas
+ * and its header. */
+static bool
+check_atlas_file
+  (const struct font_atlas* atlas,
+   const unsigned char* file,
+   const size_t file_size)
+{
+  const struct atlas_file_header* header = NULL;
+  const struct atlas_entry* entries = NULL;
+  const size_t* buckets = NULL;
+  size_t page_size = 0;
+  size_t nwalked = 0;
+  size_t i = 0;
+  ASSERT(atlas && file);
+
+  if(file_size < sizeof(struct atlas_file_header))
+    return false;
+  header = (const struct atlas_file_header*)file;
+  page_size = (size_t)atlas->page_width * (size_t)atlas->page_height;
+
+  if(memcmp(header->magic, ATLAS_FILE_MAGIC, sizeof(ATLAS_FILE_MAGIC))
+  || header->version != ATLAS_FILE_VERSION
+  || header->entry_size != sizeof(struct atlas_entry)
+  || header->page_width != atlas->page_width
+  || header->page_height != atlas->page_height
+  || (header->nbuckets & (header->nbuckets - 1))
+  || header->nentries > header->nbuckets)
+    return false;
+
+  #define CHECK_SECTION(Offset, Count, Size)                                   \
+    if((Offset) % ATLAS_FILE_ALIGNMENT                                         \
+    || (Offset) > file_size                                                    \
+    || (Count) > (file_size - (Offset)) / (Size))                              \
+      return false;
+  CHECK_SECTION(header->fonts_offset, header->nfonts, sizeof(uint64_t))
+  CHECK_SECTION(header->entries_offset, header->nentries, header->entry_size)
+  CHECK_SECTION(header->buckets_offset, header->nbuckets, sizeof(size_t))
+  CHECK_SECTION(header->pages_offset, header->npages, page_size)
+  #undef CHECK_SECTION
+
+  entries = (const struct atlas_entry*)(file + header->entries_offset);
+  buckets = (const size_t*)(file + header->buckets_offset);
+  for(i = 0; i < header->nentries; ++i) {
+    const struct font_atlas_glyph* glyph = &entries[i].glyph;
+    if((entries[i].next != ATLAS_NIL && entries[i].next >= header->nentries)
+    || entries[i].key.font_id >= header->nfonts
+    || glyph->page < 0
+    || (glyph->rect.width && (uint64_t)glyph->page >= header->npages)
+    || glyph->rect.x < 0
+    || glyph->rect.y < 0
+    || glyph->rect.width < 0
+    || glyph->rect.height < 0
+    || glyph->rect.width > atlas->page_width - glyph->rect.x
+    || glyph->rect.height > atlas->page_height - glyph->rect.y)
+      return false;
+  }
+  /* Each entry lies in one bucket chain. Bounding the walk of the chains by
+   * the number of entries rejects the cycles on which a lookup would spin */
+  for(i = 0; i < header->nbuckets; ++i) {
+    size_t ientry = buckets[i];
+    while(ientry != ATLAS_NIL) {
+      if(ientry >= header->nentries || nwalked++ >= header->nentries)
+        return false;
+      ientry = entries[ientry].next;
+    }
+  }
+  return true;
+}
+
+static long
+rect_area(const struct atlas_rect* rect)
+{
+  ASSERT(rect);
+  return (long)rect->width * (long)rect->height;
+}
+
+static struct atlas_rect
+rect_union(const struct atlas_rect* a, const struct atlas_rect* b)
+{
+  struct atlas_rect rect;
+  const int a_x_max = a->x + a->width;
+  const int a_y_max = a->y + a->height;
+  const int b_x_max = b->x + b->width;
+  const int b_y_max = b->y + b->height;
+  ASSERT(a && b);
+
+  rect.x = a->x < b->x ? a->x : b->x;
+  rect.y = a->y < b->y ? a->y : b->y;
+  rect.width = (a_x_max > b_x_max ? a_x_max : b_x_max) - rect.x;
+  rect.height = (a_y_max > b_y_max ? a_y_max : b_y_max) - rect.y;
+  return rect;
+}
+
+/* Overlapping rectangles are merged to keep the dirty rectangles disjoint.
+ * So are the rectangles whose union covers no extra pixel, e.g. the glyphs
+ * of same height packed side by side. */
+static bool
+rect_must_merge(const struct atlas_rect* a, const struct atlas_rect* b)
+{
+  struct atlas_rect rect;
+  ASSERT(a && b);
+
+  if(a->x < b->x + b->width && b->x < a->x + a->width
+  && a->y < b->y + b->height && b->y < a->y + a->height)
+    return true;
+  rect = rect_union(a, b);
+  return rect_area(&rect) <= rect_area(a) + rect_area(b);
+}
+
+static void
+page_add_dirty_rect(struct atlas_page* page, const struct atlas_rect* rect)
+{
+  struct atlas_rect dirty;
+  size_t i = 0;
+  ASSERT(page && rect);
+
+  dirty = *rect;
+  for(;;) {
+    for(i = 0; i < page->ndirty; ++i) {
+      if(rect_must_merge(page->dirty + i, &dirty))
+        break;
+    }
+    if(i == page->ndirty) {
+      long best_growth = LONG_MAX;
+      size_t j = 0;
+
+      if(page->ndirty < ATLAS_MAX_DIRTY_RECTS)
+        break;
+      for(j = 0; j < page->ndirty; ++j) {
+        const struct atlas_rect merged = rect_union(page->dirty + j, &dirty);
+        const long growth = rect_area(&merged) - rect_area(page->dirty + j);
+        if(growth < best_growth) {
+          best_growth = growth;
+          i = j;
+        }
+      }
+    }
+    /* The merged rectangle may now overlap other rectangles */
+    dirty = rect_union(page->dirty + i, &dirty);
+    page->dirty[i] = page->dirty[--page->ndirty];
+  }
+  page->dirty[page->ndirty++] = dirty;
+}
+
+static enum font_error
+atlas_register_font
+  (struct font_atlas* atlas,
+   struct font_rsrc* font,
+   size_t* font_id)
+{
+  enum font_error font_err = FONT_NO_ERROR;
+  size_t i = 0;
+  ASSERT(atlas && font && font_id);
+
+  for(i = 0; i < atlas->nfonts && atlas->fonts[i] != font; ++i);
+  if(i == atlas->nfonts) {
+    font_err = reserve(atlas->sys->allocator, (void**)&atlas->fonts,
+      &atlas->max_fonts, atlas->nfonts + 1, sizeof(struct font_rsrc*));
+    if(font_err != FONT_NO_ERROR)
+      return font_err;
+    /* Keep the font alive in order to prevent a new font to be allocated at
+     * the same address and thus to match the glyphs of this one. */
+    FONT(rsrc_ref_get(font));
+    atlas->fonts[atlas->nfonts++] = font;
+  }
+  *font_id = i;
+  return FONT_NO_ERROR;
+}
+
+/* Return the lowest y coordinate where a `width' pixels wide rectangle can
+ * lie when its left border is on the node `inode', or -1 if it does not fit
+ * into the page. */
+static int
+skyline_fit
+  (const struct font_atlas* atlas,
+   const struct atlas_page* page,
+   const size_t inode,
+   const int width,
+   const int height)
+{
+  int x = page->nodes[inode].x;
+  int y = 0;
+  int remaining = width;
+  size_t i = inode;
+
+  if(x + width > atlas->page_width)
+    return -1;
+  while(remaining > 0) {
+    ASSERT(i < page->nnodes);
+    if(page->nodes[i].y > y)
+      y = page->nodes[i].y;
+    if(y + height > atlas->page_height)
+      return -1;
+    remaining -= page->nodes[i].width;
+    ++i;
+  }
+  return y;
+}
+
+/* Find the bottom-left position of a `width x height' rectangle into the
+ * page. Return false if the rectangle does not fit. */
+static bool
+skyline_find
+  (const struct font_atlas* atlas,
+   const struct atlas_page* page,
+   const int width,
+   const int height,
+   size_t* out_inode,
+   int* out_x,
+   int* out_y)
+{
+  int best_bottom = INT_MAX;
+  int best_width = INT_MAX;
+  size_t i = 0;
+  ASSERT(atlas && page && out_inode && out_x && out_y);
+
+  for(i = 0; i < page->nnodes; ++i) {
+    const int y = skyline_fit(atlas, page, i, width, height);
+    if(y < 0)
+      continue;
+    if(y + height < best_bottom
+    || (y + height == best_bottom && page->nodes[i].width < best_width)) {
+      best_bottom = y + height;
+      best_width = page->nodes[i].width;
+      *out_inode = i;
+      *out_x = page->nodes[i].x;
+      *out_y = y;
+    }
+  }
+  return best_bottom != INT_MAX;
+}
+
+/* Raise the skyline of the page over the rectangle inserted at `inode'. */
+static enum font_error
+skyline_insert
+  (struct font_atlas* atlas,
+   struct atlas_page* page,
+   const size_t inode,
+   const int x,
+   const int y,
+   const int width,
+   const int height)
+{
+  struct skyline_node* node = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+  size_t i = 0;
+
+  font_err = reserve(atlas->sys->allocator, (void**)&page->nodes,
+    &page->max_nodes, page->nnodes + 1, sizeof(struct skyline_node));
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+
+  memmove(page->nodes + inode + 1, page->nodes + inode,
+    (page->nnodes - inode) * sizeof(struct skyline_node));
+  ++page->nnodes;
+  node = page->nodes + inode;
+  node->x = x;
+  node->y = y + height;
+  node->width = width;
+
+  /* Shrink or remove the nodes covered by the new one */
+  i = inode + 1;
+  while(i < page->nnodes) {
+    struct skyline_node* next = page->nodes + i;
+    const int shrink = node->x + node->width - next->x;
+    if(shrink <= 0)
+      break;
+    if(shrink < next->width) {
+      next->x += shrink;
+      next->width -= shrink;
+      break;
+    }
+    memmove(next, next + 1,
+      (page->nnodes - i - 1) * sizeof(struct skyline_node));
+    --page->nnodes;
+  }
+
+  /* Merge the adjacent nodes lying at the same height */
+  i = 0;
+  while(i + 1 < page->nnodes) {
+    if(page->nodes[i].y != page->nodes[i + 1].y) {
+      ++i;
+    } else {
+      page->nodes[i].width += page->nodes[i + 1].width;
+      memmove(page->nodes + i + 1, page->nodes + i + 2,
+        (page->nnodes - i - 2) * sizeof(struct skyline_node));
+      --page->nnodes;
+    }
+  }
+  return FONT_NO_ERROR;
+}
+
+static enum font_error
+atlas_add_page(struct font_atlas* atlas)
+{
+  struct atlas_page* page = NULL;
+  const size_t size = (size_t)atlas->page_width * (size_t)atlas->page_height;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(atlas);
+
+  font_err = reserve(atlas->sys->allocator, (void**)&atlas->pages,
+    &atlas->max_pages, atlas->npages + 1, sizeof(struct atlas_page));
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+
+  page = atlas->pages + atlas->npages;
+  memset(page, 0, sizeof(struct atlas_page));
+  page->pixels = MEM_CALLOC(atlas->sys->allocator, size, 1);
+  if(!page->pixels)
+    return FONT_MEMORY_ERROR;
+  font_err = reserve(atlas->sys->allocator, (void**)&page->nodes,
+    &page->max_nodes, 1, sizeof(struct skyline_node));
+  if(font_err != FONT_NO_ERROR) {
+    MEM_FREE(atlas->sys->allocator, page->pixels);
+    return font_err;
+  }
+  page->nodes[0].x = 0;
+  page->nodes[0].y = 0;
+  page->nodes[0].width = atlas->page_width;
+  page->nnodes = 1;
+  ++atlas->npages;
+  return FONT_NO_ERROR;
+}
+
+/* Allocate a `width x height' rectangle into the atlas. Pages are only added;
+ * already packed glyphs never move. */
+static enum font_error
+atlas_alloc_rect
+  (struct font_atlas* atlas,
+   const int width,
+   const int height,
+   size_t* out_page,
+   int* out_x,
+   int* out_y)
+{
+  size_t inode = 0;
+  size_t ipage = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(atlas && out_page && out_x && out_y);
+
+  if(width > atlas->page_width || height > atlas->page_height)
+    return FONT_INVALID_ARGUMENT;
+
+  for(ipage = 0; ipage < atlas->npages; ++ipage) {
+    if(skyline_find(atlas, atlas->pages + ipage, width, height, &inode,
+       out_x, out_y))
+      break;
+  }
+  if(ipage == atlas->npages) {
+    font_err = atlas_add_page(atlas);
+    if(font_err != FONT_NO_ERROR)
+      return font_err;
+    if(!skyline_find(atlas, atlas->pages + ipage, width, height, &inode,
+       out_x, out_y)) {
+      ASSERT(false); /* Unreachable code */
+      return FONT_INTERNAL_ERROR;
+    }
+  }
+  font_err = skyline_insert
+    (atlas, atlas->pages + ipage, inode, *out_x, *out_y, width, height);
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+  *out_page = ipage;
+  return FONT_NO_ERROR;
+}
+
+/* Pack the bitmap `bmp' of `glyph' into the atlas. The atlas must be locked */
+static enum font_error
+atlas_pack_glyph
+  (struct font_atlas* atlas,
+   const struct atlas_key* key,
+   struct font_glyph* glyph,
+   const FT_Bitmap* bmp,
+   struct font_atlas_glyph* out_glyph)
+{
+  struct atlas_entry* entry = NULL;
+  struct atlas_rect dirty;
+  size_t ipage = 0;
+  size_t id = 0;
+  int x = 0, y = 0;
+  int width = 0, height = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(atlas && key && glyph && bmp && out_glyph);
+
+  /* Pages store one byte per pixel */
+  if(sizeof_ft_pixel_mode(bmp->pixel_mode) != 1)
+    return FONT_INVALID_ARGUMENT;
+  font_err = atlas_unmap_index(atlas);
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+  /* Grow the index before the allocation of the rectangle that could not be
+   * given back on error */
+  font_err = reserve(atlas->sys->allocator, (void**)&atlas->entries,
+    &atlas->max_entries, atlas->nentries + 1, sizeof(struct atlas_entry));
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+  if(atlas->nentries >= atlas->nbuckets) {
+    font_err = atlas_rehash(atlas, atlas->nbuckets ? atlas->nbuckets*2 : 64);
+    if(font_err != FONT_NO_ERROR)
+      return font_err;
+  }
+
+  width = (int)bmp->width;
+  height = (int)bmp->rows;
+  if(width && height) {
+    font_err = atlas_alloc_rect(atlas, width + ATLAS_GLYPH_PADDING,
+      height + ATLAS_GLYPH_PADDING, &ipage, &x, &y);
+    if(font_err != FONT_NO_ERROR)
+      return font_err;
+    copy_bitmap(bmp,
+      atlas->pages[ipage].pixels + (size_t)y*(size_t)atlas->page_width
+      + (size_t)x,
+      (size_t)atlas->page_width);
+    /* The padding is part of the dirty rectangle in order to merge it with
+     * the rectangles of the neighbour glyphs */
+    dirty.x = x;
+    dirty.y = y;
+    dirty.width = width + ATLAS_GLYPH_PADDING;
+    dirty.height = height + ATLAS_GLYPH_PADDING;
+    page_add_dirty_rect(atlas->pages + ipage, &dirty);
+  }
+
+  entry = atlas->entries + atlas->nentries;
+  memset(entry, 0, sizeof(struct atlas_entry)); /* Clean up the padding */
+  entry->key = *key;
+  FONT(glyph_get_desc(glyph, &entry->glyph.desc));
+  entry->glyph.page = (int)ipage;
+  entry->glyph.rect.x = x;
+  entry->glyph.rect.y = y;
+  entry->glyph.rect.width = width;
+  entry->glyph.rect.height = height;
+  entry->glyph.uv.u_min = (float)x / (float)atlas->page_width;
+  entry->glyph.uv.v_min = (float)y / (float)atlas->page_height;
+  entry->glyph.uv.u_max = (float)(x + width) / (float)atlas->page_width;
+  entry->glyph.uv.v_max = (float)(y + height) / (float)atlas->page_height;
+
+  id = hash_atlas_key(key) & (atlas->nbuckets - 1);
+  entry->next = atlas->buckets[id];
+  atlas->buckets[id] = atlas->nentries;
+  ++atlas->nentries;
+
+  *out_glyph = entry->glyph;
+  return FONT_NO_ERROR;
+}
+
+static void
+release_atlas(struct font_atlas* atlas)
+{
+  struct font_system* sys = NULL;
+  size_t i = 0;
+  ASSERT(atlas);
+
+  sys = atlas->sys;
+
+  for(i = atlas->nmapped_pages; i < atlas->npages; ++i) {
+    MEM_FREE(sys->allocator, atlas->pages[i].pixels);
+    MEM_FREE(sys->allocator, atlas->pages[i].nodes);
+  }
+  for(i = 0; i < atlas->nfonts; ++i)
+    FONT(rsrc_ref_put(atlas->fonts[i]));
+  if(atlas->pages)
+    MEM_FREE(sys->allocator, atlas->pages);
+  if(atlas->fonts)
+    MEM_FREE(sys->allocator, atlas->fonts);
+  if(atlas->entries && !atlas->is_index_mapped)
+    MEM_FREE(sys->allocator, atlas->entries);
+  if(atlas->buckets && !atlas->is_index_mapped)
+    MEM_FREE(sys->allocator, atlas->buckets);
+  if(atlas->file)
+    unmap_file(atlas->file, atlas->file_size);
+  MUTEX(destroy(&atlas->lock));
+  MEM_FREE(sys->allocator, atlas);
+  FONT(system_ref_put(sys));
+}
+
+/* Return the atlas glyph of `ch' rasterized with respect to `antialiasing',
+ * or the signed distance field of the glyph if `spread' is not 0 */
+static enum font_error
+atlas_get_glyph
+  (struct font_atlas* atlas,
+   struct font_rsrc* font,
+   const wchar_t ch,
+   const bool antialiasing,
+   const int spread,
+   struct font_atlas_glyph* out_glyph)
+{
+  struct atlas_key key;
+  struct font_glyph* glyph = NULL;
+  const FT_Bitmap* bmp = NULL;
+  size_t id = 0;
+  bool is_locked = false;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!atlas || !font || !out_glyph || font->sys != atlas->sys
+  || !font->ft_face) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  MUTEX(lock(&atlas->lock));
+  is_locked = true;
+  font_err = atlas_register_font(atlas, font, &key.font_id);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  key.character = ch;
+  key.x_scale = font->ft_size->metrics.x_scale;
+  key.y_scale = font->ft_size->metrics.y_scale;
+  key.antialiasing = antialiasing;
+  key.sdf_spread = spread;
+
+  id = atlas_find(atlas, &key);
+  if(id != ATLAS_NIL) {
+    *out_glyph = atlas->entries[id].glyph;
+    goto exit;
+  }
+
+  /* Load and rasterize the glyph without the atlas lock in order to fill the
+   * atlas concurrently. Only its packing is serialized */
+  MUTEX(unlock(&atlas->lock));
+  is_locked = false;
+  font_err = font_rsrc_get_glyph(font, ch, &glyph);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  if(spread) {
+    font_err = glyph_rasterize_sdf(glyph, spread, &bmp);
+  } else {
+    font_err = glyph_rasterize(glyph, antialiasing, &bmp);
+  }
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  MUTEX(lock(&atlas->lock));
+  is_locked = true;
+
+  /* The glyph may have been packed concurrently */
+  id = atlas_find(atlas, &key);
+  if(id != ATLAS_NIL) {
+    *out_glyph = atlas->entries[id].glyph;
+    goto exit;
+  }
+  font_err = atlas_pack_glyph(atlas, &key, glyph, bmp, out_glyph);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  if(is_locked)
+    MUTEX(unlock(&atlas->lock));
+  if(glyph)
+    FONT(glyph_ref_put(glyph));
+  return font_err;
+error:
+  goto exit;
+}
+
+/*******************************************************************************
+ *
+ * Font atlas functions
+ *
+ ******************************************************************************/
+enum font_error
+font_atlas_create
+  (struct font_system* sys,
+   const int page_width,
+   const int page_height,
+   struct font_atlas** out_atlas)
+{
+  struct font_atlas* atlas = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!sys || page_width <= 0 || page_height <= 0 || !out_atlas) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  atlas = MEM_CALLOC(sys->allocator, 1, sizeof(struct font_atlas));
+  if(!atlas) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  if(pthread_mutex_init(&atlas->lock, NULL) != 0) {
+    MEM_FREE(sys->allocator, atlas);
+    atlas = NULL;
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  atlas->sys = sys;
+  FONT(system_ref_get(sys));
+  atomic_ref_init(&atlas->ref);
+  atlas->page_width = page_width;
+  atlas->page_height = page_height;
+
+exit:
+  if(out_atlas)
+    *out_atlas = atlas;
+  return font_err;
+error:
+  if(atlas) {
+    FONT(atlas_ref_put(atlas));
+    atlas = NULL;
+  }
+  goto exit;
+}
+
+enum font_error
+font_atlas_ref_get(struct font_atlas* atlas)
+{
+  if(!atlas)
+    return FONT_INVALID_ARGUMENT;
+  atomic_ref_get(&atlas->ref);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_atlas_ref_put(struct font_atlas* atlas)
+{
+  if(!atlas)
+    return FONT_INVALID_ARGUMENT;
+  if(atomic_ref_put(&atlas->ref))
+    release_atlas(atlas);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_atlas_get_glyph
+  (struct font_atlas* atlas,
+   struct font_rsrc* font,
+   const wchar_t ch,
+   const bool antialiasing,
+   struct font_atlas_glyph* glyph)
+{
+  return atlas_get_glyph(atlas, font, ch, antialiasing, 0, glyph);
+}
+
+enum font_error
+font_atlas_get_sdf_glyph
+  (struct font_atlas* atlas,
+   struct font_rsrc* font,
+   const wchar_t ch,
+   const int spread,
+   struct font_atlas_glyph* glyph)
+{
+  if(spread <= 0 || spread > FONT_SDF_MAX_SPREAD)
+    return FONT_INVALID_ARGUMENT;
+  /* The field is computed from the antialiased bitmap */
+  return atlas_get_glyph(atlas, font, ch, true, spread, glyph);
+}
+
+enum font_error
+font_atlas_get_pages_count(const struct font_atlas* atlas, size_t* count)
+{
+  pthread_mutex_t* lock = NULL;
+
+  if(!atlas || !count)
+    return FONT_INVALID_ARGUMENT;
+  lock = (pthread_mutex_t*)&atlas->lock;
+  MUTEX(lock(lock));
+  *count = atlas->npages;
+  MUTEX(unlock(lock));
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_atlas_get_page
+  (const struct font_atlas* atlas,
+   const size_t ipage,
+   int* width,
+   int* height,
+   const unsigned char** pixels)
+{
+  pthread_mutex_t* lock = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!atlas)
+    return FONT_INVALID_ARGUMENT;
+  lock = (pthread_mutex_t*)&atlas->lock;
+  MUTEX(lock(lock));
+  if(ipage >= atlas->npages) {
+    font_err = FONT_INVALID_ARGUMENT;
+  } else {
+    if(width)
+      *width = atlas->page_width;
+    if(height)
+      *height = atlas->page_height;
+    if(pixels)
+      *pixels = atlas->pages[ipage].pixels;
+  }
+  MUTEX(unlock(lock));
+  return font_err;
+}
+
+enum font_error
+font_atlas_flush
+  (struct font_atlas* atlas,
+   font_atlas_dirty_rect_T func,
+   void* data,
+   size_t* count)
+{
+  size_t ipage = 0;
+  size_t n = 0;
+
+  if(!atlas)
+    return FONT_INVALID_ARGUMENT;
+  MUTEX(lock(&atlas->lock));
+  for(ipage = 0; ipage < atlas->npages; ++ipage) {
+    struct atlas_page* page = atlas->pages + ipage;
+    size_t i = 0;
+    for(i = 0; func && i < page->ndirty; ++i) {
+      struct font_atlas_dirty_rect rect;
+      rect.page = ipage;
+      rect.rect.x = page->dirty[i].x;
+      rect.rect.y = page->dirty[i].y;
+      rect.rect.width = page->dirty[i].width;
+      rect.rect.height = page->dirty[i].height;
+      rect.pitch = (size_t)atlas->page_width;
+      rect.pixels = page->pixels
+        + (size_t)rect.rect.y * rect.pitch + (size_t)rect.rect.x;
+      func(&rect, data);
+    }
+    n += page->ndirty;
+    page->ndirty = 0;
+  }
+  MUTEX(unlock(&atlas->lock));
+  if(count)
+    *count = n;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_atlas_save(struct font_atlas* atlas, const char* path)
+{
+  struct atlas_file_header header;
+  uint64_t* hashes = NULL;
+  char* tmp_path = NULL;
+  FILE* fp = NULL;
+  size_t page_size = 0;
+  size_t offset = 0;
+  size_t i = 0;
+  bool is_locked = false;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!atlas || !path) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  MUTEX(lock(&atlas->lock));
+  is_locked = true;
+
+  if(atlas->nfonts) {
+    hashes = MEM_ALLOC(atlas->sys->allocator, atlas->nfonts*sizeof(uint64_t));
+    if(!hashes) {
+      font_err = FONT_MEMORY_ERROR;
+      goto error;
+    }
+  }
+  for(i = 0; i < atlas->nfonts; ++i) {
+    if(!atlas->fonts[i]->ft_face) { /* The font was not loaded */
+      font_err = FONT_INVALID_ARGUMENT;
+      goto error;
+    }
+    font_err = hash_font_data(atlas->fonts[i], hashes + i);
+    if(font_err != FONT_NO_ERROR)
+      goto error;
+  }
+
+  page_size = (size_t)atlas->page_width * (size_t)atlas->page_height;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ATLAS_FILE_MAGIC, sizeof(ATLAS_FILE_MAGIC));
+  header.version = ATLAS_FILE_VERSION;
+  header.entry_size = (uint32_t)sizeof(struct atlas_entry);
+  header.page_width = atlas->page_width;
+  header.page_height = atlas->page_height;
+  header.npages = atlas->npages;
+  header.nfonts = atlas->nfonts;
+  header.nentries = atlas->nentries;
+  header.nbuckets = atlas->nbuckets;
+  header.fonts_offset = align_file_offset(sizeof(header));
+  header.entries_offset = align_file_offset
+    (header.fonts_offset + atlas->nfonts * sizeof(uint64_t));
+  header.buckets_offset = align_file_offset
+    (header.entries_offset + atlas->nentries * sizeof(struct atlas_entry));
+  header.pages_offset = align_file_offset
+    (header.buckets_offset + atlas->nbuckets * sizeof(size_t));
+
+  /* The atlas may use the file it was loaded from in place. Write a new file
+   * and then rename it in order to keep the mapped file untouched */
+  tmp_path = MEM_ALLOC(atlas->sys->allocator, strlen(path) + sizeof(".tmp"));
+  if(!tmp_path) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  strcpy(tmp_path, path);
+  strcat(tmp_path, ".tmp");
+  fp = fopen(tmp_path, "wb");
+  if(!fp) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  if(!write_section(fp, &header, sizeof(header), &offset)
+  || !write_section(fp, hashes, atlas->nfonts * sizeof(uint64_t), &offset)
+  || !write_section(fp, atlas->entries,
+       atlas->nentries * sizeof(struct atlas_entry), &offset)
+  || !write_section(fp, atlas->buckets,
+       atlas->nbuckets * sizeof(size_t), &offset)) {
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  for(i = 0; i < atlas->npages; ++i) {
+    if(!write_section(fp, atlas->pages[i].pixels, page_size, &offset)) {
+      font_err = FONT_INTERNAL_ERROR;
+      goto error;
+    }
+  }
+  if(fclose(fp) != 0) {
+    fp = NULL;
+    remove(tmp_path);
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  fp = NULL;
+  if(rename(tmp_path, path) != 0) {
+    remove(tmp_path);
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+
+exit:
+  if(is_locked)
+    MUTEX(unlock(&atlas->lock));
+  if(hashes)
+    MEM_FREE(atlas->sys->allocator, hashes);
+  if(tmp_path)
+    MEM_FREE(atlas->sys->allocator, tmp_path);
+  return font_err;
+error:
+  if(fp) {
+    fclose(fp);
+    remove(tmp_path);
+  }
+  goto exit;
+}
+
+enum font_error
+font_atlas_load
+  (struct font_atlas* atlas,
+   const char* path,
+   struct font_rsrc* const* fonts,
+   const size_t nfonts,
+   bool* is_loaded)
+{
+  const struct atlas_file_header* header = NULL;
+  const unsigned char* file = NULL;
+  const uint64_t* hashes = NULL;
+  struct font_rsrc** file_fonts = NULL;
+  uint64_t* font_hashes = NULL;
+  size_t file_size = 0;
+  size_t page_size = 0;
+  size_t i = 0, j = 0;
+  bool is_locked = false;
+  bool is_matching = false;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(is_loaded)
+    *is_loaded = false;
+  if(!atlas || !path || (nfonts && !fonts)) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  for(i = 0; i < nfonts; ++i) {
+    if(!fonts[i] || !fonts[i]->ft_face || fonts[i]->sys != atlas->sys) {
+      font_err = FONT_INVALID_ARGUMENT;
+      goto error;
+    }
+  }
+  if(nfonts) {
+    font_hashes = MEM_ALLOC(atlas->sys->allocator, nfonts * sizeof(uint64_t));
+    if(!font_hashes) {
+      font_err = FONT_MEMORY_ERROR;
+      goto error;
+    }
+  }
+  for(i = 0; i < nfonts; ++i) {
+    font_err = hash_font_data(fonts[i], font_hashes + i);
+    if(font_err != FONT_NO_ERROR)
+      goto error;
+  }
+
+  MUTEX(lock(&atlas->lock));
+  is_locked = true;
+  if(atlas->npages || atlas->nentries || atlas->nfonts) {
+    font_err = FONT_INVALID_ARGUMENT; /* The atlas is not empty */
+    goto error;
+  }
+
+  font_err = map_file(path, &file, &file_size);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  if(!check_atlas_file(atlas, file, file_size))
+    goto exit; /* Outdated or invalid file. Glyphs are packed on request */
+  header = (const struct atlas_file_header*)file;
+
+  /* Match the fonts of the file with the submitted fonts. A file whose fonts
+   * were not all submitted is not used */
+  if(header->nfonts) {
+    file_fonts = MEM_CALLOC
+      (atlas->sys->allocator, header->nfonts, sizeof(struct font_rsrc*));
+    if(!file_fonts) {
+      font_err = FONT_MEMORY_ERROR;
+      goto error;
+    }
+  }
+  hashes = (const uint64_t*)(file + header->fonts_offset);
+  is_matching = true;
+  for(i = 0; i < header->nfonts && is_matching; ++i) {
+    for(j = 0; j < nfonts; ++j) {
+      size_t k = 0;
+      for(k = 0; k < i && file_fonts[k] != fonts[j]; ++k);
+      if(k == i && font_hashes[j] == hashes[i])
+        break;
+    }
+    is_matching = j < nfonts;
+    if(is_matching)
+      file_fonts[i] = fonts[j];
+  }
+  if(!is_matching)
+    goto exit;
+
+  /* Use the pages of the file in place */
+  font_err = reserve(atlas->sys->allocator, (void**)&atlas->pages,
+    &atlas->max_pages, header->npages, sizeof(struct atlas_page));
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  font_err = reserve(atlas->sys->allocator, (void**)&atlas->fonts,
+    &atlas->max_fonts, header->nfonts, sizeof(struct font_rsrc*));
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+  page_size = (size_t)atlas->page_width * (size_t)atlas->page_height;
+  for(i = 0; i < header->npages; ++i) {
+    /* Without skyline, no glyph is packed into the page */
+    memset(atlas->pages + i, 0, sizeof(struct atlas_page));
+    atlas->pages[i].pixels =
+      (unsigned char*)(file + header->pages_offset + i * page_size);
+    atlas->pages[i].dirty[0].width = atlas->page_width;
+    atlas->pages[i].dirty[0].height = atlas->page_height;
+    atlas->pages[i].ndirty = 1;
+  }
+  atlas->npages = atlas->nmapped_pages = header->npages;
+  for(i = 0; i < header->nfonts; ++i) {
+    FONT(rsrc_ref_get(file_fonts[i]));
+    atlas->fonts[i] = file_fonts[i];
+  }
+  atlas->nfonts = header->nfonts;
+  atlas->entries = (struct atlas_entry*)(file + header->entries_offset);
+  atlas->nentries = atlas->max_entries = header->nentries;
+  atlas->buckets = (size_t*)(file + header->buckets_offset);
+  atlas->nbuckets = header->nbuckets;
+  atlas->is_index_mapped = true;
+  atlas->file = file;
+  atlas->file_size = file_size;
+  file = NULL;
+  if(is_loaded)
+    *is_loaded = true;
+
+exit:
+  if(is_locked)
+    MUTEX(unlock(&atlas->lock));
+  if(file)
+    unmap_file(file, file_size);
+  if(file_fonts)
+    MEM_FREE(atlas->sys->allocator, file_fonts);
+  if(font_hashes)
+    MEM_FREE(atlas->sys->allocator, font_hashes);
+  return font_err;
+error:
+  goto exit;
+}
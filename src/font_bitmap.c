@@ -0,0 +1,583 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/snlsys.h>
+
+#include <pthread.h>
+#include <string.h>
+
+/* Number of pixels converted at once when the destination format is not the
+ * 8-bits format produced by the row kernels. */
+#define ROW_CHUNK_SIZE 256
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define FONT_BITMAP_X86
+  #include <immintrin.h>
+#endif
+
+/* Convert the `width' first pixels of a bitmap row into 8-bits pixels */
+typedef void
+(*row_kernel_T)
+  (const unsigned char* src,
+   unsigned char* dst,
+   const unsigned int width);
+
+/* Blend the RGBA color over `width' pixels with respect to their 8-bits
+ * coverage */
+typedef void
+(*blend_kernel_T)
+  (const unsigned char* coverage,
+   unsigned char* dst,
+   const unsigned int width,
+   const unsigned char color[4]);
+
+/*******************************************************************************
+ *
+ * Generic row kernels
+ *
+ ******************************************************************************/
+static void
+row_mono_c(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  unsigned int x = 0;
+
+  /* Expand the 8 pixels of a byte at once */
+  for(x = 0; x + 8 <= width; x += 8) {
+    const unsigned char byte = src[x / 8];
+    dst[x + 0] = (unsigned char)(-((byte >> 7) & 0x01));
+    dst[x + 1] = (unsigned char)(-((byte >> 6) & 0x01));
+    dst[x + 2] = (unsigned char)(-((byte >> 5) & 0x01));
+    dst[x + 3] = (unsigned char)(-((byte >> 4) & 0x01));
+    dst[x + 4] = (unsigned char)(-((byte >> 3) & 0x01));
+    dst[x + 5] = (unsigned char)(-((byte >> 2) & 0x01));
+    dst[x + 6] = (unsigned char)(-((byte >> 1) & 0x01));
+    dst[x + 7] = (unsigned char)(-((byte >> 0) & 0x01));
+  }
+  for(; x < width; ++x) {
+    const int bit_shift = 7 - (int)(x % 8);
+    dst[x] = (unsigned char)(-((src[x / 8] >> bit_shift) & 0x01));
+  }
+}
+
+static void
+row_gray_c(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  memcpy(dst, src, width);
+}
+
+static void
+row_gray2_c(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  unsigned int x = 0;
+
+  for(x = 0; x + 4 <= width; x += 4) {
+    const unsigned char byte = src[x / 4];
+    dst[x + 0] = (unsigned char)(((byte >> 6) & 0x03) * 85);
+    dst[x + 1] = (unsigned char)(((byte >> 4) & 0x03) * 85);
+    dst[x + 2] = (unsigned char)(((byte >> 2) & 0x03) * 85);
+    dst[x + 3] = (unsigned char)(((byte >> 0) & 0x03) * 85);
+  }
+  for(; x < width; ++x) {
+    const int bit_shift = (3 - (int)(x % 4)) * 2;
+    dst[x] = (unsigned char)(((src[x / 4] >> bit_shift) & 0x03) * 85);
+  }
+}
+
+static void
+row_gray4_c(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  unsigned int x = 0;
+
+  for(x = 0; x + 2 <= width; x += 2) {
+    const unsigned char byte = src[x / 2];
+    dst[x + 0] = (unsigned char)(((byte >> 4) & 0x0F) * 17);
+    dst[x + 1] = (unsigned char)(((byte >> 0) & 0x0F) * 17);
+  }
+  if(x < width)
+    dst[x] = (unsigned char)(((src[x / 2] >> 4) & 0x0F) * 17);
+}
+
+static void
+row_lcd_c(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  memcpy(dst, src, (size_t)width * 3);
+}
+
+/*******************************************************************************
+ *
+ * Generic blend kernels
+ *
+ ******************************************************************************/
+/* Divide by 255 with rounding, for val in [0, 255*255] */
+static unsigned int
+div255(const unsigned int val)
+{
+  const unsigned int tmp = val + 128;
+  return (tmp + (tmp >> 8)) >> 8;
+}
+
+static void
+blend_a8_c
+  (const unsigned char* coverage,
+   unsigned char* dst,
+   const unsigned int width,
+   const unsigned char color[4])
+{
+  unsigned int x = 0;
+
+  for(x = 0; x < width; ++x) {
+    unsigned int a = 0;
+    if(!coverage[x])
+      continue;
+    a = div255((unsigned int)coverage[x] * color[3]);
+    dst[x] = (unsigned char)div255(255 * a + dst[x] * (255 - a));
+  }
+}
+
+static void
+blend_rgba8_c
+  (const unsigned char* coverage,
+   unsigned char* dst,
+   const unsigned int width,
+   const unsigned char color[4])
+{
+  const unsigned int rgba[4] = { color[0], color[1], color[2], 255 };
+  unsigned int x = 0;
+
+  for(x = 0; x < width; ++x) {
+    unsigned char* pixel = dst + (size_t)x * 4;
+    unsigned int a = 0;
+    int i = 0;
+    if(!coverage[x])
+      continue;
+    a = div255((unsigned int)coverage[x] * color[3]);
+    for(i = 0; i < 4; ++i)
+      pixel[i] = (unsigned char)div255(rgba[i] * a + pixel[i] * (255 - a));
+  }
+}
+
+/*******************************************************************************
+ *
+ * x86 row kernels. The MONO and GRAY2 expansions broadcast each source byte
+ * over the lanes of its pixels and test the bits of one pixel per lane. The
+ * GRAY4 expansion interleaves the high and low nibbles of the source bytes.
+ *
+ ******************************************************************************/
+#ifdef FONT_BITMAP_X86
+#define MONO_BYTE_X8(Byte) ((long long)((Byte) * 0x0101010101010101ULL))
+
+static void __attribute__((target("sse2")))
+row_mono_sse2(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  const __m128i mask = _mm_set_epi8
+    (1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  unsigned int x = 0;
+
+  for(x = 0; x + 16 <= width; x += 16) {
+    const unsigned char* bytes = src + x / 8;
+    const __m128i v = _mm_set_epi64x
+      (MONO_BYTE_X8(bytes[1]), MONO_BYTE_X8(bytes[0]));
+    const __m128i px = _mm_cmpeq_epi8(_mm_and_si128(v, mask), mask);
+    _mm_storeu_si128((__m128i*)(dst + x), px);
+  }
+  if(x < width)
+    row_mono_c(src + x / 8, dst + x, width - x);
+}
+
+static void __attribute__((target("avx2")))
+row_mono_avx2(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  const __m256i mask = _mm256_set_epi8
+    (1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+     1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  unsigned int x = 0;
+
+  for(x = 0; x + 32 <= width; x += 32) {
+    const unsigned char* bytes = src + x / 8;
+    const __m256i v = _mm256_set_epi64x
+      (MONO_BYTE_X8(bytes[3]), MONO_BYTE_X8(bytes[2]),
+       MONO_BYTE_X8(bytes[1]), MONO_BYTE_X8(bytes[0]));
+    const __m256i px = _mm256_cmpeq_epi8(_mm256_and_si256(v, mask), mask);
+    _mm256_storeu_si256((__m256i*)(dst + x), px);
+  }
+  if(x < width)
+    row_mono_sse2(src + x / 8, dst + x, width - x);
+}
+
+#undef MONO_BYTE_X8
+
+static void __attribute__((target("sse2")))
+row_gray2_sse2(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  /* High and low bit of the pixel of each lane */
+  const __m128i hi_mask = _mm_set_epi8
+    (2, 8, 32, -128, 2, 8, 32, -128, 2, 8, 32, -128, 2, 8, 32, -128);
+  const __m128i lo_mask = _mm_set_epi8
+    (1, 4, 16, 64, 1, 4, 16, 64, 1, 4, 16, 64, 1, 4, 16, 64);
+  const __m128i hi_val = _mm_set1_epi8((char)170);
+  const __m128i lo_val = _mm_set1_epi8(85);
+  unsigned int x = 0;
+
+  for(x = 0; x + 16 <= width; x += 16) {
+    int bytes = 0;
+    __m128i v = _mm_setzero_si128();
+    __m128i hi = v, lo = v;
+
+    memcpy(&bytes, src + x / 4, sizeof(bytes));
+    v = _mm_cvtsi32_si128(bytes);
+    v = _mm_unpacklo_epi8(v, v);
+    v = _mm_unpacklo_epi16(v, v); /* Each byte repeated over 4 lanes */
+    hi = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, hi_mask), hi_mask),
+      hi_val);
+    lo = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, lo_mask), lo_mask),
+      lo_val);
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_add_epi8(hi, lo));
+  }
+  if(x < width)
+    row_gray2_c(src + x / 4, dst + x, width - x);
+}
+
+static void __attribute__((target("sse2")))
+row_gray4_sse2(const unsigned char* src, unsigned char* dst, unsigned int width)
+{
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  unsigned int x = 0;
+
+  for(x = 0; x + 32 <= width; x += 32) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)(src + x / 2));
+    const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    const __m128i lo = _mm_and_si128(v, nibble);
+    __m128i px0 = _mm_unpacklo_epi8(hi, lo);
+    __m128i px1 = _mm_unpackhi_epi8(hi, lo);
+    /* n * 17 == n << 4 | n for a nibble */
+    px0 = _mm_or_si128(_mm_slli_epi16(px0, 4), px0);
+    px1 = _mm_or_si128(_mm_slli_epi16(px1, 4), px1);
+    _mm_storeu_si128((__m128i*)(dst + x), px0);
+    _mm_storeu_si128((__m128i*)(dst + x + 16), px1);
+  }
+  if(x < width)
+    row_gray4_c(src + x / 2, dst + x, width - x);
+}
+
+/*******************************************************************************
+ *
+ * x86 blend kernels. Pixels are blended on 16-bits lanes; runs of null
+ * coverage are skipped without touching the destination.
+ *
+ ******************************************************************************/
+static __m128i __attribute__((target("sse2")))
+div255_epi16(const __m128i val)
+{
+  const __m128i tmp = _mm_add_epi16(val, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(tmp, _mm_srli_epi16(tmp, 8)), 8);
+}
+
+/* color * a + dst * (255 - a), divided by 255 */
+static __m128i __attribute__((target("sse2")))
+blend_epi16(const __m128i color, const __m128i dst, const __m128i a)
+{
+  const __m128i inv_a = _mm_sub_epi16(_mm_set1_epi16(255), a);
+  return div255_epi16
+    (_mm_add_epi16(_mm_mullo_epi16(color, a), _mm_mullo_epi16(dst, inv_a)));
+}
+
+static void __attribute__((target("sse2")))
+blend_a8_sse2
+  (const unsigned char* coverage,
+   unsigned char* dst,
+   const unsigned int width,
+   const unsigned char color[4])
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i white = _mm_set1_epi16(255);
+  const __m128i alpha = _mm_set1_epi16(color[3]);
+  unsigned int x = 0;
+
+  for(x = 0; x + 16 <= width; x += 16) {
+    const __m128i cov = _mm_loadu_si128((const __m128i*)(coverage + x));
+    __m128i d = zero;
+    __m128i a_lo = zero, a_hi = zero;
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(cov, zero)) == 0xFFFF)
+      continue;
+    d = _mm_loadu_si128((const __m128i*)(dst + x));
+    a_lo = div255_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(cov, zero), alpha));
+    a_hi = div255_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(cov, zero), alpha));
+    d = _mm_packus_epi16
+      (blend_epi16(white, _mm_unpacklo_epi8(d, zero), a_lo),
+       blend_epi16(white, _mm_unpackhi_epi8(d, zero), a_hi));
+    _mm_storeu_si128((__m128i*)(dst + x), d);
+  }
+  if(x < width)
+    blend_a8_c(coverage + x, dst + x, width - x, color);
+}
+
+static void __attribute__((target("sse2")))
+blend_rgba8_sse2
+  (const unsigned char* coverage,
+   unsigned char* dst,
+   const unsigned int width,
+   const unsigned char color[4])
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi16(color[3]);
+  const __m128i rgba = _mm_set_epi16
+    (255, color[2], color[1], color[0], 255, color[2], color[1], color[0]);
+  unsigned int x = 0;
+
+  /* Blend 4 pixels at once, 2 per 16-bits register */
+  for(x = 0; x + 4 <= width; x += 4) {
+    unsigned char* pixels = dst + (size_t)x * 4;
+    int cov4 = 0;
+    __m128i a = zero;
+    __m128i d = zero;
+
+    memcpy(&cov4, coverage + x, sizeof(cov4));
+    if(!cov4)
+      continue;
+    a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(cov4), zero);
+    a = div255_epi16(_mm_mullo_epi16(a, alpha));
+    a = _mm_unpacklo_epi16(a, a); /* a0 a0 a1 a1 a2 a2 a3 a3 */
+    d = _mm_loadu_si128((const __m128i*)pixels);
+    d = _mm_packus_epi16
+      (blend_epi16(rgba, _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi32(a, a)),
+       blend_epi16(rgba, _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi32(a, a)));
+    _mm_storeu_si128((__m128i*)pixels, d);
+  }
+  if(x < width)
+    blend_rgba8_c(coverage + x, dst + (size_t)x * 4, width - x, color);
+}
+#endif /* FONT_BITMAP_X86 */
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+/* Kernels of the processor, resolved once */
+static struct {
+  row_kernel_T mono;
+  row_kernel_T gray2;
+  row_kernel_T gray4;
+  blend_kernel_T a8;
+  blend_kernel_T rgba8;
+} kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+setup_kernels(void)
+{
+  kernels.mono = row_mono_c;
+  kernels.gray2 = row_gray2_c;
+  kernels.gray4 = row_gray4_c;
+  kernels.a8 = blend_a8_c;
+  kernels.rgba8 = blend_rgba8_c;
+#ifdef FONT_BITMAP_X86
+  if(__builtin_cpu_supports("sse2")) {
+    kernels.mono = row_mono_sse2;
+    kernels.gray2 = row_gray2_sse2;
+    kernels.gray4 = row_gray4_sse2;
+    kernels.a8 = blend_a8_sse2;
+    kernels.rgba8 = blend_rgba8_sse2;
+  }
+  if(__builtin_cpu_supports("avx2"))
+    kernels.mono = row_mono_avx2;
+#endif
+}
+
+static row_kernel_T
+select_row_kernel(const FT_Pixel_Mode mode)
+{
+  row_kernel_T kernel = NULL;
+
+  pthread_once(&kernels_once, setup_kernels);
+  switch(mode) {
+    case FT_PIXEL_MODE_MONO: kernel = kernels.mono; break;
+    case FT_PIXEL_MODE_GRAY: kernel = row_gray_c; break;
+    case FT_PIXEL_MODE_GRAY2: kernel = kernels.gray2; break;
+    case FT_PIXEL_MODE_GRAY4: kernel = kernels.gray4; break;
+    case FT_PIXEL_MODE_LCD:
+    case FT_PIXEL_MODE_LCD_V:
+      kernel = row_lcd_c;
+      break;
+    default: ASSERT(0); /* Unreachable code */ break;
+  }
+  return kernel;
+}
+
+/* Number of bits per pixel of the 1 byte per pixel modes */
+static unsigned int
+sizeof_src_pixel(const FT_Pixel_Mode mode)
+{
+  switch(mode) {
+    case FT_PIXEL_MODE_MONO: return 1;
+    case FT_PIXEL_MODE_GRAY2: return 2;
+    case FT_PIXEL_MODE_GRAY4: return 4;
+    default: return 8;
+  }
+}
+
+static blend_kernel_T
+select_blend_kernel(const enum font_pixel_format format)
+{
+  blend_kernel_T kernel = NULL;
+
+  pthread_once(&kernels_once, setup_kernels);
+  switch(format) {
+    case FONT_FORMAT_A8: kernel = kernels.a8; break;
+    case FONT_FORMAT_RGBA8: kernel = kernels.rgba8; break;
+    default: ASSERT(0); /* Unreachable code */ break;
+  }
+  return kernel;
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+void
+copy_bitmap(const FT_Bitmap* bmp, unsigned char* dst, const size_t pitch)
+{
+  row_kernel_T kernel = NULL;
+  unsigned int y = 0;
+  ASSERT(bmp && dst);
+
+  if(!bmp->width || !bmp->rows)
+    return;
+  kernel = select_row_kernel((FT_Pixel_Mode)bmp->pixel_mode);
+  for(y = 0; y < bmp->rows; ++y) {
+    const unsigned char* src = bmp->buffer + (long)y * bmp->pitch;
+    kernel(src, dst + (size_t)y * pitch, bmp->width);
+  }
+}
+
+void
+write_bitmap
+  (const FT_Bitmap* bmp,
+   const enum font_pixel_format format,
+   unsigned char* dst,
+   const size_t stride,
+   const int x,
+   const int y)
+{
+  row_kernel_T kernel = NULL;
+  unsigned int row = 0;
+  ASSERT(bmp && dst && x >= 0 && y >= 0);
+  ASSERT(sizeof_ft_pixel_mode((FT_Pixel_Mode)bmp->pixel_mode) == 1);
+
+  if(!bmp->width || !bmp->rows)
+    return;
+  kernel = select_row_kernel((FT_Pixel_Mode)bmp->pixel_mode);
+
+  for(row = 0; row < bmp->rows; ++row) {
+    const unsigned char* src = bmp->buffer + (long)row * bmp->pitch;
+    unsigned char* dst_row = dst + ((size_t)y + row) * stride;
+    unsigned char chunk[ROW_CHUNK_SIZE];
+    unsigned int i = 0;
+
+    if(format == FONT_FORMAT_A8) {
+      kernel(src, dst_row + x, bmp->width);
+      continue;
+    }
+    /* Convert the row chunk by chunk into a 8-bits temporary. The chunk
+     * size is a multiple of 8 so sub-byte source pixels stay aligned. */
+    for(i = 0; i < bmp->width; i += ROW_CHUNK_SIZE) {
+      const unsigned int n = bmp->width - i < ROW_CHUNK_SIZE
+        ? bmp->width - i : ROW_CHUNK_SIZE;
+      const unsigned int src_bits =
+        sizeof_src_pixel((FT_Pixel_Mode)bmp->pixel_mode);
+      unsigned int j = 0;
+
+      kernel(src + i * src_bits / 8, chunk, n);
+      switch(format) {
+        case FONT_FORMAT_A1:
+          for(j = 0; j < n; ++j) {
+            const size_t bit = (size_t)x + i + j;
+            const unsigned char mask = (unsigned char)(0x80 >> (bit % 8));
+            if(chunk[j] >= 128)
+              dst_row[bit / 8] = (unsigned char)(dst_row[bit / 8] | mask);
+            else
+              dst_row[bit / 8] = (unsigned char)(dst_row[bit / 8] & ~mask);
+          }
+          break;
+        case FONT_FORMAT_RGBA8:
+          for(j = 0; j < n; ++j) {
+            unsigned char* pixel = dst_row + ((size_t)x + i + j) * 4;
+            pixel[0] = pixel[1] = pixel[2] = 255;
+            pixel[3] = chunk[j];
+          }
+          break;
+        default: ASSERT(0); /* Unreachable code */ break;
+      }
+    }
+  }
+}
+
+void
+blend_bitmap
+  (const FT_Bitmap* bmp,
+   const unsigned char color[4],
+   const struct font_surface* surface,
+   const int x,
+   const int y)
+{
+  row_kernel_T kernel = NULL;
+  blend_kernel_T blend = NULL;
+  const size_t Bpp = surface->format == FONT_FORMAT_RGBA8 ? 4 : 1;
+  unsigned int src_bits = 0;
+  long x0 = 0, x1 = 0, y0 = 0, y1 = 0; /* Clipped area */
+  unsigned int col_begin = 0, col_end = 0;
+  unsigned int row_begin = 0, row_end = 0;
+  unsigned int row = 0;
+  ASSERT(bmp && color && surface);
+  ASSERT(sizeof_ft_pixel_mode((FT_Pixel_Mode)bmp->pixel_mode) == 1);
+
+  /* Intersect the clip rectangle with the surface */
+  x0 = surface->clip.x_min > 0 ? surface->clip.x_min : 0;
+  y0 = surface->clip.y_min > 0 ? surface->clip.y_min : 0;
+  x1 = surface->clip.x_max < surface->width
+    ? surface->clip.x_max : surface->width;
+  y1 = surface->clip.y_max < surface->height
+    ? surface->clip.y_max : surface->height;
+
+  /* Bitmap pixels lying in the clipped area */
+  x0 = x0 - x > 0 ? x0 - x : 0;
+  y0 = y0 - y > 0 ? y0 - y : 0;
+  x1 = x1 - x < (long)bmp->width ? x1 - x : (long)bmp->width;
+  y1 = y1 - y < (long)bmp->rows ? y1 - y : (long)bmp->rows;
+  if(x0 >= x1 || y0 >= y1)
+    return;
+  col_begin = (unsigned int)x0;
+  col_end = (unsigned int)x1;
+  row_begin = (unsigned int)y0;
+  row_end = (unsigned int)y1;
+
+  kernel = select_row_kernel((FT_Pixel_Mode)bmp->pixel_mode);
+  blend = select_blend_kernel(surface->format);
+  src_bits = sizeof_src_pixel((FT_Pixel_Mode)bmp->pixel_mode);
+
+  for(row = row_begin; row < row_end; ++row) {
+    const unsigned char* src = bmp->buffer + (long)row * bmp->pitch;
+    unsigned char* dst_row = surface->pixels
+      + (size_t)((long)y + row) * surface->stride;
+    unsigned char chunk[ROW_CHUNK_SIZE];
+    unsigned int i = 0;
+
+    /* Expand the visible span chunk by chunk. The first chunk starts on a
+     * multiple of 8 pixels so that sub-byte source pixels stay aligned */
+    for(i = col_begin & ~7u; i < col_end; i += ROW_CHUNK_SIZE) {
+      const unsigned int n = col_end - i < ROW_CHUNK_SIZE
+        ? col_end - i : ROW_CHUNK_SIZE;
+      const unsigned int skip = i < col_begin ? col_begin - i : 0;
+      const unsigned char* coverage = chunk;
+
+      if(bmp->pixel_mode == FT_PIXEL_MODE_GRAY) /* Blend in place */
+        coverage = src + i;
+      else
+        kernel(src + i * src_bits / 8, chunk, n);
+      blend(coverage + skip, dst_row + (size_t)((long)x + i + skip) * Bpp,
+        n - skip, color);
+    }
+  }
+}
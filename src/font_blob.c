@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200112L /* open, fstat and mmap support */
+
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+/* Must be invoked with the lock of the font system */
+static void
+release_blob(struct font_blob* blob)
+{
+  struct font_blob** slot = NULL;
+  struct font_system* sys = NULL;
+  ASSERT(blob);
+
+  sys = blob->sys;
+
+  for(slot = &sys->blobs; *slot != blob; slot = &(*slot)->next)
+    ASSERT(*slot);
+  *slot = blob->next;
+
+  if(blob->data)
+    unmap_file(blob->data, blob->size);
+  MEM_FREE(sys->allocator, blob);
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+enum font_error
+map_file(const char* path, const unsigned char** out_data, size_t* out_size)
+{
+  struct stat st;
+  void* data = MAP_FAILED;
+  int fd = -1;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(path && out_data && out_size);
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(data == MAP_FAILED) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  *out_data = data;
+  *out_size = (size_t)st.st_size;
+
+exit:
+  /* The mapping remains valid once the file is closed */
+  if(fd >= 0)
+    close(fd);
+  return font_err;
+error:
+  goto exit;
+}
+
+void
+unmap_file(const unsigned char* data, const size_t size)
+{
+  ASSERT(data);
+  munmap((void*)data, size);
+}
+
+enum font_error
+blob_open
+  (struct font_system* sys,
+   const char* path,
+   struct font_blob** out_blob)
+{
+  struct font_blob* blob = NULL;
+  size_t len = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(sys && path && out_blob);
+
+  MUTEX(lock(&sys->lock));
+
+  /* Share the blob of a file that is already loaded */
+  for(blob = sys->blobs; blob && strcmp(blob->path, path); blob = blob->next);
+  if(blob) {
+    ++blob->ref;
+    goto exit;
+  }
+
+  len = strlen(path);
+  blob = MEM_CALLOC(sys->allocator, 1, sizeof(struct font_blob) + len + 1);
+  if(!blob) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  blob->ref = 1;
+  blob->sys = sys;
+  blob->path = (char*)(blob + 1);
+  memcpy(blob->path, path, len + 1);
+  blob->next = sys->blobs;
+  sys->blobs = blob;
+
+  font_err = map_file(path, &blob->data, &blob->size);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  MUTEX(unlock(&sys->lock));
+  *out_blob = blob;
+  return font_err;
+error:
+  if(blob) {
+    release_blob(blob);
+    blob = NULL;
+  }
+  goto exit;
+}
+
+/* The blob references are updated under the lock of the font system in order
+ * to not share a blob that is being released */
+void
+blob_ref_get(struct font_blob* blob)
+{
+  ASSERT(blob);
+  MUTEX(lock(&blob->sys->lock));
+  ++blob->ref;
+  MUTEX(unlock(&blob->sys->lock));
+}
+
+void
+blob_ref_put(struct font_blob* blob)
+{
+  struct font_system* sys = NULL;
+  ASSERT(blob && blob->ref > 0);
+  sys = blob->sys;
+  MUTEX(lock(&sys->lock));
+  if(--blob->ref == 0)
+    release_blob(blob);
+  MUTEX(unlock(&sys->lock));
+}
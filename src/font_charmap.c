@@ -0,0 +1,134 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <string.h>
+
+#define CHARMAP_BMP_SIZE (CHARMAP_PAGES_COUNT * CHARMAP_PAGE_SIZE)
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static inline bool
+is_covered(const struct charmap* charmap, const uint32_t code)
+{
+  ASSERT(charmap && code < CHARMAP_BMP_SIZE);
+  return (charmap->coverage[code / 32] >> (code % 32)) & 1;
+}
+
+/* Fill the glyph indices of the page from the charmap of the face. Must be
+ * invoked with the font lock. */
+static void
+build_page(FT_Face ft_face, const uint32_t ipage, FT_UInt* page)
+{
+  const FT_ULong first = (FT_ULong)ipage * CHARMAP_PAGE_SIZE;
+  FT_ULong code = 0;
+  FT_UInt glyph_index = 0;
+  ASSERT(ft_face && ipage > 0 && ipage < CHARMAP_PAGES_COUNT && page);
+
+  memset(page, 0, CHARMAP_PAGE_SIZE * sizeof(FT_UInt));
+  code = FT_Get_Next_Char(ft_face, first - 1, &glyph_index);
+  while(glyph_index && code < first + CHARMAP_PAGE_SIZE) {
+    page[code - first] = glyph_index;
+    code = FT_Get_Next_Char(ft_face, code, &glyph_index);
+  }
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+void
+charmap_setup(FT_Face ft_face, struct charmap* charmap)
+{
+  FT_ULong code = 0;
+  FT_UInt glyph_index = 0;
+  ASSERT(ft_face && charmap);
+
+  memset(charmap, 0, sizeof(struct charmap));
+  if(!ft_face->charmap)
+    return;
+
+  /* Walk the charmap once rather than querying each character */
+  code = FT_Get_First_Char(ft_face, &glyph_index);
+  while(glyph_index && code < CHARMAP_BMP_SIZE) {
+    charmap->coverage[code / 32] |= (uint32_t)1 << (code % 32);
+    if(code < CHARMAP_PAGE_SIZE)
+      charmap->latin1[code] = glyph_index;
+    code = FT_Get_Next_Char(ft_face, code, &glyph_index);
+  }
+}
+
+void
+charmap_clear(struct mem_allocator* allocator, struct charmap* charmap)
+{
+  size_t i = 0;
+  ASSERT(allocator && charmap);
+
+  for(i = 0; i < CHARMAP_PAGES_COUNT; ++i) {
+    if(charmap->pages[i])
+      MEM_FREE(allocator, charmap->pages[i]);
+  }
+  memset(charmap, 0, sizeof(struct charmap));
+}
+
+bool
+charmap_has_char(struct font_rsrc* font, const wchar_t ch)
+{
+  const uint32_t code = (uint32_t)ch;
+  ASSERT(font && font->ft_face);
+  if(code < CHARMAP_BMP_SIZE)
+    return is_covered(&font->charmap, code);
+  return charmap_get_index(font, ch) != 0;
+}
+
+FT_UInt
+charmap_get_index(struct font_rsrc* font, const wchar_t ch)
+{
+  struct charmap* charmap = NULL;
+  const uint32_t code = (uint32_t)ch;
+  uint32_t ipage = 0;
+  FT_UInt* page = NULL;
+  FT_UInt glyph_index = 0;
+  ASSERT(font && font->ft_face);
+
+  charmap = &font->charmap;
+  if(code < CHARMAP_PAGE_SIZE)
+    return charmap->latin1[code];
+
+  if(code >= CHARMAP_BMP_SIZE) {
+    /* Characters out of the BMP are looked up into the FreeType charmap */
+    MUTEX(lock(&font->lock));
+    glyph_index = FT_Get_Char_Index(font->ft_face, (FT_ULong)code);
+    MUTEX(unlock(&font->lock));
+    return glyph_index;
+  }
+
+  if(!is_covered(charmap, code))
+    return 0;
+
+  ipage = code / CHARMAP_PAGE_SIZE;
+  page = __atomic_load_n(&charmap->pages[ipage], __ATOMIC_ACQUIRE);
+  if(page)
+    return page[code % CHARMAP_PAGE_SIZE];
+
+  MUTEX(lock(&font->lock));
+  page = charmap->pages[ipage];
+  if(!page) {
+    page = MEM_ALLOC(font->sys->allocator, CHARMAP_PAGE_SIZE * sizeof(FT_UInt));
+    if(page) {
+      build_page(font->ft_face, ipage, page);
+      __atomic_store_n(&charmap->pages[ipage], page, __ATOMIC_RELEASE);
+    }
+  }
+  glyph_index = page
+    ? page[code % CHARMAP_PAGE_SIZE]
+    : FT_Get_Char_Index(font->ft_face, (FT_ULong)code); /* Out of memory */
+  MUTEX(unlock(&font->lock));
+  return glyph_index;
+}
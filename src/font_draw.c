@@ -0,0 +1,178 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static bool
+check_surface(const struct font_surface* surface)
+{
+  size_t row_size = 0;
+
+  if(!surface || !surface->pixels || surface->width < 0 || surface->height < 0)
+    return false;
+  switch(surface->format) {
+    case FONT_FORMAT_A8: row_size = (size_t)surface->width; break;
+    case FONT_FORMAT_RGBA8: row_size = (size_t)surface->width * 4; break;
+    default: return false;
+  }
+  return surface->stride >= row_size;
+}
+
+static long
+floor_div(const long num, const long den)
+{
+  ASSERT(den > 0);
+  return num >= 0 ? num / den : -((-num + den - 1) / den);
+}
+
+/* Return true if the glyph bounding box at (x, y) misses the clip rectangle.
+ * Such glyphs are not rasterized. */
+static bool
+is_clipped
+  (const struct font_glyph* glyph,
+   const struct font_surface* surface,
+   const long x,
+   const long y)
+{
+  ASSERT(glyph && surface);
+  return x + glyph->bbox.x_max <= surface->clip.x_min
+      || x + glyph->bbox.x_min >= surface->clip.x_max
+      || y - glyph->bbox.y_min <= surface->clip.y_min
+      || y - glyph->bbox.y_max >= surface->clip.y_max;
+}
+
+static enum font_error
+draw_glyphs
+  (struct font_rsrc* font,
+   const struct font_glyph_position* positions,
+   const size_t count,
+   const bool antialiasing,
+   const unsigned char color[4],
+   const struct font_surface* surface,
+   const int x,
+   const int y)
+{
+  const enum glyph_render_mode mode =
+    antialiasing ? GLYPH_RENDER_NORMAL : GLYPH_RENDER_MONO;
+  long nphases = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && (positions || !count) && color && surface);
+
+  /* Bitmap glyphs are drawn at the nearest pixel */
+  nphases = FT_IS_SCALABLE(font->ft_face) ? FONT_SUBPIXEL_PHASES : 1;
+
+  for(i = 0; i < count; ++i) {
+    const long pen_y = (long)y - positions[i].y; /* Rows go downward */
+    struct font_glyph* glyph = NULL;
+    const FT_Bitmap* bmp = NULL;
+    FT_BitmapGlyph ft_bitmap = NULL;
+    long pen_x = 0;
+    long phase = 0;
+
+    if(positions[i].character == L'\n')
+      continue;
+
+    /* Round the pen position to the nearest phase */
+    phase = floor_div(((long)positions[i].x * 64 + positions[i].x_frac)
+      * nphases + 32, 64);
+    pen_x = (long)x + floor_div(phase, nphases);
+    phase -= floor_div(phase, nphases) * nphases;
+
+    font_err = font_rsrc_get_subpixel_glyph
+      (font, positions[i].character, (int)phase, &glyph);
+    if(font_err == FONT_INVALID_ARGUMENT) { /* No glyph for the character */
+      font_err = FONT_NO_ERROR;
+      continue;
+    }
+    if(font_err != FONT_NO_ERROR)
+      break;
+
+    if(!is_clipped(glyph, surface, pen_x, pen_y)) {
+      font_err = glyph_rasterize(glyph, antialiasing, &bmp);
+      if(font_err != FONT_NO_ERROR) {
+        FONT(glyph_ref_put(glyph));
+        break;
+      }
+      /* The bitmap is published by glyph_rasterize */
+      ft_bitmap = (FT_BitmapGlyph)glyph->ft_bitmaps[mode];
+      blend_bitmap(bmp, color, surface,
+        (int)(pen_x + ft_bitmap->left), (int)(pen_y - ft_bitmap->top));
+    }
+    FONT(glyph_ref_put(glyph));
+  }
+  return font_err;
+}
+
+/*******************************************************************************
+ *
+ * Text rendering functions
+ *
+ ******************************************************************************/
+enum font_error
+font_rsrc_draw_text
+  (struct font_rsrc* font,
+   const wchar_t* text,
+   const size_t count,
+   const bool antialiasing,
+   const unsigned char color[4],
+   const struct font_surface* surface,
+   const int x,
+   const int y)
+{
+  struct font_glyph_position* positions = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!font || (count && !text) || !color || !check_surface(surface)
+  || !font->ft_face) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  if(!count)
+    goto exit;
+
+  positions = MEM_ALLOC
+    (font->sys->allocator, count * sizeof(struct font_glyph_position));
+  if(!positions) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  font_err = font_rsrc_layout_text(font, text, count, positions, NULL);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  font_err = draw_glyphs
+    (font, positions, count, antialiasing, color, surface, x, y);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  if(positions)
+    MEM_FREE(font->sys->allocator, positions);
+  return font_err;
+error:
+  goto exit;
+}
+
+enum font_error
+font_rsrc_draw_glyphs
+  (struct font_rsrc* font,
+   const struct font_glyph_position* positions,
+   const size_t count,
+   const bool antialiasing,
+   const unsigned char color[4],
+   const struct font_surface* surface,
+   const int x,
+   const int y)
+{
+  if(!font || (count && !positions) || !color || !check_surface(surface)
+  || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  return draw_glyphs
+    (font, positions, count, antialiasing, color, surface, x, y);
+}
@@ -0,0 +1,303 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <string.h>
+
+#define FAMILY_BMP_SIZE (CHARMAP_PAGES_COUNT * CHARMAP_PAGE_SIZE)
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+/* Return the index of the first font covering `ch' or FAMILY_NO_FONT */
+static uint8_t
+find_font(struct font_family* family, const wchar_t ch)
+{
+  size_t i = 0;
+  ASSERT(family);
+  for(i = 0; i < family->nfonts; ++i) {
+    if(charmap_has_char(family->fonts[i], ch))
+      return (uint8_t)i;
+  }
+  return FAMILY_NO_FONT;
+}
+
+static void
+release_family(struct font_family* family)
+{
+  struct font_system* sys = NULL;
+  size_t i = 0;
+  ASSERT(family);
+
+  sys = family->sys;
+  for(i = 0; i < CHARMAP_PAGES_COUNT; ++i) {
+    if(family->pages[i])
+      MEM_FREE(sys->allocator, family->pages[i]);
+  }
+  if(family->fonts) {
+    for(i = 0; i < family->nfonts; ++i)
+      FONT(rsrc_ref_put(family->fonts[i]));
+    MEM_FREE(sys->allocator, family->fonts);
+  }
+  if(family->generations)
+    MEM_FREE(sys->allocator, family->generations);
+  MUTEX(destroy(&family->lock));
+  MEM_FREE(sys->allocator, family);
+  FONT(system_ref_put(sys));
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+/* Return true if the generations memoized by `family' are the current ones */
+static bool
+family_is_valid(struct font_family* family)
+{
+  size_t i = 0;
+  ASSERT(family);
+  for(i = 0; i < family->nfonts; ++i) {
+    const unsigned gen = __atomic_load_n
+      (&family->fonts[i]->generation, __ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&family->generations[i], __ATOMIC_ACQUIRE) != gen)
+      return false;
+  }
+  return true;
+}
+
+void
+family_validate(struct font_family* family)
+{
+  size_t i = 0;
+  ASSERT(family);
+
+  if(family_is_valid(family))
+    return;
+
+  MUTEX(lock(&family->lock));
+  /* Another thread may have invalidated the memo while this one waited for
+   * the lock; freeing the pages again would release the pages it fills */
+  if(!family_is_valid(family)) {
+    for(i = 0; i < CHARMAP_PAGES_COUNT; ++i) {
+      if(family->pages[i]) {
+        MEM_FREE(family->sys->allocator, family->pages[i]);
+        __atomic_store_n(&family->pages[i], NULL, __ATOMIC_RELEASE);
+      }
+    }
+    for(i = 0; i < family->nfonts; ++i) {
+      __atomic_store_n(&family->generations[i], __atomic_load_n
+        (&family->fonts[i]->generation, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
+  }
+  MUTEX(unlock(&family->lock));
+}
+
+struct font_rsrc*
+family_resolve(struct font_family* family, const wchar_t ch)
+{
+  const uint32_t code = (uint32_t)ch;
+  uint8_t* page = NULL;
+  uint8_t id = 0;
+  ASSERT(family);
+
+  if(code >= FAMILY_BMP_SIZE) {
+    id = find_font(family, ch);
+    return id == FAMILY_NO_FONT ? NULL : family->fonts[id];
+  }
+
+  page = __atomic_load_n
+    (&family->pages[code / CHARMAP_PAGE_SIZE], __ATOMIC_ACQUIRE);
+  if(!page) {
+    MUTEX(lock(&family->lock));
+    page = family->pages[code / CHARMAP_PAGE_SIZE];
+    if(!page) {
+      page = MEM_CALLOC(family->sys->allocator, CHARMAP_PAGE_SIZE, 1);
+      if(page) {
+        __atomic_store_n
+          (&family->pages[code / CHARMAP_PAGE_SIZE], page, __ATOMIC_RELEASE);
+      }
+    }
+    MUTEX(unlock(&family->lock));
+  }
+
+  if(page)
+    id = __atomic_load_n(&page[code % CHARMAP_PAGE_SIZE], __ATOMIC_RELAXED);
+  if(!id) {
+    /* Concurrent resolutions of a character store the same value */
+    const uint8_t ifont = find_font(family, ch);
+    id = ifont == FAMILY_NO_FONT ? FAMILY_NO_FONT : (uint8_t)(ifont + 1);
+    if(page)
+      __atomic_store_n(&page[code % CHARMAP_PAGE_SIZE], id, __ATOMIC_RELAXED);
+  }
+  return id == FAMILY_NO_FONT ? NULL : family->fonts[id - 1];
+}
+
+/*******************************************************************************
+ *
+ * Font family functions
+ *
+ ******************************************************************************/
+enum font_error
+font_family_create
+  (struct font_system* sys,
+   struct font_rsrc* const* fonts,
+   const size_t nfonts,
+   struct font_family** out_family)
+{
+  struct font_family* family = NULL;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!sys || !fonts || !nfonts || nfonts > FAMILY_MAX_FONTS || !out_family) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  for(i = 0; i < nfonts; ++i) {
+    if(!fonts[i] || fonts[i]->sys != sys || !fonts[i]->ft_face) {
+      font_err = FONT_INVALID_ARGUMENT;
+      goto error;
+    }
+  }
+  family = MEM_CALLOC(sys->allocator, 1, sizeof(struct font_family));
+  if(!family) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  if(pthread_mutex_init(&family->lock, NULL) != 0) {
+    MEM_FREE(sys->allocator, family);
+    family = NULL;
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  family->sys = sys;
+  FONT(system_ref_get(sys));
+  atomic_ref_init(&family->ref);
+
+  family->fonts = MEM_CALLOC(sys->allocator, nfonts, sizeof(struct font_rsrc*));
+  family->generations = MEM_CALLOC(sys->allocator, nfonts, sizeof(unsigned));
+  if(!family->fonts || !family->generations) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  for(i = 0; i < nfonts; ++i) {
+    family->fonts[i] = fonts[i];
+    family->generations[i] = fonts[i]->generation;
+    FONT(rsrc_ref_get(fonts[i]));
+  }
+  family->nfonts = nfonts;
+
+exit:
+  if(out_family)
+    *out_family = family;
+  return font_err;
+error:
+  if(family) {
+    FONT(family_ref_put(family));
+    family = NULL;
+  }
+  goto exit;
+}
+
+enum font_error
+font_family_ref_get(struct font_family* family)
+{
+  if(!family)
+    return FONT_INVALID_ARGUMENT;
+  atomic_ref_get(&family->ref);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_family_ref_put(struct font_family* family)
+{
+  if(!family)
+    return FONT_INVALID_ARGUMENT;
+  if(atomic_ref_put(&family->ref))
+    release_family(family);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_family_resolve
+  (struct font_family* family,
+   const wchar_t ch,
+   struct font_rsrc** font)
+{
+  if(!family || !font)
+    return FONT_INVALID_ARGUMENT;
+  family_validate(family);
+  *font = family_resolve(family, ch);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_family_get_glyph
+  (struct font_family* family,
+   const wchar_t ch,
+   struct font_glyph** glyph)
+{
+  struct font_rsrc* font = NULL;
+
+  if(!family || !glyph) {
+    if(glyph)
+      *glyph = NULL;
+    return FONT_INVALID_ARGUMENT;
+  }
+  family_validate(family);
+  font = family_resolve(family, ch);
+  if(!font) {
+    *glyph = NULL;
+    return FONT_INVALID_ARGUMENT;
+  }
+  return font_rsrc_get_glyph(font, ch, glyph);
+}
+
+enum font_error
+font_family_get_glyph_descs
+  (struct font_family* family,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs)
+{
+  struct font_rsrc* next = NULL;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!family || (count && (!chars || !descs)))
+    return FONT_INVALID_ARGUMENT;
+  family_validate(family);
+
+  /* Query each run of characters resolved to the same font at once. The font
+   * of the character that ends a run is the font of the next run */
+  if(count)
+    next = family_resolve(family, chars[0]);
+  while(i < count) {
+    struct font_rsrc* font = next;
+    size_t n = 1;
+
+    while(i + n < count) {
+      next = family_resolve(family, chars[i + n]);
+      if(next != font)
+        break;
+      ++n;
+    }
+    if(!font) {
+      size_t j = 0;
+      memset(descs + i, 0, n * sizeof(struct font_glyph_desc));
+      for(j = i; j < i + n; ++j)
+        descs[j].character = chars[j];
+    } else {
+      font_err = get_glyph_descs(font, &font->metrics, font->ft_size,
+        &font->size_req, chars + i, n, descs + i);
+      if(font_err != FONT_NO_ERROR)
+        return font_err;
+    }
+    i += n;
+  }
+  return FONT_NO_ERROR;
+}
@@ -0,0 +1,377 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <ft2build.h>
+#include FT_ADVANCES_H
+#include FT_OUTLINE_H
+
+#include <string.h>
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static size_t
+hash_character(const uint32_t key)
+{
+  /* Multiplicative hash. Consecutive characters spread over the table */
+  return (size_t)(key * 2654435761u);
+}
+
+static struct glyph_metrics*
+metrics_cache_find(const struct metrics_cache* cache, const wchar_t ch)
+{
+  const uint32_t key = (uint32_t)ch + 1;
+  size_t i = 0;
+  ASSERT(cache);
+
+  if(!cache->nslots)
+    return NULL;
+  i = hash_character(key) & (cache->nslots - 1);
+  while(cache->slots[i].key && cache->slots[i].key != key)
+    i = (i + 1) & (cache->nslots - 1);
+  return cache->slots[i].key ? cache->slots + i : NULL;
+}
+
+static void
+metrics_cache_put
+  (struct metrics_cache* cache,
+   const struct glyph_metrics* metrics)
+{
+  size_t i = 0;
+  ASSERT(cache && metrics && metrics->key && cache->nused < cache->nslots);
+
+  i = hash_character(metrics->key) & (cache->nslots - 1);
+  while(cache->slots[i].key)
+    i = (i + 1) & (cache->nslots - 1);
+  cache->slots[i] = *metrics;
+  ++cache->nused;
+}
+
+static enum font_error
+metrics_cache_insert
+  (struct mem_allocator* allocator,
+   struct metrics_cache* cache,
+   const struct glyph_metrics* metrics)
+{
+  ASSERT(allocator && cache && metrics);
+
+  /* Keep the load factor under 3/4 */
+  if((cache->nused + 1) * 4 > cache->nslots * 3) {
+    struct metrics_cache tmp;
+    size_t i = 0;
+
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.nslots = cache->nslots ? cache->nslots * 2 : 256;
+    tmp.slots = MEM_CALLOC(allocator, tmp.nslots, sizeof(struct glyph_metrics));
+    if(!tmp.slots)
+      return FONT_MEMORY_ERROR;
+    for(i = 0; i < cache->nslots; ++i) {
+      if(cache->slots[i].key)
+        metrics_cache_put(&tmp, cache->slots + i);
+    }
+    if(cache->slots)
+      MEM_FREE(allocator, cache->slots);
+    cache->slots = tmp.slots;
+    cache->nslots = tmp.nslots;
+  }
+  metrics_cache_put(cache, metrics);
+  return FONT_NO_ERROR;
+}
+
+/* Drop the metrics loaded at another size. Must be invoked with the font
+ * lock */
+static void
+metrics_cache_validate
+  (struct mem_allocator* allocator,
+   struct metrics_cache* cache,
+   FT_Size ft_size)
+{
+  ASSERT(allocator && cache && ft_size);
+  if(cache->x_scale != ft_size->metrics.x_scale
+  || cache->y_scale != ft_size->metrics.y_scale) {
+    metrics_cache_clear(allocator, cache);
+    cache->x_scale = ft_size->metrics.x_scale;
+    cache->y_scale = ft_size->metrics.y_scale;
+  }
+}
+
+/* Load flags of the unhinted metrics. Bitmap fonts have no outline to load
+ * instead of their bitmaps */
+static FT_Int32
+unhinted_load_flags(FT_Face ft_face)
+{
+  ASSERT(ft_face);
+  return FT_IS_SCALABLE(ft_face)
+    ? FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP
+    : FT_LOAD_DEFAULT;
+}
+
+/* Load the glyph into the glyph slot of the face and retrieve its metrics.
+ * The bounding box is the one of FT_Glyph_Get_CBox in pixels. */
+static void
+load_metrics
+  (FT_Face ft_face,
+   const FT_Int32 load_flags,
+   struct glyph_metrics* metrics)
+{
+  FT_GlyphSlot slot = NULL;
+  ASSERT(ft_face && metrics && metrics->glyph_index);
+
+  if(FT_Load_Glyph(ft_face, metrics->glyph_index, load_flags) != 0) {
+    metrics->glyph_index = 0;
+    return;
+  }
+  slot = ft_face->glyph;
+  metrics->advance = slot->advance.x;
+  if(slot->format == FT_GLYPH_FORMAT_OUTLINE) {
+    FT_BBox box;
+    FT_Outline_Get_CBox(&slot->outline, &box);
+    metrics->x_min = (int32_t)(box.xMin >> 6);
+    metrics->y_min = (int32_t)(box.yMin >> 6);
+    metrics->x_max = (int32_t)((box.xMax + 63) >> 6);
+    metrics->y_max = (int32_t)((box.yMax + 63) >> 6);
+  } else if(slot->format == FT_GLYPH_FORMAT_BITMAP) {
+    metrics->x_min = (int32_t)slot->bitmap_left;
+    metrics->y_max = (int32_t)slot->bitmap_top;
+    metrics->x_max = metrics->x_min + (int32_t)slot->bitmap.width;
+    metrics->y_min = metrics->y_max - (int32_t)slot->bitmap.rows;
+  }
+}
+
+static void
+setup_desc
+  (const wchar_t ch,
+   const struct glyph_metrics* metrics,
+   struct font_glyph_desc* desc)
+{
+  ASSERT(metrics && desc);
+  desc->character = ch;
+  desc->bbox.x_min = (int)metrics->x_min;
+  desc->bbox.y_min = (int)metrics->y_min;
+  desc->bbox.x_max = (int)metrics->x_max;
+  desc->bbox.y_max = (int)metrics->y_max;
+  desc->width = (int)(metrics->advance >> 6);
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+enum font_error
+get_glyph_metrics
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const FT_Size_RequestRec* req,
+   const wchar_t ch,
+   struct face_instance** instance,
+   struct glyph_metrics* metrics)
+{
+  struct glyph_metrics* found = NULL;
+  struct mem_allocator* allocator = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && cache && ft_size && req && instance && metrics);
+
+  allocator = font->sys->allocator;
+  MUTEX(lock(&font->lock));
+  metrics_cache_validate(allocator, cache, ft_size);
+  found = metrics_cache_find(cache, ch);
+  if(found)
+    *metrics = *found;
+  MUTEX(unlock(&font->lock));
+  if(found)
+    return FONT_NO_ERROR;
+
+  memset(metrics, 0, sizeof(struct glyph_metrics));
+  metrics->key = (uint32_t)ch + 1;
+  metrics->glyph_index = charmap_get_index(font, ch);
+  if(metrics->glyph_index) {
+    if(!*instance) {
+      font_err = face_instance_acquire(font, instance);
+      if(font_err != FONT_NO_ERROR)
+        return font_err;
+      font_err = face_instance_set_size(*instance, req);
+      if(font_err != FONT_NO_ERROR)
+        return font_err;
+    }
+    load_metrics((*instance)->ft_face, FT_LOAD_DEFAULT, metrics);
+  }
+
+  MUTEX(lock(&font->lock));
+  metrics_cache_validate(allocator, cache, ft_size);
+  if(!metrics_cache_find(cache, ch)) /* Not loaded concurrently */
+    font_err = metrics_cache_insert(allocator, cache, metrics);
+  MUTEX(unlock(&font->lock));
+  return font_err;
+}
+
+bool
+find_glyph_desc
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const wchar_t ch,
+   struct font_glyph_desc* desc)
+{
+  struct glyph_metrics* found = NULL;
+  ASSERT(font && cache && ft_size && desc);
+
+  MUTEX(lock(&font->lock));
+  metrics_cache_validate(font->sys->allocator, cache, ft_size);
+  found = metrics_cache_find(cache, ch);
+  if(found)
+    setup_desc(ch, found, desc);
+  MUTEX(unlock(&font->lock));
+  return found != NULL;
+}
+
+enum font_error
+cache_glyph_metrics
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const struct font_glyph* glyph)
+{
+  struct glyph_metrics metrics;
+  struct mem_allocator* allocator = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && cache && ft_size && glyph && glyph->ft_glyph);
+
+  memset(&metrics, 0, sizeof(metrics));
+  metrics.key = (uint32_t)glyph->character + 1;
+  metrics.glyph_index = charmap_get_index(font, glyph->character);
+  metrics.advance = glyph->ft_glyph->advance.x >> 10; /* 16.16 to 26.6 */
+  metrics.x_min = (int32_t)glyph->bbox.x_min;
+  metrics.y_min = (int32_t)glyph->bbox.y_min;
+  metrics.x_max = (int32_t)glyph->bbox.x_max;
+  metrics.y_max = (int32_t)glyph->bbox.y_max;
+
+  allocator = font->sys->allocator;
+  MUTEX(lock(&font->lock));
+  metrics_cache_validate(allocator, cache, ft_size);
+  if(!metrics_cache_find(cache, glyph->character))
+    font_err = metrics_cache_insert(allocator, cache, &metrics);
+  MUTEX(unlock(&font->lock));
+  return font_err;
+}
+
+enum font_error
+get_glyph_descs
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const FT_Size_RequestRec* req,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs)
+{
+  struct face_instance* instance = NULL;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && cache && ft_size && req && (chars || !count));
+  ASSERT(descs || !count);
+
+  for(i = 0; i < count; ++i) {
+    struct glyph_metrics metrics;
+    font_err = get_glyph_metrics
+      (font, cache, ft_size, req, chars[i], &instance, &metrics);
+    if(font_err != FONT_NO_ERROR)
+      break;
+    setup_desc(chars[i], &metrics, descs + i);
+  }
+  if(instance)
+    face_instance_release(font, instance);
+  return font_err;
+}
+
+enum font_error
+get_unhinted_glyph_descs
+  (struct font_rsrc* font,
+   const FT_Size_RequestRec* req,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs)
+{
+  struct face_instance* instance = NULL;
+  FT_Int32 load_flags = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && req && (chars || !count) && (descs || !count));
+
+  for(i = 0; i < count; ++i) {
+    struct glyph_metrics metrics;
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.glyph_index = charmap_get_index(font, chars[i]);
+    if(metrics.glyph_index) {
+      if(!instance) {
+        font_err = face_instance_acquire(font, &instance);
+        if(font_err != FONT_NO_ERROR)
+          break;
+        font_err = face_instance_set_size(instance, req);
+        if(font_err != FONT_NO_ERROR)
+          break;
+        load_flags = unhinted_load_flags(instance->ft_face);
+      }
+      load_metrics(instance->ft_face, load_flags, &metrics);
+    }
+    setup_desc(chars[i], &metrics, descs + i);
+  }
+  if(instance)
+    face_instance_release(font, instance);
+  return font_err;
+}
+
+enum font_error
+get_glyph_advances
+  (struct font_rsrc* font,
+   const FT_Size_RequestRec* req,
+   const wchar_t* chars,
+   const size_t count,
+   int* advances)
+{
+  struct face_instance* instance = NULL;
+  FT_Int32 load_flags = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && req && (chars || !count) && (advances || !count));
+
+  for(i = 0; i < count; ++i) {
+    const FT_UInt glyph_index = charmap_get_index(font, chars[i]);
+    FT_Fixed advance = 0; /* 16.16 */
+    if(glyph_index) {
+      if(!instance) {
+        font_err = face_instance_acquire(font, &instance);
+        if(font_err != FONT_NO_ERROR)
+          break;
+        font_err = face_instance_set_size(instance, req);
+        if(font_err != FONT_NO_ERROR)
+          break;
+        load_flags = unhinted_load_flags(instance->ft_face);
+      }
+      /* The advance of a glyph that cannot be loaded is null */
+      if(FT_Get_Advance(instance->ft_face, glyph_index, load_flags, &advance))
+        advance = 0;
+    }
+    advances[i] = (int)(advance >> 16);
+  }
+  if(instance)
+    face_instance_release(font, instance);
+  return font_err;
+}
+
+void
+metrics_cache_clear
+  (struct mem_allocator* allocator,
+   struct metrics_cache* cache)
+{
+  ASSERT(allocator && cache);
+  if(cache->slots)
+    MEM_FREE(allocator, cache->slots);
+  memset(cache, 0, sizeof(struct metrics_cache));
+}
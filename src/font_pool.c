@@ -0,0 +1,139 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <string.h>
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+/* The glyphs of a slab follow its header in the same memory block */
+static struct font_glyph*
+slab_glyphs(struct glyph_slab* slab)
+{
+  ASSERT(slab);
+  return (struct font_glyph*)(slab + 1);
+}
+
+static void
+slab_link(struct glyph_pool* pool, struct glyph_slab* slab)
+{
+  ASSERT(pool && slab);
+  slab->prev = NULL;
+  slab->next = pool->slabs;
+  if(pool->slabs)
+    pool->slabs->prev = slab;
+  pool->slabs = slab;
+}
+
+static void
+slab_unlink(struct glyph_pool* pool, struct glyph_slab* slab)
+{
+  ASSERT(pool && slab);
+  if(slab->prev)
+    slab->prev->next = slab->next;
+  else
+    pool->slabs = slab->next;
+  if(slab->next)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = NULL;
+}
+
+static struct glyph_slab*
+slab_create(struct mem_allocator* allocator)
+{
+  struct glyph_slab* slab = NULL;
+  struct font_glyph* glyphs = NULL;
+  size_t i = 0;
+  ASSERT(allocator);
+
+  slab = MEM_ALLOC(allocator,
+    sizeof(struct glyph_slab) + GLYPH_SLAB_SIZE * sizeof(struct font_glyph));
+  if(!slab)
+    return NULL;
+  memset(slab, 0, sizeof(struct glyph_slab));
+  glyphs = slab_glyphs(slab);
+  for(i = GLYPH_SLAB_SIZE; i-- > 0; ) {
+    glyphs[i].hash_next = slab->free_glyphs;
+    slab->free_glyphs = glyphs + i;
+  }
+  return slab;
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+struct font_glyph*
+glyph_pool_alloc(struct mem_allocator* allocator, struct glyph_pool* pool)
+{
+  struct glyph_slab* slab = NULL;
+  struct font_glyph* glyph = NULL;
+  ASSERT(allocator && pool);
+
+  slab = pool->slabs;
+  if(!slab) {
+    slab = slab_create(allocator);
+    if(!slab)
+      return NULL;
+    slab_link(pool, slab);
+    ++pool->nslabs;
+  }
+  glyph = slab->free_glyphs;
+  slab->free_glyphs = glyph->hash_next;
+  ++slab->nused;
+  if(!slab->free_glyphs) /* The slab is full */
+    slab_unlink(pool, slab);
+
+  memset(glyph, 0, sizeof(struct font_glyph));
+  glyph->slab = slab;
+  return glyph;
+}
+
+void
+glyph_pool_free
+  (struct mem_allocator* allocator,
+   struct glyph_pool* pool,
+   struct font_glyph* glyph)
+{
+  struct glyph_slab* slab = NULL;
+  ASSERT(allocator && pool && glyph && glyph->slab);
+
+  slab = glyph->slab;
+  ASSERT(slab->nused > 0);
+  if(!slab->free_glyphs) /* The slab was full */
+    slab_link(pool, slab);
+  glyph->hash_next = slab->free_glyphs;
+  slab->free_glyphs = glyph;
+  --slab->nused;
+
+  /* Give the empty slabs back to the allocator but the last one */
+  if(!slab->nused && pool->nslabs > 1) {
+    slab_unlink(pool, slab);
+    MEM_FREE(allocator, slab);
+    --pool->nslabs;
+  }
+}
+
+void
+glyph_pool_release(struct mem_allocator* allocator, struct glyph_pool* pool)
+{
+  struct glyph_slab* slab = NULL;
+  ASSERT(allocator && pool);
+
+  slab = pool->slabs;
+  while(slab) {
+    struct glyph_slab* next = slab->next;
+    if(!slab->nused) {
+      slab_unlink(pool, slab);
+      MEM_FREE(allocator, slab);
+      --pool->nslabs;
+    }
+    slab = next;
+  }
+}
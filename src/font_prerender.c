@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 200112L /* sysconf support */
+
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of characters processed by a task */
+#define PRERENDER_TASK_SIZE 32
+
+struct prerender;
+
+/* Span of the tasks of a worker. The worker pops its tasks from the front of
+ * the span while idle workers steal the back half of it. */
+struct worker {
+  pthread_mutex_t lock; /* Protect the span */
+  size_t begin;
+  size_t end;
+  pthread_t thread;
+  bool is_running; /* Has its own thread */
+  struct prerender* job;
+};
+
+struct prerender {
+  struct font_rsrc* font;
+  struct font_atlas* atlas; /* May be NULL */
+  const struct font_char_range* ranges;
+  size_t* offsets; /* Index of the first character of each range + total */
+  size_t nranges;
+  size_t nchars;
+  size_t ntasks;
+  int flags;
+
+  struct worker* workers;
+  size_t nworkers;
+
+  font_prerender_progress_T progress; /* May be NULL */
+  void* progress_data;
+  pthread_mutex_t progress_lock; /* Serialize the progress invocations */
+  size_t nchars_done; /* Atomic */
+  int is_canceled; /* Atomic */
+  int error; /* Atomic. First error of the workers */
+};
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static enum font_error
+prerender_char(struct prerender* job, const wchar_t ch)
+{
+  const bool aa[2] = { false, true };
+  const int aa_flags[2] = { FONT_PRERENDER_MONO, FONT_PRERENDER_ANTIALIASED };
+  const int spread = FONT_PRERENDER_SDF_SPREAD(job->flags);
+  struct font_glyph* glyph = NULL;
+  int i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(job);
+
+  if(job->atlas) {
+    for(i = 0; i < 2; ++i) {
+      struct font_atlas_glyph atlas_glyph;
+      if(!(job->flags & aa_flags[i]))
+        continue;
+      font_err = font_atlas_get_glyph
+        (job->atlas, job->font, ch, aa[i], &atlas_glyph);
+      /* The font has no glyph for the character */
+      if(font_err == FONT_INVALID_ARGUMENT)
+        return FONT_NO_ERROR;
+      if(font_err != FONT_NO_ERROR)
+        return font_err;
+    }
+    if(spread) {
+      struct font_atlas_glyph atlas_glyph;
+      font_err = font_atlas_get_sdf_glyph
+        (job->atlas, job->font, ch, spread, &atlas_glyph);
+      if(font_err == FONT_INVALID_ARGUMENT)
+        return FONT_NO_ERROR;
+    }
+    return font_err;
+  }
+
+  font_err = font_rsrc_get_glyph(job->font, ch, &glyph);
+  if(font_err == FONT_INVALID_ARGUMENT)
+    return FONT_NO_ERROR;
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+  for(i = 0; i < 2 && font_err == FONT_NO_ERROR; ++i) {
+    const FT_Bitmap* bmp = NULL;
+    if(job->flags & aa_flags[i])
+      font_err = glyph_rasterize(glyph, aa[i], &bmp);
+  }
+  if(spread && font_err == FONT_NO_ERROR) {
+    const FT_Bitmap* bmp = NULL;
+    font_err = glyph_rasterize_sdf(glyph, spread, &bmp);
+  }
+  FONT(glyph_ref_put(glyph));
+  return font_err;
+}
+
+static enum font_error
+prerender_task(struct prerender* job, const size_t task)
+{
+  const size_t first = task * PRERENDER_TASK_SIZE;
+  const size_t last = first + PRERENDER_TASK_SIZE < job->nchars
+    ? first + PRERENDER_TASK_SIZE : job->nchars;
+  size_t irange = 0;
+  size_t lo = 0, hi = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(job && task < job->ntasks);
+
+  /* Binary search of the range of the first character */
+  lo = 0;
+  hi = job->nranges;
+  while(hi - lo > 1) {
+    const size_t mid = (lo + hi) / 2;
+    if(job->offsets[mid] <= first)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  irange = lo;
+
+  for(i = first; i < last && font_err == FONT_NO_ERROR; ++i) {
+    wchar_t ch = 0;
+    while(i >= job->offsets[irange + 1])
+      ++irange;
+    ch = (wchar_t)(job->ranges[irange].first
+       + (wchar_t)(i - job->offsets[irange]));
+    font_err = prerender_char(job, ch);
+  }
+  return font_err;
+}
+
+static bool
+worker_pop(struct worker* worker, size_t* task)
+{
+  bool is_popped = false;
+  ASSERT(worker && task);
+
+  MUTEX(lock(&worker->lock));
+  if(worker->begin < worker->end) {
+    *task = worker->begin++;
+    is_popped = true;
+  }
+  MUTEX(unlock(&worker->lock));
+  return is_popped;
+}
+
+/* Move the back half of the span of another worker to the empty span of the
+ * thief. Return false if no worker has pending tasks. */
+static bool
+worker_steal(struct worker* thief)
+{
+  struct prerender* job = NULL;
+  size_t i = 0;
+  ASSERT(thief);
+
+  job = thief->job;
+  for(i = 1; i < job->nworkers; ++i) {
+    const size_t ithief = (size_t)(thief - job->workers);
+    struct worker* victim = job->workers + (ithief + i) % job->nworkers;
+    size_t begin = 0, end = 0;
+
+    MUTEX(lock(&victim->lock));
+    if(victim->begin < victim->end) {
+      end = victim->end;
+      begin = end - (victim->end - victim->begin + 1) / 2;
+      victim->end = begin;
+    }
+    MUTEX(unlock(&victim->lock));
+
+    if(begin < end) {
+      MUTEX(lock(&thief->lock));
+      thief->begin = begin;
+      thief->end = end;
+      MUTEX(unlock(&thief->lock));
+      return true;
+    }
+  }
+  return false;
+}
+
+static void
+report_progress(struct prerender* job, const size_t ntask_chars)
+{
+  ASSERT(job);
+
+  __atomic_add_fetch(&job->nchars_done, ntask_chars, __ATOMIC_RELAXED);
+  if(!job->progress)
+    return;
+
+  /* The counter is read under the lock to report a monotonic progress */
+  MUTEX(lock(&job->progress_lock));
+  if(!job->progress
+    (__atomic_load_n(&job->nchars_done, __ATOMIC_RELAXED), job->nchars,
+     job->progress_data)) {
+    __atomic_store_n(&job->is_canceled, 1, __ATOMIC_RELAXED);
+  }
+  MUTEX(unlock(&job->progress_lock));
+}
+
+static void*
+worker_run(void* arg)
+{
+  struct worker* worker = arg;
+  struct prerender* job = NULL;
+  ASSERT(worker);
+
+  job = worker->job;
+  for(;;) {
+    enum font_error font_err = FONT_NO_ERROR;
+    size_t task = 0;
+    size_t first = 0;
+    int no_error = FONT_NO_ERROR;
+
+    if(__atomic_load_n(&job->is_canceled, __ATOMIC_RELAXED)
+    || __atomic_load_n(&job->error, __ATOMIC_RELAXED) != FONT_NO_ERROR)
+      break;
+    if(!worker_pop(worker, &task)) {
+      if(!worker_steal(worker) || !worker_pop(worker, &task))
+        break;
+    }
+    font_err = prerender_task(job, task);
+    if(font_err != FONT_NO_ERROR) {
+      __atomic_compare_exchange_n(&job->error, &no_error, (int)font_err,
+        false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      break;
+    }
+    first = task * PRERENDER_TASK_SIZE;
+    report_progress(job, first + PRERENDER_TASK_SIZE < job->nchars
+      ? PRERENDER_TASK_SIZE : job->nchars - first);
+  }
+  return NULL;
+}
+
+static size_t
+count_online_cpus(void)
+{
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
+
+/*******************************************************************************
+ *
+ * Glyph pre-rendering functions
+ *
+ ******************************************************************************/
+enum font_error
+font_rsrc_prerender
+  (struct font_rsrc* font,
+   const struct font_char_range* ranges,
+   const size_t nranges,
+   const int flags,
+   const size_t nthreads,
+   struct font_atlas* atlas,
+   font_prerender_progress_T progress,
+   void* progress_data)
+{
+  const int raster_flags = FONT_PRERENDER_MONO | FONT_PRERENDER_ANTIALIASED
+    | FONT_PRERENDER_SDF(0xFF);
+  struct prerender job;
+  struct mem_allocator* allocator = NULL;
+  size_t nworkers = 0;
+  size_t nlocks = 0;
+  size_t i = 0;
+  bool is_progress_lock_init = false;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  memset(&job, 0, sizeof(job));
+
+  if(!font || (nranges && !ranges) || !font->ft_face
+  || (flags & ~raster_flags) || (atlas && !(flags & raster_flags))
+  || FONT_PRERENDER_SDF_SPREAD(flags) > FONT_SDF_MAX_SPREAD) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  for(i = 0; i < nranges; ++i) {
+    if(ranges[i].first < 0 || ranges[i].last < ranges[i].first) {
+      font_err = FONT_INVALID_ARGUMENT;
+      goto error;
+    }
+  }
+  allocator = font->sys->allocator;
+
+  job.font = font;
+  job.atlas = atlas;
+  job.ranges = ranges;
+  job.nranges = nranges;
+  job.flags = flags;
+  job.progress = progress;
+  job.progress_data = progress_data;
+  job.error = FONT_NO_ERROR;
+
+  job.offsets = MEM_ALLOC(allocator, (nranges + 1) * sizeof(size_t));
+  if(!job.offsets) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  for(i = 0; i < nranges; ++i) {
+    job.offsets[i] = job.nchars;
+    job.nchars += (size_t)ranges[i].last - (size_t)ranges[i].first + 1;
+  }
+  job.offsets[nranges] = job.nchars;
+  job.ntasks = (job.nchars + PRERENDER_TASK_SIZE - 1) / PRERENDER_TASK_SIZE;
+  if(!job.ntasks)
+    goto exit;
+
+  nworkers = nthreads ? nthreads : count_online_cpus();
+  if(nworkers > job.ntasks)
+    nworkers = job.ntasks;
+  job.workers = MEM_CALLOC(allocator, nworkers, sizeof(struct worker));
+  if(!job.workers) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  if(pthread_mutex_init(&job.progress_lock, NULL) != 0) {
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  is_progress_lock_init = true;
+
+  /* Evenly distribute the tasks between the workers */
+  for(nlocks = 0; nlocks < nworkers; ++nlocks) {
+    struct worker* worker = job.workers + nlocks;
+    if(pthread_mutex_init(&worker->lock, NULL) != 0) {
+      font_err = FONT_INTERNAL_ERROR;
+      goto error;
+    }
+    worker->begin = job.ntasks * nlocks / nworkers;
+    worker->end = job.ntasks * (nlocks + 1) / nworkers;
+    worker->job = &job;
+  }
+  job.nworkers = nworkers;
+
+  /* The calling thread is the first worker. The tasks of a worker whose
+   * thread cannot be created are stolen by the others. */
+  for(i = 1; i < nworkers; ++i) {
+    struct worker* worker = job.workers + i;
+    worker->is_running =
+      pthread_create(&worker->thread, NULL, worker_run, worker) == 0;
+  }
+  worker_run(job.workers);
+  for(i = 1; i < nworkers; ++i) {
+    if(job.workers[i].is_running) {
+      const int err = pthread_join(job.workers[i].thread, NULL);
+      ASSERT(!err);
+      (void)err;
+    }
+  }
+  font_err = (enum font_error)job.error;
+
+exit:
+  for(i = 0; i < nlocks; ++i)
+    MUTEX(destroy(&job.workers[i].lock));
+  if(is_progress_lock_init)
+    MUTEX(destroy(&job.progress_lock));
+  if(job.workers)
+    MEM_FREE(allocator, job.workers);
+  if(job.offsets)
+    MEM_FREE(allocator, job.offsets);
+  return font_err;
+error:
+  goto exit;
+}
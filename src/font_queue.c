@@ -0,0 +1,372 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+struct font_glyph_queue {
+  struct atomic_ref ref;
+  struct font_system* sys;
+  size_t capacity;
+  size_t mask; /* Size of the rings - 1. The size is a power of 2 */
+  size_t ninflight; /* Atomic. Requests pushed and not drained yet */
+
+  /* Ring of the pending requests, protected by the lock. Indices are
+   * monotonic and wrapped on access */
+  struct font_glyph_request* requests;
+  size_t requests_head;
+  size_t requests_tail;
+  size_t npushed;
+  size_t ncompleted;
+
+  /* Single producer, single consumer ring of the completions. The worker
+   * publishes the tail while the head is only accessed by the draining
+   * thread. Since ninflight never exceeds the ring size, the worker cannot
+   * overwrite a completion that is not drained yet. */
+  struct font_glyph_completion* completions;
+  size_t completions_head;
+  size_t completions_tail; /* Atomic */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond_request; /* Signaled on push and on stop */
+  pthread_cond_t cond_completion; /* Signaled on completion */
+  bool is_running; /* The worker thread is created */
+  bool is_stopping;
+};
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static size_t
+round_up_pow2(const size_t i)
+{
+  size_t pow2 = 1;
+  while(pow2 < i)
+    pow2 *= 2;
+  return pow2;
+}
+
+static void
+request_release(const struct font_glyph_request* request)
+{
+  ASSERT(request);
+  if(request->size)
+    FONT(size_ref_put(request->size));
+  FONT(rsrc_ref_put(request->font));
+}
+
+static void
+process_request
+  (const struct font_glyph_request* request,
+   struct font_glyph_completion* completion)
+{
+  struct font_rsrc* font = NULL;
+  const FT_Bitmap* bmp = NULL;
+  ASSERT(request && completion);
+
+  completion->request = *request;
+  completion->glyph = NULL;
+  font = request->font;
+  if(request->size) {
+    completion->error = font_size_get_glyph
+      (request->size, request->character, &completion->glyph);
+  } else {
+    completion->error = font_rsrc_get_glyph
+      (font, request->character, &completion->glyph);
+  }
+  if(completion->error != FONT_NO_ERROR)
+    return;
+
+  completion->error = glyph_rasterize
+    (completion->glyph, request->antialiasing, &bmp);
+  if(completion->error != FONT_NO_ERROR) {
+    FONT(glyph_ref_put(completion->glyph));
+    completion->glyph = NULL;
+    return;
+  }
+
+  /* Cache the glyph metrics for the placeholders of subsequent requests. A
+   * failure only loses the placeholder */
+  if(request->size) {
+    cache_glyph_metrics(font, &request->size->metrics, request->size->ft_size,
+      completion->glyph);
+  } else {
+    cache_glyph_metrics(font, &font->metrics, font->ft_size, completion->glyph);
+  }
+}
+
+static void*
+worker_run(void* arg)
+{
+  struct font_glyph_queue* queue = arg;
+  ASSERT(queue);
+
+  for(;;) {
+    struct font_glyph_request request;
+    size_t tail = 0;
+
+    MUTEX(lock(&queue->lock));
+    while(queue->requests_head == queue->requests_tail && !queue->is_stopping)
+      COND(wait(&queue->cond_request, &queue->lock));
+    if(queue->is_stopping) {
+      MUTEX(unlock(&queue->lock));
+      break;
+    }
+    request = queue->requests[queue->requests_head++ & queue->mask];
+    MUTEX(unlock(&queue->lock));
+
+    tail = __atomic_load_n(&queue->completions_tail, __ATOMIC_RELAXED);
+    process_request(&request, queue->completions + (tail & queue->mask));
+    __atomic_store_n(&queue->completions_tail, tail + 1, __ATOMIC_RELEASE);
+
+    MUTEX(lock(&queue->lock));
+    ++queue->ncompleted;
+    COND(broadcast(&queue->cond_completion));
+    MUTEX(unlock(&queue->lock));
+  }
+  return NULL;
+}
+
+static void
+release_queue(struct font_glyph_queue* queue)
+{
+  struct font_system* sys = NULL;
+  size_t tail = 0;
+  ASSERT(queue);
+
+  sys = queue->sys;
+  if(queue->is_running) {
+    int err = 0;
+    MUTEX(lock(&queue->lock));
+    queue->is_stopping = true;
+    COND(signal(&queue->cond_request));
+    MUTEX(unlock(&queue->lock));
+    err = pthread_join(queue->thread, NULL);
+    ASSERT(!err);
+    (void)err;
+  }
+
+  /* Cancel the pending requests and the completions that are not drained */
+  for(; queue->requests_head != queue->requests_tail; ++queue->requests_head)
+    request_release(queue->requests + (queue->requests_head & queue->mask));
+  tail = __atomic_load_n(&queue->completions_tail, __ATOMIC_ACQUIRE);
+  for(; queue->completions_head != tail; ++queue->completions_head) {
+    struct font_glyph_completion* completion =
+      queue->completions + (queue->completions_head & queue->mask);
+    if(completion->glyph)
+      FONT(glyph_ref_put(completion->glyph));
+    request_release(&completion->request);
+  }
+
+  if(queue->requests)
+    MEM_FREE(sys->allocator, queue->requests);
+  if(queue->completions)
+    MEM_FREE(sys->allocator, queue->completions);
+  COND(destroy(&queue->cond_completion));
+  COND(destroy(&queue->cond_request));
+  MUTEX(destroy(&queue->lock));
+  MEM_FREE(sys->allocator, queue);
+  FONT(system_ref_put(sys));
+}
+
+/*******************************************************************************
+ *
+ * Glyph queue functions
+ *
+ ******************************************************************************/
+enum font_error
+font_glyph_queue_create
+  (struct font_system* sys,
+   const size_t capacity,
+   struct font_glyph_queue** out_queue)
+{
+  struct font_glyph_queue* queue = NULL;
+  size_t size = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!sys || !capacity || capacity > SIZE_MAX / 4 || !out_queue) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  queue = MEM_CALLOC(sys->allocator, 1, sizeof(struct font_glyph_queue));
+  if(!queue) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  if(pthread_mutex_init(&queue->lock, NULL) != 0) {
+    MEM_FREE(sys->allocator, queue);
+    queue = NULL;
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  if(pthread_cond_init(&queue->cond_request, NULL) != 0) {
+    MUTEX(destroy(&queue->lock));
+    MEM_FREE(sys->allocator, queue);
+    queue = NULL;
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  if(pthread_cond_init(&queue->cond_completion, NULL) != 0) {
+    COND(destroy(&queue->cond_request));
+    MUTEX(destroy(&queue->lock));
+    MEM_FREE(sys->allocator, queue);
+    queue = NULL;
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  queue->sys = sys;
+  FONT(system_ref_get(sys));
+  atomic_ref_init(&queue->ref);
+
+  size = round_up_pow2(capacity);
+  queue->capacity = capacity;
+  queue->mask = size - 1;
+  queue->requests = MEM_CALLOC
+    (sys->allocator, size, sizeof(struct font_glyph_request));
+  queue->completions = MEM_CALLOC
+    (sys->allocator, size, sizeof(struct font_glyph_completion));
+  if(!queue->requests || !queue->completions) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  if(pthread_create(&queue->thread, NULL, worker_run, queue) != 0) {
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
+  queue->is_running = true;
+
+exit:
+  if(out_queue)
+    *out_queue = queue;
+  return font_err;
+error:
+  if(queue) {
+    FONT(glyph_queue_ref_put(queue));
+    queue = NULL;
+  }
+  goto exit;
+}
+
+enum font_error
+font_glyph_queue_ref_get(struct font_glyph_queue* queue)
+{
+  if(!queue)
+    return FONT_INVALID_ARGUMENT;
+  atomic_ref_get(&queue->ref);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_glyph_queue_ref_put(struct font_glyph_queue* queue)
+{
+  if(!queue)
+    return FONT_INVALID_ARGUMENT;
+  if(atomic_ref_put(&queue->ref))
+    release_queue(queue);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_glyph_queue_push
+  (struct font_glyph_queue* queue,
+   const struct font_glyph_request* request,
+   struct font_glyph_desc* desc,
+   bool* has_desc)
+{
+  struct font_rsrc* font = NULL;
+  struct font_size* size = NULL;
+  size_t ninflight = 0;
+  bool is_found = false;
+
+  if(!queue || !request || !request->font)
+    return FONT_INVALID_ARGUMENT;
+  font = request->font;
+  size = request->size;
+  if(font->sys != queue->sys || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  if(size && (size->font != font || !size->ft_size))
+    return FONT_INVALID_ARGUMENT;
+
+  /* Reserve a slot in the rings */
+  ninflight = __atomic_load_n(&queue->ninflight, __ATOMIC_RELAXED);
+  do {
+    if(ninflight >= queue->capacity)
+      return FONT_MEMORY_ERROR;
+  } while(!__atomic_compare_exchange_n(&queue->ninflight, &ninflight,
+    ninflight + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  if(desc) {
+    is_found = size
+      ? find_glyph_desc(font, &size->metrics, size->ft_size,
+          request->character, desc)
+      : find_glyph_desc(font, &font->metrics, font->ft_size,
+          request->character, desc);
+    if(!is_found) {
+      memset(desc, 0, sizeof(struct font_glyph_desc));
+      desc->character = request->character;
+    }
+  }
+  if(has_desc)
+    *has_desc = is_found;
+
+  FONT(rsrc_ref_get(font));
+  if(size)
+    FONT(size_ref_get(size));
+  MUTEX(lock(&queue->lock));
+  queue->requests[queue->requests_tail++ & queue->mask] = *request;
+  ++queue->npushed;
+  COND(signal(&queue->cond_request));
+  MUTEX(unlock(&queue->lock));
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_glyph_queue_drain
+  (struct font_glyph_queue* queue,
+   font_glyph_completion_T func,
+   void* data,
+   size_t* count)
+{
+  size_t tail = 0;
+  size_t n = 0;
+
+  if(!queue || !func)
+    return FONT_INVALID_ARGUMENT;
+
+  tail = __atomic_load_n(&queue->completions_tail, __ATOMIC_ACQUIRE);
+  for(; queue->completions_head != tail; ++queue->completions_head, ++n) {
+    struct font_glyph_completion* completion =
+      queue->completions + (queue->completions_head & queue->mask);
+    func(completion, data);
+    if(completion->glyph)
+      FONT(glyph_ref_put(completion->glyph));
+    request_release(&completion->request);
+    /* Give the slot back to the producers */
+    __atomic_sub_fetch(&queue->ninflight, 1, __ATOMIC_RELEASE);
+  }
+  if(count)
+    *count = n;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_glyph_queue_wait(struct font_glyph_queue* queue)
+{
+  size_t npushed = 0;
+
+  if(!queue)
+    return FONT_INVALID_ARGUMENT;
+  MUTEX(lock(&queue->lock));
+  npushed = queue->npushed;
+  while(queue->ncompleted < npushed)
+    COND(wait(&queue->cond_completion, &queue->lock));
+  MUTEX(unlock(&queue->lock));
+  return FONT_NO_ERROR;
+}
@@ -1,52 +1,29 @@
 #include "font_rsrc.h"
+#include "font_rsrc_c.h"
 
 #include <snlsys/mem_allocator.h>
-#include <snlsys/ref_count.h>
 #include <snlsys/snlsys.h>
 
 #include <ft2build.h>
-#include FT_FREETYPE_H
-#include FT_GLYPH_H
+#include FT_MODULE_H
+#include FT_OUTLINE_H
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
-#ifndef NDEBUG
-  #define FT(func) ASSERT(0 == FT_##func)
-#else
-  #define FT(func) FT_##func
-#endif
-
-struct font_system {
-  struct ref ref;
-  struct mem_allocator* allocator;
-  FT_Library ft_handle;
-};
-
-struct font_rsrc {
-  struct ref ref;
-  struct font_system* sys;
-  FT_Face ft_face;
-};
-
-struct font_glyph {
-  struct ref ref;
-  struct font_rsrc* font;
-  wchar_t character;
-  struct { /* Glyph bounding box in pixels */
-    int x_min;
-    int y_min;
-    int x_max;
-    int y_max;
-  } bbox;
-  FT_Glyph ft_glyph;
-};
+/* Default memory budget of the per font glyph cache, in bytes. */
+#define GLYPH_CACHE_DEFAULT_SIZE (4 * 1024 * 1024)
+
+/* Maximum size in pixels of a bitmap whose distance field is computed */
+#define SDF_MAX_SIZE 16384
 
 /*******************************************************************************
  *
  * Helper functions.
  *
  ******************************************************************************/
-static enum font_error
+enum font_error
 ft_to_font_error(FT_Error ft_err)
 {
   enum font_error font_err = FONT_NO_ERROR;
@@ -62,7 +39,7 @@ ft_to_font_error(FT_Error ft_err)
   return font_err;
 }
 
-static int
+int
 sizeof_ft_pixel_mode(FT_Pixel_Mode mode)
 {
   int size = 0;
@@ -88,98 +65,1206 @@ sizeof_ft_pixel_mode(FT_Pixel_Mode mode)
   return size;
 }
 
-static void
-copy_bitmap_pixel
-  (const FT_Bitmap* bitmap,
-   const int x,
-   const int y,
-   unsigned char* pixel)
+static size_t
+sizeof_ft_glyph(FT_Glyph ft_glyph)
 {
-  const unsigned char* bmp_row = bitmap->buffer + y * bitmap->pitch;
-  const unsigned char* bmp_byte = NULL;
-  int bit_shift = 0;
-  const char mode = bitmap->pixel_mode;
+  size_t size = 0;
 
-  switch(mode) {
-    case FT_PIXEL_MODE_MONO:
-      bmp_byte = bmp_row + x / 8;
-      bit_shift = 7 - x % 8;
-      *pixel = (unsigned char)((((*bmp_byte) >> bit_shift) & 0x01) * 255);
-      break;
-    case FT_PIXEL_MODE_GRAY:
-      bmp_byte = bmp_row + x;
-      *pixel = *bmp_byte;
-      break;
-    case FT_PIXEL_MODE_GRAY2:
-      bmp_byte = bmp_row + x / 4;
-      bit_shift = (3 - x % 4) * 2;
-      *pixel = (unsigned char)((((*bmp_byte) >> bit_shift) & 0x03) * 85);
+  if(!ft_glyph)
+    return 0;
+
+  switch(ft_glyph->format) {
+    case FT_GLYPH_FORMAT_OUTLINE: {
+      const FT_Outline* outline = &((FT_OutlineGlyph)ft_glyph)->outline;
+      size = sizeof(struct FT_OutlineGlyphRec_)
+        + (size_t)outline->n_points * (sizeof(FT_Vector) + sizeof(char))
+        + (size_t)outline->n_contours * sizeof(short);
       break;
-    case FT_PIXEL_MODE_GRAY4:
-      bmp_byte = bmp_row + x / 2;
-      bit_shift = (1 - x % 2) * 4;
-      *pixel = (unsigned char)((((*bmp_byte) >> bit_shift) & 0x0F) * 17);
+    }
+    case FT_GLYPH_FORMAT_BITMAP: {
+      const FT_Bitmap* bmp = &((FT_BitmapGlyph)ft_glyph)->bitmap;
+      size = sizeof(struct FT_BitmapGlyphRec_)
+        + (size_t)abs(bmp->pitch) * (size_t)bmp->rows;
       break;
-    case FT_PIXEL_MODE_LCD:
-    case FT_PIXEL_MODE_LCD_V:
-      bmp_byte = bmp_row + x * 3;
-      pixel[0] = bmp_byte[0];
-      pixel[1] = bmp_byte[1];
-      pixel[2] = bmp_byte[2];
+    }
+    default:
+      size = sizeof(struct FT_GlyphRec_);
       break;
-    default: ASSERT(0); /* Unreachable code */ break;
   }
+  return size;
+}
+
+static size_t
+sizeof_sdf(const struct glyph_sdf* sdf)
+{
+  ASSERT(sdf);
+  return sizeof(struct glyph_sdf) + (size_t)sdf->bitmap.width*sdf->bitmap.rows;
+}
+
+static size_t
+sizeof_glyph(const struct font_glyph* glyph)
+{
+  const struct glyph_sdf* sdf = NULL;
+  size_t size = sizeof(struct font_glyph);
+  int i = 0;
+  ASSERT(glyph);
+
+  size += sizeof_ft_glyph(glyph->ft_glyph);
+  for(i = 0; i < GLYPH_RENDER_MODES_COUNT__; ++i) {
+    if(glyph->ft_bitmaps[i] != glyph->ft_glyph)
+      size += sizeof_ft_glyph(glyph->ft_bitmaps[i]);
+  }
+  for(sdf = glyph->sdfs; sdf; sdf = sdf->next)
+    size += sizeof_sdf(sdf);
+  return size;
+}
+
+static size_t
+hash_glyph_key(const struct glyph_key* key)
+{
+  /* 32-bits FNV-1a hash of the key fields. */
+  const uint32_t fields[5] = {
+    (uint32_t)key->character,
+    (uint32_t)key->x_scale,
+    (uint32_t)key->y_scale,
+    (uint32_t)key->load_flags,
+    (uint32_t)key->x_phase
+  };
+  const unsigned char* bytes = (const unsigned char*)fields;
+  uint32_t hash = 2166136261u;
+  size_t i = 0;
+
+  for(i = 0; i < sizeof(fields); ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return (size_t)hash;
+}
+
+static bool
+glyph_key_eq(const struct glyph_key* a, const struct glyph_key* b)
+{
+  return a->character == b->character
+      && a->x_scale == b->x_scale
+      && a->y_scale == b->y_scale
+      && a->load_flags == b->load_flags
+      && a->x_phase == b->x_phase;
 }
 
 static void
-release_font_system(struct ref* ref)
+destroy_glyph(struct font_rsrc* font, struct font_glyph* glyph)
 {
-  struct font_system* sys = NULL;
-  ASSERT(ref);
+  int i = 0;
+  ASSERT(font && glyph);
+
+  for(i = 0; i < GLYPH_RENDER_MODES_COUNT__; ++i) {
+    if(glyph->ft_bitmaps[i] && glyph->ft_bitmaps[i] != glyph->ft_glyph) {
+      STATS_SUB(font, bitmaps_size, sizeof_ft_glyph(glyph->ft_bitmaps[i]));
+      FT_Done_Glyph(glyph->ft_bitmaps[i]);
+    }
+  }
+  while(glyph->sdfs) {
+    struct glyph_sdf* sdf = glyph->sdfs;
+    glyph->sdfs = sdf->next;
+    STATS_SUB(font, bitmaps_size, sizeof_sdf(sdf));
+    MEM_FREE(font->sys->allocator, sdf);
+  }
+  if(glyph->ft_glyph)
+    FT_Done_Glyph(glyph->ft_glyph);
+  STATS_ADD(font, glyphs_released, 1);
+  glyph_pool_free(font->sys->allocator, &font->pool, glyph);
+}
+
+static void
+lru_remove(struct glyph_cache* cache, struct font_glyph* glyph)
+{
+  ASSERT(cache && glyph);
+  if(glyph->lru_prev)
+    glyph->lru_prev->lru_next = glyph->lru_next;
+  else
+    cache->lru_head = glyph->lru_next;
+  if(glyph->lru_next)
+    glyph->lru_next->lru_prev = glyph->lru_prev;
+  else
+    cache->lru_tail = glyph->lru_prev;
+  glyph->lru_prev = glyph->lru_next = NULL;
+}
+
+static void
+lru_push_front(struct glyph_cache* cache, struct font_glyph* glyph)
+{
+  ASSERT(cache && glyph);
+  glyph->lru_prev = NULL;
+  glyph->lru_next = cache->lru_head;
+  if(cache->lru_head)
+    cache->lru_head->lru_prev = glyph;
+  else
+    cache->lru_tail = glyph;
+  cache->lru_head = glyph;
+}
 
-  sys = CONTAINER_OF(ref, struct font_system, ref);
+static struct font_glyph*
+glyph_cache_find(struct glyph_cache* cache, const struct glyph_key* key)
+{
+  struct font_glyph* glyph = NULL;
+  ASSERT(cache && key);
+
+  if(!cache->nbuckets)
+    return NULL;
+  glyph = cache->buckets[hash_glyph_key(key) & (cache->nbuckets - 1)];
+  while(glyph && !glyph_key_eq(&glyph->key, key))
+    glyph = glyph->hash_next;
+  if(glyph)
+    glyph->generation = cache->generation;
+  if(glyph && glyph != cache->lru_head) {
+    lru_remove(cache, glyph);
+    lru_push_front(cache, glyph);
+  }
+  return glyph;
+}
+
+/* Unregister the glyph from the cache. Idle glyphs are destroyed while the
+ * ones still in use are released on their last font_glyph_ref_put. */
+static void
+glyph_cache_evict(struct font_rsrc* font, struct font_glyph* glyph)
+{
+  struct glyph_cache* cache = &font->cache;
+  struct font_glyph** slot = NULL;
+  ASSERT(font && glyph && glyph->is_cached);
+
+  slot = &cache->buckets[hash_glyph_key(&glyph->key) & (cache->nbuckets - 1)];
+  while(*slot != glyph)
+    slot = &(*slot)->hash_next;
+  *slot = glyph->hash_next;
+  glyph->hash_next = NULL;
+  lru_remove(cache, glyph);
+
+  ASSERT(cache->nglyphs > 0 && cache->mem_size >= glyph->mem_size);
+  --cache->nglyphs;
+  cache->mem_size -= glyph->mem_size;
+  glyph->is_cached = false;
+  STATS_ADD(font, cache_evictions, 1);
+
+  if(glyph->is_idle)
+    destroy_glyph(font, glyph);
+}
+
+/* Evict the least recently used glyphs until the cache fits in its budget.
+ * The `keep' glyph is never evicted. */
+static void
+glyph_cache_trim(struct font_rsrc* font, const struct font_glyph* keep)
+{
+  struct glyph_cache* cache = &font->cache;
+  struct font_glyph* glyph = cache->lru_tail;
+  ASSERT(font);
+
+  while(glyph && cache->mem_size > cache->mem_budget) {
+    struct font_glyph* prev = glyph->lru_prev;
+    if(glyph != keep)
+      glyph_cache_evict(font, glyph);
+    glyph = prev;
+  }
+}
+
+static void
+glyph_cache_clear(struct font_rsrc* font)
+{
+  ASSERT(font);
+  while(font->cache.lru_tail)
+    glyph_cache_evict(font, font->cache.lru_tail);
+}
+
+static enum font_error
+glyph_cache_grow(struct font_rsrc* font)
+{
+  struct glyph_cache* cache = &font->cache;
+  struct font_glyph** buckets = NULL;
+  size_t nbuckets = 0;
+  size_t i = 0;
+  ASSERT(font);
+
+  nbuckets = cache->nbuckets ? cache->nbuckets * 2 : 64;
+  buckets = MEM_CALLOC(font->sys->allocator, nbuckets, sizeof(*buckets));
+  if(!buckets)
+    return FONT_MEMORY_ERROR;
+
+  for(i = 0; i < cache->nbuckets; ++i) {
+    struct font_glyph* glyph = cache->buckets[i];
+    while(glyph) {
+      struct font_glyph* next = glyph->hash_next;
+      const size_t id = hash_glyph_key(&glyph->key) & (nbuckets - 1);
+      glyph->hash_next = buckets[id];
+      buckets[id] = glyph;
+      glyph = next;
+    }
+  }
+  if(cache->buckets)
+    MEM_FREE(font->sys->allocator, cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+  return FONT_NO_ERROR;
+}
+
+static enum font_error
+glyph_cache_insert(struct font_rsrc* font, struct font_glyph* glyph)
+{
+  struct glyph_cache* cache = &font->cache;
+  size_t id = 0;
+  ASSERT(font && glyph && !glyph->is_cached);
+
+  if(!cache->mem_budget)
+    return FONT_NO_ERROR;
+
+  if(cache->nglyphs >= cache->nbuckets) {
+    const enum font_error font_err = glyph_cache_grow(font);
+    if(font_err != FONT_NO_ERROR)
+      return font_err;
+  }
+  id = hash_glyph_key(&glyph->key) & (cache->nbuckets - 1);
+  glyph->hash_next = cache->buckets[id];
+  cache->buckets[id] = glyph;
+  lru_push_front(cache, glyph);
+  glyph->generation = cache->generation;
+  glyph->mem_size = sizeof_glyph(glyph);
+  glyph->is_cached = true;
+  ++cache->nglyphs;
+  cache->mem_size += glyph->mem_size;
+
+  glyph_cache_trim(font, glyph);
+  return FONT_NO_ERROR;
+}
+
+/* Update the memory footprint of a cached glyph whose content changed. */
+static void
+glyph_cache_update(struct font_rsrc* font, struct font_glyph* glyph)
+{
+  size_t mem_size = 0;
+  ASSERT(font && glyph);
+
+  if(!glyph->is_cached)
+    return;
+  mem_size = sizeof_glyph(glyph);
+  font->cache.mem_size = font->cache.mem_size - glyph->mem_size + mem_size;
+  glyph->mem_size = mem_size;
+  glyph_cache_trim(font, glyph);
+}
+
+/* FreeType memory callbacks forwarding to the allocator of the system. Each
+ * block is prefixed by its size in order to track the FreeType memory on
+ * free. The header is FT_MEMORY_HEADER_SIZE bytes long to keep the
+ * alignment of the returned block. */
+#define FT_MEMORY_HEADER_SIZE 16
+
+static void*
+ft_alloc(FT_Memory memory, long size)
+{
+  struct font_system* sys = memory->user;
+  char* mem = NULL;
+
+  mem = MEM_ALLOC(sys->allocator, FT_MEMORY_HEADER_SIZE + (size_t)size);
+  if(!mem)
+    return NULL;
+  *(size_t*)mem = (size_t)size;
+  SYS_STATS_ADD(sys, ft_allocated_size, (size_t)size);
+  SYS_STATS_ADD(sys, ft_allocations_count, 1);
+  return mem + FT_MEMORY_HEADER_SIZE;
+}
+
+static void
+ft_free(FT_Memory memory, void* block)
+{
+  struct font_system* sys = memory->user;
+  char* mem = NULL;
+
+  if(!block)
+    return;
+  mem = (char*)block - FT_MEMORY_HEADER_SIZE;
+  SYS_STATS_SUB(sys, ft_allocated_size, *(size_t*)mem);
+  MEM_FREE(sys->allocator, mem);
+}
+
+static void*
+ft_realloc(FT_Memory memory, long cur_size, long new_size, void* block)
+{
+  struct font_system* sys = memory->user;
+  char* mem = NULL;
+  size_t size = 0;
+  (void)cur_size;
+
+  if(!block)
+    return ft_alloc(memory, new_size);
+  mem = (char*)block - FT_MEMORY_HEADER_SIZE;
+  size = *(size_t*)mem;
+  mem = MEM_REALLOC
+    (sys->allocator, mem, FT_MEMORY_HEADER_SIZE + (size_t)new_size);
+  if(!mem)
+    return NULL;
+  *(size_t*)mem = (size_t)new_size;
+  SYS_STATS_SUB(sys, ft_allocated_size, size);
+  SYS_STATS_ADD(sys, ft_allocated_size, (size_t)new_size);
+  return mem + FT_MEMORY_HEADER_SIZE;
+}
+
+/* Setup the request of a FreeType size of `width' x `height' pixels, i.e.
+ * the request issued by FT_Set_Pixel_Sizes. */
+static void
+pixel_size_request
+  (const int width,
+   const int height,
+   FT_Size_RequestRec* req)
+{
+  ASSERT(width > 0 && height > 0 && req);
+  memset(req, 0, sizeof(FT_Size_RequestRec));
+  req->type = FT_SIZE_REQUEST_TYPE_NOMINAL;
+  req->width = (FT_Long)width << 6;
+  req->height = (FT_Long)height << 6;
+}
+
+static bool
+size_request_eq(const FT_Size_RequestRec* a, const FT_Size_RequestRec* b)
+{
+  return a->type == b->type
+      && a->width == b->width
+      && a->height == b->height
+      && a->horiResolution == b->horiResolution
+      && a->vertResolution == b->vertResolution;
+}
+
+/* Create a FreeType face from the font data. FreeType faces are registered
+ * into their library and are thus created under the font system lock. */
+static enum font_error
+open_face
+  (struct font_system* sys,
+   struct font_reader* reader, /* May be NULL */
+   const void* data, /* Unused if `reader' is not NULL */
+   const size_t size,
+   FT_Face* out_face)
+{
+  FT_Face ft_face = NULL;
+  FT_Error ft_err = 0;
+  ASSERT(sys && (reader || data) && out_face);
+
+  if(reader) {
+    FT_Open_Args args;
+    enum font_error font_err = FONT_NO_ERROR;
+
+    memset(&args, 0, sizeof(args));
+    args.flags = FT_OPEN_STREAM;
+    font_err = reader_open_ft_stream(reader, &args.stream);
+    if(font_err != FONT_NO_ERROR)
+      return font_err;
+    /* FreeType closes the stream on failure too */
+    MUTEX(lock(&sys->lock));
+    ft_err = FT_Open_Face(sys->ft_handle, &args, 0, &ft_face);
+    MUTEX(unlock(&sys->lock));
+  } else {
+    MUTEX(lock(&sys->lock));
+    ft_err = FT_New_Memory_Face
+      (sys->ft_handle, data, (FT_Long)size, 0, &ft_face);
+    MUTEX(unlock(&sys->lock));
+  }
+  if(0 != ft_err)
+    return ft_to_font_error(ft_err);
+
+  /* FreeType only selects a unicode charmap by default. Fall back to the
+   * first charmap of the face, e.g. the ISO-8859-1 map of .fon fonts. */
+  if(!ft_face->charmap && ft_face->num_charmaps > 0)
+    FT(Set_Charmap(ft_face, ft_face->charmaps[0]));
+
+  *out_face = ft_face;
+  return FONT_NO_ERROR;
+}
+
+static void
+close_face(struct font_system* sys, FT_Face ft_face)
+{
+  ASSERT(sys && ft_face);
+  MUTEX(lock(&sys->lock));
+  FT(Done_Face(ft_face)); /* Release the sizes of the face too */
+  MUTEX(unlock(&sys->lock));
+}
+
+static void
+clear_face_instances(struct font_rsrc* font)
+{
+  ASSERT(font);
+  while(font->faces) {
+    struct face_instance* instance = font->faces;
+    font->faces = instance->next;
+    close_face(font->sys, instance->ft_face);
+    MEM_FREE(font->sys->allocator, instance);
+  }
+}
+
+/* Reference a glyph of the cache. Must be invoked with the font lock. */
+static void
+glyph_cache_ref(struct font_rsrc* font, struct font_glyph* glyph)
+{
+  ASSERT(font && glyph && glyph->is_cached);
+  if(!glyph->is_idle) {
+    atomic_ref_get(&glyph->ref);
+  } else {
+    atomic_ref_init(&glyph->ref);
+    glyph->is_idle = false;
+    atomic_ref_get(&font->ref);
+  }
+}
+
+/* Create the FreeType size of the size handle onto the current face. Must be
+ * invoked with the font lock. */
+static enum font_error
+setup_size(struct font_rsrc* font, struct font_size* size)
+{
+  FT_Size_RequestRec req;
+  FT_Size ft_size = NULL;
+  FT_Error ft_err = 0;
+  ASSERT(font && size && !size->ft_size);
+
+  if(!font->ft_face || !FT_IS_SCALABLE(font->ft_face))
+    return FONT_INVALID_ARGUMENT;
+
+  ft_err = FT_New_Size(font->ft_face, &ft_size);
+  if(ft_err != 0)
+    return ft_to_font_error(ft_err);
+  FT(Activate_Size(ft_size));
+  req = size->req;
+  ft_err = FT_Request_Size(font->ft_face, &req);
+  FT(Activate_Size(font->ft_size));
+  if(ft_err != 0) {
+    FT(Done_Size(ft_size));
+    return ft_to_font_error(ft_err);
+  }
+  size->ft_size = ft_size;
+  return FONT_NO_ERROR;
+}
+
+static enum font_error
+get_line_space(const struct font_rsrc* font, FT_Size ft_size, int* line_space)
+{
+  ASSERT(font && ft_size && line_space);
+
+  if(FT_IS_SCALABLE(font->ft_face)) {
+    /* The font metrics are encoded in 26.6 fixed point */
+    const signed long height = ft_size->metrics.height >> 6;
+    if(height < 0 || height > UINT16_MAX)
+      return FONT_MEMORY_ERROR;
+    *line_space = (int)height;
+  } else {
+    ASSERT(font->ft_face->num_fixed_sizes != 0);
+    *line_space = (int)font->ft_face->available_sizes[0].height;
+  }
+  return FONT_NO_ERROR;
+}
+
+/* Replace the face of the font by the one stored in `data' or read by
+ * `reader'. On success the font takes the ownership of the blob and of the
+ * reader references. */
+static enum font_error
+load_face
+  (struct font_rsrc* font,
+   struct font_blob* blob, /* May be NULL */
+   struct font_reader* reader, /* May be NULL */
+   const void* data, /* NULL if `reader' is not NULL */
+   const size_t size)
+{
+  struct font_size* handle = NULL;
+  FT_Face ft_face = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && (data || reader));
+
+  font_err = open_face(font->sys, reader, data, size, &ft_face);
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+
+  MUTEX(lock(&font->lock));
+
+  /* Cached glyphs and face instances rely on the previous face data. */
+  glyph_cache_clear(font);
+  metrics_cache_clear(font->sys->allocator, &font->metrics);
+  charmap_clear(font->sys->allocator, &font->charmap);
+  clear_face_instances(font);
+  if(font->ft_face)
+    close_face(font->sys, font->ft_face);
+  if(font->blob)
+    blob_ref_put(font->blob);
+  if(font->reader)
+    reader_ref_put(font->reader);
+  font->ft_face = ft_face;
+  font->ft_size = ft_face->size;
+  font->blob = blob;
+  font->reader = reader;
+  font->data = data;
+  font->data_size = size;
+  __atomic_store_n(&font->data_hash, 0, __ATOMIC_RELAXED);
+  charmap_setup(ft_face, &font->charmap);
+  __atomic_add_fetch(&font->generation, 1, __ATOMIC_RELEASE);
+
+  /* Set a default char size of 16pt for a resolution of 96x96dpi, i.e. the
+   * request of FT_Set_Char_Size(face, 0, 16*64, 0, 96). */
+  memset(&font->size_req, 0, sizeof(FT_Size_RequestRec));
+  if(FT_IS_SCALABLE(font->ft_face)) {
+    FT_Size_RequestRec req;
+    font->size_req.type = FT_SIZE_REQUEST_TYPE_NOMINAL;
+    font->size_req.width = font->size_req.height = 16*64;
+    font->size_req.horiResolution = font->size_req.vertResolution = 96;
+    req = font->size_req;
+    FT(Request_Size(font->ft_face, &req));
+  }
+
+  /* Move the size handles to the new face */
+  for(handle = font->sizes; handle; handle = handle->next) {
+    metrics_cache_clear(font->sys->allocator, &handle->metrics);
+    handle->ft_size = NULL;
+    setup_size(font, handle);
+  }
+  FT(Activate_Size(font->ft_size));
+
+  MUTEX(unlock(&font->lock));
+  return FONT_NO_ERROR;
+}
+
+static void
+setup_glyph_key
+  (const struct font_rsrc* font,
+   FT_Size ft_size,
+   const wchar_t ch,
+   const int x_phase,
+   struct glyph_key* key)
+{
+  ASSERT(font && ft_size && key);
+  key->character = ch;
+  key->x_scale = ft_size->metrics.x_scale;
+  key->y_scale = ft_size->metrics.y_scale;
+  key->load_flags = FT_LOAD_DEFAULT;
+  /* Bitmap glyphs cannot be shifted: their phases share the same glyph */
+  key->x_phase = FT_IS_SCALABLE(font->ft_face) ? x_phase : 0;
+}
+
+/* Load the glyph `glyph_index' into the face instance whose size is already
+ * activated. Return FONT_INVALID_ARGUMENT if the glyph cannot be loaded */
+static enum font_error
+load_ft_glyph
+  (struct face_instance* instance,
+   const struct glyph_key* key,
+   const FT_UInt glyph_index,
+   FT_Glyph* out_ft_glyph)
+{
+  FT_Glyph ft_glyph = NULL;
+  FT_Error ft_err = 0;
+  ASSERT(instance && key && glyph_index && out_ft_glyph);
+
+  /* A glyph that cannot be loaded, e.g. a control character of a bitmap
+   * font, is handled as a missing glyph */
+  if(FT_Load_Glyph(instance->ft_face, glyph_index, key->load_flags) != 0)
+    return FONT_INVALID_ARGUMENT;
+  ft_err = FT_Get_Glyph(instance->ft_face->glyph, &ft_glyph);
+  if(ft_err != 0)
+    return ft_to_font_error(ft_err);
+  if(key->x_phase && ft_glyph->format == FT_GLYPH_FORMAT_OUTLINE) {
+    FT_Outline_Translate(&((FT_OutlineGlyph)ft_glyph)->outline,
+      key->x_phase * 64 / FONT_SUBPIXEL_PHASES, 0);
+  }
+  *out_ft_glyph = ft_glyph;
+  return FONT_NO_ERROR;
+}
+
+/* Return the referenced glyph of `key', registering a new glyph of
+ * `*ft_glyph' if the key is not cached yet; `*ft_glyph' is then set to NULL.
+ * Must be invoked with the font lock. */
+static enum font_error
+publish_glyph
+  (struct font_rsrc* font,
+   const struct glyph_key* key,
+   FT_Glyph* ft_glyph,
+   struct font_glyph** out_glyph)
+{
+  FT_BBox box;
+  struct font_glyph* glyph = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && key && ft_glyph && *ft_glyph && out_glyph);
+
+  glyph = glyph_cache_find(&font->cache, key);
+  if(glyph) { /* The glyph was loaded concurrently */
+    glyph_cache_ref(font, glyph);
+    *out_glyph = glyph;
+    return FONT_NO_ERROR;
+  }
+  glyph = glyph_pool_alloc(font->sys->allocator, &font->pool);
+  if(!glyph)
+    return FONT_MEMORY_ERROR;
+  STATS_ADD(font, glyphs_created, 1);
+  atomic_ref_init(&glyph->ref);
+  glyph->font = font;
+  atomic_ref_get(&font->ref);
+  glyph->character = key->character;
+  glyph->key = *key;
+  glyph->ft_glyph = *ft_glyph;
+  *ft_glyph = NULL;
+
+  FT_Glyph_Get_CBox(glyph->ft_glyph, FT_GLYPH_BBOX_PIXELS, &box);
+  glyph->bbox.x_min = (int)box.xMin;
+  glyph->bbox.y_min = (int)box.yMin;
+  glyph->bbox.x_max = (int)box.xMax;
+  glyph->bbox.y_max = (int)box.yMax;
+
+  /* The glyph is returned even if it cannot be cached; the caller releases
+   * it on error */
+  font_err = glyph_cache_insert(font, glyph);
+  *out_glyph = glyph;
+  return font_err;
+}
+
+/* Return the glyph of `ch' at the submitted size of the font. The outline of
+ * the glyph is shifted right by `x_phase' / FONT_SUBPIXEL_PHASES pixel. The
+ * glyph is loaded from a face instance and published into the cache under
+ * the font lock; if another thread cached the same glyph meanwhile, its glyph
+ * is returned. */
+static enum font_error
+get_glyph
+  (struct font_rsrc* font,
+   FT_Size ft_size, /* Size of the font face the request was applied to */
+   const FT_Size_RequestRec* req,
+   const wchar_t ch,
+   const int x_phase, /* In [0, FONT_SUBPIXEL_PHASES) */
+   struct font_glyph** out_glyph)
+{
+  struct glyph_key key;
+  struct face_instance* instance = NULL;
+  struct font_glyph* glyph = NULL;
+  FT_Glyph ft_glyph = NULL;
+  FT_UInt glyph_index = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  ASSERT(font && ft_size && req && out_glyph);
+  ASSERT(x_phase >= 0 && x_phase < FONT_SUBPIXEL_PHASES);
+
+  setup_glyph_key(font, ft_size, ch, x_phase, &key);
+
+  MUTEX(lock(&font->lock));
+  glyph = glyph_cache_find(&font->cache, &key);
+  if(glyph)
+    glyph_cache_ref(font, glyph);
+  MUTEX(unlock(&font->lock));
+  if(glyph) {
+    STATS_ADD(font, cache_hits, 1);
+    goto exit;
+  }
+  STATS_ADD(font, cache_misses, 1);
+
+  glyph_index = charmap_get_index(font, ch);
+  if(0 == glyph_index) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  font_err = face_instance_acquire(font, &instance);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  font_err = face_instance_set_size(instance, req);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  font_err = load_ft_glyph(instance, &key, glyph_index, &ft_glyph);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  face_instance_release(font, instance);
+  instance = NULL;
+
+  MUTEX(lock(&font->lock));
+  font_err = publish_glyph(font, &key, &ft_glyph, &glyph);
+  MUTEX(unlock(&font->lock));
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  if(ft_glyph)
+    FT_Done_Glyph(ft_glyph);
+  *out_glyph = glyph;
+  return font_err;
+error:
+  if(instance)
+    face_instance_release(font, instance);
+  if(glyph) {
+    FONT(glyph_ref_put(glyph));
+    glyph = NULL;
+  }
+  goto exit;
+}
+
+/* Return in `glyphs' the referenced glyphs of `count' characters at the
+ * submitted size of the font, or NULL for the characters without glyph. The
+ * cache is looked up once for the whole batch; the missing glyphs are then
+ * loaded from a single face instance whose size is activated once, and are
+ * published under one acquisition of the font lock. A character repeated in
+ * the batch is loaded once. */
+static enum font_error
+get_glyphs
+  (struct font_rsrc* font,
+   FT_Size ft_size,
+   const FT_Size_RequestRec* req,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph** glyphs)
+{
+  struct glyph_key key;
+  struct face_instance* instance = NULL;
+  struct mem_allocator* allocator = NULL;
+  FT_Glyph* ft_glyphs = NULL; /* Loaded glyph of the first miss of a char */
+  size_t* firsts = NULL; /* Per miss, index of the first miss of its char */
+  size_t* table = NULL; /* Open addressing table of the first misses + 1 */
+  size_t ntable = 0;
+  size_t nmisses = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && ft_size && req && (chars || !count) && (glyphs || !count));
+
+  allocator = font->sys->allocator;
+  memset(glyphs, 0, count * sizeof(struct font_glyph*));
+
+  MUTEX(lock(&font->lock));
+  for(i = 0; i < count; ++i) {
+    setup_glyph_key(font, ft_size, chars[i], 0, &key);
+    glyphs[i] = glyph_cache_find(&font->cache, &key);
+    if(glyphs[i])
+      glyph_cache_ref(font, glyphs[i]);
+    else
+      ++nmisses;
+  }
+  MUTEX(unlock(&font->lock));
+  STATS_ADD(font, cache_hits, count - nmisses);
+  STATS_ADD(font, cache_misses, nmisses);
+  if(!nmisses)
+    return FONT_NO_ERROR;
+
+  ntable = 16;
+  while(ntable < nmisses * 2)
+    ntable *= 2;
+  ft_glyphs = MEM_CALLOC(allocator, count, sizeof(FT_Glyph));
+  firsts = MEM_CALLOC(allocator, count, sizeof(size_t));
+  table = MEM_CALLOC(allocator, ntable, sizeof(size_t));
+  if(!ft_glyphs || !firsts || !table) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+
+  /* Load the glyphs of the misses outside of the font lock */
+  for(i = 0; i < count; ++i) {
+    FT_UInt glyph_index = 0;
+    size_t slot = 0;
+
+    if(glyphs[i])
+      continue;
+    slot = (size_t)((uint32_t)chars[i] * 2654435761u) & (ntable - 1);
+    while(table[slot] && chars[table[slot] - 1] != chars[i])
+      slot = (slot + 1) & (ntable - 1);
+    if(table[slot]) { /* The character was already requested by the batch */
+      firsts[i] = table[slot] - 1;
+      continue;
+    }
+    table[slot] = i + 1;
+    firsts[i] = i;
+
+    glyph_index = charmap_get_index(font, chars[i]);
+    if(!glyph_index)
+      continue;
+    if(!instance) {
+      font_err = face_instance_acquire(font, &instance);
+      if(font_err != FONT_NO_ERROR)
+        goto error;
+      font_err = face_instance_set_size(instance, req);
+      if(font_err != FONT_NO_ERROR)
+        goto error;
+    }
+    setup_glyph_key(font, ft_size, chars[i], 0, &key);
+    font_err = load_ft_glyph(instance, &key, glyph_index, ft_glyphs + i);
+    if(font_err == FONT_INVALID_ARGUMENT) /* Missing glyph */
+      font_err = FONT_NO_ERROR;
+    if(font_err != FONT_NO_ERROR)
+      goto error;
+  }
+  if(instance) {
+    face_instance_release(font, instance);
+    instance = NULL;
+  }
+
+  /* Publish the loaded glyphs. The misses are processed in order so that
+   * the first miss of a character is published before its repetitions */
+  MUTEX(lock(&font->lock));
+  for(i = 0; i < count && font_err == FONT_NO_ERROR; ++i) {
+    if(glyphs[i] || (firsts[i] == i && !ft_glyphs[i]))
+      continue;
+    if(firsts[i] != i) {
+      glyphs[i] = glyphs[firsts[i]];
+      if(glyphs[i])
+        atomic_ref_get(&glyphs[i]->ref);
+    } else {
+      setup_glyph_key(font, ft_size, chars[i], 0, &key);
+      font_err = publish_glyph(font, &key, ft_glyphs + i, glyphs + i);
+    }
+  }
+  MUTEX(unlock(&font->lock));
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  if(ft_glyphs) {
+    for(i = 0; i < count; ++i) {
+      if(ft_glyphs[i])
+        FT_Done_Glyph(ft_glyphs[i]);
+    }
+    MEM_FREE(allocator, ft_glyphs);
+  }
+  if(firsts)
+    MEM_FREE(allocator, firsts);
+  if(table)
+    MEM_FREE(allocator, table);
+  return font_err;
+error:
+  if(instance)
+    face_instance_release(font, instance);
+  for(i = 0; i < count; ++i) {
+    if(glyphs[i]) {
+      FONT(glyph_ref_put(glyphs[i]));
+      glyphs[i] = NULL;
+    }
+  }
+  goto exit;
+}
+
+static void
+release_font_system(struct font_system* sys)
+{
+  ASSERT(sys);
+  ASSERT(!sys->blobs); /* Blobs are released with their fonts */
 
   FT_Error ft_err = 0;
   (void)ft_err;
 
-  ft_err = FT_Done_FreeType(sys->ft_handle);
+  ft_err = FT_Done_Library(sys->ft_handle);
   ASSERT(!ft_err);
+  MUTEX(destroy(&sys->lock));
   MEM_FREE(sys->allocator, sys);
 }
 
 static void
-release_font(struct ref* ref)
+release_font(struct font_rsrc* font)
 {
   struct font_system* sys = NULL;
-  struct font_rsrc* font = NULL;
-  ASSERT(ref);
+  ASSERT(font);
 
-  font = CONTAINER_OF(ref, struct font_rsrc, ref);
   sys = font->sys;
 
+  glyph_cache_clear(font);
+  if(font->cache.buckets)
+    MEM_FREE(sys->allocator, font->cache.buckets);
+  glyph_pool_release(sys->allocator, &font->pool);
+  ASSERT(!font->pool.nslabs); /* Glyphs reference their font */
+  metrics_cache_clear(sys->allocator, &font->metrics);
+  charmap_clear(sys->allocator, &font->charmap);
+  clear_face_instances(font);
   if(font->ft_face)
-    FT(Done_Face(font->ft_face));
+    close_face(sys, font->ft_face);
+  if(font->blob)
+    blob_ref_put(font->blob);
+  if(font->reader)
+    reader_ref_put(font->reader);
+  MUTEX(destroy(&font->lock));
 
   MEM_FREE(sys->allocator, font);
   FONT(system_ref_put(sys));
 }
 
 static void
-release_glyph(struct ref* ref)
+release_size(struct font_size* size)
 {
-  struct font_glyph* glyph = NULL;
+  struct font_size** slot = NULL;
   struct font_rsrc* font = NULL;
+  ASSERT(size);
 
-  glyph = CONTAINER_OF(ref, struct font_glyph, ref);
-  font = glyph->font;
+  font = size->font;
 
-  if(glyph->ft_glyph)
-    FT_Done_Glyph(glyph->ft_glyph);
+  MUTEX(lock(&font->lock));
+  for(slot = &font->sizes; *slot != size; slot = &(*slot)->next)
+    ASSERT(*slot);
+  *slot = size->next;
+  if(size->ft_size)
+    FT(Done_Size(size->ft_size));
+  metrics_cache_clear(font->sys->allocator, &size->metrics);
+  MUTEX(unlock(&font->lock));
 
-  MEM_FREE(font->sys->allocator, glyph);
+  MEM_FREE(font->sys->allocator, size);
   FONT(rsrc_ref_put(font));
 }
 
+/* Must be invoked with the font lock. The font reference of the glyph is
+ * released by the caller. */
+static void
+release_glyph(struct font_glyph* glyph)
+{
+  ASSERT(glyph);
+
+  /* A cached glyph stays alive until it is evicted from the cache. */
+  glyph->is_idle = true;
+  if(!glyph->is_cached)
+    destroy_glyph(glyph->font, glyph);
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+enum font_error
+glyph_rasterize
+  (struct font_glyph* glyph,
+   const bool antialiasing,
+   const FT_Bitmap** bitmap)
+{
+  const enum glyph_render_mode mode =
+    antialiasing ? GLYPH_RENDER_NORMAL : GLYPH_RENDER_MONO;
+  FT_Glyph ft_bitmap = NULL;
+  ASSERT(glyph && bitmap);
+
+  ft_bitmap = __atomic_load_n(&glyph->ft_bitmaps[mode], __ATOMIC_ACQUIRE);
+  if(!ft_bitmap) {
+    struct font_rsrc* font = glyph->font;
+    FT_Glyph ft_new = glyph->ft_glyph; /* Bitmap fonts are rendered as is */
+
+    if(glyph->ft_glyph->format != FT_GLYPH_FORMAT_BITMAP) {
+      /* Rasterize a copy of the glyph in order to keep its outline */
+      const FT_Render_Mode ft_mode = mode == GLYPH_RENDER_NORMAL
+        ? FT_RENDER_MODE_NORMAL : FT_RENDER_MODE_MONO;
+      const uint64_t t0 = stats_time();
+      const FT_Error ft_err = FT_Glyph_To_Bitmap(&ft_new, ft_mode, NULL, 0);
+      STATS_ADD(font, rasterize_time, stats_time() - t0);
+      if(ft_err != 0)
+        return ft_to_font_error(ft_err);
+    }
+    /* Publish the bitmap unless it was rasterized concurrently */
+    MUTEX(lock(&font->lock));
+    ft_bitmap = glyph->ft_bitmaps[mode];
+    if(!ft_bitmap) {
+      __atomic_store_n(&glyph->ft_bitmaps[mode], ft_new, __ATOMIC_RELEASE);
+      ft_bitmap = ft_new;
+      ft_new = NULL;
+      if(ft_bitmap != glyph->ft_glyph)
+        STATS_ADD(font, bitmaps_size, sizeof_ft_glyph(ft_bitmap));
+      glyph_cache_update(font, glyph);
+    }
+    MUTEX(unlock(&font->lock));
+    if(ft_new && ft_new != glyph->ft_glyph)
+      FT_Done_Glyph(ft_new);
+  }
+  *bitmap = &((FT_BitmapGlyph)ft_bitmap)->bitmap;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+glyph_rasterize_sdf
+  (struct font_glyph* glyph,
+   const int spread,
+   const FT_Bitmap** bitmap)
+{
+  struct font_rsrc* font = NULL;
+  struct glyph_sdf* sdf = NULL;
+  struct glyph_sdf* new_sdf = NULL;
+  const FT_Bitmap* bmp = NULL;
+  size_t width = 0, height = 0;
+  uint64_t t0 = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(glyph && spread > 0 && spread <= FONT_SDF_MAX_SPREAD && bitmap);
+
+  for(sdf = __atomic_load_n(&glyph->sdfs, __ATOMIC_ACQUIRE);
+      sdf && sdf->spread != spread;
+      sdf = sdf->next);
+  if(sdf) {
+    *bitmap = &sdf->bitmap;
+    return FONT_NO_ERROR;
+  }
+
+  font_err = glyph_rasterize(glyph, true, &bmp);
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+  if(sizeof_ft_pixel_mode((FT_Pixel_Mode)bmp->pixel_mode) != 1)
+    return FONT_INVALID_ARGUMENT;
+  /* The distance transform stores the pixel offsets on 16-bits */
+  if(bmp->width > SDF_MAX_SIZE || bmp->rows > SDF_MAX_SIZE)
+    return FONT_INVALID_ARGUMENT;
+  if(!bmp->width || !bmp->rows) { /* No outline, e.g. the space glyph */
+    *bitmap = bmp;
+    return FONT_NO_ERROR;
+  }
+
+  font = glyph->font;
+  width = bmp->width + 2 * (size_t)spread;
+  height = bmp->rows + 2 * (size_t)spread;
+  new_sdf = MEM_ALLOC
+    (font->sys->allocator, sizeof(struct glyph_sdf) + width * height);
+  if(!new_sdf)
+    return FONT_MEMORY_ERROR;
+  memset(new_sdf, 0, sizeof(struct glyph_sdf));
+  new_sdf->spread = spread;
+  new_sdf->bitmap.width = (unsigned int)width;
+  new_sdf->bitmap.rows = (unsigned int)height;
+  new_sdf->bitmap.pitch = (int)width;
+  new_sdf->bitmap.buffer = (unsigned char*)(new_sdf + 1);
+  new_sdf->bitmap.num_grays = 256;
+  new_sdf->bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+  t0 = stats_time();
+  font_err = compute_sdf
+    (font->sys->allocator, bmp, spread, new_sdf->bitmap.buffer, width);
+  STATS_ADD(font, rasterize_time, stats_time() - t0);
+  if(font_err != FONT_NO_ERROR) {
+    MEM_FREE(font->sys->allocator, new_sdf);
+    return font_err;
+  }
+
+  /* Publish the field unless it was computed concurrently */
+  MUTEX(lock(&font->lock));
+  for(sdf = glyph->sdfs; sdf && sdf->spread != spread; sdf = sdf->next);
+  if(!sdf) {
+    new_sdf->next = glyph->sdfs;
+    __atomic_store_n(&glyph->sdfs, new_sdf, __ATOMIC_RELEASE);
+    sdf = new_sdf;
+    new_sdf = NULL;
+    STATS_ADD(font, bitmaps_size, sizeof_sdf(sdf));
+    glyph_cache_update(font, glyph);
+  }
+  MUTEX(unlock(&font->lock));
+  if(new_sdf)
+    MEM_FREE(font->sys->allocator, new_sdf);
+  *bitmap = &sdf->bitmap;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+hash_font_data(struct font_rsrc* font, uint64_t* out_hash)
+{
+  const unsigned char* bytes = NULL;
+  uint64_t hash = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && (font->data || font->reader) && out_hash);
+
+  /* Concurrent computations store the same value */
+  hash = __atomic_load_n(&font->data_hash, __ATOMIC_RELAXED);
+  if(hash) {
+    *out_hash = hash;
+    return FONT_NO_ERROR;
+  }
+  if(font->reader) {
+    font_err = reader_hash(font->reader, &hash);
+    if(font_err != FONT_NO_ERROR)
+      return font_err;
+  } else {
+    bytes = font->data;
+    hash = 14695981039346656037u;
+    for(i = 0; i < font->data_size; ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211u;
+    }
+  }
+  __atomic_store_n(&font->data_hash, hash, __ATOMIC_RELAXED);
+  *out_hash = hash;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+face_instance_acquire
+  (struct font_rsrc* font,
+   struct face_instance** out_instance)
+{
+  struct face_instance* instance = NULL;
+  struct font_reader* reader = NULL;
+  const void* data = NULL;
+  size_t data_size = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && out_instance);
+
+  MUTEX(lock(&font->lock));
+  instance = font->faces;
+  if(instance)
+    font->faces = instance->next;
+  reader = font->reader;
+  data = font->data;
+  data_size = font->data_size;
+  MUTEX(unlock(&font->lock));
+  if(instance)
+    goto exit;
+
+  instance = MEM_CALLOC(font->sys->allocator, 1, sizeof(struct face_instance));
+  if(!instance) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  font_err = open_face
+    (font->sys, reader, data, data_size, &instance->ft_face);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  instance->next = NULL;
+  *out_instance = instance;
+  return font_err;
+error:
+  if(instance) {
+    MEM_FREE(font->sys->allocator, instance);
+    instance = NULL;
+  }
+  *out_instance = NULL;
+  return font_err;
+}
+
+void
+face_instance_release(struct font_rsrc* font, struct face_instance* instance)
+{
+  ASSERT(font && instance);
+  MUTEX(lock(&font->lock));
+  instance->next = font->faces;
+  font->faces = instance;
+  MUTEX(unlock(&font->lock));
+}
+
+/* Activate the size of the face instance matching the request. Once all the
+ * size slots are used, the oldest slot is set up to the new request. */
+enum font_error
+face_instance_set_size
+  (struct face_instance* instance,
+   const FT_Size_RequestRec* req)
+{
+  FT_Size_RequestRec tmp;
+  size_t i = 0;
+  FT_Error ft_err = 0;
+  ASSERT(instance && req);
+
+  if(!FT_IS_SCALABLE(instance->ft_face))
+    return FONT_NO_ERROR; /* Bitmap fonts have a fixed size */
+
+  for(i = 0; i < instance->nsizes; ++i) {
+    if(size_request_eq(&instance->sizes[i].req, req)) {
+      FT(Activate_Size(instance->sizes[i].ft_size));
+      return FONT_NO_ERROR;
+    }
+  }
+  if(instance->nsizes < FACE_MAX_SIZES) {
+    ft_err = FT_New_Size(instance->ft_face, &instance->sizes[i].ft_size);
+    if(ft_err != 0)
+      return ft_to_font_error(ft_err);
+    ++instance->nsizes;
+  } else {
+    i = instance->next_size;
+    instance->next_size = (instance->next_size + 1) % FACE_MAX_SIZES;
+  }
+  FT(Activate_Size(instance->sizes[i].ft_size));
+  tmp = *req;
+  ft_err = FT_Request_Size(instance->ft_face, &tmp);
+  if(ft_err != 0) {
+    /* Invalidate the slot */
+    memset(&instance->sizes[i].req, 0, sizeof(FT_Size_RequestRec));
+    return ft_to_font_error(ft_err);
+  }
+  instance->sizes[i].req = *req;
+  return FONT_NO_ERROR;
+}
+
 /*******************************************************************************
  *
  * Font system functions
@@ -206,13 +1291,26 @@ font_system_create
     goto error;
   }
   sys->allocator = alloc;
-  ref_init(&sys->ref);
+  atomic_ref_init(&sys->ref);
+  if(pthread_mutex_init(&sys->lock, NULL) != 0) {
+    MEM_FREE(alloc, sys);
+    sys = NULL;
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
 
-  ft_err = FT_Init_FreeType(&sys->ft_handle);
+  /* Set up the library as FT_Init_FreeType but with the system allocator */
+  sys->ft_memory.user = sys;
+  sys->ft_memory.alloc = ft_alloc;
+  sys->ft_memory.free = ft_free;
+  sys->ft_memory.realloc = ft_realloc;
+  ft_err = FT_New_Library(&sys->ft_memory, &sys->ft_handle);
   if(ft_err != 0) {
     font_err = ft_to_font_error(ft_err);
     goto error;
   }
+  FT_Add_Default_Modules(sys->ft_handle);
+  FT_Set_Default_Properties(sys->ft_handle);
 
 exit:
   if(out_sys)
@@ -231,7 +1329,7 @@ font_system_ref_get(struct font_system* sys)
 {
   if(!sys)
     return FONT_INVALID_ARGUMENT;
-  ref_get(&sys->ref);
+  atomic_ref_get(&sys->ref);
   return FONT_NO_ERROR;
 }
 
@@ -240,7 +1338,8 @@ font_system_ref_put(struct font_system* sys)
 {
   if(!sys)
     return FONT_INVALID_ARGUMENT;
-  ref_put(&sys->ref, release_font_system);
+  if(atomic_ref_put(&sys->ref))
+    release_font_system(sys);
   return FONT_NO_ERROR;
 }
 
@@ -267,9 +1366,16 @@ font_rsrc_create
     font_err = FONT_MEMORY_ERROR;
     goto error;
   }
+  if(pthread_mutex_init(&font->lock, NULL) != 0) {
+    MEM_FREE(sys->allocator, font);
+    font = NULL;
+    font_err = FONT_INTERNAL_ERROR;
+    goto error;
+  }
   font->sys = sys;
   FONT(system_ref_get(sys));
-  ref_init(&font->ref);
+  atomic_ref_init(&font->ref);
+  font->cache.mem_budget = GLYPH_CACHE_DEFAULT_SIZE;
 
   if(path) {
     font_err = font_rsrc_load(font, path);
@@ -294,7 +1400,7 @@ font_rsrc_ref_get(struct font_rsrc* font)
 {
   if(!font)
     return FONT_INVALID_ARGUMENT;
-  ref_get(&font->ref);
+  atomic_ref_get(&font->ref);
   return FONT_NO_ERROR;
 }
 
@@ -303,32 +1409,89 @@ font_rsrc_ref_put(struct font_rsrc* font)
 {
   if(!font)
     return FONT_INVALID_ARGUMENT;
-  ref_put(&font->ref, release_font);
+  if(atomic_ref_put(&font->ref))
+    release_font(font);
   return FONT_NO_ERROR;
 }
 
 enum font_error
 font_rsrc_load(struct font_rsrc* font, const char* path)
 {
-  FT_Error ft_err = 0;
+  struct font_blob* blob = NULL;
+  uint64_t t0 = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!font || !path)
+    return FONT_INVALID_ARGUMENT;
+
+  trace_begin(font, FONT_TRACE_LOAD);
+  t0 = stats_time();
+  font_err = blob_open(font->sys, path, &blob);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  font_err = load_face(font, blob, NULL, blob->data, blob->size);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  STATS_ADD(font, load_time, stats_time() - t0);
+  trace_end(font, FONT_TRACE_LOAD);
+  return font_err;
+error:
+  if(blob)
+    blob_ref_put(blob);
+  goto exit;
+}
+
+enum font_error
+font_rsrc_load_memory
+  (struct font_rsrc* font,
+   const void* data,
+   const size_t size)
+{
+  uint64_t t0 = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!font || !data || !size)
+    return FONT_INVALID_ARGUMENT;
+  trace_begin(font, FONT_TRACE_LOAD);
+  t0 = stats_time();
+  font_err = load_face(font, NULL, NULL, data, size);
+  STATS_ADD(font, load_time, stats_time() - t0);
+  trace_end(font, FONT_TRACE_LOAD);
+  return font_err;
+}
+
+enum font_error
+font_rsrc_load_stream
+  (struct font_rsrc* font,
+   const struct font_stream* stream)
+{
+  struct font_reader* reader = NULL;
+  uint64_t t0 = 0;
   enum font_error font_err = FONT_NO_ERROR;
 
-  if(!font || !path) {
-    font_err = FONT_INVALID_ARGUMENT;
+  if(!font || !stream || !stream->read || !stream->size)
+    return FONT_INVALID_ARGUMENT;
+
+  trace_begin(font, FONT_TRACE_LOAD);
+  t0 = stats_time();
+  font_err = reader_create(font->sys, stream, &reader);
+  if(font_err != FONT_NO_ERROR)
     goto error;
-  }
-  ft_err = FT_New_Face(font->sys->ft_handle, path, 0, &font->ft_face);
-  if(0 != ft_err) {
-    font_err = ft_to_font_error(ft_err);
+  font_err = load_face(font, NULL, reader, NULL, stream->size);
+  if(font_err != FONT_NO_ERROR)
     goto error;
-  }
-  /* Set a default char size of 16pt for a resolution of 96x96dpi. */
-  if(FT_IS_SCALABLE(font->ft_face))
-    FT(Set_Char_Size(font->ft_face, 0, 16*64, 0, 96));
 
 exit:
+  STATS_ADD(font, load_time, stats_time() - t0);
+  trace_end(font, FONT_TRACE_LOAD);
   return font_err;
 error:
+  if(reader) {
+    reader->stream.release = NULL; /* The stream is not owned on failure */
+    reader_ref_put(reader);
+  }
   goto exit;
 }
 
@@ -338,36 +1501,78 @@ font_rsrc_set_size
    const int width,
    const int height)
 {
-  if(!font || !width || !height)
+  FT_Size_RequestRec req;
+
+  if(!font || width <= 0 || height <= 0)
     return FONT_INVALID_ARGUMENT;
-  if(!FT_IS_SCALABLE(font->ft_face))
+  if(!font->ft_face || !FT_IS_SCALABLE(font->ft_face))
      return FONT_INVALID_ARGUMENT;
 
   /* Ensure that that the API and the FT library are compatible. */
-  STATIC_ASSERT(sizeof(int) <= sizeof(FT_UInt), Unexpected_type_size);
-  FT(Set_Pixel_Sizes(font->ft_face, (FT_UInt)width, (FT_UInt)height));
+  STATIC_ASSERT(sizeof(int) <= sizeof(FT_Long), Unexpected_type_size);
+  MUTEX(lock(&font->lock));
+  pixel_size_request(width, height, &font->size_req);
+  req = font->size_req;
+  FT(Activate_Size(font->ft_size));
+  FT(Request_Size(font->ft_face, &req));
+  MUTEX(unlock(&font->lock));
   return FONT_NO_ERROR;
 }
 
 enum font_error
-font_rsrc_get_line_space(const struct font_rsrc* font, int* line_space)
+font_rsrc_set_glyph_cache_size(struct font_rsrc* font, const size_t size)
 {
-  if(!font || !line_space)
+  if(!font)
     return FONT_INVALID_ARGUMENT;
+  MUTEX(lock(&font->lock));
+  font->cache.mem_budget = size;
+  glyph_cache_trim(font, NULL);
+  MUTEX(unlock(&font->lock));
+  return FONT_NO_ERROR;
+}
 
-  if(FT_IS_SCALABLE(font->ft_face)) {
-    /* The font metrics are encoded in 26.6 fixed point */
-    const signed long height = font->ft_face->size->metrics.height >> 6;
-    if(height < 0 || height > UINT16_MAX)
-      return FONT_MEMORY_ERROR;
-    *line_space = (int)height;
-  } else {
-    ASSERT(font->ft_face->num_fixed_sizes != 0);
-    *line_space = (int)font->ft_face->available_sizes[0].height;
+enum font_error
+font_rsrc_next_glyph_generation(struct font_rsrc* font, unsigned* generation)
+{
+  if(!font || !generation)
+    return FONT_INVALID_ARGUMENT;
+  MUTEX(lock(&font->lock));
+  *generation = ++font->cache.generation;
+  MUTEX(unlock(&font->lock));
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_rsrc_release_glyph_generations
+  (struct font_rsrc* font,
+   const unsigned generation)
+{
+  struct font_glyph* glyph = NULL;
+
+  if(!font)
+    return FONT_INVALID_ARGUMENT;
+  MUTEX(lock(&font->lock));
+  /* Lookups move the glyphs to the LRU head and tag them with the current
+   * generation: the older generations lie at the LRU tail */
+  glyph = font->cache.lru_tail;
+  while(glyph && (int)(glyph->generation - generation) < 0) {
+    struct font_glyph* prev = glyph->lru_prev;
+    glyph_cache_evict(font, glyph);
+    glyph = prev;
   }
+  glyph_pool_release(font->sys->allocator, &font->pool);
+  MUTEX(unlock(&font->lock));
   return FONT_NO_ERROR;
 }
 
+enum font_error
+font_rsrc_get_line_space(const struct font_rsrc* font, int* line_space)
+{
+  if(!font || !line_space)
+    return FONT_INVALID_ARGUMENT;
+  return get_line_space(font, font->ft_size, line_space);
+}
+
 enum font_error
 font_rsrc_is_scalable(const struct font_rsrc* font, bool* is_scalable)
 {
@@ -377,6 +1582,15 @@ font_rsrc_is_scalable(const struct font_rsrc* font, bool* is_scalable)
   return FONT_NO_ERROR;
 }
 
+enum font_error
+font_rsrc_has_char(struct font_rsrc* font, const wchar_t ch, bool* has_char)
+{
+  if(!font || !has_char || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  *has_char = charmap_has_char(font, ch);
+  return FONT_NO_ERROR;
+}
+
 /*******************************************************************************
  *
  * Font glyph functions
@@ -388,48 +1602,131 @@ font_rsrc_get_glyph
    wchar_t ch,
    struct font_glyph** out_glyph)
 {
-  FT_BBox box;
-  struct font_glyph* glyph = NULL;
-  FT_UInt glyph_index = 0;
   enum font_error font_err = FONT_NO_ERROR;
 
-  if(!font || !out_glyph) {
-    font_err = FONT_INVALID_ARGUMENT;
-    goto error;
+  if(!font || !out_glyph || !font->ft_face) {
+    if(out_glyph)
+      *out_glyph = NULL;
+    return FONT_INVALID_ARGUMENT;
   }
-  glyph_index = FT_Get_Char_Index(font->ft_face, (FT_ULong)ch);
-  if(0 == glyph_index) {
-    font_err = FONT_INVALID_ARGUMENT;
-    goto error;
+  trace_begin(font, FONT_TRACE_GET_GLYPH);
+  font_err = get_glyph
+    (font, font->ft_size, &font->size_req, ch, 0, out_glyph);
+  trace_end(font, FONT_TRACE_GET_GLYPH);
+  return font_err;
+}
+
+enum font_error
+font_rsrc_get_subpixel_glyph
+  (struct font_rsrc* font,
+   const wchar_t ch,
+   const int x_phase,
+   struct font_glyph** out_glyph)
+{
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!font || x_phase < 0 || x_phase >= FONT_SUBPIXEL_PHASES || !out_glyph
+  || !font->ft_face) {
+    if(out_glyph)
+      *out_glyph = NULL;
+    return FONT_INVALID_ARGUMENT;
   }
-  glyph = MEM_CALLOC(font->sys->allocator, 1, sizeof(struct font_glyph));
-  if(!glyph) {
-    font_err = FONT_MEMORY_ERROR;
-    goto error;
+  trace_begin(font, FONT_TRACE_GET_GLYPH);
+  font_err = get_glyph
+    (font, font->ft_size, &font->size_req, ch, x_phase, out_glyph);
+  trace_end(font, FONT_TRACE_GET_GLYPH);
+  return font_err;
+}
+
+enum font_error
+font_rsrc_get_glyphs
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   const bool antialiasing,
+   struct font_glyph_desc* descs,
+   struct font_bitmap_desc* bitmaps,
+   size_t* buffer_size,
+   unsigned char* buffer)
+{
+  struct font_glyph** glyphs = NULL;
+  size_t offset = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!font || (count && !chars) || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+
+  /* The whole batch is one traced glyph request */
+  trace_begin(font, FONT_TRACE_GET_GLYPH);
+  if(count) {
+    glyphs = MEM_ALLOC(font->sys->allocator, count*sizeof(struct font_glyph*));
+    if(!glyphs) {
+      font_err = FONT_MEMORY_ERROR;
+      goto error;
+    }
+    font_err = get_glyphs
+      (font, font->ft_size, &font->size_req, chars, count, glyphs);
+    if(font_err != FONT_NO_ERROR) {
+      MEM_FREE(font->sys->allocator, glyphs);
+      glyphs = NULL;
+      goto error;
+    }
   }
-  ref_init(&glyph->ref);
-  glyph->font = font;
-  FONT(rsrc_ref_get(font));
-  glyph->character = ch;
+  for(i = 0; i < count; ++i) {
+    struct font_glyph* glyph = glyphs[i];
+    const FT_Bitmap* bmp = NULL;
+    size_t size = 0;
+    int Bpp = 0;
 
-  FT(Load_Glyph(font->ft_face, (FT_ULong)glyph_index, FT_LOAD_DEFAULT));
-  FT(Get_Glyph(font->ft_face->glyph, &glyph->ft_glyph));
+    if(!glyph) { /* The font has no glyph for the character */
+      if(descs) {
+        memset(descs + i, 0, sizeof(struct font_glyph_desc));
+        descs[i].character = chars[i];
+      }
+      if(bitmaps) {
+        memset(bitmaps + i, 0, sizeof(struct font_bitmap_desc));
+        bitmaps[i].offset = offset;
+      }
+      continue;
+    }
+    if(descs)
+      FONT(glyph_get_desc(glyph, descs + i));
 
-  FT_Glyph_Get_CBox(glyph->ft_glyph, FT_GLYPH_BBOX_PIXELS, &box);
-  glyph->bbox.x_min = (int)box.xMin;
-  glyph->bbox.y_min = (int)box.yMin;
-  glyph->bbox.x_max = (int)box.xMax;
-  glyph->bbox.y_max = (int)box.yMax;
+    if(bitmaps || buffer_size || buffer) {
+      font_err = glyph_rasterize(glyph, antialiasing, &bmp);
+      if(font_err != FONT_NO_ERROR)
+        goto error;
+      Bpp = sizeof_ft_pixel_mode(bmp->pixel_mode);
+      size = (size_t)Bpp * bmp->width * bmp->rows;
+      if(bitmaps) {
+        bitmaps[i].width = (int)bmp->width;
+        bitmaps[i].height = (int)bmp->rows;
+        bitmaps[i].bytes_per_pixel = Bpp;
+        bitmaps[i].offset = offset;
+      }
+      if(buffer) {
+        const uint64_t t0 = stats_time();
+        copy_bitmap(bmp, buffer + offset, (size_t)Bpp * bmp->width);
+        STATS_ADD(font, copy_time, stats_time() - t0);
+      }
+      offset += size;
+    }
+  }
+  if(buffer_size)
+    *buffer_size = offset;
 
 exit:
-  if(out_glyph)
-    *out_glyph = glyph;
+  if(glyphs) {
+    for(i = 0; i < count; ++i) {
+      if(glyphs[i])
+        FONT(glyph_ref_put(glyphs[i]));
+    }
+    MEM_FREE(font->sys->allocator, glyphs);
+  }
+  trace_end(font, FONT_TRACE_GET_GLYPH);
   return font_err;
 error:
-  if(glyph) {
-    FONT(glyph_ref_put(glyph));
-    glyph = NULL;
-  }
   goto exit;
 }
 
@@ -438,16 +1735,35 @@ font_glyph_ref_get(struct font_glyph* glyph)
 {
   if(!glyph)
     return FONT_INVALID_ARGUMENT;
-  ref_get(&glyph->ref);
+  atomic_ref_get(&glyph->ref);
   return FONT_NO_ERROR;
 }
 
 enum font_error
 font_glyph_ref_put(struct font_glyph* glyph)
 {
+  struct font_rsrc* font = NULL;
+  bool is_released = false;
+  int count = 0;
+
   if(!glyph)
     return FONT_INVALID_ARGUMENT;
-  ref_put(&glyph->ref, release_glyph);
+
+  /* Lock free release of the references that are not the last one */
+  count = __atomic_load_n(&glyph->ref.count, __ATOMIC_RELAXED);
+  while(count > 1) {
+    if(__atomic_compare_exchange_n(&glyph->ref.count, &count, count - 1,
+       false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return FONT_NO_ERROR;
+  }
+  font = glyph->font;
+  MUTEX(lock(&font->lock));
+  is_released = atomic_ref_put(&glyph->ref);
+  if(is_released)
+    release_glyph(glyph);
+  MUTEX(unlock(&font->lock));
+  if(is_released)
+    FONT(rsrc_ref_put(font));
   return FONT_NO_ERROR;
 }
 
@@ -468,12 +1784,10 @@ font_glyph_get_bitmap
     font_err = FONT_INVALID_ARGUMENT;
     goto error;
   }
-  if(antialiasing) {
-    FT(Glyph_To_Bitmap(&glyph->ft_glyph, FT_RENDER_MODE_NORMAL, NULL, 1));
-  } else {
-    FT(Glyph_To_Bitmap(&glyph->ft_glyph, FT_RENDER_MODE_MONO, NULL, 1));
-  }
-  bmp = &((FT_BitmapGlyph)glyph->ft_glyph)->bitmap;
+  trace_begin(glyph->font, FONT_TRACE_GET_BITMAP);
+  font_err = glyph_rasterize(glyph, antialiasing, &bmp);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
   Bpp = sizeof_ft_pixel_mode(bmp->pixel_mode);
 
   if(width)
@@ -483,22 +1797,117 @@ font_glyph_get_bitmap
   if(bytes_per_pixel)
     *bytes_per_pixel = Bpp;
   if(buffer) {
-    const size_t pitch = (size_t)(Bpp * bmp->width);
-    int x, y;
-    for(y = 0; y < bmp->rows; ++y) {
-      unsigned char* row = buffer + (size_t)y * pitch;
-      for(x = 0; x < bmp->width; ++x) {
-        unsigned char* pixel = row + x * Bpp;
-        copy_bitmap_pixel(bmp, x, y, pixel);
-      }
-    }
+    const uint64_t t0 = stats_time();
+    copy_bitmap(bmp, buffer, (size_t)Bpp * bmp->width);
+    STATS_ADD(glyph->font, copy_time, stats_time() - t0);
   }
 exit:
+  if(glyph)
+    trace_end(glyph->font, FONT_TRACE_GET_BITMAP);
   return font_err;
 error:
   goto exit;
 }
 
+enum font_error
+font_glyph_write_bitmap
+  (struct font_glyph* glyph,
+   const bool antialiasing,
+   const enum font_pixel_format format,
+   unsigned char* dst,
+   const size_t stride,
+   const int x,
+   const int y)
+{
+  const FT_Bitmap* bmp = NULL;
+  size_t row_size = 0;
+  uint64_t t0 = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!glyph || !dst || x < 0 || y < 0)
+    return FONT_INVALID_ARGUMENT;
+  if(format != FONT_FORMAT_A1
+  && format != FONT_FORMAT_A8
+  && format != FONT_FORMAT_RGBA8)
+    return FONT_INVALID_ARGUMENT;
+
+  font_err = glyph_rasterize(glyph, antialiasing, &bmp);
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+  if(sizeof_ft_pixel_mode((FT_Pixel_Mode)bmp->pixel_mode) != 1)
+    return FONT_INVALID_ARGUMENT;
+
+  switch(format) {
+    case FONT_FORMAT_A1: row_size = ((size_t)x + bmp->width + 7) / 8; break;
+    case FONT_FORMAT_A8: row_size = (size_t)x + bmp->width; break;
+    case FONT_FORMAT_RGBA8: row_size = ((size_t)x + bmp->width) * 4; break;
+    default: ASSERT(0); /* Unreachable code */ break;
+  }
+  if(bmp->rows && stride < row_size)
+    return FONT_INVALID_ARGUMENT;
+
+  t0 = stats_time();
+  write_bitmap(bmp, format, dst, stride, x, y);
+  STATS_ADD(glyph->font, copy_time, stats_time() - t0);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_glyph_get_bitmap_view
+  (struct font_glyph* glyph,
+   const bool antialiasing,
+   struct font_bitmap_view* view)
+{
+  const FT_Bitmap* bmp = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!glyph || !view)
+    return FONT_INVALID_ARGUMENT;
+
+  font_err = glyph_rasterize(glyph, antialiasing, &bmp);
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+
+  switch(bmp->pixel_mode) {
+    case FT_PIXEL_MODE_MONO: view->bits_per_pixel = 1; break;
+    case FT_PIXEL_MODE_GRAY2: view->bits_per_pixel = 2; break;
+    case FT_PIXEL_MODE_GRAY4: view->bits_per_pixel = 4; break;
+    case FT_PIXEL_MODE_GRAY: view->bits_per_pixel = 8; break;
+    default: return FONT_INVALID_ARGUMENT; /* Unsupported pixel mode */
+  }
+  view->buffer = bmp->buffer;
+  view->width = (int)bmp->width;
+  view->height = (int)bmp->rows;
+  view->pitch = bmp->pitch;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_glyph_get_sdf
+  (struct font_glyph* glyph,
+   const int spread,
+   int* width,
+   int* height,
+   unsigned char* buffer)
+{
+  const FT_Bitmap* bmp = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!glyph || spread <= 0 || spread > FONT_SDF_MAX_SPREAD)
+    return FONT_INVALID_ARGUMENT;
+
+  font_err = glyph_rasterize_sdf(glyph, spread, &bmp);
+  if(font_err != FONT_NO_ERROR)
+    return font_err;
+  if(width)
+    *width = (int)bmp->width;
+  if(height)
+    *height = (int)bmp->rows;
+  if(buffer)
+    copy_bitmap(bmp, buffer, bmp->width);
+  return FONT_NO_ERROR;
+}
+
 enum font_error
 font_glyph_get_desc
   (const struct font_glyph* glyph,
@@ -521,3 +1930,183 @@ font_glyph_get_desc
   return FONT_NO_ERROR;
 }
 
+enum font_error
+font_rsrc_get_glyph_descs
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs)
+{
+  if(!font || (count && (!chars || !descs)) || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  return get_glyph_descs
+    (font, &font->metrics, font->ft_size, &font->size_req, chars, count, descs);
+}
+
+enum font_error
+font_rsrc_get_unhinted_glyph_descs
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs)
+{
+  if(!font || (count && (!chars || !descs)) || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  return get_unhinted_glyph_descs(font, &font->size_req, chars, count, descs);
+}
+
+enum font_error
+font_rsrc_get_glyph_advances
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   int* advances)
+{
+  if(!font || (count && (!chars || !advances)) || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  return get_glyph_advances(font, &font->size_req, chars, count, advances);
+}
+
+/*******************************************************************************
+ *
+ * Font size functions
+ *
+ ******************************************************************************/
+enum font_error
+font_size_create
+  (struct font_rsrc* font,
+   const int width,
+   const int height,
+   struct font_size** out_size)
+{
+  struct font_size* size = NULL;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!font || width <= 0 || height <= 0 || !out_size) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  size = MEM_CALLOC(font->sys->allocator, 1, sizeof(struct font_size));
+  if(!size) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  atomic_ref_init(&size->ref);
+  size->font = font;
+  FONT(rsrc_ref_get(font));
+  pixel_size_request(width, height, &size->req);
+
+  MUTEX(lock(&font->lock));
+  size->next = font->sizes;
+  font->sizes = size;
+  font_err = setup_size(font, size);
+  MUTEX(unlock(&font->lock));
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  if(out_size)
+    *out_size = size;
+  return font_err;
+error:
+  if(size) {
+    FONT(size_ref_put(size));
+    size = NULL;
+  }
+  goto exit;
+}
+
+enum font_error
+font_size_ref_get(struct font_size* size)
+{
+  if(!size)
+    return FONT_INVALID_ARGUMENT;
+  atomic_ref_get(&size->ref);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_size_ref_put(struct font_size* size)
+{
+  if(!size)
+    return FONT_INVALID_ARGUMENT;
+  if(atomic_ref_put(&size->ref))
+    release_size(size);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_size_get_glyph
+  (struct font_size* size,
+   const wchar_t ch,
+   struct font_glyph** glyph)
+{
+  if(!size || !glyph || !size->ft_size) {
+    if(glyph)
+      *glyph = NULL;
+    return FONT_INVALID_ARGUMENT;
+  }
+  return get_glyph(size->font, size->ft_size, &size->req, ch, 0, glyph);
+}
+
+enum font_error
+font_size_get_subpixel_glyph
+  (struct font_size* size,
+   const wchar_t ch,
+   const int x_phase,
+   struct font_glyph** glyph)
+{
+  if(!size || x_phase < 0 || x_phase >= FONT_SUBPIXEL_PHASES || !glyph
+  || !size->ft_size) {
+    if(glyph)
+      *glyph = NULL;
+    return FONT_INVALID_ARGUMENT;
+  }
+  return get_glyph
+    (size->font, size->ft_size, &size->req, ch, x_phase, glyph);
+}
+
+enum font_error
+font_size_get_line_space(const struct font_size* size, int* line_space)
+{
+  if(!size || !line_space || !size->ft_size)
+    return FONT_INVALID_ARGUMENT;
+  return get_line_space(size->font, size->ft_size, line_space);
+}
+
+enum font_error
+font_size_get_glyph_descs
+  (struct font_size* size,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs)
+{
+  if(!size || (count && (!chars || !descs)) || !size->ft_size)
+    return FONT_INVALID_ARGUMENT;
+  return get_glyph_descs
+    (size->font, &size->metrics, size->ft_size, &size->req, chars, count, descs);
+}
+
+enum font_error
+font_size_get_unhinted_glyph_descs
+  (struct font_size* size,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs)
+{
+  if(!size || (count && (!chars || !descs)) || !size->ft_size)
+    return FONT_INVALID_ARGUMENT;
+  return get_unhinted_glyph_descs(size->font, &size->req, chars, count, descs);
+}
+
+enum font_error
+font_size_get_glyph_advances
+  (struct font_size* size,
+   const wchar_t* chars,
+   const size_t count,
+   int* advances)
+{
+  if(!size || (count && (!chars || !advances)) || !size->ft_size)
+    return FONT_INVALID_ARGUMENT;
+  return get_glyph_advances(size->font, &size->req, chars, count, advances);
+}
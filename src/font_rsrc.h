@@ -3,6 +3,8 @@
 
 #include <snlsys/snlsys.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #if defined(FONT_SHARED_BUILD)
   #define FONT_API EXPORT_SYM
@@ -29,13 +31,56 @@ enum font_error {
  *
  * Font system
  *
+ * Thread safety: the objects of a font system can be shared by several
+ * threads. Getting glyphs, rasterizing or writing their bitmaps, packing them
+ * into an atlas and managing the object references can be invoked
+ * concurrently, on the same object or not. Glyphs of a font are loaded from a
+ * pool of per thread FreeType faces over the shared font data. The functions
+ * that configure a font, i.e. font_rsrc_load, font_rsrc_load_memory,
+ * font_rsrc_load_stream and font_rsrc_set_size, must not be invoked
+ * concurrently to other functions on the same font or on its sizes and
+ * glyphs.
+ *
  ******************************************************************************/
 struct font_system;
+struct font_rsrc; /* Traced font */
+
+/* Counters of a font system or of one of its fonts. They are updated with
+ * relaxed atomic operations and can be read at any time. */
+struct font_stats {
+  size_t glyphs_created;
+  size_t glyphs_released;
+  size_t cache_hits;
+  size_t cache_misses;
+  size_t cache_evictions;
+  size_t bitmaps_size; /* Bytes currently held by the rasterized bitmaps */
+  size_t ft_allocated_size; /* Bytes currently allocated by FreeType */
+  size_t ft_allocations_count; /* Overall number of FreeType allocations */
+  uint64_t load_time; /* Cumulative time in nanoseconds */
+  uint64_t rasterize_time; /* Cumulative time in nanoseconds */
+  uint64_t copy_time; /* Cumulative time in nanoseconds */
+};
+
+enum font_trace_event {
+  FONT_TRACE_LOAD, /* font_rsrc_load, font_rsrc_load_memory and _stream */
+  FONT_TRACE_GET_GLYPH, /* font_rsrc_get_glyph and font_rsrc_get_glyphs */
+  FONT_TRACE_GET_BITMAP /* font_glyph_get_bitmap */
+};
+
+/* Invoked at the beginning and at the end of the traced functions, from the
+ * calling thread */
+struct font_trace_hooks {
+  void (*begin)(const enum font_trace_event event, struct font_rsrc*, void*);
+  void (*end)(const enum font_trace_event event, struct font_rsrc*, void*);
+  void* data; /* Last argument of the hooks */
+};
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* The allocator backs the font objects as well as the FreeType memory, i.e.
+ * the faces, the glyph outlines and their bitmaps. It must be thread safe. */
 FONT_API enum font_error
 font_system_create
   (struct mem_allocator* allocator, /* May be NULL */
@@ -49,6 +94,21 @@ FONT_API enum font_error
 font_system_ref_put
   (struct font_system* sys);
 
+/* Accumulate the counters of all the fonts of the system, released or not.
+ * The FreeType allocations are only counted per system. */
+FONT_API enum font_error
+font_system_get_stats
+  (const struct font_system* sys,
+   struct font_stats* stats);
+
+/* Set the hooks invoked around the traced functions of the fonts of the
+ * system. NULL disables the tracing. Must not be invoked concurrently to the
+ * other functions of the system objects. */
+FONT_API enum font_error
+font_system_set_trace_hooks
+  (struct font_system* sys,
+   const struct font_trace_hooks* hooks); /* May be NULL */
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -60,6 +120,17 @@ font_system_ref_put
  ******************************************************************************/
 struct font_rsrc; /* Font resource */
 
+/* Font data read on demand, e.g. from a compressed archive */
+struct font_stream {
+  /* Copy `size' bytes from `offset' into `buffer' and return the number of
+   * copied bytes. Never invoked concurrently for the same stream. */
+  size_t (*read)(void* data, size_t offset, void* buffer, size_t size);
+  /* Invoked once the font no longer reads the stream. May be NULL */
+  void (*release)(void* data);
+  size_t size; /* Size of the font data in bytes */
+  void* data; /* First argument of the callbacks */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -78,17 +149,60 @@ FONT_API enum font_error
 font_rsrc_ref_put
   (struct font_rsrc* font);
 
+/* Load the font file. The file is memory mapped and its content is shared by
+ * all the fonts of the font system loaded from the same path. */
 FONT_API enum font_error
 font_rsrc_load
   (struct font_rsrc* font,
    const char* path);
 
+/* Load the font from a memory buffer. The buffer is owned by the caller and
+ * must remain valid until the font is released or loaded again. */
+FONT_API enum font_error
+font_rsrc_load_memory
+  (struct font_rsrc* font,
+   const void* data,
+   const size_t size); /* In bytes */
+
+/* Load the font from a stream. Its data are read on demand by pages that are
+ * cached until the font is released or loaded again, so that only the tables
+ * and the glyphs that are used are read. On success, the font releases the
+ * stream once it no longer reads it; on failure the stream is not released. */
+FONT_API enum font_error
+font_rsrc_load_stream
+  (struct font_rsrc* font,
+   const struct font_stream* stream);
+
 FONT_API enum font_error
 font_rsrc_set_size
   (struct font_rsrc* font,
    const int width,  /* In pixels */
    const int height); /* In pixels */
 
+/* Define the memory budget of the glyph cache of the font. Glyphs returned by
+ * font_rsrc_get_glyph are cached with respect to the current font size and
+ * the least recently used ones are evicted when the cache exceeds its budget.
+ * A size of 0 disables the cache. */
+FONT_API enum font_error
+font_rsrc_set_glyph_cache_size
+  (struct font_rsrc* font,
+   const size_t size); /* In bytes */
+
+/* Glyph generations. The cached glyphs are tagged with the current generation
+ * of their font when they are created or returned by the cache, e.g. once
+ * per frame. Starting a new generation returns its identifier; releasing the
+ * generations older than `generation' evicts their cached glyphs at once and
+ * gives the glyph memory back to the allocator of the font system. */
+FONT_API enum font_error
+font_rsrc_next_glyph_generation
+  (struct font_rsrc* font,
+   unsigned* generation);
+
+FONT_API enum font_error
+font_rsrc_release_glyph_generations
+  (struct font_rsrc* font,
+   const unsigned generation);
+
 FONT_API enum font_error
 font_rsrc_get_line_space
   (const struct font_rsrc* font,
@@ -99,6 +213,55 @@ font_rsrc_is_scalable
   (const struct font_rsrc* font,
    bool* is_scalable);
 
+FONT_API enum font_error
+font_rsrc_get_stats
+  (const struct font_rsrc* font,
+   struct font_stats* stats);
+
+/* Check whether the font has a glyph for `ch'. A single bit test for the
+ * characters of the Basic Multilingual Plane. */
+FONT_API enum font_error
+font_rsrc_has_char
+  (struct font_rsrc* font,
+   const wchar_t ch,
+   bool* has_char);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*******************************************************************************
+ *
+ * Font size. Handle on a pixel size of a font. Several sizes of a font can be
+ * used concurrently without reloading nor rescaling the font face.
+ *
+ ******************************************************************************/
+struct font_size;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FONT_API enum font_error
+font_size_create
+  (struct font_rsrc* font, /* Must be scalable */
+   const int width, /* In pixels */
+   const int height, /* In pixels */
+   struct font_size** size);
+
+FONT_API enum font_error
+font_size_ref_get
+  (struct font_size* size);
+
+FONT_API enum font_error
+font_size_ref_put
+  (struct font_size* size);
+
+FONT_API enum font_error
+font_size_get_line_space
+  (const struct font_size* size,
+   int* line_space); /* In pixels */
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -120,6 +283,35 @@ struct font_glyph_desc {
   wchar_t character;
 };
 
+/* Maximum spread of the signed distance field of a glyph, in pixels */
+#define FONT_SDF_MAX_SPREAD 64
+
+/* Number of the subpixel phases a glyph can be shifted by horizontally, i.e.
+ * glyphs are positioned to 1/FONT_SUBPIXEL_PHASES pixel */
+#define FONT_SUBPIXEL_PHASES 4
+
+enum font_pixel_format {
+  FONT_FORMAT_A1, /* 1 bit per pixel, most significant bit first */
+  FONT_FORMAT_A8, /* 1 byte per pixel */
+  FONT_FORMAT_RGBA8 /* White RGB. The glyph coverage is stored in alpha */
+};
+
+/* Read only access to the bitmap of a glyph, as rasterized by FreeType */
+struct font_bitmap_view {
+  const unsigned char* buffer; /* First row of the bitmap */
+  int width; /* In pixels */
+  int height; /* In pixels */
+  int pitch; /* Signed offset in bytes between 2 consecutive rows */
+  int bits_per_pixel; /* 1, 2, 4 or 8 */
+};
+
+struct font_bitmap_desc {
+  int width;
+  int height;
+  int bytes_per_pixel;
+  size_t offset; /* Offset in bytes of the bitmap into the batch buffer */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -130,6 +322,106 @@ font_rsrc_get_glyph
    wchar_t ch,
    struct font_glyph** glyph);
 
+/* Return the glyph of `ch' at the pixel size of the size handle. Glyphs of
+ * all the sizes of a font share the font glyph cache. */
+FONT_API enum font_error
+font_size_get_glyph
+  (struct font_size* size,
+   const wchar_t ch,
+   struct font_glyph** glyph);
+
+/* Return the glyph of `ch' whose outline is shifted right by
+ * x_phase/FONT_SUBPIXEL_PHASES pixel before its rasterization, i.e. the
+ * glyph of a pen lying at this fraction of pixel. Each phase of a glyph is
+ * cached as a distinct glyph; its bounding box includes the shift. The phases
+ * of the glyphs of bitmap fonts are the unshifted glyph. */
+FONT_API enum font_error
+font_rsrc_get_subpixel_glyph
+  (struct font_rsrc* font,
+   const wchar_t ch,
+   const int x_phase, /* In [0, FONT_SUBPIXEL_PHASES) */
+   struct font_glyph** glyph);
+
+FONT_API enum font_error
+font_size_get_subpixel_glyph
+  (struct font_size* size,
+   const wchar_t ch,
+   const int x_phase, /* In [0, FONT_SUBPIXEL_PHASES) */
+   struct font_glyph** glyph);
+
+/* Retrieve the glyph descriptors and the bitmaps of `count' characters in one
+ * call. The bitmaps are tightly packed into `buffer' in the order of the
+ * characters; `buffer_size' returns the overall size in bytes of the bitmaps,
+ * allowing to allocate the buffer of a subsequent call. A character without
+ * glyph in the font has a null descriptor and an empty bitmap. The glyphs
+ * missing from the glyph cache are loaded together, from one face state.
+ * Without glyph cache, i.e. font_rsrc_set_glyph_cache_size(font, 0), the
+ * glyphs are loaded and rasterized again by each call, so that querying the
+ * buffer size and then copying the bitmaps loads each glyph twice. */
+FONT_API enum font_error
+font_rsrc_get_glyphs
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   const bool antialiasing,
+   struct font_glyph_desc* descs, /* May be NULL. `count' entries */
+   struct font_bitmap_desc* bitmaps, /* May be NULL. `count' entries */
+   size_t* buffer_size, /* May be NULL */
+   unsigned char* buffer); /* May be NULL */
+
+/* Retrieve the descriptors of `count' characters without creating their
+ * glyph. The descriptors are those returned by font_glyph_get_desc and are
+ * cached per size, making this the fast path of layout and measurement. A
+ * character without glyph in the font has a null descriptor. */
+FONT_API enum font_error
+font_rsrc_get_glyph_descs
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs); /* `count' entries */
+
+FONT_API enum font_error
+font_size_get_glyph_descs
+  (struct font_size* size,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs); /* `count' entries */
+
+/* Opt-in fast path of the descriptor query for the characters not queried
+ * yet. The glyphs are loaded without hinting nor embedded bitmaps, so that
+ * the descriptors may differ by a pixel from those of font_glyph_get_desc.
+ * They are not cached. */
+FONT_API enum font_error
+font_rsrc_get_unhinted_glyph_descs
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs); /* `count' entries */
+
+FONT_API enum font_error
+font_size_get_unhinted_glyph_descs
+  (struct font_size* size,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs); /* `count' entries */
+
+/* Retrieve the unhinted advances in pixels of `count' characters, read from
+ * the metrics tables of the font without loading the glyphs when the font
+ * format allows it. A character without glyph has a null advance. */
+FONT_API enum font_error
+font_rsrc_get_glyph_advances
+  (struct font_rsrc* font,
+   const wchar_t* chars,
+   const size_t count,
+   int* advances); /* `count' entries */
+
+FONT_API enum font_error
+font_size_get_glyph_advances
+  (struct font_size* size,
+   const wchar_t* chars,
+   const size_t count,
+   int* advances); /* `count' entries */
+
 FONT_API enum font_error
 font_glyph_ref_get
   (struct font_glyph* glyph);
@@ -147,6 +439,44 @@ font_glyph_get_bitmap
    int* bytes_per_pixel, /* May be NULL */
    unsigned char* buffer); /* May be NULL */
 
+/* Rasterize the glyph directly into a caller surface, e.g. a sub-rectangle of
+ * a larger staging texture. The upper-left pixel of the glyph bitmap is
+ * written at the pixel (x, y) of `dst' whose rows are `stride' bytes long.
+ * Pixels outside the glyph bitmap are left unchanged. */
+FONT_API enum font_error
+font_glyph_write_bitmap
+  (struct font_glyph* glyph,
+   const bool antialiasing,
+   const enum font_pixel_format format,
+   unsigned char* dst,
+   const size_t stride, /* In bytes */
+   const int x, /* In pixels */
+   const int y); /* In pixels */
+
+/* Expose the bitmap buffer of FreeType without any copy. The view is valid
+ * until the glyph is released. */
+FONT_API enum font_error
+font_glyph_get_bitmap_view
+  (struct font_glyph* glyph,
+   const bool antialiasing,
+   struct font_bitmap_view* view);
+
+/* Compute the signed distance field of the glyph from its antialiased
+ * rasterization. The field covers the glyph bitmap extended by `spread'
+ * pixels on each side, i.e. its upper-left pixel lies `spread' pixels to the
+ * left of and above the glyph bitmap. The distance to the outline is mapped
+ * to one byte per pixel: 128 on the outline, 255 `spread' pixels inside and
+ * 0 `spread' pixels outside. Generating the field at a large font size lets
+ * it be rendered at any smaller one. The field is computed once per spread
+ * and kept with the glyph as its bitmaps. */
+FONT_API enum font_error
+font_glyph_get_sdf
+  (struct font_glyph* glyph,
+   const int spread, /* In pixels, in [1, FONT_SDF_MAX_SPREAD] */
+   int* width, /* May be NULL */
+   int* height, /* May be NULL */
+   unsigned char* buffer); /* May be NULL */
+
 FONT_API enum font_error
 font_glyph_get_desc
   (const struct font_glyph* glyph,
@@ -156,5 +486,539 @@ font_glyph_get_desc
 } /* extern "C" */
 #endif
 
+/*******************************************************************************
+ *
+ * Font atlas. Pack the bitmap of the glyphs of one or more fonts into pages of
+ * fixed size. Each page stores one byte per pixel. The atlas grows by adding
+ * pages; the glyphs already packed never move.
+ *
+ ******************************************************************************/
+struct font_atlas;
+struct font_atlas_glyph {
+  struct font_glyph_desc desc;
+  int page; /* Index of the page where the glyph bitmap lies */
+  struct { /* Glyph bitmap in the page, in pixels */
+    int x;
+    int y;
+    int width;
+    int height;
+  } rect;
+  struct { /* Glyph bitmap in the page, in normalized coordinates */
+    float u_min;
+    float v_min;
+    float u_max;
+    float v_max;
+  } uv;
+};
+
+/* Page region written since the last flush of the atlas */
+struct font_atlas_dirty_rect {
+  size_t page; /* Index of the page */
+  struct { /* Region in the page, in pixels */
+    int x;
+    int y;
+    int width;
+    int height;
+  } rect;
+  const unsigned char* pixels; /* First pixel of the region */
+  size_t pitch; /* Number of bytes between two rows, i.e. the page width */
+};
+
+/* Invoked on each dirty rectangle of the atlas, under its lock */
+typedef void
+(*font_atlas_dirty_rect_T)
+  (const struct font_atlas_dirty_rect* rect,
+   void* data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FONT_API enum font_error
+font_atlas_create
+  (struct font_system* sys,
+   const int page_width, /* In pixels */
+   const int page_height, /* In pixels */
+   struct font_atlas** atlas);
+
+FONT_API enum font_error
+font_atlas_ref_get
+  (struct font_atlas* atlas);
+
+FONT_API enum font_error
+font_atlas_ref_put
+  (struct font_atlas* atlas);
+
+/* Return the atlas location of the glyph of `ch' at the current font size.
+ * The glyph is rasterized and packed on its first request. */
+FONT_API enum font_error
+font_atlas_get_glyph
+  (struct font_atlas* atlas,
+   struct font_rsrc* font,
+   const wchar_t ch,
+   const bool antialiasing,
+   struct font_atlas_glyph* glyph);
+
+/* Return the atlas location of the signed distance field of the glyph of `ch'
+ * for `spread', as computed by font_glyph_get_sdf. The field is packed on its
+ * first request, apart from the bitmaps of the glyph. */
+FONT_API enum font_error
+font_atlas_get_sdf_glyph
+  (struct font_atlas* atlas,
+   struct font_rsrc* font,
+   const wchar_t ch,
+   const int spread, /* In pixels, in [1, FONT_SDF_MAX_SPREAD] */
+   struct font_atlas_glyph* glyph);
+
+FONT_API enum font_error
+font_atlas_get_pages_count
+  (const struct font_atlas* atlas,
+   size_t* count);
+
+FONT_API enum font_error
+font_atlas_get_page
+  (const struct font_atlas* atlas,
+   const size_t ipage,
+   int* width, /* May be NULL */
+   int* height, /* May be NULL */
+   const unsigned char** pixels); /* May be NULL */
+
+/* Submit the rectangles written since the last flush to `func', and reset
+ * them. Rectangles of a page are disjoint, and are merged when a page has too
+ * many of them. Pages are zero initialized so that a new page only has the
+ * rectangles of its glyphs; the pages mapped by font_atlas_load are dirty as
+ * a whole. `func' may be NULL to discard the rectangles and must not invoke
+ * the atlas functions. */
+FONT_API enum font_error
+font_atlas_flush
+  (struct font_atlas* atlas,
+   font_atlas_dirty_rect_T func, /* May be NULL */
+   void* data,
+   size_t* count); /* May be NULL. Number of submitted rectangles */
+
+/* Write the pages and the glyph index of the atlas into the file `path',
+ * with a hash of the data of its fonts. The file layout is the one of the
+ * host memory and is thus not portable across architectures. */
+FONT_API enum font_error
+font_atlas_save
+  (struct font_atlas* atlas,
+   const char* path);
+
+/* Map the atlas file `path' into the empty atlas. The pages and the index of
+ * the file are used in place: its glyphs are returned without being loaded
+ * nor rasterized, while new glyphs are packed into new pages. Each font of
+ * the file is matched with one of the submitted `fonts' that has the same
+ * data. If a font has no match, or if the file was saved with another page
+ * size or by another version, the file is not used and `is_loaded' is set to
+ * false; glyphs are then packed on request. */
+FONT_API enum font_error
+font_atlas_load
+  (struct font_atlas* atlas,
+   const char* path,
+   struct font_rsrc* const* fonts,
+   const size_t nfonts,
+   bool* is_loaded); /* May be NULL */
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*******************************************************************************
+ *
+ * Text layout. Place the glyphs of a string with respect to their advance and
+ * the kerning of the font, at its current size. Lines are broken on '\n' and
+ * are `line space' pixels apart. Coordinates are in pixels, relative to the
+ * pen origin of the first line, with the y axis pointing up. Glyphs are
+ * neither created nor rasterized. Characters without glyph have no advance.
+ *
+ ******************************************************************************/
+struct font_text_metrics {
+  int width; /* Advance of the longest line */
+  int height; /* Line space times the number of lines */
+  int lines_count;
+  struct { /* Bounding box of the glyph bitmaps */
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+  } bbox;
+};
+
+struct font_glyph_position {
+  wchar_t character;
+  int x; /* Pen position of the glyph origin, rounded toward -infinity */
+  int y; /* Baseline of the line of the glyph */
+  int x_frac; /* Fractional part of the pen position in 1/64 pixel */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FONT_API enum font_error
+font_rsrc_measure_text
+  (struct font_rsrc* font,
+   const wchar_t* text,
+   const size_t count, /* Number of characters */
+   struct font_text_metrics* metrics);
+
+FONT_API enum font_error
+font_rsrc_layout_text
+  (struct font_rsrc* font,
+   const wchar_t* text,
+   const size_t count, /* Number of characters */
+   struct font_glyph_position* positions, /* Array of `count' positions */
+   struct font_text_metrics* metrics); /* May be NULL */
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*******************************************************************************
+ *
+ * Text rendering. Rasterize the glyphs of a text and composite them straight
+ * into a caller surface. The glyph coverage, times the alpha of the color,
+ * blends the color over the surface: dst = color * a + dst * (1 - a), the
+ * alpha of the color being replaced by 1 for the alpha channel of the RGBA8
+ * surfaces. Only the pixels covered by a glyph bitmap and lying in the clip
+ * rectangle are written.
+ *
+ ******************************************************************************/
+struct font_surface {
+  unsigned char* pixels; /* Upper-left pixel */
+  int width; /* In pixels */
+  int height; /* In pixels */
+  size_t stride; /* Offset in bytes between 2 consecutive rows */
+  enum font_pixel_format format; /* FONT_FORMAT_A8 or FONT_FORMAT_RGBA8 */
+  struct { /* Clip rectangle in pixels. The max bounds are exclusive */
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+  } clip;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lay out the text as font_rsrc_layout_text and draw it. The pen origin of
+ * the first line lies at the pixel (x, y) of the surface, whose rows go
+ * downward. The glyphs of scalable fonts are drawn at the subpixel phase
+ * nearest to the fractional part of their pen position. */
+FONT_API enum font_error
+font_rsrc_draw_text
+  (struct font_rsrc* font,
+   const wchar_t* text,
+   const size_t count, /* Number of characters */
+   const bool antialiasing,
+   const unsigned char color[4], /* RGBA */
+   const struct font_surface* surface,
+   const int x, /* In pixels */
+   const int y); /* In pixels */
+
+/* Draw a glyph run laid out by font_rsrc_layout_text or by the caller */
+FONT_API enum font_error
+font_rsrc_draw_glyphs
+  (struct font_rsrc* font,
+   const struct font_glyph_position* positions,
+   const size_t count, /* Number of positions */
+   const bool antialiasing,
+   const unsigned char color[4], /* RGBA */
+   const struct font_surface* surface,
+   const int x, /* In pixels */
+   const int y); /* In pixels */
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*******************************************************************************
+ *
+ * Font family. Ordered fallback chain of fonts: each character is resolved to
+ * the first font that has a glyph for it. The resolution relies on the
+ * coverage of the fonts and is memoized per character. The fonts of a family
+ * are used at their current size and must share the family font system.
+ *
+ ******************************************************************************/
+struct font_family;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The family references its `nfonts' fonts, in fallback order */
+FONT_API enum font_error
+font_family_create
+  (struct font_system* sys,
+   struct font_rsrc* const* fonts,
+   const size_t nfonts, /* In [1, 254] */
+   struct font_family** family);
+
+FONT_API enum font_error
+font_family_ref_get
+  (struct font_family* family);
+
+FONT_API enum font_error
+font_family_ref_put
+  (struct font_family* family);
+
+/* Return the first font of the family that has a glyph for `ch', or NULL if
+ * none. The returned font is not referenced. */
+FONT_API enum font_error
+font_family_resolve
+  (struct font_family* family,
+   const wchar_t ch,
+   struct font_rsrc** font);
+
+/* Return the glyph of `ch' from the font `ch' is resolved to */
+FONT_API enum font_error
+font_family_get_glyph
+  (struct font_family* family,
+   const wchar_t ch,
+   struct font_glyph** glyph);
+
+/* Metrics only glyph descriptors of `count' characters, as returned by
+ * font_rsrc_get_glyph_descs for the font of each character. A character that
+ * no font covers has a null descriptor. */
+FONT_API enum font_error
+font_family_get_glyph_descs
+  (struct font_family* family,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs); /* `count' entries */
+
+/* Text layout across the fonts of the family. The kerning applies between
+ * glyphs of the same font and lines are spaced with the line space of the
+ * first font. */
+FONT_API enum font_error
+font_family_measure_text
+  (struct font_family* family,
+   const wchar_t* text,
+   const size_t count, /* Number of characters */
+   struct font_text_metrics* metrics);
+
+FONT_API enum font_error
+font_family_layout_text
+  (struct font_family* family,
+   const wchar_t* text,
+   const size_t count, /* Number of characters */
+   struct font_glyph_position* positions, /* Array of `count' positions */
+   struct font_text_metrics* metrics); /* May be NULL */
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*******************************************************************************
+ *
+ * Glyph pre-rendering. Load and rasterize the glyphs of character ranges
+ * ahead of their use, across a pool of worker threads.
+ *
+ ******************************************************************************/
+struct font_char_range {
+  wchar_t first;
+  wchar_t last; /* Inclusive */
+};
+
+enum font_prerender_flag {
+  FONT_PRERENDER_MONO = 1 << 0, /* Rasterize the monochrome bitmaps */
+  FONT_PRERENDER_ANTIALIASED = 1 << 1 /* Rasterize the antialiased bitmaps */
+};
+
+/* Compute the signed distance fields for `Spread', in
+ * [1, FONT_SDF_MAX_SPREAD] */
+#define FONT_PRERENDER_SDF(Spread) (((Spread) & 0xFF) << 8)
+#define FONT_PRERENDER_SDF_SPREAD(Flags) (((Flags) >> 8) & 0xFF)
+
+/* Invoked by the workers each time a task is completed, never concurrently.
+ * Return false to cancel the pre-rendering. */
+typedef bool
+(*font_prerender_progress_T)
+  (const size_t nchars_done,
+   const size_t nchars,
+   void* data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Load the glyphs of the characters of `ranges' at the current font size and
+ * rasterize them with respect to `flags'. The glyphs are kept by the glyph
+ * cache of the font, whose size should thus be set accordingly, or are packed
+ * into `atlas' if it is not NULL, in which case at least one rasterization
+ * flag must be set. Characters without glyph are skipped and the codepoints of
+ * the ranges cannot be negative. The work is split across `nthreads' threads,
+ * the calling one included; 0 uses one thread per online processor. A job
+ * canceled by `progress' stops once its running tasks are completed and
+ * returns FONT_NO_ERROR: the characters already processed are kept. */
+FONT_API enum font_error
+font_rsrc_prerender
+  (struct font_rsrc* font,
+   const struct font_char_range* ranges,
+   const size_t nranges,
+   const int flags, /* Combination of enum font_prerender_flag */
+   const size_t nthreads,
+   struct font_atlas* atlas, /* May be NULL */
+   font_prerender_progress_T progress, /* May be NULL */
+   void* progress_data);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*******************************************************************************
+ *
+ * Asynchronous glyph requests. A worker thread loads and rasterizes the
+ * requested glyphs and posts them to a lock-free completion queue that is
+ * drained by the requesting thread, e.g. once per frame. The fonts and sizes
+ * of the pending requests must not be configured, i.e. loaded or resized.
+ *
+ ******************************************************************************/
+struct font_glyph_queue;
+
+struct font_glyph_request {
+  struct font_rsrc* font; /* Used at its current size if `size' is NULL */
+  struct font_size* size; /* May be NULL */
+  wchar_t character;
+  bool antialiasing;
+  void* data; /* User data forwarded to the completion */
+};
+
+struct font_glyph_completion {
+  struct font_glyph_request request;
+  /* Glyph whose bitmap is rasterized in the requested mode. NULL on error.
+   * The glyph is released after the completion callback; reference it to
+   * keep it. */
+  struct font_glyph* glyph;
+  /* FONT_INVALID_ARGUMENT if the font has no glyph for the character */
+  enum font_error error;
+};
+
+/* Invoked by font_glyph_queue_drain on the calling thread */
+typedef void
+(*font_glyph_completion_T)
+  (const struct font_glyph_completion* completion,
+   void* data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Create a queue and its worker thread. At most `capacity' requests can be
+ * pushed and not drained yet. */
+FONT_API enum font_error
+font_glyph_queue_create
+  (struct font_system* sys,
+   const size_t capacity,
+   struct font_glyph_queue** queue);
+
+FONT_API enum font_error
+font_glyph_queue_ref_get
+  (struct font_glyph_queue* queue);
+
+/* Releasing the last reference cancels the pending requests */
+FONT_API enum font_error
+font_glyph_queue_ref_put
+  (struct font_glyph_queue* queue);
+
+/* Enqueue the request without waiting for its glyph. The font and the size
+ * are referenced until the completion is drained. If the glyph metrics are
+ * already cached, `desc' is set to the descriptor of the glyph as a
+ * placeholder and `has_desc' is true. Return FONT_MEMORY_ERROR if the queue
+ * is full. */
+FONT_API enum font_error
+font_glyph_queue_push
+  (struct font_glyph_queue* queue,
+   const struct font_glyph_request* request,
+   struct font_glyph_desc* desc, /* May be NULL */
+   bool* has_desc); /* May be NULL */
+
+/* Invoke `func' on the available completions, in completion order, without
+ * waiting for the pending requests. Must not be invoked concurrently on the
+ * same queue. */
+FONT_API enum font_error
+font_glyph_queue_drain
+  (struct font_glyph_queue* queue,
+   font_glyph_completion_T func,
+   void* data,
+   size_t* count); /* May be NULL. Number of drained completions */
+
+/* Block until the worker completed the requests pushed before the call */
+FONT_API enum font_error
+font_glyph_queue_wait
+  (struct font_glyph_queue* queue);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+/*******************************************************************************
+ *
+ * Shared glyph cache. Bitmaps rasterized by a process are published into a
+ * POSIX shared memory object and read in place by the other processes of the
+ * host. Glyphs are keyed by the data of their font, its size and the
+ * rasterization mode, so that the processes that load the same font file share
+ * their glyphs. The index is lock-free; entries are never evicted.
+ *
+ ******************************************************************************/
+struct font_shared_cache;
+
+struct font_shared_glyph {
+  struct font_glyph_desc desc;
+  struct { /* One byte per pixel */
+    int width;
+    int height;
+    const unsigned char* pixels; /* Rows of `width' bytes. NULL if empty */
+  } bitmap;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Open the shared memory object `name', e.g. "/font-cache", or create it with
+ * room for `nslots' glyphs whose bitmaps fit in `data_size' bytes. An existing
+ * object keeps the sizes it was created with. */
+FONT_API enum font_error
+font_shared_cache_create
+  (struct font_system* sys,
+   const char* name,
+   const size_t nslots,
+   const size_t data_size, /* In bytes */
+   struct font_shared_cache** cache);
+
+FONT_API enum font_error
+font_shared_cache_ref_get
+  (struct font_shared_cache* cache);
+
+/* Unmap the object, which lives until it is unlinked */
+FONT_API enum font_error
+font_shared_cache_ref_put
+  (struct font_shared_cache* cache);
+
+/* Remove the shared memory object `name'. The processes that mapped it keep
+ * their mapping. */
+FONT_API enum font_error
+font_shared_cache_unlink
+  (const char* name);
+
+/* Return the glyph of `ch' at the current font size. It is rasterized and
+ * published on its first request by any process. The bitmap lies in the
+ * shared memory and is valid until the cache is released. Return
+ * FONT_MEMORY_ERROR if the cache is full; the glyph can still be requested to
+ * the font. */
+FONT_API enum font_error
+font_shared_cache_get_glyph
+  (struct font_shared_cache* cache,
+   struct font_rsrc* font,
+   const wchar_t ch,
+   const bool antialiasing,
+   struct font_shared_glyph* glyph);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
 #endif /* FONT_RSRC_H */
 
@@ -0,0 +1,582 @@
+#ifndef FONT_RSRC_C_H
+#define FONT_RSRC_C_H
+
+#include "font_rsrc.h"
+
+#include <snlsys/snlsys.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_GLYPH_H
+#include FT_SIZES_H
+#include FT_SYSTEM_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef NDEBUG
+  #define FT(func) ASSERT(0 == FT_##func)
+  #define MUTEX(func) ASSERT(0 == pthread_mutex_##func)
+  #define COND(func) ASSERT(0 == pthread_cond_##func)
+#else
+  #define FT(func) FT_##func
+  #define MUTEX(func) pthread_mutex_##func
+  #define COND(func) pthread_cond_##func
+#endif
+
+/* Maximum number of FreeType sizes of a face instance */
+#define FACE_MAX_SIZES 8
+
+/* Reference counter that can be updated concurrently */
+struct atomic_ref {
+  int count;
+};
+
+static inline void
+atomic_ref_init(struct atomic_ref* ref)
+{
+  __atomic_store_n(&ref->count, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+atomic_ref_get(struct atomic_ref* ref)
+{
+  __atomic_add_fetch(&ref->count, 1, __ATOMIC_RELAXED);
+}
+
+/* Return true if the last reference was released */
+static inline bool
+atomic_ref_put(struct atomic_ref* ref)
+{
+  return __atomic_sub_fetch(&ref->count, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+/* Update a counter of the font and of its system */
+#define STATS_ADD(Font, Counter, Val) do {                                    \
+  __atomic_add_fetch(&(Font)->stats.Counter, (Val), __ATOMIC_RELAXED);        \
+  __atomic_add_fetch(&(Font)->sys->stats.Counter, (Val), __ATOMIC_RELAXED);   \
+} while(0)
+#define STATS_SUB(Font, Counter, Val) do {                                    \
+  __atomic_sub_fetch(&(Font)->stats.Counter, (Val), __ATOMIC_RELAXED);        \
+  __atomic_sub_fetch(&(Font)->sys->stats.Counter, (Val), __ATOMIC_RELAXED);   \
+} while(0)
+/* Update a counter of the system only */
+#define SYS_STATS_ADD(Sys, Counter, Val) \
+  __atomic_add_fetch(&(Sys)->stats.Counter, (Val), __ATOMIC_RELAXED)
+#define SYS_STATS_SUB(Sys, Counter, Val) \
+  __atomic_sub_fetch(&(Sys)->stats.Counter, (Val), __ATOMIC_RELAXED)
+
+/* Read only content of a font file, shared by the fonts loaded from the same
+ * path. The file is memory mapped. */
+struct font_blob {
+  int ref; /* Protected by the lock of the font system */
+  struct font_system* sys;
+  char* path;
+  const unsigned char* data;
+  size_t size;
+  struct font_blob* next; /* Next blob of the font system */
+};
+
+/* Content of a font stream, shared by the faces of the font. The data are
+ * read on demand by pages that are published without lock. */
+struct font_reader {
+  struct atomic_ref ref;
+  struct font_system* sys;
+  struct font_stream stream;
+  unsigned char** pages; /* Atomic pointers. NULL if not read yet */
+  size_t npages;
+  pthread_mutex_t lock; /* Serialize the reads of the stream */
+};
+
+struct font_system {
+  struct atomic_ref ref;
+  struct mem_allocator* allocator;
+  struct FT_MemoryRec_ ft_memory; /* Route the FreeType memory to allocator */
+  FT_Library ft_handle;
+  struct font_blob* blobs; /* List of the opened blobs */
+  struct font_stats stats; /* Counters of all the fonts of the system */
+  struct font_trace_hooks trace;
+  /* Protect the blob list and the creation/destruction of the FreeType faces
+   * that update the lists of the FreeType library. */
+  pthread_mutex_t lock;
+};
+
+/* FreeType face used by one thread at a time to load glyphs. The face
+ * instances of a font share its read only font data. */
+struct face_instance {
+  FT_Face ft_face;
+  struct { /* FreeType sizes of the face, indexed by their request */
+    FT_Size_RequestRec req;
+    FT_Size ft_size;
+  } sizes[FACE_MAX_SIZES];
+  size_t nsizes;
+  size_t next_size; /* Size slot to recycle when all the slots are used */
+  struct face_instance* next; /* Next idle face instance of the font */
+};
+
+enum glyph_render_mode {
+  GLYPH_RENDER_MONO,
+  GLYPH_RENDER_NORMAL,
+  GLYPH_RENDER_MODES_COUNT__
+};
+
+/* Signed distance field of a glyph for a spread. Published once and then
+ * immutable; its pixels follow the structure */
+struct glyph_sdf {
+  struct glyph_sdf* next; /* Field of the glyph for another spread */
+  int spread;
+  FT_Bitmap bitmap; /* 1 byte per pixel */
+};
+
+struct glyph_key {
+  wchar_t character;
+  FT_Fixed x_scale; /* Scale of the face size the glyph was loaded with */
+  FT_Fixed y_scale;
+  FT_Int32 load_flags;
+  int x_phase; /* Subpixel phase of the outline. 0 for bitmap glyphs */
+};
+
+/* Number of glyphs of a slab of the glyph pool */
+#define GLYPH_SLAB_SIZE 64
+
+struct glyph_slab {
+  struct glyph_slab* prev; /* Slabs of the pool with free glyphs */
+  struct glyph_slab* next;
+  struct font_glyph* free_glyphs; /* Linked through their hash_next field */
+  size_t nused;
+};
+
+/* Slab allocator of the glyphs of a font, protected by the font lock. The
+ * slabs with free glyphs are listed; the other ones are only referenced by
+ * their glyphs. */
+struct glyph_pool {
+  struct glyph_slab* slabs;
+  size_t nslabs;
+};
+
+struct glyph_cache {
+  struct font_glyph** buckets; /* Hash table of the cached glyphs */
+  size_t nbuckets; /* Power of 2 */
+  size_t nglyphs;
+  size_t mem_size; /* Estimated size in bytes of the cached glyphs */
+  size_t mem_budget; /* Maximum value of mem_size. 0 disables the cache */
+  struct font_glyph* lru_head; /* Most recently used glyph */
+  struct font_glyph* lru_tail; /* Least recently used glyph */
+  unsigned generation; /* Current generation of the glyphs */
+};
+
+/* Metrics of the glyph of a character, as returned by font_glyph_get_desc */
+struct glyph_metrics {
+  uint32_t key; /* Character + 1. 0 for an empty slot */
+  FT_UInt glyph_index; /* 0 if the font has no glyph for the character */
+  FT_Pos advance; /* 26.6 */
+  int32_t x_min; /* Bounding box in pixels */
+  int32_t y_min;
+  int32_t x_max;
+  int32_t y_max;
+};
+
+/* Open addressing hash table of the glyph metrics of a font size. Protected
+ * by the font lock */
+struct metrics_cache {
+  struct glyph_metrics* slots;
+  size_t nslots; /* Power of 2 */
+  size_t nused;
+  FT_Fixed x_scale; /* Scale of the size the metrics were loaded at */
+  FT_Fixed y_scale;
+};
+
+#define CHARMAP_PAGE_SIZE 256
+#define CHARMAP_PAGES_COUNT 256 /* Pages of the Basic Multilingual Plane */
+
+/* Glyph indices of the characters of the Basic Multilingual Plane. The
+ * Latin-1 page and the coverage are set up on load while the other pages are
+ * built on their first lookup. */
+struct charmap {
+  FT_UInt latin1[CHARMAP_PAGE_SIZE];
+  /* Page table of the other pages. Published atomically under the font lock */
+  FT_UInt* pages[CHARMAP_PAGES_COUNT];
+  /* Bit set of the BMP characters that have a glyph */
+  uint32_t coverage[CHARMAP_PAGES_COUNT * CHARMAP_PAGE_SIZE / 32];
+};
+
+struct font_rsrc {
+  struct atomic_ref ref;
+  struct font_system* sys;
+  struct font_blob* blob; /* Content of ft_face. NULL for in memory fonts */
+  struct font_reader* reader; /* Content of ft_face. NULL if not streamed */
+  const void* data; /* Font data shared by the faces. NULL if streamed */
+  size_t data_size;
+  uint64_t data_hash; /* Atomic. Hash of the data, 0 if not computed yet */
+
+  /* Face of the font used to set up its sizes and to retrieve its metrics.
+   * Glyphs are loaded from the face instances of the `faces' pool. */
+  FT_Face ft_face;
+  FT_Size ft_size; /* Default size of the face, set by font_rsrc_set_size */
+  FT_Size_RequestRec size_req; /* Request of the default size */
+  struct font_size* sizes; /* List of the size handles of the font */
+
+  struct charmap charmap; /* Character to glyph index map of ft_face */
+  struct face_instance* faces; /* Pool of idle face instances */
+  struct glyph_cache cache;
+  struct glyph_pool pool;
+  struct metrics_cache metrics; /* Glyph metrics at the default size */
+  unsigned generation; /* Incremented each time a face is loaded */
+  struct font_stats stats;
+  pthread_mutex_t lock; /* Protect the sizes, the faces and the cache */
+};
+
+/* Maximum number of fonts of a family. Font indices are memoized on 8-bits */
+#define FAMILY_MAX_FONTS 254
+#define FAMILY_NO_FONT 255 /* Memoized resolution of an uncovered character */
+
+struct font_family {
+  struct atomic_ref ref;
+  struct font_system* sys;
+  struct font_rsrc** fonts;
+  unsigned* generations; /* Generation of the fonts the memo relies on */
+  size_t nfonts;
+  /* Memoized font index + 1 of the BMP characters, 0 if not resolved yet.
+   * The pages are allocated on first use and published under the lock */
+  uint8_t* pages[CHARMAP_PAGES_COUNT];
+  pthread_mutex_t lock;
+};
+
+struct font_size {
+  struct atomic_ref ref;
+  struct font_rsrc* font;
+  FT_Size_RequestRec req;
+  FT_Size ft_size; /* NULL if the current face cannot be set to this size */
+  struct metrics_cache metrics;
+  struct font_size* next; /* Next size handle of the font */
+};
+
+struct font_glyph {
+  /* Its last reference is released under the font lock since a glyph cache
+   * hit may concurrently reference an idle glyph. */
+  struct atomic_ref ref;
+  struct font_rsrc* font;
+  wchar_t character;
+  struct { /* Glyph bounding box in pixels */
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+  } bbox;
+  FT_Glyph ft_glyph; /* Glyph as loaded from the face. Never rasterized */
+  /* Bitmap of ft_glyph per render mode, rasterized on first request and
+   * published under the font lock. With bitmap fonts, the bitmaps are
+   * ft_glyph itself. */
+  FT_Glyph ft_bitmaps[GLYPH_RENDER_MODES_COUNT__];
+  /* Signed distance fields of the glyph per spread, computed from its
+   * antialiased bitmap on first request and published under the font lock */
+  struct glyph_sdf* sdfs;
+
+  /* Glyph cache data, protected by the font lock */
+  struct glyph_key key;
+  struct font_glyph* hash_next;
+  struct font_glyph* lru_prev;
+  struct font_glyph* lru_next;
+  size_t mem_size;
+  unsigned generation; /* Generation of the last cache lookup of the glyph */
+  struct glyph_slab* slab; /* Slab of the glyph pool the glyph lies in */
+  bool is_cached; /* Is registered in the glyph cache */
+  bool is_idle; /* Is only referenced by the glyph cache */
+};
+
+static inline void
+trace_begin(struct font_rsrc* font, const enum font_trace_event event)
+{
+  if(font->sys->trace.begin)
+    font->sys->trace.begin(event, font, font->sys->trace.data);
+}
+
+static inline void
+trace_end(struct font_rsrc* font, const enum font_trace_event event)
+{
+  if(font->sys->trace.end)
+    font->sys->trace.end(event, font, font->sys->trace.data);
+}
+
+/*******************************************************************************
+ *
+ * Internal functions shared by the font modules.
+ *
+ ******************************************************************************/
+extern enum font_error
+ft_to_font_error
+  (FT_Error ft_err);
+
+extern int
+sizeof_ft_pixel_mode
+  (FT_Pixel_Mode mode);
+
+/* Rasterize the glyph in the submitted mode and return its bitmap. The
+ * bitmap is memoized by the glyph and is valid until the glyph is released. */
+extern enum font_error
+glyph_rasterize
+  (struct font_glyph* glyph,
+   const bool antialiasing,
+   const FT_Bitmap** bitmap);
+
+/* Return the signed distance field of the glyph for `spread', in
+ * [1, FONT_SDF_MAX_SPREAD]. The field is memoized as the bitmaps of
+ * glyph_rasterize; it is empty if the glyph has no outline. */
+extern enum font_error
+glyph_rasterize_sdf
+  (struct font_glyph* glyph,
+   const int spread,
+   const FT_Bitmap** bitmap);
+
+/* Copy the bitmap into `dst' whose rows are `pitch' bytes long. */
+extern void
+copy_bitmap
+  (const FT_Bitmap* bitmap,
+   unsigned char* dst,
+   const size_t pitch);
+
+/* Write the 1 byte per pixel bitmap into `dst' in the submitted format. The
+ * upper-left pixel of the bitmap is written at the pixel (x, y) of `dst'
+ * whose rows are `stride' bytes long. */
+extern void
+write_bitmap
+  (const FT_Bitmap* bitmap,
+   const enum font_pixel_format format,
+   unsigned char* dst,
+   const size_t stride,
+   const int x,
+   const int y);
+
+/* Blend the color over the surface with respect to the coverage of the 1
+ * byte per pixel bitmap whose upper-left pixel lies at the pixel (x, y) of
+ * the surface. The bitmap is clipped against the clip rectangle. */
+extern void
+blend_bitmap
+  (const FT_Bitmap* bitmap,
+   const unsigned char color[4],
+   const struct font_surface* surface,
+   const int x,
+   const int y);
+
+/* Write into `dst', whose rows are `pitch' bytes long, the signed distance
+ * field of the 1 byte per pixel bitmap. The field is (width + 2*spread) x
+ * (rows + 2*spread) pixels. */
+extern enum font_error
+compute_sdf
+  (struct mem_allocator* allocator,
+   const FT_Bitmap* bitmap,
+   const int spread,
+   unsigned char* dst,
+   const size_t pitch);
+
+/* Compute the 64-bits FNV-1a hash of the font data. It is computed once per
+ * loaded face; a stream that cannot be read is not hashed */
+extern enum font_error
+hash_font_data
+  (struct font_rsrc* font,
+   uint64_t* hash);
+
+/* Pop an idle face instance of the font or create a new one. The instance is
+ * used by the calling thread only until it is released. */
+extern enum font_error
+face_instance_acquire
+  (struct font_rsrc* font,
+   struct face_instance** instance);
+
+extern void
+face_instance_release
+  (struct font_rsrc* font,
+   struct face_instance* instance);
+
+/* Activate the size of the face instance matching the request */
+extern enum font_error
+face_instance_set_size
+  (struct face_instance* instance,
+   const FT_Size_RequestRec* req);
+
+/* Return the metrics of the glyph of `ch' at the font size `ft_size' set up
+ * with `req'. On a cache miss the glyph is loaded into a face instance that
+ * is acquired on first use and returned in `instance' for subsequent calls;
+ * the caller releases it. */
+extern enum font_error
+get_glyph_metrics
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const FT_Size_RequestRec* req,
+   const wchar_t ch,
+   struct face_instance** instance,
+   struct glyph_metrics* metrics);
+
+/* Return false if the metrics of `ch' are not cached yet. Never loads the
+ * glyph */
+extern bool
+find_glyph_desc
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const wchar_t ch,
+   struct font_glyph_desc* desc);
+
+/* Register the metrics of a glyph loaded at the font size `ft_size' without
+ * loading it again */
+extern enum font_error
+cache_glyph_metrics
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const struct font_glyph* glyph);
+
+/* Get the glyph metrics of a batch of characters */
+extern enum font_error
+get_glyph_descs
+  (struct font_rsrc* font,
+   struct metrics_cache* cache,
+   FT_Size ft_size,
+   const FT_Size_RequestRec* req,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs);
+
+/* Get the glyph metrics of a batch of characters, loaded without hinting nor
+ * embedded bitmaps. The metrics are not cached */
+extern enum font_error
+get_unhinted_glyph_descs
+  (struct font_rsrc* font,
+   const FT_Size_RequestRec* req,
+   const wchar_t* chars,
+   const size_t count,
+   struct font_glyph_desc* descs);
+
+/* Get the unhinted advances in pixels of a batch of characters */
+extern enum font_error
+get_glyph_advances
+  (struct font_rsrc* font,
+   const FT_Size_RequestRec* req,
+   const wchar_t* chars,
+   const size_t count,
+   int* advances);
+
+/* Monotonic time in nanoseconds */
+extern uint64_t
+stats_time
+  (void);
+
+/* Allocate a zeroed glyph. Must be invoked with the font lock */
+extern struct font_glyph*
+glyph_pool_alloc
+  (struct mem_allocator* allocator,
+   struct glyph_pool* pool);
+
+/* Must be invoked with the font lock */
+extern void
+glyph_pool_free
+  (struct mem_allocator* allocator,
+   struct glyph_pool* pool,
+   struct font_glyph* glyph);
+
+/* Release the slabs of a pool whose glyphs are all freed */
+extern void
+glyph_pool_release
+  (struct mem_allocator* allocator,
+   struct glyph_pool* pool);
+
+/* Must be invoked with the font lock */
+extern void
+metrics_cache_clear
+  (struct mem_allocator* allocator,
+   struct metrics_cache* cache);
+
+/* Set up the Latin-1 page and the coverage of the charmap of `ft_face' */
+extern void
+charmap_setup
+  (FT_Face ft_face,
+   struct charmap* charmap);
+
+extern void
+charmap_clear
+  (struct mem_allocator* allocator,
+   struct charmap* charmap);
+
+extern bool
+charmap_has_char
+  (struct font_rsrc* font,
+   const wchar_t ch);
+
+/* Return the glyph index of `ch' into the face of the font. 0 if the font has
+ * no glyph for the character */
+extern FT_UInt
+charmap_get_index
+  (struct font_rsrc* font,
+   const wchar_t ch);
+
+/* Forget the memoized resolutions if a font was loaded again since they were
+ * computed. Fonts are not loaded concurrently to the use of the family. */
+extern void
+family_validate
+  (struct font_family* family);
+
+/* Return the font of the family `ch' is resolved to, or NULL if none */
+extern struct font_rsrc*
+family_resolve
+  (struct font_family* family,
+   const wchar_t ch);
+
+/* Map the content of the file `path' in read only memory */
+extern enum font_error
+map_file
+  (const char* path,
+   const unsigned char** data,
+   size_t* size);
+
+extern void
+unmap_file
+  (const unsigned char* data,
+   const size_t size);
+
+extern enum font_error
+reader_create
+  (struct font_system* sys,
+   const struct font_stream* stream,
+   struct font_reader** reader);
+
+extern void
+reader_ref_get
+  (struct font_reader* reader);
+
+extern void
+reader_ref_put
+  (struct font_reader* reader);
+
+/* Set up a FreeType stream over the reader, to be opened with FT_Open_Face.
+ * The stream references the reader until FreeType closes it. */
+extern enum font_error
+reader_open_ft_stream
+  (struct font_reader* reader,
+   FT_Stream* stream);
+
+/* Compute the 64-bits FNV-1a hash of the stream data, i.e. the hash of the
+ * same data in memory. The data are not cached. */
+extern enum font_error
+reader_hash
+  (struct font_reader* reader,
+   uint64_t* hash);
+
+/* Return the blob of the font file `path', mapping the file if no blob of the
+ * system already exposes it. */
+extern enum font_error
+blob_open
+  (struct font_system* sys,
+   const char* path,
+   struct font_blob** blob);
+
+extern void
+blob_ref_get
+  (struct font_blob* blob);
+
+extern void
+blob_ref_put
+  (struct font_blob* blob);
+
+#endif /* FONT_RSRC_C_H */
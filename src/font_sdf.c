@@ -0,0 +1,180 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Offset of a grid cell toward its nearest seed, i.e. its nearest pixel of
+ * the other side of the outline */
+struct sdf_cell {
+  int16_t dx;
+  int16_t dy;
+};
+
+/* Offset of the cells without seed. Its squared length fits in an int */
+#define SDF_FAR 8192
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static inline int
+cell_dist2(const struct sdf_cell cell)
+{
+  return (int)cell.dx * (int)cell.dx + (int)cell.dy * (int)cell.dy;
+}
+
+/* Replace the cell by its neighbour (dx, dy) if its seed is nearer */
+static inline void
+cell_compare
+  (struct sdf_cell* cell,
+   const struct sdf_cell* other,
+   const int dx,
+   const int dy)
+{
+  struct sdf_cell tmp;
+  tmp.dx = (int16_t)(other->dx + dx);
+  tmp.dy = (int16_t)(other->dy + dy);
+  if(cell_dist2(tmp) < cell_dist2(*cell))
+    *cell = tmp;
+}
+
+/* Compare each cell of a row with the 3 cells of the row `prev'. The cells of
+ * the row do not depend on each other so this loop can be vectorized. */
+static void
+sweep_row_vertical
+  (struct sdf_cell* row,
+   const struct sdf_cell* prev,
+   const int width,
+   const int dy)
+{
+  int x = 0;
+  cell_compare(row, prev, 0, dy);
+  if(width > 1)
+    cell_compare(row, prev + 1, 1, dy);
+  for(x = 1; x < width - 1; ++x) {
+    cell_compare(row + x, prev + x - 1, -1, dy);
+    cell_compare(row + x, prev + x, 0, dy);
+    cell_compare(row + x, prev + x + 1, 1, dy);
+  }
+  if(width > 1) {
+    cell_compare(row + width - 1, prev + width - 2, -1, dy);
+    cell_compare(row + width - 1, prev + width - 1, 0, dy);
+  }
+}
+
+static void
+sweep_row_horizontal(struct sdf_cell* row, const int width)
+{
+  int x = 0;
+  for(x = 1; x < width; ++x)
+    cell_compare(row + x, row + x - 1, -1, 0);
+  for(x = width - 2; x >= 0; --x)
+    cell_compare(row + x, row + x + 1, 1, 0);
+}
+
+/* 8-points Sequential Signed Euclidean Distance Transform: propagate the
+ * offsets of the seeds forward then backward over the grid. */
+static void
+ssedt(struct sdf_cell* grid, const int width, const int height)
+{
+  int y = 0;
+  ASSERT(grid && width > 0 && height > 0);
+
+  for(y = 0; y < height; ++y) {
+    struct sdf_cell* row = grid + (size_t)y * (size_t)width;
+    if(y > 0)
+      sweep_row_vertical(row, row - width, width, -1);
+    sweep_row_horizontal(row, width);
+  }
+  for(y = height - 1; y >= 0; --y) {
+    struct sdf_cell* row = grid + (size_t)y * (size_t)width;
+    if(y < height - 1)
+      sweep_row_vertical(row, row + width, width, 1);
+    sweep_row_horizontal(row, width);
+  }
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+enum font_error
+compute_sdf
+  (struct mem_allocator* allocator,
+   const FT_Bitmap* bmp,
+   const int spread,
+   unsigned char* dst,
+   const size_t pitch)
+{
+  const struct sdf_cell seed = { 0, 0 };
+  const struct sdf_cell far = { SDF_FAR, SDF_FAR };
+  const int width = (int)bmp->width + 2 * spread;
+  const int height = (int)bmp->rows + 2 * spread;
+  const size_t ncells = (size_t)width * (size_t)height;
+  struct sdf_cell* inside = NULL; /* Offsets toward the nearest inside pixel */
+  struct sdf_cell* outside = NULL; /* Offsets toward the nearest outside one */
+  unsigned char* coverage = NULL;
+  const float scale = 127.f / (float)spread;
+  size_t i = 0;
+  int x = 0, y = 0;
+  ASSERT(allocator && bmp && spread > 0 && dst);
+  ASSERT(bmp->width && bmp->rows);
+
+  inside = MEM_ALLOC(allocator, 2 * ncells * sizeof(struct sdf_cell));
+  coverage = MEM_ALLOC(allocator, (size_t)bmp->width * bmp->rows);
+  if(!inside || !coverage) {
+    if(inside)
+      MEM_FREE(allocator, inside);
+    if(coverage)
+      MEM_FREE(allocator, coverage);
+    return FONT_MEMORY_ERROR;
+  }
+  outside = inside + ncells;
+
+  /* Seed the grids with the pixels of the bitmap whose coverage is at least
+   * 50%. The border of `spread' pixels lies outside of the glyph. */
+  copy_bitmap(bmp, coverage, bmp->width);
+  for(i = 0; i < ncells; ++i) {
+    inside[i] = far;
+    outside[i] = seed;
+  }
+  for(y = 0; y < (int)bmp->rows; ++y) {
+    const unsigned char* src = coverage + (size_t)y * bmp->width;
+    const size_t row = (size_t)(y + spread) * (size_t)width + (size_t)spread;
+    for(x = 0; x < (int)bmp->width; ++x) {
+      if(src[x] >= 128) {
+        inside[row + (size_t)x] = seed;
+        outside[row + (size_t)x] = far;
+      }
+    }
+  }
+  ssedt(inside, width, height);
+  ssedt(outside, width, height);
+
+  /* Map the signed distance to the outline, i.e. half a pixel away from the
+   * pixel centers, onto [0, 255]. The outline lies at 128. */
+  for(y = 0; y < height; ++y) {
+    unsigned char* dst_row = dst + (size_t)y * pitch;
+    const size_t row = (size_t)y * (size_t)width;
+    for(x = 0; x < width; ++x) {
+      const int in2 = cell_dist2(inside[row + (size_t)x]);
+      const int out2 = cell_dist2(outside[row + (size_t)x]);
+      const float dist = in2 == 0
+        ?  (sqrtf((float)out2) - 0.5f)
+        : -(sqrtf((float)in2) - 0.5f);
+      float val = 128.f + dist * scale;
+      val = val < 0.f ? 0.f : val > 255.f ? 255.f : val;
+      dst_row[x] = (unsigned char)(val + 0.5f);
+    }
+  }
+  MEM_FREE(allocator, coverage);
+  MEM_FREE(allocator, inside);
+  return FONT_NO_ERROR;
+}
@@ -0,0 +1,535 @@
+#define _POSIX_C_SOURCE 200112L /* shm_open, ftruncate, mmap and nanosleep */
+
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Shared memory layout. The header is followed by the slots of the index and
+ * by the data section where the bitmaps are allocated. Sections are aligned
+ * on SHARED_ALIGNMENT bytes and the bitmaps on SHARED_BITMAP_ALIGNMENT. */
+#define SHARED_MAGIC "FONTSHM"
+#define SHARED_VERSION 1
+#define SHARED_ALIGNMENT 64
+#define SHARED_BITMAP_ALIGNMENT 16
+
+/* Time waited for another process to set up the region, in milliseconds */
+#define SHARED_SETUP_TIMEOUT 1000
+
+/* State of the header and of the slots. It only moves forward */
+enum shared_state {
+  SHARED_EMPTY, /* Zero initialized on creation */
+  SHARED_BUSY, /* Written by a process */
+  SHARED_READY /* Published */
+};
+
+struct shared_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t state; /* Atomic */
+  uint64_t nslots; /* Power of 2 */
+  uint64_t slots_offset; /* In bytes from the beginning of the region */
+  uint64_t data_offset; /* In bytes from the beginning of the region */
+  uint64_t data_size;
+  uint64_t data_used; /* Atomic. Bytes allocated in the data section */
+};
+
+struct shared_key {
+  uint64_t font_hash; /* Hash of the font data */
+  int64_t x_scale; /* Scale of the font size */
+  int64_t y_scale;
+  uint32_t character;
+  uint32_t antialiasing;
+};
+
+/* Open addressing slot of the index. Its key and glyph are written once,
+ * before it is published */
+struct shared_slot {
+  uint32_t state; /* Atomic */
+  uint32_t padding;
+  struct shared_key key;
+  int32_t bbox[4]; /* x_min, y_min, x_max, y_max */
+  int32_t advance;
+  int32_t width; /* Of the bitmap */
+  int32_t height;
+  uint64_t offset; /* Of the bitmap in the data section */
+};
+
+struct font_shared_cache {
+  struct atomic_ref ref;
+  struct font_system* sys;
+  unsigned char* region; /* Mapped shared memory */
+  size_t region_size;
+  struct shared_header* header;
+  struct shared_slot* slots;
+  unsigned char* data;
+};
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static size_t
+round_up_pow2(const size_t i)
+{
+  size_t pow2 = 1;
+  while(pow2 < i)
+    pow2 *= 2;
+  return pow2;
+}
+
+static uint64_t
+align_offset(const uint64_t offset, const uint64_t alignment)
+{
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static uint64_t
+hash_shared_key(const struct shared_key* key)
+{
+  /* 64-bits FNV-1a hash of the key fields */
+  const uint64_t fields[4] = {
+    key->font_hash,
+    (uint64_t)key->x_scale,
+    (uint64_t)key->y_scale,
+    ((uint64_t)key->character << 1) | key->antialiasing
+  };
+  const unsigned char* bytes = (const unsigned char*)fields;
+  uint64_t hash = 14695981039346656037u;
+  size_t i = 0;
+
+  for(i = 0; i < sizeof(fields); ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static bool
+shared_key_eq(const struct shared_key* a, const struct shared_key* b)
+{
+  return a->font_hash == b->font_hash
+      && a->x_scale == b->x_scale
+      && a->y_scale == b->y_scale
+      && a->character == b->character
+      && a->antialiasing == b->antialiasing;
+}
+
+static void
+setup_glyph
+  (const struct font_shared_cache* cache,
+   const struct shared_slot* slot,
+   struct font_shared_glyph* glyph)
+{
+  ASSERT(cache && slot && glyph);
+  glyph->desc.bbox.x_min = slot->bbox[0];
+  glyph->desc.bbox.y_min = slot->bbox[1];
+  glyph->desc.bbox.x_max = slot->bbox[2];
+  glyph->desc.bbox.y_max = slot->bbox[3];
+  glyph->desc.width = slot->advance;
+  glyph->desc.character = (wchar_t)slot->key.character;
+  glyph->bitmap.width = slot->width;
+  glyph->bitmap.height = slot->height;
+  glyph->bitmap.pixels = slot->width && slot->height
+    ? cache->data + slot->offset : NULL;
+}
+
+/* Check that the bitmap of a published slot lies in the data section. Slots
+ * are written by other processes that may not share the slot layout */
+static bool
+slot_is_valid
+  (const struct font_shared_cache* cache,
+   const struct shared_slot* slot)
+{
+  const uint64_t data_size = cache->header->data_size;
+  ASSERT(cache && slot);
+  return slot->width >= 0
+      && slot->height >= 0
+      && slot->offset <= data_size
+      && (uint64_t)slot->width * (uint64_t)slot->height
+         <= data_size - slot->offset;
+}
+
+/* Return the published slot of the key, or NULL if none */
+static const struct shared_slot*
+find_slot(const struct font_shared_cache* cache, const struct shared_key* key)
+{
+  const uint64_t mask = cache->header->nslots - 1;
+  const uint64_t hash = hash_shared_key(key);
+  uint64_t i = 0;
+  ASSERT(cache && key);
+
+  for(i = 0; i <= mask; ++i) {
+    const struct shared_slot* slot = cache->slots + ((hash + i) & mask);
+    const uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if(state == SHARED_EMPTY)
+      break;
+    /* Busy and invalid slots are skipped */
+    if(state == SHARED_READY && shared_key_eq(&slot->key, key)
+    && slot_is_valid(cache, slot))
+      return slot;
+  }
+  return NULL;
+}
+
+/* Reserve `size' bytes in the data section. Space is never given back */
+static bool
+alloc_data(struct font_shared_cache* cache, const size_t size, uint64_t* off)
+{
+  struct shared_header* header = NULL;
+  uint64_t used = 0;
+  uint64_t end = 0;
+  ASSERT(cache && off);
+
+  header = cache->header;
+  used = __atomic_load_n(&header->data_used, __ATOMIC_RELAXED);
+  do {
+    *off = align_offset(used, SHARED_BITMAP_ALIGNMENT);
+    end = *off + size;
+    if(end > header->data_size)
+      return false;
+  } while(!__atomic_compare_exchange_n(&header->data_used, &used, end, false,
+    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return true;
+}
+
+/* Publish the glyph whose bitmap was written at `offset'. If the key was
+ * published concurrently, the published slot is returned instead. */
+static enum font_error
+publish_slot
+  (struct font_shared_cache* cache,
+   const struct shared_key* key,
+   const struct font_glyph_desc* desc,
+   const int width,
+   const int height,
+   const uint64_t offset,
+   const struct shared_slot** out_slot)
+{
+  const uint64_t mask = cache->header->nslots - 1;
+  const uint64_t hash = hash_shared_key(key);
+  uint64_t i = 0;
+  ASSERT(cache && key && desc && out_slot);
+
+  for(i = 0; i <= mask; ++i) {
+    struct shared_slot* slot = cache->slots + ((hash + i) & mask);
+    uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+    if(state == SHARED_EMPTY
+    && __atomic_compare_exchange_n(&slot->state, &state, SHARED_BUSY, false,
+       __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      slot->key = *key;
+      slot->bbox[0] = desc->bbox.x_min;
+      slot->bbox[1] = desc->bbox.y_min;
+      slot->bbox[2] = desc->bbox.x_max;
+      slot->bbox[3] = desc->bbox.y_max;
+      slot->advance = desc->width;
+      slot->width = width;
+      slot->height = height;
+      slot->offset = offset;
+      __atomic_store_n(&slot->state, SHARED_READY, __ATOMIC_RELEASE);
+      *out_slot = slot;
+      return FONT_NO_ERROR;
+    }
+    /* On a failed exchange, `state' is the state set by the other process */
+    if(state == SHARED_READY && shared_key_eq(&slot->key, key)
+    && slot_is_valid(cache, slot)) {
+      *out_slot = slot;
+      return FONT_NO_ERROR;
+    }
+  }
+  return FONT_MEMORY_ERROR; /* No more slot */
+}
+
+static void
+wait_a_moment(void)
+{
+  const struct timespec delay = { 0, 1000000 }; /* 1 ms */
+  nanosleep(&delay, NULL);
+}
+
+/* Set up the header of the region created by the calling process */
+static void
+setup_header(struct font_shared_cache* cache, const size_t nslots)
+{
+  struct shared_header* header = NULL;
+  ASSERT(cache && nslots && !(nslots & (nslots - 1)));
+
+  header = cache->header;
+  memcpy(header->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC));
+  header->version = SHARED_VERSION;
+  header->nslots = nslots;
+  header->slots_offset =
+    align_offset(sizeof(struct shared_header), SHARED_ALIGNMENT);
+  header->data_offset = align_offset(header->slots_offset
+    + nslots * sizeof(struct shared_slot), SHARED_ALIGNMENT);
+  header->data_size = cache->region_size - header->data_offset;
+  header->data_used = 0;
+  __atomic_store_n(&header->state, SHARED_READY, __ATOMIC_RELEASE);
+}
+
+/* Wait for the creator of the region to set up its header and check it */
+static enum font_error
+check_header(struct font_shared_cache* cache)
+{
+  const struct shared_header* header = NULL;
+  uint64_t slots_end = 0;
+  int i = 0;
+  ASSERT(cache);
+
+  header = cache->header;
+  while(__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) != SHARED_READY) {
+    if(i++ >= SHARED_SETUP_TIMEOUT)
+      return FONT_INTERNAL_ERROR; /* The creator may have died */
+    wait_a_moment();
+  }
+
+  slots_end = header->slots_offset + header->nslots*sizeof(struct shared_slot);
+  if(memcmp(header->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC))
+  || header->version != SHARED_VERSION
+  || !header->nslots
+  || (header->nslots & (header->nslots - 1))
+  || header->slots_offset % SHARED_ALIGNMENT
+  || header->data_offset % SHARED_ALIGNMENT
+  || header->slots_offset > cache->region_size
+  || header->nslots > (cache->region_size - header->slots_offset)
+       / sizeof(struct shared_slot)
+  || header->data_offset < slots_end
+  || header->data_offset > cache->region_size
+  || header->data_size > cache->region_size - header->data_offset)
+    return FONT_INVALID_ARGUMENT;
+  return FONT_NO_ERROR;
+}
+
+static void
+release_shared_cache(struct font_shared_cache* cache)
+{
+  struct font_system* sys = NULL;
+  ASSERT(cache);
+
+  sys = cache->sys;
+  if(cache->region)
+    munmap(cache->region, cache->region_size);
+  MEM_FREE(sys->allocator, cache);
+  FONT(system_ref_put(sys));
+}
+
+/*******************************************************************************
+ *
+ * Shared glyph cache functions
+ *
+ ******************************************************************************/
+enum font_error
+font_shared_cache_create
+  (struct font_system* sys,
+   const char* name,
+   const size_t nslots,
+   const size_t data_size,
+   struct font_shared_cache** out_cache)
+{
+  struct font_shared_cache* cache = NULL;
+  struct stat st;
+  void* region = MAP_FAILED;
+  uint64_t size = 0;
+  size_t pow2_nslots = 0;
+  int fd = -1;
+  int i = 0;
+  bool is_creator = false;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!sys || !name || !nslots || !data_size || !out_cache
+  || nslots > (SIZE_MAX / 4) / sizeof(struct shared_slot)
+  || data_size > SIZE_MAX / 4) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  cache = MEM_CALLOC(sys->allocator, 1, sizeof(struct font_shared_cache));
+  if(!cache) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  cache->sys = sys;
+  FONT(system_ref_get(sys));
+  atomic_ref_init(&cache->ref);
+
+  pow2_nslots = round_up_pow2(nslots);
+  size = align_offset(sizeof(struct shared_header), SHARED_ALIGNMENT);
+  size = align_offset
+    (size + pow2_nslots * sizeof(struct shared_slot), SHARED_ALIGNMENT);
+  size += data_size;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd >= 0) {
+    is_creator = true;
+    if(ftruncate(fd, (off_t)size) != 0) {
+      font_err = FONT_MEMORY_ERROR;
+      goto error;
+    }
+  } else if(errno == EEXIST) {
+    fd = shm_open(name, O_RDWR, 0);
+  }
+  if(fd < 0) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  /* Wait for the creator to size the object */
+  for(i = 0; ; ++i) {
+    if(fstat(fd, &st) != 0) {
+      font_err = FONT_INTERNAL_ERROR;
+      goto error;
+    }
+    if(st.st_size != 0)
+      break;
+    if(i >= SHARED_SETUP_TIMEOUT) {
+      font_err = FONT_INTERNAL_ERROR;
+      goto error;
+    }
+    wait_a_moment();
+  }
+  if((uint64_t)st.st_size < sizeof(struct shared_header)) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  region = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+    fd, 0);
+  if(region == MAP_FAILED) {
+    font_err = FONT_MEMORY_ERROR;
+    goto error;
+  }
+  cache->region = region;
+  cache->region_size = (size_t)st.st_size;
+  cache->header = region;
+
+  if(is_creator)
+    setup_header(cache, pow2_nslots);
+  font_err = check_header(cache);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  cache->slots =
+    (struct shared_slot*)(cache->region + cache->header->slots_offset);
+  cache->data = cache->region + cache->header->data_offset;
+
+exit:
+  /* The mapping remains valid once the object is closed */
+  if(fd >= 0)
+    close(fd);
+  if(out_cache)
+    *out_cache = cache;
+  return font_err;
+error:
+  /* Do not let the other processes wait for an object that is not set up */
+  if(is_creator)
+    shm_unlink(name);
+  if(cache) {
+    FONT(shared_cache_ref_put(cache));
+    cache = NULL;
+  }
+  goto exit;
+}
+
+enum font_error
+font_shared_cache_ref_get(struct font_shared_cache* cache)
+{
+  if(!cache)
+    return FONT_INVALID_ARGUMENT;
+  atomic_ref_get(&cache->ref);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_shared_cache_ref_put(struct font_shared_cache* cache)
+{
+  if(!cache)
+    return FONT_INVALID_ARGUMENT;
+  if(atomic_ref_put(&cache->ref))
+    release_shared_cache(cache);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_shared_cache_unlink(const char* name)
+{
+  if(!name || shm_unlink(name) != 0)
+    return FONT_INVALID_ARGUMENT;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_shared_cache_get_glyph
+  (struct font_shared_cache* cache,
+   struct font_rsrc* font,
+   const wchar_t ch,
+   const bool antialiasing,
+   struct font_shared_glyph* out_glyph)
+{
+  struct shared_key key;
+  struct font_glyph_desc desc;
+  const struct shared_slot* slot = NULL;
+  struct font_glyph* glyph = NULL;
+  const FT_Bitmap* bmp = NULL;
+  uint64_t offset = 0;
+  size_t size = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+
+  if(!cache || !font || !out_glyph || font->sys != cache->sys
+  || !font->ft_face) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  memset(&key, 0, sizeof(key));
+  font_err = hash_font_data(font, &key.font_hash);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  key.x_scale = font->ft_size->metrics.x_scale;
+  key.y_scale = font->ft_size->metrics.y_scale;
+  key.character = (uint32_t)ch;
+  key.antialiasing = antialiasing;
+
+  slot = find_slot(cache, &key);
+  if(slot)
+    goto exit;
+
+  font_err = font_rsrc_get_glyph(font, ch, &glyph);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  font_err = glyph_rasterize(glyph, antialiasing, &bmp);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+  /* Bitmaps are shared with one byte per pixel */
+  if(sizeof_ft_pixel_mode(bmp->pixel_mode) != 1) {
+    font_err = FONT_INVALID_ARGUMENT;
+    goto error;
+  }
+  size = (size_t)bmp->width * (size_t)bmp->rows;
+  if(size) {
+    if(!alloc_data(cache, size, &offset)) {
+      font_err = FONT_MEMORY_ERROR;
+      goto error;
+    }
+    copy_bitmap(bmp, cache->data + offset, bmp->width);
+  }
+  FONT(glyph_get_desc(glyph, &desc));
+  font_err = publish_slot(cache, &key, &desc, (int)bmp->width,
+    (int)bmp->rows, offset, &slot);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+exit:
+  if(slot)
+    setup_glyph(cache, slot, out_glyph);
+  if(glyph)
+    FONT(glyph_ref_put(glyph));
+  return font_err;
+error:
+  slot = NULL;
+  goto exit;
+}
@@ -0,0 +1,90 @@
+#define _POSIX_C_SOURCE 200112L /* clock_gettime support */
+
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/snlsys.h>
+
+#include <string.h>
+#include <time.h>
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static void
+load_stats(const struct font_stats* src, struct font_stats* dst)
+{
+  ASSERT(src && dst);
+  #define LOAD(Counter) \
+    dst->Counter = __atomic_load_n(&src->Counter, __ATOMIC_RELAXED)
+  LOAD(glyphs_created);
+  LOAD(glyphs_released);
+  LOAD(cache_hits);
+  LOAD(cache_misses);
+  LOAD(cache_evictions);
+  LOAD(bitmaps_size);
+  LOAD(ft_allocated_size);
+  LOAD(ft_allocations_count);
+  LOAD(load_time);
+  LOAD(rasterize_time);
+  LOAD(copy_time);
+  #undef LOAD
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+uint64_t
+stats_time(void)
+{
+  struct timespec t;
+  const int err = clock_gettime(CLOCK_MONOTONIC, &t);
+  ASSERT(!err);
+  (void)err;
+  return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+/*******************************************************************************
+ *
+ * Statistics functions
+ *
+ ******************************************************************************/
+enum font_error
+font_system_get_stats
+  (const struct font_system* sys,
+   struct font_stats* stats)
+{
+  if(!sys || !stats)
+    return FONT_INVALID_ARGUMENT;
+  load_stats(&sys->stats, stats);
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_system_set_trace_hooks
+  (struct font_system* sys,
+   const struct font_trace_hooks* hooks)
+{
+  if(!sys)
+    return FONT_INVALID_ARGUMENT;
+  if(hooks)
+    sys->trace = *hooks;
+  else
+    memset(&sys->trace, 0, sizeof(struct font_trace_hooks));
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+font_rsrc_get_stats
+  (const struct font_rsrc* font,
+   struct font_stats* stats)
+{
+  if(!font || !stats)
+    return FONT_INVALID_ARGUMENT;
+  load_stats(&font->stats, stats);
+  return FONT_NO_ERROR;
+}
@@ -0,0 +1,242 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+
+#include <string.h>
+
+/* Size of the pages the stream is read by. The tables of a font are mostly
+ * accessed by small ranges, e.g. the outline of one glyph. */
+#define READER_PAGE_SIZE 16384
+
+/* Size of the chunks the stream is hashed by */
+#define READER_HASH_CHUNK_SIZE 65536
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+static size_t
+page_size(const struct font_reader* reader, const size_t ipage)
+{
+  const size_t offset = ipage * READER_PAGE_SIZE;
+  ASSERT(reader && ipage < reader->npages);
+  return reader->stream.size - offset < READER_PAGE_SIZE
+    ? reader->stream.size - offset : READER_PAGE_SIZE;
+}
+
+/* Return the page `ipage', reading it on its first access, or NULL on error */
+static const unsigned char*
+get_page(struct font_reader* reader, const size_t ipage)
+{
+  unsigned char* page = NULL;
+  ASSERT(reader && ipage < reader->npages);
+
+  page = __atomic_load_n(&reader->pages[ipage], __ATOMIC_ACQUIRE);
+  if(page)
+    return page;
+
+  MUTEX(lock(&reader->lock));
+  page = reader->pages[ipage]; /* The page may have been read concurrently */
+  if(!page) {
+    const size_t size = page_size(reader, ipage);
+    page = MEM_ALLOC(reader->sys->allocator, size);
+    if(page) {
+      const size_t n = reader->stream.read
+        (reader->stream.data, ipage * READER_PAGE_SIZE, page, size);
+      if(n != size) {
+        MEM_FREE(reader->sys->allocator, page);
+        page = NULL;
+      } else {
+        __atomic_store_n(&reader->pages[ipage], page, __ATOMIC_RELEASE);
+      }
+    }
+  }
+  MUTEX(unlock(&reader->lock));
+  return page;
+}
+
+/* Copy `size' bytes from `offset' and return the number of copied bytes */
+static size_t
+reader_read
+  (struct font_reader* reader,
+   const size_t offset,
+   unsigned char* buffer,
+   const size_t size)
+{
+  size_t n = 0;
+  ASSERT(reader && buffer);
+
+  if(offset >= reader->stream.size)
+    return 0;
+  while(n < size && offset + n < reader->stream.size) {
+    const size_t pos = offset + n;
+    const size_t ipage = pos / READER_PAGE_SIZE;
+    const size_t begin = pos - ipage * READER_PAGE_SIZE;
+    const unsigned char* page = get_page(reader, ipage);
+    size_t len = 0;
+
+    if(!page)
+      break;
+    len = page_size(reader, ipage) - begin;
+    len = len < size - n ? len : size - n;
+    memcpy(buffer + n, page + begin, len);
+    n += len;
+  }
+  return n;
+}
+
+/* FreeType stream callbacks. A null count is a seek that returns 0 on
+ * success */
+static unsigned long
+ft_stream_read
+  (FT_Stream ft_stream,
+   unsigned long offset,
+   unsigned char* buffer,
+   unsigned long count)
+{
+  struct font_reader* reader = ft_stream->descriptor.pointer;
+  ASSERT(reader);
+
+  if(!count)
+    return offset > reader->stream.size ? 1 : 0;
+  return (unsigned long)reader_read(reader, offset, buffer, count);
+}
+
+static void
+ft_stream_close(FT_Stream ft_stream)
+{
+  struct font_reader* reader = ft_stream->descriptor.pointer;
+  ASSERT(reader);
+
+  /* External streams are not freed by FreeType */
+  MEM_FREE(reader->sys->allocator, ft_stream);
+  reader_ref_put(reader);
+}
+
+static void
+release_reader(struct font_reader* reader)
+{
+  struct font_system* sys = NULL;
+  size_t i = 0;
+  ASSERT(reader);
+
+  sys = reader->sys;
+  if(reader->stream.release)
+    reader->stream.release(reader->stream.data);
+  for(i = 0; i < reader->npages; ++i) {
+    if(reader->pages[i])
+      MEM_FREE(sys->allocator, reader->pages[i]);
+  }
+  if(reader->pages)
+    MEM_FREE(sys->allocator, reader->pages);
+  MUTEX(destroy(&reader->lock));
+  MEM_FREE(sys->allocator, reader);
+  FONT(system_ref_put(sys));
+}
+
+/*******************************************************************************
+ *
+ * Internal functions
+ *
+ ******************************************************************************/
+enum font_error
+reader_create
+  (struct font_system* sys,
+   const struct font_stream* stream,
+   struct font_reader** out_reader)
+{
+  struct font_reader* reader = NULL;
+  ASSERT(sys && stream && stream->read && stream->size && out_reader);
+
+  reader = MEM_CALLOC(sys->allocator, 1, sizeof(struct font_reader));
+  if(!reader)
+    return FONT_MEMORY_ERROR;
+  if(pthread_mutex_init(&reader->lock, NULL) != 0) {
+    MEM_FREE(sys->allocator, reader);
+    return FONT_INTERNAL_ERROR;
+  }
+  reader->sys = sys;
+  FONT(system_ref_get(sys));
+  atomic_ref_init(&reader->ref);
+  reader->stream = *stream;
+
+  reader->npages = (stream->size - 1) / READER_PAGE_SIZE + 1;
+  reader->pages = MEM_CALLOC
+    (sys->allocator, reader->npages, sizeof(unsigned char*));
+  if(!reader->pages) {
+    reader->stream.release = NULL; /* The stream is not owned on failure */
+    reader_ref_put(reader);
+    return FONT_MEMORY_ERROR;
+  }
+  *out_reader = reader;
+  return FONT_NO_ERROR;
+}
+
+void
+reader_ref_get(struct font_reader* reader)
+{
+  ASSERT(reader);
+  atomic_ref_get(&reader->ref);
+}
+
+void
+reader_ref_put(struct font_reader* reader)
+{
+  ASSERT(reader);
+  if(atomic_ref_put(&reader->ref))
+    release_reader(reader);
+}
+
+enum font_error
+reader_open_ft_stream(struct font_reader* reader, FT_Stream* out_stream)
+{
+  FT_Stream ft_stream = NULL;
+  ASSERT(reader && out_stream);
+
+  ft_stream = MEM_CALLOC(reader->sys->allocator, 1, sizeof(FT_StreamRec));
+  if(!ft_stream)
+    return FONT_MEMORY_ERROR;
+  ft_stream->size = (unsigned long)reader->stream.size;
+  ft_stream->descriptor.pointer = reader;
+  ft_stream->read = ft_stream_read;
+  ft_stream->close = ft_stream_close;
+  reader_ref_get(reader);
+  *out_stream = ft_stream;
+  return FONT_NO_ERROR;
+}
+
+enum font_error
+reader_hash(struct font_reader* reader, uint64_t* out_hash)
+{
+  unsigned char* chunk = NULL;
+  uint64_t hash = 14695981039346656037u;
+  size_t offset = 0;
+  ASSERT(reader && out_hash);
+
+  chunk = MEM_ALLOC(reader->sys->allocator, READER_HASH_CHUNK_SIZE);
+  if(!chunk)
+    return FONT_MEMORY_ERROR;
+  /* Bypass the pages in order to not cache the whole stream */
+  MUTEX(lock(&reader->lock));
+  while(offset < reader->stream.size) {
+    const size_t size = reader->stream.size - offset < READER_HASH_CHUNK_SIZE
+      ? reader->stream.size - offset : READER_HASH_CHUNK_SIZE;
+    size_t i = 0;
+    if(reader->stream.read(reader->stream.data, offset, chunk, size) != size)
+      break;
+    for(i = 0; i < size; ++i) {
+      hash ^= chunk[i];
+      hash *= 1099511628211u;
+    }
+    offset += size;
+  }
+  MUTEX(unlock(&reader->lock));
+  MEM_FREE(reader->sys->allocator, chunk);
+  if(offset != reader->stream.size)
+    return FONT_INTERNAL_ERROR;
+  *out_hash = hash;
+  return FONT_NO_ERROR;
+}
@@ -0,0 +1,212 @@
+#include "font_rsrc.h"
+#include "font_rsrc_c.h"
+
+#include <snlsys/snlsys.h>
+
+#include <limits.h>
+#include <string.h>
+
+/*******************************************************************************
+ *
+ * Helper functions.
+ *
+ ******************************************************************************/
+/* Convert a 26.6 fixed point value to pixels, rounded toward -infinity */
+static int
+floor_26_6(const FT_Pos val)
+{
+  return (int)(val >> 6);
+}
+
+static int
+ceil_26_6(const FT_Pos val)
+{
+  return (int)((val + 63) >> 6);
+}
+
+/* Lay out the text with the cached glyph metrics of the fonts at their
+ * current size. Characters are resolved against the family, if any, and
+ * otherwise against `font'. A face instance is only acquired to load the
+ * uncached metrics and the kerning. */
+static enum font_error
+layout_text
+  (struct font_rsrc* font, /* First font of the family */
+   struct font_family* family, /* May be NULL */
+   const wchar_t* text,
+   const size_t count,
+   struct font_glyph_position* positions, /* May be NULL */
+   struct font_text_metrics* metrics)
+{
+  struct face_instance* instance = NULL;
+  struct font_rsrc* instance_font = NULL; /* Font of the face instance */
+  struct font_rsrc* prev_font = NULL;
+  FT_UInt prev_index = 0;
+  FT_Pos pen_x = 0; /* 26.6 */
+  FT_Pos max_x = 0; /* 26.6 */
+  FT_Pos x_min = LONG_MAX, y_min = LONG_MAX; /* 26.6 */
+  FT_Pos x_max = LONG_MIN, y_max = LONG_MIN; /* 26.6 */
+  int line_space = 0;
+  int line = 0;
+  size_t i = 0;
+  enum font_error font_err = FONT_NO_ERROR;
+  ASSERT(font && (text || !count) && metrics);
+
+  font_err = font_rsrc_get_line_space(font, &line_space);
+  if(font_err != FONT_NO_ERROR)
+    goto error;
+
+  for(i = 0; i < count; ++i) {
+    const FT_Pos pen_y = -(FT_Pos)line * line_space * 64;
+    struct glyph_metrics glyph;
+    struct font_rsrc* glyph_font = NULL;
+
+    if(text[i] == L'\n') {
+      if(positions) {
+        positions[i].character = text[i];
+        positions[i].x = floor_26_6(pen_x);
+        positions[i].y = floor_26_6(pen_y);
+        positions[i].x_frac = (int)(pen_x & 63);
+      }
+      max_x = pen_x > max_x ? pen_x : max_x;
+      pen_x = 0;
+      prev_index = 0;
+      ++line;
+      continue;
+    }
+
+    glyph_font = family ? family_resolve(family, text[i]) : font;
+    if(!glyph_font)
+      glyph_font = font;
+    if(instance && instance_font != glyph_font) {
+      face_instance_release(instance_font, instance);
+      instance = NULL;
+    }
+    instance_font = glyph_font;
+    font_err = get_glyph_metrics(glyph_font, &glyph_font->metrics,
+      glyph_font->ft_size, &glyph_font->size_req, text[i], &instance, &glyph);
+    if(font_err != FONT_NO_ERROR)
+      goto error;
+
+    if(glyph.glyph_index && prev_index && prev_font == glyph_font
+    && FT_HAS_KERNING(glyph_font->ft_face)) {
+      FT_Vector delta;
+      if(!instance) {
+        font_err = face_instance_acquire(glyph_font, &instance);
+        if(font_err != FONT_NO_ERROR)
+          goto error;
+        font_err = face_instance_set_size(instance, &glyph_font->size_req);
+        if(font_err != FONT_NO_ERROR)
+          goto error;
+      }
+      if(FT_Get_Kerning(instance->ft_face, prev_index, glyph.glyph_index,
+         FT_KERNING_DEFAULT, &delta) == 0)
+        pen_x += delta.x;
+    }
+    if(positions) {
+      positions[i].character = text[i];
+      positions[i].x = floor_26_6(pen_x);
+      positions[i].y = floor_26_6(pen_y);
+      positions[i].x_frac = (int)(pen_x & 63);
+    }
+    if(!glyph.glyph_index) {
+      prev_index = 0;
+      continue;
+    }
+
+    if(glyph.x_min < glyph.x_max && glyph.y_min < glyph.y_max) {
+      const FT_Pos gx_min = pen_x + (FT_Pos)glyph.x_min * 64;
+      const FT_Pos gx_max = pen_x + (FT_Pos)glyph.x_max * 64;
+      const FT_Pos gy_min = pen_y + (FT_Pos)glyph.y_min * 64;
+      const FT_Pos gy_max = pen_y + (FT_Pos)glyph.y_max * 64;
+      x_min = gx_min < x_min ? gx_min : x_min;
+      x_max = gx_max > x_max ? gx_max : x_max;
+      y_min = gy_min < y_min ? gy_min : y_min;
+      y_max = gy_max > y_max ? gy_max : y_max;
+    }
+    pen_x += glyph.advance;
+    prev_index = glyph.glyph_index;
+    prev_font = glyph_font;
+  }
+  max_x = pen_x > max_x ? pen_x : max_x;
+
+  memset(metrics, 0, sizeof(struct font_text_metrics));
+  metrics->width = floor_26_6(max_x);
+  metrics->lines_count = count ? line + 1 : 0;
+  metrics->height = metrics->lines_count * line_space;
+  if(x_min <= x_max) {
+    metrics->bbox.x_min = floor_26_6(x_min);
+    metrics->bbox.y_min = floor_26_6(y_min);
+    metrics->bbox.x_max = ceil_26_6(x_max);
+    metrics->bbox.y_max = ceil_26_6(y_max);
+  }
+
+exit:
+  if(instance)
+    face_instance_release(instance_font, instance);
+  return font_err;
+error:
+  goto exit;
+}
+
+/*******************************************************************************
+ *
+ * Text layout functions
+ *
+ ******************************************************************************/
+enum font_error
+font_rsrc_measure_text
+  (struct font_rsrc* font,
+   const wchar_t* text,
+   const size_t count,
+   struct font_text_metrics* metrics)
+{
+  if(!font || (count && !text) || !metrics || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  return layout_text(font, NULL, text, count, NULL, metrics);
+}
+
+enum font_error
+font_rsrc_layout_text
+  (struct font_rsrc* font,
+   const wchar_t* text,
+   const size_t count,
+   struct font_glyph_position* positions,
+   struct font_text_metrics* metrics)
+{
+  struct font_text_metrics tmp;
+
+  if(!font || (count && (!text || !positions)) || !font->ft_face)
+    return FONT_INVALID_ARGUMENT;
+  return layout_text
+    (font, NULL, text, count, positions, metrics ? metrics : &tmp);
+}
+
+enum font_error
+font_family_measure_text
+  (struct font_family* family,
+   const wchar_t* text,
+   const size_t count,
+   struct font_text_metrics* metrics)
+{
+  if(!family || (count && !text) || !metrics)
+    return FONT_INVALID_ARGUMENT;
+  family_validate(family);
+  return layout_text(family->fonts[0], family, text, count, NULL, metrics);
+}
+
+enum font_error
+font_family_layout_text
+  (struct font_family* family,
+   const wchar_t* text,
+   const size_t count,
+   struct font_glyph_position* positions,
+   struct font_text_metrics* metrics)
+{
+  struct font_text_metrics tmp;
+
+  if(!family || (count && (!text || !positions)))
+    return FONT_INVALID_ARGUMENT;
+  family_validate(family);
+  return layout_text(family->fonts[0], family, text, count, positions,
+    metrics ? metrics : &tmp);
+}
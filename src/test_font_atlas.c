@@ -0,0 +1,423 @@
+#include "font_rsrc.h"
+#include <snlsys/image.h>
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OK FONT_NO_ERROR
+#define BAD_ARG FONT_INVALID_ARGUMENT
+
+#define NTHREADS 4
+
+struct thread_data {
+  struct font_atlas* atlas;
+  struct font_rsrc* font;
+  size_t first; /* Index of the first requested glyph */
+  struct font_atlas_glyph glyphs[95];
+  size_t nerrors;
+};
+
+static bool
+rect_overlap(const struct font_atlas_glyph* a, const struct font_atlas_glyph* b)
+{
+  if(a->page != b->page)
+    return false;
+  if(!a->rect.width || !a->rect.height || !b->rect.width || !b->rect.height)
+    return false;
+  return a->rect.x < b->rect.x + b->rect.width
+      && b->rect.x < a->rect.x + a->rect.width
+      && a->rect.y < b->rect.y + b->rect.height
+      && b->rect.y < a->rect.y + a->rect.height;
+}
+
+/* Request the glyphs of the printable ASCII characters from `first' */
+static void*
+get_glyphs_concurrently(void* arg)
+{
+  struct thread_data* data = arg;
+  size_t i = 0;
+
+  for(i = 0; i < 95; ++i) {
+    const size_t k = (data->first + i) % 95;
+    if(font_atlas_get_glyph(data->atlas, data->font, (wchar_t)(k + 32), true,
+       data->glyphs + k) != OK)
+      ++data->nerrors;
+  }
+  return NULL;
+}
+
+struct dirty {
+  struct font_atlas* atlas;
+  struct font_atlas_dirty_rect rects[64];
+  size_t count;
+  size_t nerrors;
+};
+
+static void
+add_dirty_rect(const struct font_atlas_dirty_rect* rect, void* data)
+{
+  struct dirty* dirty = data;
+
+  if(dirty->count >= sizeof(dirty->rects) / sizeof(dirty->rects[0])) {
+    ++dirty->nerrors;
+    return;
+  }
+  dirty->rects[dirty->count++] = *rect;
+}
+
+/* Check that the dirty rectangles are disjoint, point into their page and
+ * cover the glyph rectangles of `glyphs' */
+static void
+check_dirty_rects
+  (const struct dirty* dirty,
+   const struct font_atlas_glyph* glyphs,
+   const size_t nglyphs)
+{
+  size_t i = 0, k = 0;
+
+  for(i = 0; i < dirty->count; ++i) {
+    const struct font_atlas_dirty_rect* a = dirty->rects + i;
+    const unsigned char* pixels = NULL;
+    int w = 0, h = 0;
+    CHECK(font_atlas_get_page(dirty->atlas, a->page, &w, &h, &pixels), OK);
+    CHECK(a->pitch, (size_t)w);
+    CHECK(a->rect.x >= 0 && a->rect.width > 0, true);
+    CHECK(a->rect.y >= 0 && a->rect.height > 0, true);
+    CHECK(a->rect.x + a->rect.width <= w, true);
+    CHECK(a->rect.y + a->rect.height <= h, true);
+    CHECK(a->pixels, pixels + (size_t)a->rect.y * a->pitch
+      + (size_t)a->rect.x);
+    for(k = i + 1; k < dirty->count; ++k) {
+      const struct font_atlas_dirty_rect* b = dirty->rects + k;
+      CHECK(a->page == b->page
+         && a->rect.x < b->rect.x + b->rect.width
+         && b->rect.x < a->rect.x + a->rect.width
+         && a->rect.y < b->rect.y + b->rect.height
+         && b->rect.y < a->rect.y + a->rect.height, false);
+    }
+  }
+  for(i = 0; i < nglyphs; ++i) {
+    const struct font_atlas_glyph* glyph = glyphs + i;
+    if(!glyph->rect.width || !glyph->rect.height)
+      continue;
+    for(k = 0; k < dirty->count; ++k) {
+      const struct font_atlas_dirty_rect* rect = dirty->rects + k;
+      if(rect->page == (size_t)glyph->page
+      && rect->rect.x <= glyph->rect.x
+      && rect->rect.y <= glyph->rect.y
+      && rect->rect.x + rect->rect.width >= glyph->rect.x + glyph->rect.width
+      && rect->rect.y + rect->rect.height >= glyph->rect.y+glyph->rect.height)
+        break;
+    }
+    CHECK(k < dirty->count, true);
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  char buf[BUFSIZ];
+  char path[BUFSIZ];
+  unsigned char sdf[64*64];
+  struct font_atlas_glyph glyphs[95];
+  struct font_atlas_glyph atlas_glyph;
+  struct thread_data data[NTHREADS];
+  pthread_t threads[NTHREADS];
+  struct dirty dirty;
+  struct font_char_range range;
+  struct font_system* sys = NULL;
+  struct font_rsrc* font = NULL;
+  struct font_atlas* atlas = NULL;
+  struct font_atlas* atlas2 = NULL;
+  const unsigned char* pixels = NULL;
+  const char* name = NULL;
+  size_t count = 0;
+  size_t i = 0;
+  int w = 0;
+  int h = 0;
+  int j = 0;
+  bool b = false;
+
+  if(argc != 2) {
+    printf("usage: %s FONT\n", argv[0]);
+    goto error;
+  }
+
+  CHECK(font_system_create(NULL, &sys), OK);
+  CHECK(font_rsrc_create(sys, argv[1], &font), OK);
+
+  CHECK(font_atlas_create(NULL, 0, 0, NULL), BAD_ARG);
+  CHECK(font_atlas_create(sys, 0, 0, NULL), BAD_ARG);
+  CHECK(font_atlas_create(NULL, 64, 64, NULL), BAD_ARG);
+  CHECK(font_atlas_create(sys, 64, 64, NULL), BAD_ARG);
+  CHECK(font_atlas_create(NULL, 64, 64, &atlas), BAD_ARG);
+  CHECK(font_atlas_create(sys, 0, 64, &atlas), BAD_ARG);
+  CHECK(font_atlas_create(sys, 64, 0, &atlas), BAD_ARG);
+  CHECK(font_atlas_create(sys, 64, 64, &atlas), OK);
+
+  CHECK(font_atlas_get_pages_count(NULL, NULL), BAD_ARG);
+  CHECK(font_atlas_get_pages_count(atlas, NULL), BAD_ARG);
+  CHECK(font_atlas_get_pages_count(NULL, &count), BAD_ARG);
+  CHECK(font_atlas_get_pages_count(atlas, &count), OK);
+  CHECK(count, 0);
+  CHECK(font_atlas_get_page(atlas, 0, &w, &h, &pixels), BAD_ARG);
+
+  CHECK(font_atlas_get_glyph(NULL, NULL, L'a', true, NULL), BAD_ARG);
+  CHECK(font_atlas_get_glyph(atlas, NULL, L'a', true, NULL), BAD_ARG);
+  CHECK(font_atlas_get_glyph(NULL, font, L'a', true, NULL), BAD_ARG);
+  CHECK(font_atlas_get_glyph(atlas, font, L'a', true, NULL), BAD_ARG);
+  CHECK(font_atlas_get_glyph(NULL, NULL, L'a', true, &atlas_glyph), BAD_ARG);
+  CHECK(font_atlas_get_glyph(atlas, NULL, L'a', true, &atlas_glyph), BAD_ARG);
+  CHECK(font_atlas_get_glyph(NULL, font, L'a', true, &atlas_glyph), BAD_ARG);
+  CHECK(font_atlas_get_glyph(atlas, font, L'a', true, &atlas_glyph), OK);
+  CHECK(atlas_glyph.desc.character, L'a');
+  CHECK(atlas_glyph.page, 0);
+  NCHECK(atlas_glyph.rect.width, 0);
+  NCHECK(atlas_glyph.rect.height, 0);
+  CHECK(atlas_glyph.uv.u_min < atlas_glyph.uv.u_max, true);
+  CHECK(atlas_glyph.uv.v_min < atlas_glyph.uv.v_max, true);
+
+  for(j = 32; j < 127; ++j) {
+    CHECK(font_atlas_get_glyph
+      (atlas, font, (wchar_t)j, true, glyphs + (j - 32)), OK);
+    CHECK(glyphs[j - 32].desc.character, (wchar_t)j);
+  }
+  /* Glyphs already packed are not packed twice */
+  CHECK(font_atlas_get_glyph(atlas, font, L'a', true, &atlas_glyph), OK);
+  CHECK(memcmp(&atlas_glyph, glyphs + (L'a' - 32), sizeof(atlas_glyph)), 0);
+
+  for(i = 0; i < 95; ++i) {
+    size_t k = 0;
+    for(k = i + 1; k < 95; ++k)
+      CHECK(rect_overlap(glyphs + i, glyphs + k), false);
+  }
+
+  /* Dirty rectangles */
+  memset(&dirty, 0, sizeof(dirty));
+  dirty.atlas = atlas;
+  CHECK(font_atlas_flush(NULL, add_dirty_rect, &dirty, &count), BAD_ARG);
+  CHECK(font_atlas_flush(atlas, add_dirty_rect, &dirty, &count), OK);
+  CHECK(count, dirty.count);
+  NCHECK(count, 0);
+  CHECK(dirty.nerrors, 0);
+  check_dirty_rects(&dirty, glyphs, 95);
+  CHECK(font_atlas_get_pages_count(atlas, &i), OK);
+  CHECK(count <= 8 * i, true); /* Merged when a page has too many rects */
+  CHECK(font_atlas_flush(atlas, add_dirty_rect, &dirty, &count), OK);
+  CHECK(count, 0);
+  CHECK(font_atlas_get_glyph(atlas, font, L'a', true, &atlas_glyph), OK);
+  CHECK(font_atlas_flush(atlas, NULL, NULL, &count), OK);
+  CHECK(count, 0); /* Already packed */
+
+  /* Pre-rendering packed glyphs does not pack them again */
+  range.first = 32;
+  range.last = 126;
+  CHECK(font_atlas_get_pages_count(atlas, &count), OK);
+  CHECK(font_rsrc_prerender(font, &range, 1, 0, 2, atlas, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_prerender
+    (font, &range, 1, FONT_PRERENDER_ANTIALIASED, 2, atlas, NULL, NULL), OK);
+  CHECK(font_atlas_get_pages_count(atlas, &i), OK);
+  CHECK(i, count);
+  CHECK(font_atlas_get_glyph(atlas, font, L'a', true, &atlas_glyph), OK);
+  CHECK(memcmp(&atlas_glyph, glyphs + (L'a' - 32), sizeof(atlas_glyph)), 0);
+
+  CHECK(font_atlas_get_pages_count(atlas, &count), OK);
+  NCHECK(count, 0);
+  for(i = 0; i < count; ++i) {
+    CHECK(font_atlas_get_page(NULL, i, &w, &h, &pixels), BAD_ARG);
+    CHECK(font_atlas_get_page(atlas, i, NULL, NULL, NULL), OK);
+    CHECK(font_atlas_get_page(atlas, i, &w, &h, &pixels), OK);
+    CHECK(w, 64);
+    CHECK(h, 64);
+    NCHECK(pixels, NULL);
+    NCHECK(snprintf(buf, BUFSIZ, "/tmp/atlas%.3d.ppm", (int)i), BUFSIZ);
+    CHECK(image_ppm_write(buf, w, h, 1, pixels), 0);
+  }
+
+  /* Save and load the atlas */
+  name = strrchr(argv[1], '/');
+  NCHECK(snprintf(path, BUFSIZ, "/tmp/%s.atlas", name ? name+1 : argv[1]),
+    BUFSIZ);
+  CHECK(font_atlas_save(NULL, path), BAD_ARG);
+  CHECK(font_atlas_save(atlas, NULL), BAD_ARG);
+  CHECK(font_atlas_save(atlas, path), OK);
+
+  CHECK(font_atlas_create(sys, 32, 64, &atlas2), OK);
+  CHECK(font_atlas_load(atlas2, path, &font, 1, &b), OK);
+  CHECK(b, false); /* Page size mismatch */
+  CHECK(font_atlas_ref_put(atlas2), OK);
+
+  CHECK(font_atlas_create(sys, 64, 64, &atlas2), OK);
+  CHECK(font_atlas_load(NULL, path, &font, 1, &b), BAD_ARG);
+  CHECK(font_atlas_load(atlas2, NULL, &font, 1, &b), BAD_ARG);
+  CHECK(font_atlas_load(atlas2, path, NULL, 1, &b), BAD_ARG);
+  CHECK(font_atlas_load(atlas2, "/nonexistent/atlas", &font, 1, &b), BAD_ARG);
+  CHECK(font_atlas_load(atlas2, path, NULL, 0, &b), OK);
+  CHECK(b, false); /* Font mismatch */
+  CHECK(font_atlas_load(atlas2, path, &font, 1, &b), OK);
+  CHECK(b, true);
+  CHECK(font_atlas_load(atlas2, path, &font, 1, NULL), BAD_ARG);
+
+  CHECK(font_atlas_get_pages_count(atlas2, &i), OK);
+  CHECK(i, count);
+  memset(&dirty, 0, sizeof(dirty));
+  dirty.atlas = atlas2;
+  CHECK(font_atlas_flush(atlas2, add_dirty_rect, &dirty, &i), OK);
+  CHECK(i, count); /* The mapped pages are dirty as a whole */
+  for(i = 0; i < count; ++i) {
+    CHECK(dirty.rects[i].rect.x, 0);
+    CHECK(dirty.rects[i].rect.y, 0);
+    CHECK(dirty.rects[i].rect.width, 64);
+    CHECK(dirty.rects[i].rect.height, 64);
+  }
+  for(i = 0; i < count; ++i) {
+    const unsigned char* pixels2 = NULL;
+    CHECK(font_atlas_get_page(atlas, i, &w, &h, &pixels), OK);
+    CHECK(font_atlas_get_page(atlas2, i, NULL, NULL, &pixels2), OK);
+    CHECK(memcmp(pixels, pixels2, (size_t)w * (size_t)h), 0);
+  }
+  for(j = 32; j < 127; ++j) {
+    CHECK(font_atlas_get_glyph
+      (atlas2, font, (wchar_t)j, true, &atlas_glyph), OK);
+    CHECK(memcmp(&atlas_glyph, glyphs + (j - 32), sizeof(atlas_glyph)), 0);
+  }
+  /* New glyphs are packed into new pages */
+  CHECK(font_atlas_get_glyph(atlas2, font, L'a', false, &atlas_glyph), OK);
+  CHECK((size_t)atlas_glyph.page >= count, true);
+  CHECK(font_atlas_get_glyph(atlas2, font, L'b', true, &atlas_glyph), OK);
+  CHECK(memcmp(&atlas_glyph, glyphs + (L'b' - 32), sizeof(atlas_glyph)), 0);
+
+  /* Save a loaded atlas to the file it was loaded from */
+  CHECK(font_atlas_save(atlas2, path), OK);
+  CHECK(font_atlas_get_glyph(atlas2, font, L'c', false, &atlas_glyph), OK);
+  CHECK(font_atlas_get_glyph(atlas2, font, L'b', true, &atlas_glyph), OK);
+  CHECK(memcmp(&atlas_glyph, glyphs + (L'b' - 32), sizeof(atlas_glyph)), 0);
+  CHECK(font_atlas_save(atlas2, path), OK);
+  CHECK(font_atlas_ref_put(atlas2), OK);
+  CHECK(font_atlas_create(sys, 64, 64, &atlas2), OK);
+  CHECK(font_atlas_load(atlas2, path, &font, 1, &b), OK);
+  CHECK(b, true);
+  CHECK(font_atlas_get_pages_count(atlas2, &i), OK);
+  CHECK(i > count, true);
+  for(j = 32; j < 127; ++j) {
+    CHECK(font_atlas_get_glyph
+      (atlas2, font, (wchar_t)j, true, &atlas_glyph), OK);
+    CHECK(memcmp(&atlas_glyph, glyphs + (j - 32), sizeof(atlas_glyph)), 0);
+  }
+  CHECK(font_atlas_ref_put(atlas2), OK);
+  CHECK(remove(path), 0);
+
+  /* Mono glyphs are packed apart from the anti-aliased ones */
+  CHECK(font_atlas_get_glyph(atlas, font, L'a', false, &atlas_glyph), OK);
+  CHECK(rect_overlap(&atlas_glyph, glyphs + (L'a' - 32)), false);
+  memset(&dirty, 0, sizeof(dirty));
+  dirty.atlas = atlas;
+  CHECK(font_atlas_flush(atlas, add_dirty_rect, &dirty, NULL), OK);
+  CHECK(dirty.count, 1);
+  check_dirty_rects(&dirty, &atlas_glyph, 1);
+  CHECK(dirty.rects[0].rect.width <= atlas_glyph.rect.width + 1, true);
+  CHECK(dirty.rects[0].rect.height <= atlas_glyph.rect.height + 1, true);
+  CHECK(font_atlas_flush(atlas, NULL, NULL, NULL), OK);
+
+  /* Signed distance fields are packed apart from the bitmaps */
+  CHECK(font_atlas_get_sdf_glyph(NULL, font, L'a', 4, &atlas_glyph), BAD_ARG);
+  CHECK(font_atlas_get_sdf_glyph(atlas, font, L'a', 0, &atlas_glyph), BAD_ARG);
+  CHECK(font_atlas_get_sdf_glyph
+    (atlas, font, L'a', FONT_SDF_MAX_SPREAD + 1, &atlas_glyph), BAD_ARG);
+  CHECK(font_atlas_get_sdf_glyph(atlas, font, L'a', 4, NULL), BAD_ARG);
+  CHECK(font_atlas_get_sdf_glyph(atlas, font, L'a', 4, &atlas_glyph), OK);
+  CHECK(rect_overlap(&atlas_glyph, glyphs + (L'a' - 32)), false);
+
+  /* Build, save and load an atlas of signed distance fields */
+  CHECK(font_atlas_create(sys, 64, 64, &atlas2), OK);
+  CHECK(font_rsrc_prerender(font, &range, 1,
+    FONT_PRERENDER_SDF(FONT_SDF_MAX_SPREAD + 1), 2, atlas2, NULL, NULL),
+    BAD_ARG);
+  CHECK(font_rsrc_prerender
+    (font, &range, 1, FONT_PRERENDER_SDF(4), 2, atlas2, NULL, NULL), OK);
+  for(j = 32; j < 127; ++j) {
+    struct font_glyph* glyph = NULL;
+    struct font_atlas_glyph* sdf_glyph = glyphs + (j - 32);
+    int y = 0;
+    CHECK(font_atlas_get_sdf_glyph
+      (atlas2, font, (wchar_t)j, 4, sdf_glyph), OK);
+    CHECK(font_rsrc_get_glyph(font, (wchar_t)j, &glyph), OK);
+    CHECK(font_glyph_get_sdf(glyph, 4, &w, &h, sdf), OK);
+    CHECK(font_glyph_ref_put(glyph), OK);
+    CHECK(sdf_glyph->desc.character, (wchar_t)j);
+    CHECK(sdf_glyph->rect.width, w);
+    CHECK(sdf_glyph->rect.height, h);
+    if(!w || !h)
+      continue;
+    CHECK(font_atlas_get_page
+      (atlas2, (size_t)sdf_glyph->page, NULL, NULL, &pixels), OK);
+    for(y = 0; y < h; ++y) {
+      CHECK(memcmp(pixels + (sdf_glyph->rect.y + y) * 64 + sdf_glyph->rect.x,
+        sdf + y * w, (size_t)w), 0);
+    }
+  }
+  CHECK(font_atlas_get_pages_count(atlas2, &count), OK);
+  CHECK(font_atlas_save(atlas2, path), OK);
+  CHECK(font_atlas_ref_put(atlas2), OK);
+  CHECK(font_atlas_create(sys, 64, 64, &atlas2), OK);
+  CHECK(font_atlas_load(atlas2, path, &font, 1, &b), OK);
+  CHECK(b, true);
+  for(j = 32; j < 127; ++j) {
+    CHECK(font_atlas_get_sdf_glyph
+      (atlas2, font, (wchar_t)j, 4, &atlas_glyph), OK);
+    CHECK(memcmp(&atlas_glyph, glyphs + (j - 32), sizeof(atlas_glyph)), 0);
+  }
+  /* The bitmaps and the fields of other spreads are not in the file */
+  CHECK(font_atlas_get_glyph(atlas2, font, L'a', true, &atlas_glyph), OK);
+  CHECK((size_t)atlas_glyph.page >= count, true);
+  CHECK(font_atlas_get_sdf_glyph(atlas2, font, L'a', 2, &atlas_glyph), OK);
+  CHECK((size_t)atlas_glyph.page >= count, true);
+  CHECK(atlas_glyph.rect.width, glyphs[L'a' - 32].rect.width - 4);
+  CHECK(font_atlas_ref_put(atlas2), OK);
+  CHECK(remove(path), 0);
+
+  /* Concurrent filling. A glyph is packed once whatever the thread that
+   * requests it */
+  CHECK(font_atlas_create(sys, 64, 64, &atlas2), OK);
+  for(i = 0; i < NTHREADS; ++i) {
+    data[i].atlas = atlas2;
+    data[i].font = font;
+    data[i].first = i * 95 / NTHREADS;
+    data[i].nerrors = 0;
+    CHECK(pthread_create
+      (threads + i, NULL, get_glyphs_concurrently, data + i), 0);
+  }
+  for(i = 0; i < NTHREADS; ++i) {
+    CHECK(pthread_join(threads[i], NULL), 0);
+    CHECK(data[i].nerrors, 0);
+  }
+  for(i = 0; i < 95; ++i) {
+    size_t k = 0;
+    CHECK(data[0].glyphs[i].desc.character, (wchar_t)(i + 32));
+    for(k = 1; k < NTHREADS; ++k) {
+      CHECK(memcmp(data[0].glyphs + i, data[k].glyphs + i,
+        sizeof(struct font_atlas_glyph)), 0);
+    }
+    for(k = i + 1; k < 95; ++k)
+      CHECK(rect_overlap(data[0].glyphs + i, data[0].glyphs + k), false);
+  }
+  CHECK(font_atlas_ref_put(atlas2), OK);
+
+  CHECK(font_atlas_ref_get(NULL), BAD_ARG);
+  CHECK(font_atlas_ref_get(atlas), OK);
+  CHECK(font_atlas_ref_put(NULL), BAD_ARG);
+  CHECK(font_atlas_ref_put(atlas), OK);
+  CHECK(font_atlas_ref_put(atlas), OK);
+
+  CHECK(font_rsrc_ref_put(font), OK);
+  CHECK(font_system_ref_put(sys), OK);
+
+  CHECK(MEM_ALLOCATED_SIZE(&mem_default_allocator), 0);
+  return 0;
+
+error:
+  return -1;
+}
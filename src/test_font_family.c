@@ -0,0 +1,203 @@
+#include "font_rsrc.h"
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OK FONT_NO_ERROR
+#define BAD_ARG FONT_INVALID_ARGUMENT
+
+#define NTHREADS 4
+
+struct thread_data {
+  struct font_family* family;
+  struct font_rsrc** fonts;
+  size_t nerrors;
+};
+
+/* Resolve the BMP characters and check them against the font coverages */
+static void*
+resolve_concurrently(void* arg)
+{
+  struct thread_data* data = arg;
+  struct font_rsrc* font = NULL;
+  bool b0 = false;
+  bool b1 = false;
+  int ch = 0;
+
+  for(ch = 0; ch < 0x10000; ++ch) {
+    if(font_rsrc_has_char(data->fonts[0], (wchar_t)ch, &b0) != FONT_NO_ERROR
+    || font_rsrc_has_char(data->fonts[1], (wchar_t)ch, &b1) != FONT_NO_ERROR
+    || font_family_resolve(data->family, (wchar_t)ch, &font) != FONT_NO_ERROR
+    || font != (b0 ? data->fonts[0] : b1 ? data->fonts[1] : NULL))
+      ++data->nerrors;
+  }
+  return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+  wchar_t text[64];
+  struct font_glyph_desc descs[64];
+  struct font_glyph_desc desc;
+  struct font_glyph_position positions[64];
+  struct font_glyph_position positions2[64];
+  struct font_text_metrics metrics, metrics2;
+  struct font_system* sys = NULL;
+  struct font_system* sys2 = NULL;
+  struct font_rsrc* fonts[2] = { NULL, NULL };
+  struct font_rsrc* font = NULL;
+  struct font_rsrc* other = NULL;
+  struct font_family* family = NULL;
+  struct font_glyph* glyph = NULL;
+  wchar_t fallback_char = 0; /* Character of the fallback font only */
+  size_t n = 0;
+  size_t i = 0;
+  bool b0 = false;
+  bool b1 = false;
+
+  if(argc != 3) {
+    printf("usage: %s FONT FALLBACK_FONT\n", argv[0]);
+    goto error;
+  }
+
+  CHECK(font_system_create(NULL, &sys), OK);
+  CHECK(font_rsrc_create(sys, argv[1], fonts + 0), OK);
+  CHECK(font_rsrc_create(sys, argv[2], fonts + 1), OK);
+
+  CHECK(font_family_create(NULL, fonts, 2, &family), BAD_ARG);
+  CHECK(font_family_create(sys, NULL, 2, &family), BAD_ARG);
+  CHECK(font_family_create(sys, fonts, 0, &family), BAD_ARG);
+  CHECK(font_family_create(sys, fonts, 255, &family), BAD_ARG);
+  CHECK(font_family_create(sys, fonts, 2, NULL), BAD_ARG);
+  CHECK(font_rsrc_create(sys, NULL, &other), OK);
+  CHECK(font_family_create(sys, &other, 1, &family), BAD_ARG); /* No face */
+  CHECK(font_rsrc_ref_put(other), OK);
+  CHECK(font_system_create(NULL, &sys2), OK);
+  CHECK(font_rsrc_create(sys2, argv[1], &other), OK);
+  CHECK(font_family_create(sys, &other, 1, &family), BAD_ARG);
+  CHECK(font_rsrc_ref_put(other), OK);
+  CHECK(font_system_ref_put(sys2), OK);
+  CHECK(font_family_create(sys, fonts, 2, &family), OK);
+
+  CHECK(font_family_ref_get(NULL), BAD_ARG);
+  CHECK(font_family_ref_get(family), OK);
+  CHECK(font_family_ref_put(NULL), BAD_ARG);
+  CHECK(font_family_ref_put(family), OK);
+
+  /* Characters are resolved to the first font that covers them */
+  CHECK(font_family_resolve(NULL, L'a', &font), BAD_ARG);
+  CHECK(font_family_resolve(family, L'a', NULL), BAD_ARG);
+  for(i = 0; i < 2; ++i) { /* The second pass reads the memoized fonts */
+    int ch = 0;
+    for(ch = 0; ch < 0x10000; ++ch) {
+      CHECK(font_rsrc_has_char(fonts[0], (wchar_t)ch, &b0), OK);
+      CHECK(font_rsrc_has_char(fonts[1], (wchar_t)ch, &b1), OK);
+      CHECK(font_family_resolve(family, (wchar_t)ch, &font), OK);
+      CHECK(font, b0 ? fonts[0] : b1 ? fonts[1] : NULL);
+      if(!b0 && b1 && ch > 32 && !fallback_char)
+        fallback_char = (wchar_t)ch;
+    }
+  }
+  CHECK(font_family_resolve(family, (wchar_t)0x10FFFF, &font), OK);
+  CHECK(font, NULL);
+
+  CHECK(font_family_get_glyph(NULL, L'a', &glyph), BAD_ARG);
+  CHECK(font_family_get_glyph(family, L'a', NULL), BAD_ARG);
+  CHECK(font_family_get_glyph(family, (wchar_t)0x10FFFF, &glyph), BAD_ARG);
+  CHECK(glyph, NULL);
+  CHECK(font_family_get_glyph(family, L'a', &glyph), OK);
+  CHECK(font_glyph_get_desc(glyph, &desc), OK);
+  CHECK(desc.character, L'a');
+  CHECK(font_glyph_ref_put(glyph), OK);
+
+  /* Batch the characters of both fonts */
+  for(i = 0; i < 64; ++i)
+    text[i] = (wchar_t)(L'A' + i % 26);
+  text[10] = (wchar_t)0x10FFFF;
+  if(fallback_char) {
+    text[20] = text[21] = text[40] = fallback_char;
+  }
+  CHECK(font_family_get_glyph_descs(NULL, text, 64, descs), BAD_ARG);
+  CHECK(font_family_get_glyph_descs(family, NULL, 64, descs), BAD_ARG);
+  CHECK(font_family_get_glyph_descs(family, text, 64, NULL), BAD_ARG);
+  CHECK(font_family_get_glyph_descs(family, NULL, 0, NULL), OK);
+  CHECK(font_family_get_glyph_descs(family, text, 64, descs), OK);
+  for(i = 0; i < 64; ++i) {
+    CHECK(font_family_resolve(family, text[i], &font), OK);
+    if(!font) {
+      CHECK(descs[i].character, text[i]);
+      CHECK(descs[i].width, 0);
+    } else {
+      CHECK(font_rsrc_get_glyph_descs(font, text + i, 1, &desc), OK);
+      CHECK(memcmp(&desc, descs + i, sizeof(desc)), 0);
+    }
+  }
+
+  /* Text covered by the first font is laid out as with the first font */
+  CHECK(font_family_measure_text(NULL, text, 10, &metrics), BAD_ARG);
+  CHECK(font_family_measure_text(family, NULL, 10, &metrics), BAD_ARG);
+  CHECK(font_family_measure_text(family, text, 10, NULL), BAD_ARG);
+  CHECK(font_family_layout_text(family, text, 10, NULL, NULL), BAD_ARG);
+  CHECK(font_family_measure_text(family, text, 10, &metrics), OK);
+  CHECK(font_rsrc_measure_text(fonts[0], text, 10, &metrics2), OK);
+  CHECK(memcmp(&metrics, &metrics2, sizeof(metrics)), 0);
+  CHECK(font_family_layout_text(family, text, 10, positions, &metrics), OK);
+  CHECK(font_rsrc_layout_text(fonts[0], text, 10, positions2, &metrics2), OK);
+  CHECK(memcmp(positions, positions2, 10 * sizeof(*positions)), 0);
+  CHECK(memcmp(&metrics, &metrics2, sizeof(metrics)), 0);
+
+  /* Fallback glyphs advance the pen */
+  text[1] = L'\n';
+  CHECK(font_family_layout_text(family, text, 64, positions, &metrics), OK);
+  CHECK(metrics.lines_count, 2);
+  CHECK(positions[2].x, 0);
+  for(i = 3; i < 64; ++i) {
+    CHECK(font_family_resolve(family, text[i - 1], &font), OK);
+    if(font && descs[i - 1].width > 0)
+      CHECK(positions[i].x > positions[i - 1].x, true);
+  }
+
+  /* Reloading a font invalidates the memoized resolutions */
+  CHECK(font_rsrc_load(fonts[0], argv[2]), OK);
+  for(n = 0, i = 0; i < 0x10000; i += 7) {
+    CHECK(font_rsrc_has_char(fonts[0], (wchar_t)i, &b0), OK);
+    CHECK(font_rsrc_has_char(fonts[1], (wchar_t)i, &b1), OK);
+    CHECK(font_family_resolve(family, (wchar_t)i, &font), OK);
+    CHECK(font, b0 ? fonts[0] : b1 ? fonts[1] : NULL);
+    n += font != NULL;
+  }
+  NCHECK(n, 0);
+
+  /* Threads that resolve characters after a reload invalidate the memo once */
+  for(n = 0; n < 4; ++n) {
+    struct thread_data data[NTHREADS];
+    pthread_t threads[NTHREADS];
+    CHECK(font_rsrc_load(fonts[0], argv[1 + n % 2]), OK);
+    for(i = 0; i < NTHREADS; ++i) {
+      data[i].family = family;
+      data[i].fonts = fonts;
+      data[i].nerrors = 0;
+      CHECK(pthread_create
+        (threads + i, NULL, resolve_concurrently, data + i), 0);
+    }
+    for(i = 0; i < NTHREADS; ++i) {
+      CHECK(pthread_join(threads[i], NULL), 0);
+      CHECK(data[i].nerrors, 0);
+    }
+  }
+
+  CHECK(font_family_ref_put(family), OK);
+  CHECK(font_rsrc_ref_put(fonts[0]), OK);
+  CHECK(font_rsrc_ref_put(fonts[1]), OK);
+  CHECK(font_system_ref_put(sys), OK);
+
+  CHECK(MEM_ALLOCATED_SIZE(&mem_default_allocator), 0);
+  return 0;
+
+error:
+  return -1;
+}
@@ -0,0 +1,189 @@
+#include "font_rsrc.h"
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OK FONT_NO_ERROR
+#define BAD_ARG FONT_INVALID_ARGUMENT
+#define MEM_ERR FONT_MEMORY_ERROR
+
+struct drain {
+  struct font_glyph_queue* queue;
+  size_t ncompletions;
+  size_t nerrors;
+  size_t next; /* Expected index of the next completion */
+};
+
+static void
+check_completion(const struct font_glyph_completion* completion, void* data)
+{
+  struct drain* drain = data;
+  struct font_glyph* glyph = NULL;
+  struct font_glyph_desc desc, desc2;
+  int w = 0, h = 0, Bpp = 0;
+  int w2 = 0, h2 = 0, Bpp2 = 0;
+
+  ++drain->ncompletions;
+  if(completion->request.data != (void*)(drain->next++ + 1))
+    ++drain->nerrors; /* Completions are not in request order */
+
+  if(completion->error != OK) {
+    if(completion->glyph)
+      ++drain->nerrors;
+    return;
+  }
+  if(completion->request.size) {
+    CHECK(font_size_get_glyph
+      (completion->request.size, completion->request.character, &glyph), OK);
+  } else {
+    CHECK(font_rsrc_get_glyph
+      (completion->request.font, completion->request.character, &glyph), OK);
+  }
+  CHECK(font_glyph_get_desc(glyph, &desc), OK);
+  CHECK(font_glyph_get_desc(completion->glyph, &desc2), OK);
+  if(memcmp(&desc, &desc2, sizeof(desc)))
+    ++drain->nerrors;
+  CHECK(font_glyph_get_bitmap
+    (glyph, completion->request.antialiasing, &w, &h, &Bpp, NULL), OK);
+  CHECK(font_glyph_get_bitmap
+    (completion->glyph, completion->request.antialiasing, &w2, &h2, &Bpp2,
+     NULL), OK);
+  if(w != w2 || h != h2 || Bpp != Bpp2)
+    ++drain->nerrors;
+  CHECK(font_glyph_ref_put(glyph), OK);
+}
+
+/* Drain the queue until `n' completions were drained overall */
+static void
+drain_all(struct drain* drain, const size_t n)
+{
+  while(drain->ncompletions < n) {
+    size_t count = 0;
+    CHECK(font_glyph_queue_wait(drain->queue), OK);
+    CHECK(font_glyph_queue_drain
+      (drain->queue, check_completion, drain, &count), OK);
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  struct font_glyph_request request;
+  struct font_glyph_desc desc, desc2;
+  struct drain drain;
+  struct font_system* sys = NULL;
+  struct font_system* sys2 = NULL;
+  struct font_rsrc* font = NULL;
+  struct font_rsrc* font2 = NULL;
+  struct font_size* size = NULL;
+  struct font_glyph_queue* queue = NULL;
+  size_t count = 0;
+  size_t n = 0;
+  int i = 0;
+  bool has_desc = false;
+  bool is_scalable = false;
+
+  if(argc != 2) {
+    printf("usage: %s FONT\n", argv[0]);
+    goto error;
+  }
+
+  CHECK(font_system_create(NULL, &sys), OK);
+  CHECK(font_rsrc_create(sys, argv[1], &font), OK);
+  CHECK(font_rsrc_is_scalable(font, &is_scalable), OK);
+  if(is_scalable)
+    CHECK(font_size_create(font, 24, 24, &size), OK);
+
+  CHECK(font_glyph_queue_create(NULL, 16, &queue), BAD_ARG);
+  CHECK(font_glyph_queue_create(sys, 0, &queue), BAD_ARG);
+  CHECK(font_glyph_queue_create(sys, 16, NULL), BAD_ARG);
+  CHECK(font_glyph_queue_create(sys, 100, &queue), OK);
+
+  CHECK(font_glyph_queue_ref_get(NULL), BAD_ARG);
+  CHECK(font_glyph_queue_ref_get(queue), OK);
+  CHECK(font_glyph_queue_ref_put(NULL), BAD_ARG);
+  CHECK(font_glyph_queue_ref_put(queue), OK);
+
+  memset(&drain, 0, sizeof(drain));
+  drain.queue = queue;
+  memset(&request, 0, sizeof(request));
+  request.character = L'a';
+  CHECK(font_glyph_queue_push(NULL, &request, NULL, NULL), BAD_ARG);
+  CHECK(font_glyph_queue_push(queue, NULL, NULL, NULL), BAD_ARG);
+  CHECK(font_glyph_queue_push(queue, &request, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_create(sys, NULL, &font2), OK);
+  request.font = font2; /* No face */
+  CHECK(font_glyph_queue_push(queue, &request, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_ref_put(font2), OK);
+  CHECK(font_system_create(NULL, &sys2), OK);
+  CHECK(font_rsrc_create(sys2, argv[1], &font2), OK);
+  request.font = font2; /* Other system */
+  CHECK(font_glyph_queue_push(queue, &request, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_ref_put(font2), OK);
+  CHECK(font_system_ref_put(sys2), OK);
+  if(size) {
+    CHECK(font_rsrc_create(sys, argv[1], &font2), OK);
+    request.font = font2;
+    request.size = size; /* Size of another font */
+    CHECK(font_glyph_queue_push(queue, &request, NULL, NULL), BAD_ARG);
+    CHECK(font_rsrc_ref_put(font2), OK);
+  }
+  CHECK(font_glyph_queue_drain(NULL, check_completion, &drain, &n), BAD_ARG);
+  CHECK(font_glyph_queue_drain(queue, NULL, &drain, &n), BAD_ARG);
+  CHECK(font_glyph_queue_wait(NULL), BAD_ARG);
+
+  /* Requests of the printable ASCII characters at the current font size and,
+   * for scalable fonts, at the size handle */
+  CHECK(font_glyph_queue_wait(queue), OK);
+  CHECK(font_glyph_queue_drain(queue, check_completion, &drain, &n), OK);
+  CHECK(n, 0);
+  request.font = font;
+  for(i = 32; i < 127; ++i) {
+    request.size = size && i % 2 ? size : NULL;
+    request.character = (wchar_t)i;
+    request.antialiasing = i % 3 == 0;
+    request.data = (void*)(++count);
+    CHECK(font_glyph_queue_push(queue, &request, &desc, &has_desc), OK);
+    CHECK(desc.character, (wchar_t)i);
+  }
+  request.size = NULL;
+  request.character = (wchar_t)0x10FFFF; /* No glyph */
+  for(i = 0; i < 5; ++i) {
+    request.data = (void*)(++count);
+    CHECK(font_glyph_queue_push(queue, &request, NULL, NULL), OK);
+  }
+  CHECK(font_glyph_queue_push(queue, &request, NULL, NULL), MEM_ERR); /* Full */
+  drain_all(&drain, count);
+  CHECK(drain.ncompletions, count);
+  CHECK(drain.nerrors, 0);
+
+  /* The metrics of the rasterized glyphs are known on push */
+  request.character = L'b';
+  request.data = (void*)(++count);
+  CHECK(font_glyph_queue_push(queue, &request, &desc, &has_desc), OK);
+  CHECK(has_desc, true);
+  CHECK(font_rsrc_get_glyph_descs(font, &request.character, 1, &desc2), OK);
+  CHECK(memcmp(&desc, &desc2, sizeof(desc)), 0);
+  drain_all(&drain, count);
+  CHECK(drain.nerrors, 0);
+
+  /* Releasing the queue cancels its pending requests */
+  for(i = 0; i < 100; ++i) {
+    request.character = (wchar_t)(32 + i % 95);
+    CHECK(font_glyph_queue_push(queue, &request, NULL, NULL), OK);
+  }
+  CHECK(font_glyph_queue_ref_put(queue), OK);
+
+  if(size)
+    CHECK(font_size_ref_put(size), OK);
+  CHECK(font_rsrc_ref_put(font), OK);
+  CHECK(font_system_ref_put(sys), OK);
+
+  CHECK(MEM_ALLOCATED_SIZE(&mem_default_allocator), 0);
+  return 0;
+
+error:
+  return -1;
+}
@@ -2,27 +2,194 @@
 #include <snlsys/image.h>
 #include <snlsys/mem_allocator.h>
 #include <snlsys/snlsys.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define OK FONT_NO_ERROR
 #define BAD_ARG FONT_INVALID_ARGUMENT
 
+#define NTHREADS 4
+
+struct thread_data {
+  struct font_rsrc* font;
+  const struct font_glyph_desc* descs; /* Expected descriptors of 32..126 */
+  size_t nerrors;
+};
+
+struct memory_stream {
+  const unsigned char* data;
+  size_t size;
+  size_t nbytes_read;
+  size_t nreleases;
+};
+
+struct progress {
+  size_t ncalls;
+  size_t ndone;
+  size_t nchars;
+  size_t ncalls_max; /* Cancel the pre-rendering after ncalls_max calls */
+  bool is_monotonic;
+};
+
+struct trace {
+  const struct font_rsrc* font;
+  size_t nbegins[3];
+  size_t nends[3];
+  bool is_nested;
+  bool is_valid;
+};
+
+static void
+trace_begin(enum font_trace_event event, struct font_rsrc* font, void* data)
+{
+  struct trace* trace = data;
+  if(font != trace->font || (int)event < 0 || (int)event > 2) {
+    trace->is_valid = false;
+    return;
+  }
+  if(trace->nbegins[event] != trace->nends[event])
+    trace->is_nested = true;
+  ++trace->nbegins[event];
+}
+
+static void
+trace_end(enum font_trace_event event, struct font_rsrc* font, void* data)
+{
+  struct trace* trace = data;
+  if(font != trace->font || (int)event < 0 || (int)event > 2) {
+    trace->is_valid = false;
+    return;
+  }
+  ++trace->nends[event];
+}
+
+static unsigned char
+div255(const unsigned int val)
+{
+  return (unsigned char)((val + 127) / 255);
+}
+
+static bool
+track_progress(const size_t ndone, const size_t nchars, void* data)
+{
+  struct progress* progress = data;
+  if(ndone < progress->ndone || ndone > nchars)
+    progress->is_monotonic = false;
+  progress->ndone = ndone;
+  progress->nchars = nchars;
+  return ++progress->ncalls < progress->ncalls_max;
+}
+
+static size_t
+read_memory_stream
+  (void* data, const size_t offset, void* buffer, const size_t size)
+{
+  struct memory_stream* stream = data;
+  size_t n = 0;
+  if(offset >= stream->size)
+    return 0;
+  n = stream->size - offset < size ? stream->size - offset : size;
+  memcpy(buffer, stream->data + offset, n);
+  __atomic_add_fetch(&stream->nbytes_read, n, __ATOMIC_RELAXED);
+  return n;
+}
+
+static void
+release_memory_stream(void* data)
+{
+  struct memory_stream* stream = data;
+  ++stream->nreleases;
+}
+
+static void*
+get_glyphs_concurrently(void* arg)
+{
+  struct thread_data* data = arg;
+  unsigned char bitmap[256 * 256 * 4];
+  int i = 0;
+  int j = 0;
+
+  for(j = 0; j < 16; ++j) {
+    for(i = 32; i < 127; ++i) {
+      struct font_glyph_desc desc;
+      struct font_glyph* glyph = NULL;
+      int w = 0, h = 0, Bpp = 0;
+
+      if(font_rsrc_get_glyph(data->font, (wchar_t)i, &glyph) != OK) {
+        ++data->nerrors;
+        continue;
+      }
+      if(font_glyph_get_desc(glyph, &desc) != OK
+      || memcmp(&desc, data->descs + i - 32, sizeof(desc)))
+        ++data->nerrors;
+      if(font_glyph_get_bitmap(glyph, (i + j) % 2, &w, &h, &Bpp, NULL) != OK
+      || w * h * Bpp > (int)sizeof(bitmap)
+      || font_glyph_get_bitmap(glyph, (i + j) % 2, &w, &h, &Bpp, bitmap)!=OK)
+        ++data->nerrors;
+      if(font_glyph_ref_put(glyph) != OK)
+        ++data->nerrors;
+    }
+  }
+  return NULL;
+}
+
 int
 main(int argc, char** argv)
 {
   char buf[BUFSIZ];
+  wchar_t chars[96];
+  struct font_glyph_desc descs[96];
+  struct font_glyph_desc descs2[96];
+  int advances[96];
+  struct font_bitmap_desc bitmaps[96];
   struct font_glyph_desc desc;
+  struct font_bitmap_view view;
+  struct font_char_range ranges[3];
+  struct progress progress;
+  struct font_text_metrics metrics, metrics2;
+  struct font_glyph_position positions[5];
+  struct font_stats stats, stats2;
+  struct font_surface target;
+  unsigned char a8[2][128 * 64];
+  unsigned char rgba8[128 * 64 * 4];
+  const unsigned char white[4] = { 255, 255, 255, 255 };
+  const unsigned char orange[4] = { 255, 128, 0, 128 };
+  const wchar_t* text = L"abcdefghijklmnopqrstuvwxyz";
+  struct font_trace_hooks hooks;
+  struct trace trace;
   struct font_system* sys = NULL;
   struct font_rsrc* font = NULL;
+  struct font_rsrc* font2 = NULL;
+  struct font_rsrc* font3 = NULL;
+  struct font_stream stream;
+  struct memory_stream mem_stream;
+  struct font_size* size12 = NULL;
+  struct font_size* size48 = NULL;
   struct font_glyph* glyph = NULL;
+  struct font_glyph* glyph2 = NULL;
+  struct font_glyph* glyph3 = NULL;
   const char* path = NULL;
   unsigned char* buffer = NULL;
+  unsigned char* buffer2 = NULL;
+  unsigned char* surface = NULL;
+  unsigned char* file = NULL;
+  size_t file_size = 0;
+  FILE* fp = NULL;
+  size_t stride = 0;
   size_t buffer_size = 0;
+  size_t required_size = 0;
+  size_t prev_size = 0;
+  unsigned u = 0, u2 = 0;
   int h = 0;
   int w = 0;
   int Bpp = 0;
   int i = 0;
+  int j = 0;
   bool b = false;
 
   if(argc != 2) {
@@ -49,6 +216,34 @@ main(int argc, char** argv)
   CHECK(font_rsrc_is_scalable(NULL, &b), BAD_ARG);
   CHECK(font_rsrc_is_scalable(font, &b), OK);
 
+  CHECK(font_rsrc_has_char(NULL, L'a', NULL), BAD_ARG);
+  CHECK(font_rsrc_has_char(font, L'a', NULL), BAD_ARG);
+  CHECK(font_rsrc_has_char(NULL, L'a', &b), BAD_ARG);
+  CHECK(font_rsrc_has_char(font, L'a', &b), OK);
+  CHECK(b, true);
+  CHECK(font_rsrc_has_char(font, (wchar_t)0x10FFFF, &b), OK);
+  CHECK(b, false);
+  CHECK(font_rsrc_get_glyph(font, (wchar_t)0x10FFFF, &glyph), BAD_ARG);
+  for(i = 0; i < 256; ++i) { /* Unloadable glyphs are missing glyphs */
+    const enum font_error err = font_rsrc_get_glyph(font, (wchar_t)i, &glyph);
+    CHECK(err == OK || err == BAD_ARG, true);
+    if(err == OK)
+      CHECK(font_glyph_ref_put(glyph), OK);
+  }
+  for(i = 0, j = 0; i < 0x10000; ++i) {
+    CHECK(font_rsrc_has_char(font, (wchar_t)i, &b), OK);
+    if(!b) {
+      CHECK(font_rsrc_get_glyph(font, (wchar_t)i, &glyph), BAD_ARG);
+      CHECK(glyph, NULL);
+    } else if(i >= 256 && !j) { /* Lazily built page */
+      j = i;
+      chars[0] = (wchar_t)i;
+      CHECK(font_rsrc_get_glyph_descs(font, chars, 1, &desc), OK);
+      CHECK(desc.character, chars[0]);
+    }
+  }
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+
   if(b) {
     CHECK(font_rsrc_set_size(NULL, 0, 0), BAD_ARG);
     CHECK(font_rsrc_set_size(font, 0, 0), BAD_ARG);
@@ -108,7 +303,31 @@ main(int argc, char** argv)
   CHECK(font_glyph_ref_get(glyph), OK);
   CHECK(font_glyph_ref_put(NULL), BAD_ARG);
   CHECK(font_glyph_ref_put(glyph), OK);
+
+  /* Glyph cache */
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph2), OK);
+  CHECK(glyph2, glyph);
+  CHECK(font_glyph_ref_put(glyph2), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_glyph_get_desc(glyph, &desc), OK);
+  CHECK(desc.character, L'a');
+  CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, NULL), OK);
+
+  CHECK(font_rsrc_set_glyph_cache_size(NULL, 0), BAD_ARG);
+  CHECK(font_rsrc_set_glyph_cache_size(font, 0), OK);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph2), OK);
+  NCHECK(glyph2, glyph);
+  CHECK(font_glyph_get_desc(glyph2, &desc), OK);
+  CHECK(desc.character, L'a');
+  CHECK(font_glyph_ref_put(glyph2), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_set_glyph_cache_size(font, 1), OK);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_rsrc_get_glyph(font, L'b', &glyph2), OK);
   CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_glyph_ref_put(glyph2), OK);
+  CHECK(font_rsrc_set_glyph_cache_size(font, 1024 * 1024), OK);
 
   b = true;
   for(i = 0; b && i < w*h*Bpp; ++i)
@@ -131,8 +350,829 @@ main(int argc, char** argv)
     CHECK(image_ppm_write(buf, w, h, Bpp, buffer), 0);
     CHECK(font_glyph_ref_put(glyph), OK);
   }
+
+  /* Large mono glyph whose rows span several SIMD registers */
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  if(b) {
+    CHECK(font_rsrc_set_size(font, 128, 128), OK);
+    CHECK(font_rsrc_get_glyph(font, L'W', &glyph), OK);
+    CHECK(font_glyph_get_bitmap(glyph, false, &w, &h, &Bpp, NULL), OK);
+    CHECK(Bpp, 1);
+    CHECK(w > 32, true);
+    required_size = (size_t)(w * h);
+    if(required_size > buffer_size) {
+      buffer = MEM_REALLOC(&mem_default_allocator, buffer, required_size);
+      NCHECK(buffer, NULL);
+      buffer_size = required_size;
+    }
+    CHECK(font_glyph_get_bitmap(glyph, false, NULL, NULL, NULL, buffer), OK);
+    prev_size = 0;
+    for(i = 0; i < w*h; ++i) {
+      CHECK(buffer[i] == 0 || buffer[i] == 255, true);
+      prev_size += buffer[i] != 0;
+    }
+    NCHECK(prev_size, 0);
+    CHECK(font_glyph_ref_put(glyph), OK);
+    CHECK(font_rsrc_set_size(font, 16, 16), OK);
+  }
+
+  /* Write into a sub-rectangle of a larger surface */
+  CHECK(font_rsrc_get_glyph(font, L'g', &glyph), OK);
+  CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, NULL), OK);
+  CHECK(Bpp, 1);
+  required_size = (size_t)(w * h) * 4;
+  if(required_size > buffer_size) {
+    buffer = MEM_REALLOC(&mem_default_allocator, buffer, required_size);
+    NCHECK(buffer, NULL);
+    buffer_size = required_size;
+  }
+  CHECK(font_glyph_get_bitmap(glyph, true, NULL, NULL, NULL, buffer), OK);
+  surface = MEM_CALLOC(&mem_default_allocator, (size_t)((w+5)*4*(h+3)), 1);
+  NCHECK(surface, NULL);
+  stride = (size_t)((w + 5) * 4);
+  CHECK(font_glyph_write_bitmap
+    (NULL, true, FONT_FORMAT_A8, surface, stride, 3, 2), BAD_ARG);
+  CHECK(font_glyph_write_bitmap
+    (glyph, true, FONT_FORMAT_A8, NULL, stride, 3, 2), BAD_ARG);
+  CHECK(font_glyph_write_bitmap
+    (glyph, true, FONT_FORMAT_A8, surface, stride, -1, 2), BAD_ARG);
+  CHECK(font_glyph_write_bitmap
+    (glyph, true, FONT_FORMAT_A8, surface, (size_t)w, 3, 2), BAD_ARG);
+  CHECK(font_glyph_write_bitmap
+    (glyph, true, FONT_FORMAT_A8, surface, stride, 3, 2), OK);
+  for(i = 0; i < h + 3; ++i) {
+    int j;
+    for(j = 0; j < (w + 5) * 4; ++j) {
+      const bool inside = i >= 2 && i < h + 2 && j >= 3 && j < w + 3;
+      CHECK(surface[(size_t)i*stride + (size_t)j],
+        inside ? buffer[(i-2)*w + (j-3)] : 0);
+    }
+  }
+  memset(surface, 0, stride * (size_t)(h + 3));
+  CHECK(font_glyph_write_bitmap
+    (glyph, true, FONT_FORMAT_RGBA8, surface, stride, 1, 1), OK);
+  for(i = 0; i < h; ++i) {
+    int j;
+    for(j = 0; j < w; ++j) {
+      const unsigned char* pixel = surface + (size_t)(i+1)*stride + (j+1)*4;
+      CHECK(pixel[0], 255);
+      CHECK(pixel[3], buffer[i*w + j]);
+    }
+  }
+  MEM_FREE(&mem_default_allocator, surface);
+
+  /* Mono and anti-aliased bitmaps may have different sizes */
+  CHECK(font_glyph_get_bitmap(glyph, false, &w, &h, &Bpp, NULL), OK);
+  required_size = (size_t)(w * h);
+  if(required_size > buffer_size) {
+    buffer = MEM_REALLOC(&mem_default_allocator, buffer, required_size);
+    NCHECK(buffer, NULL);
+    buffer_size = required_size;
+  }
+  CHECK(font_glyph_get_bitmap(glyph, false, NULL, NULL, NULL, buffer), OK);
+  surface = MEM_CALLOC(&mem_default_allocator, (size_t)((w+5)*4*(h+3)), 1);
+  NCHECK(surface, NULL);
+  stride = (size_t)((w + 5) * 4);
+  CHECK(font_glyph_write_bitmap
+    (glyph, false, FONT_FORMAT_A1, surface, stride, 5, 0), OK);
+  for(i = 0; i < h; ++i) {
+    int j;
+    for(j = 0; j < w; ++j) {
+      const int bit = (surface[(size_t)i*stride + (size_t)(j+5)/8]
+        >> (7 - (j+5)%8)) & 1;
+      CHECK(bit, buffer[i*w + j] ? 1 : 0);
+    }
+  }
+  MEM_FREE(&mem_default_allocator, surface);
+
+  CHECK(font_glyph_get_bitmap_view(NULL, true, &view), BAD_ARG);
+  CHECK(font_glyph_get_bitmap_view(glyph, true, NULL), BAD_ARG);
+  CHECK(font_glyph_get_bitmap_view(glyph, false, &view), OK);
+  CHECK(view.width, w);
+  CHECK(view.height, h);
+  CHECK(view.bits_per_pixel, 1);
+  for(i = 0; i < h; ++i) {
+    int j;
+    for(j = 0; j < w; ++j) {
+      const int bit = (view.buffer[i*view.pitch + j/8] >> (7 - j%8)) & 1;
+      CHECK(bit, buffer[i*w + j] ? 1 : 0);
+    }
+  }
+
+  /* Both render modes of outline glyphs are memoized */
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  if(b) {
+    struct font_bitmap_view mono_view = view;
+    CHECK(font_glyph_get_bitmap_view(glyph, true, &view), OK);
+    CHECK(view.bits_per_pixel, 8);
+    NCHECK(view.buffer, mono_view.buffer);
+    CHECK(font_glyph_get_bitmap_view(glyph, false, &view), OK);
+    CHECK(view.buffer, mono_view.buffer);
+  }
+  CHECK(font_glyph_ref_put(glyph), OK);
+
+  /* Batch */
+  for(i = 0; i < 95; ++i)
+    chars[i] = (wchar_t)(i + 32);
+  chars[95] = (wchar_t)0x10FFFF; /* Missing character */
+  CHECK(font_rsrc_get_glyphs
+    (NULL, chars, 96, true, NULL, NULL, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_get_glyphs
+    (font, NULL, 96, true, NULL, NULL, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_get_glyphs
+    (font, NULL, 0, true, NULL, NULL, NULL, NULL), OK);
+  CHECK(font_rsrc_get_glyphs
+    (font, chars, 96, true, NULL, NULL, NULL, NULL), OK);
+  CHECK(font_rsrc_get_glyphs
+    (font, chars, 96, true, descs, bitmaps, &required_size, NULL), OK);
+  CHECK(descs[95].character, chars[95]);
+  CHECK(descs[95].width, 0);
+  CHECK(bitmaps[95].width, 0);
+  CHECK(bitmaps[95].height, 0);
+  CHECK(bitmaps[95].offset, required_size);
+  if(required_size > buffer_size) {
+    buffer = MEM_REALLOC(&mem_default_allocator, buffer, required_size);
+    NCHECK(buffer, NULL);
+    buffer_size = required_size;
+  }
+  CHECK(font_rsrc_get_glyphs
+    (font, chars, 96, true, NULL, NULL, NULL, buffer), OK);
+  for(i = 0; i < 95; ++i) {
+    const size_t size = (size_t)
+      (bitmaps[i].width * bitmaps[i].height * bitmaps[i].bytes_per_pixel);
+    unsigned char* bitmap = NULL;
+
+    CHECK(font_rsrc_get_glyph(font, chars[i], &glyph), OK);
+    CHECK(font_glyph_get_desc(glyph, &desc), OK);
+    CHECK(memcmp(&desc, descs + i, sizeof(desc)), 0);
+    CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, NULL), OK);
+    CHECK(bitmaps[i].width, w);
+    CHECK(bitmaps[i].height, h);
+    CHECK(bitmaps[i].bytes_per_pixel, Bpp);
+    if(i) CHECK(bitmaps[i].offset, bitmaps[i-1].offset + prev_size);
+    bitmap = MEM_ALLOC(&mem_default_allocator, size + 1);
+    NCHECK(bitmap, NULL);
+    CHECK(font_glyph_get_bitmap(glyph, true, NULL, NULL, NULL, bitmap), OK);
+    CHECK(memcmp(bitmap, buffer + bitmaps[i].offset, size), 0);
+    MEM_FREE(&mem_default_allocator, bitmap);
+    CHECK(font_glyph_ref_put(glyph), OK);
+    prev_size = size;
+  }
   MEM_FREE(&mem_default_allocator, buffer);
 
+  /* The characters repeated in a batch are loaded once, even without cache */
+  CHECK(font_rsrc_set_glyph_cache_size(font, 0), OK);
+  CHECK(font_rsrc_get_stats(font, &stats), OK);
+  CHECK(font_rsrc_get_glyphs
+    (font, L"abaa", 4, true, descs2, bitmaps, NULL, NULL), OK);
+  CHECK(font_rsrc_get_stats(font, &stats2), OK);
+  CHECK(stats2.glyphs_created - stats.glyphs_created, 2);
+  CHECK(stats2.glyphs_created - stats2.glyphs_released,
+    stats.glyphs_created - stats.glyphs_released);
+  CHECK(memcmp(descs2 + 0, descs2 + 2, sizeof(*descs2)), 0);
+  CHECK(memcmp(descs2 + 0, descs2 + 3, sizeof(*descs2)), 0);
+  CHECK(memcmp(descs2 + 0, descs + ('a' - 32), sizeof(*descs2)), 0);
+  CHECK(bitmaps[3].width, bitmaps[0].width);
+  CHECK(bitmaps[3].height, bitmaps[0].height);
+  CHECK(font_rsrc_set_glyph_cache_size(font, 1024 * 1024), OK);
+
+  /* Metrics only batch */
+  CHECK(font_rsrc_get_glyph_descs(NULL, chars, 96, descs2), BAD_ARG);
+  CHECK(font_rsrc_get_glyph_descs(font, NULL, 96, descs2), BAD_ARG);
+  CHECK(font_rsrc_get_glyph_descs(font, chars, 96, NULL), BAD_ARG);
+  CHECK(font_rsrc_get_glyph_descs(font, NULL, 0, NULL), OK);
+  for(j = 0; j < 2; ++j) { /* The second pass hits the metrics cache */
+    memset(descs2, 0xFF, sizeof(descs2));
+    CHECK(font_rsrc_get_glyph_descs(font, chars, 96, descs2), OK);
+    CHECK(memcmp(descs, descs2, sizeof(descs)), 0);
+  }
+  CHECK(descs2[95].character, chars[95]);
+  CHECK(descs2[95].bbox.x_max, 0);
+
+  /* Unhinted metrics are close to the hinted ones */
+  CHECK(font_rsrc_get_unhinted_glyph_descs(NULL, chars, 96, descs2), BAD_ARG);
+  CHECK(font_rsrc_get_unhinted_glyph_descs(font, NULL, 96, descs2), BAD_ARG);
+  CHECK(font_rsrc_get_unhinted_glyph_descs(font, chars, 96, NULL), BAD_ARG);
+  CHECK(font_rsrc_get_unhinted_glyph_descs(font, NULL, 0, NULL), OK);
+  CHECK(font_rsrc_get_glyph_advances(NULL, chars, 96, advances), BAD_ARG);
+  CHECK(font_rsrc_get_glyph_advances(font, NULL, 96, advances), BAD_ARG);
+  CHECK(font_rsrc_get_glyph_advances(font, chars, 96, NULL), BAD_ARG);
+  CHECK(font_rsrc_get_glyph_advances(font, NULL, 0, NULL), OK);
+  memset(descs2, 0xFF, sizeof(descs2));
+  CHECK(font_rsrc_get_unhinted_glyph_descs(font, chars, 96, descs2), OK);
+  CHECK(font_rsrc_get_glyph_advances(font, chars, 96, advances), OK);
+  for(i = 0; i < 96; ++i) {
+    CHECK(descs2[i].character, chars[i]);
+    CHECK(abs(descs2[i].width - descs[i].width) <= 1, true);
+    CHECK(abs(advances[i] - descs[i].width) <= 1, true);
+  }
+  CHECK(descs2[95].bbox.x_max, 0);
+  CHECK(advances[95], 0);
+
+  /* Size handles */
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  CHECK(font_size_create(NULL, 12, 12, &size12), BAD_ARG);
+  CHECK(font_size_create(font, 0, 12, &size12), BAD_ARG);
+  CHECK(font_size_create(font, 12, 0, &size12), BAD_ARG);
+  CHECK(font_size_create(font, 12, 12, NULL), BAD_ARG);
+  if(!b) {
+    CHECK(font_size_create(font, 12, 12, &size12), BAD_ARG);
+  } else {
+    struct font_glyph_desc desc12, desc48;
+    int line_space12 = 0, line_space48 = 0;
+
+    CHECK(font_size_create(font, 12, 12, &size12), OK);
+    CHECK(font_size_create(font, 48, 48, &size48), OK);
+    CHECK(font_size_get_line_space(NULL, &line_space12), BAD_ARG);
+    CHECK(font_size_get_line_space(size12, NULL), BAD_ARG);
+    CHECK(font_size_get_line_space(size12, &line_space12), OK);
+    CHECK(font_size_get_line_space(size48, &line_space48), OK);
+    CHECK(line_space12 < line_space48, true);
+
+    CHECK(font_size_get_glyph(NULL, L'H', &glyph), BAD_ARG);
+    CHECK(font_size_get_glyph(size12, L'H', NULL), BAD_ARG);
+    CHECK(font_size_get_glyph(size12, L'H', &glyph), OK);
+    CHECK(font_size_get_glyph(size48, L'H', &glyph2), OK);
+    NCHECK(glyph, glyph2);
+    CHECK(font_glyph_get_desc(glyph, &desc12), OK);
+    CHECK(font_glyph_get_desc(glyph2, &desc48), OK);
+    CHECK(desc12.bbox.y_max < desc48.bbox.y_max, true);
+    CHECK(desc12.width < desc48.width, true);
+    CHECK(font_glyph_ref_put(glyph2), OK);
+    CHECK(font_size_get_glyph_descs(NULL, chars, 1, &desc), BAD_ARG);
+    CHECK(font_size_get_glyph_descs(size12, NULL, 1, &desc), BAD_ARG);
+    CHECK(font_size_get_glyph_descs(size12, L"H", 1, NULL), BAD_ARG);
+    CHECK(font_size_get_glyph_descs(size12, L"H", 1, &desc), OK);
+    CHECK(memcmp(&desc, &desc12, sizeof(desc)), 0);
+    CHECK(font_size_get_glyph_descs(size48, L"H", 1, &desc), OK);
+    CHECK(memcmp(&desc, &desc48, sizeof(desc)), 0);
+    CHECK(font_size_get_unhinted_glyph_descs(NULL, L"H", 1, &desc), BAD_ARG);
+    CHECK(font_size_get_unhinted_glyph_descs(size48, L"H", 1, &desc), OK);
+    CHECK(desc.character, L'H');
+    CHECK(abs(desc.width - desc48.width) <= 1, true);
+    CHECK(font_size_get_glyph_advances(NULL, L"H", 1, advances), BAD_ARG);
+    CHECK(font_size_get_glyph_advances(size48, L"H", 1, advances), OK);
+    CHECK(abs(advances[0] - desc48.width) <= 1, true);
+
+    /* Sizes do not depend on the default size of the font */
+    CHECK(font_rsrc_set_size(font, 48, 48), OK);
+    CHECK(font_rsrc_get_glyph(font, L'H', &glyph2), OK);
+    CHECK(font_glyph_get_desc(glyph2, &desc), OK);
+    CHECK(memcmp(&desc, &desc48, sizeof(desc)), 0);
+    CHECK(font_glyph_ref_put(glyph2), OK);
+    CHECK(font_rsrc_get_glyph_descs(font, L"H", 1, &desc), OK);
+    CHECK(memcmp(&desc, &desc48, sizeof(desc)), 0);
+    CHECK(font_size_get_glyph(size12, L'H', &glyph2), OK);
+    CHECK(glyph2, glyph); /* Cached */
+    CHECK(font_glyph_ref_put(glyph2), OK);
+    CHECK(font_glyph_ref_put(glyph), OK);
+    CHECK(font_rsrc_get_line_space(font, &i), OK);
+    CHECK(i, line_space48);
+
+    /* Size handles survive a reload of their font */
+    CHECK(font_rsrc_load(font, path), OK);
+    CHECK(font_size_get_glyph(size12, L'H', &glyph), OK);
+    CHECK(font_glyph_get_desc(glyph, &desc), OK);
+    CHECK(memcmp(&desc, &desc12, sizeof(desc)), 0);
+    CHECK(font_glyph_ref_put(glyph), OK);
+
+    CHECK(font_size_ref_get(NULL), BAD_ARG);
+    CHECK(font_size_ref_get(size12), OK);
+    CHECK(font_size_ref_put(NULL), BAD_ARG);
+    CHECK(font_size_ref_put(size12), OK);
+    CHECK(font_size_ref_put(size12), OK);
+    CHECK(font_size_ref_put(size48), OK);
+    CHECK(font_rsrc_set_size(font, 16, 16), OK);
+  }
+
+  /* Subpixel glyph variants */
+  CHECK(font_rsrc_get_subpixel_glyph(NULL, L'a', 0, &glyph), BAD_ARG);
+  CHECK(font_rsrc_get_subpixel_glyph(font, L'a', 0, NULL), BAD_ARG);
+  CHECK(font_rsrc_get_subpixel_glyph(font, L'a', -1, &glyph), BAD_ARG);
+  CHECK(font_rsrc_get_subpixel_glyph
+    (font, L'a', FONT_SUBPIXEL_PHASES, &glyph), BAD_ARG);
+  CHECK(font_rsrc_get_subpixel_glyph
+    (font, (wchar_t)0x10FFFF, 1, &glyph), BAD_ARG);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_rsrc_get_subpixel_glyph(font, L'a', 0, &glyph2), OK);
+  CHECK(glyph2, glyph);
+  CHECK(font_glyph_ref_put(glyph2), OK);
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  for(i = 1; i < FONT_SUBPIXEL_PHASES; ++i) {
+    struct font_glyph_desc desc2;
+    CHECK(font_rsrc_get_subpixel_glyph(font, L'a', i, &glyph2), OK);
+    CHECK(font_rsrc_get_subpixel_glyph(font, L'a', i, &glyph3), OK);
+    CHECK(glyph3, glyph2); /* Cached */
+    CHECK(font_glyph_ref_put(glyph3), OK);
+    if(!b) { /* Bitmap glyphs cannot be shifted */
+      CHECK(glyph2, glyph);
+    } else {
+      NCHECK(glyph2, glyph);
+      CHECK(font_glyph_get_desc(glyph, &desc), OK);
+      CHECK(font_glyph_get_desc(glyph2, &desc2), OK);
+      CHECK(desc2.character, desc.character);
+      CHECK(desc2.width, desc.width);
+      CHECK(desc2.bbox.x_min >= desc.bbox.x_min, true);
+      CHECK(desc2.bbox.x_max >= desc.bbox.x_max, true);
+      CHECK(desc2.bbox.x_max <= desc.bbox.x_max + 1, true);
+      CHECK(font_glyph_get_bitmap(glyph2, true, &w, &h, &Bpp, NULL), OK);
+      CHECK(w > 0 && h > 0, true);
+    }
+    CHECK(font_glyph_ref_put(glyph2), OK);
+  }
+  CHECK(font_glyph_ref_put(glyph), OK);
+  if(b) {
+    CHECK(font_size_create(font, 12, 12, &size12), OK);
+    CHECK(font_size_get_subpixel_glyph(NULL, L'a', 1, &glyph), BAD_ARG);
+    CHECK(font_size_get_subpixel_glyph(size12, L'a', 1, NULL), BAD_ARG);
+    CHECK(font_size_get_subpixel_glyph(size12, L'a', -1, &glyph), BAD_ARG);
+    CHECK(font_size_get_subpixel_glyph(size12, L'a', 1, &glyph), OK);
+    CHECK(font_size_get_subpixel_glyph(size12, L'a', 0, &glyph2), OK);
+    NCHECK(glyph2, glyph);
+    CHECK(font_glyph_ref_put(glyph2), OK);
+    CHECK(font_size_get_glyph(size12, L'a', &glyph2), OK);
+    NCHECK(glyph2, glyph);
+    CHECK(font_glyph_ref_put(glyph2), OK);
+    CHECK(font_glyph_ref_put(glyph), OK);
+    CHECK(font_size_ref_put(size12), OK);
+  }
+
+  /* Concurrent glyph requests. A tiny cache budget stresses the concurrent
+   * eviction of the glyphs */
+  for(i = 32; i < 127; ++i) {
+    CHECK(font_rsrc_get_glyph(font, (wchar_t)i, &glyph), OK);
+    CHECK(font_glyph_get_desc(glyph, &descs[i - 32]), OK);
+    CHECK(font_glyph_ref_put(glyph), OK);
+  }
+  for(j = 0; j < 2; ++j) {
+    pthread_t threads[NTHREADS];
+    struct thread_data data[NTHREADS];
+    CHECK(font_rsrc_set_glyph_cache_size(font, j ? 4096 : 1024*1024), OK);
+    for(i = 0; i < NTHREADS; ++i) {
+      data[i].font = font;
+      data[i].descs = descs;
+      data[i].nerrors = 0;
+      CHECK(pthread_create
+        (threads + i, NULL, get_glyphs_concurrently, data + i), 0);
+    }
+    for(i = 0; i < NTHREADS; ++i) {
+      CHECK(pthread_join(threads[i], NULL), 0);
+      CHECK(data[i].nerrors, 0);
+    }
+  }
+  CHECK(font_rsrc_set_glyph_cache_size(font, 4*1024*1024), OK);
+
+  /* Glyph generations */
+  CHECK(font_rsrc_next_glyph_generation(NULL, &u), BAD_ARG);
+  CHECK(font_rsrc_next_glyph_generation(font, NULL), BAD_ARG);
+  CHECK(font_rsrc_release_glyph_generations(NULL, 0), BAD_ARG);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_rsrc_get_glyph(font, L'b', &glyph2), OK);
+  CHECK(font_rsrc_next_glyph_generation(font, &u), OK);
+  CHECK(font_rsrc_next_glyph_generation(font, &u2), OK);
+  CHECK(u2, u + 1);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph3), OK); /* Last used in u2 */
+  CHECK(glyph3, glyph);
+  CHECK(font_glyph_ref_put(glyph3), OK);
+  CHECK(font_rsrc_release_glyph_generations(font, u2), OK);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph3), OK);
+  CHECK(glyph3, glyph); /* Still cached */
+  CHECK(font_glyph_ref_put(glyph3), OK);
+  CHECK(font_rsrc_get_glyph(font, L'b', &glyph3), OK);
+  NCHECK(glyph3, glyph2); /* Evicted while in use */
+  CHECK(font_glyph_get_desc(glyph2, &desc), OK); /* Evicted but valid */
+  CHECK(desc.character, L'b');
+  CHECK(font_glyph_ref_put(glyph3), OK);
+  CHECK(font_glyph_ref_put(glyph2), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_next_glyph_generation(font, &u), OK);
+  CHECK(font_rsrc_release_glyph_generations(font, u), OK); /* Evict all */
+
+  /* Statistics */
+  CHECK(font_rsrc_get_stats(NULL, &stats), BAD_ARG);
+  CHECK(font_rsrc_get_stats(font, NULL), BAD_ARG);
+  CHECK(font_system_get_stats(NULL, &stats), BAD_ARG);
+  CHECK(font_system_get_stats(sys, NULL), BAD_ARG);
+  CHECK(font_rsrc_get_stats(font, &stats), OK);
+  CHECK(stats.bitmaps_size, 0); /* Every glyph was released */
+  CHECK(stats.glyphs_created, stats.glyphs_released);
+  CHECK(stats.cache_hits > 0, true);
+  CHECK(stats.cache_misses > 0, true);
+  CHECK(stats.cache_evictions > 0, true);
+  CHECK(stats.ft_allocated_size, 0);
+  CHECK(stats.load_time > 0, true);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph2), OK);
+  CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, NULL), OK);
+  buffer = MEM_ALLOC(&mem_default_allocator, (size_t)(w * h * Bpp) + 1);
+  NCHECK(buffer, NULL);
+  CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, buffer), OK);
+  MEM_FREE(&mem_default_allocator, buffer);
+  CHECK(font_rsrc_get_stats(font, &stats2), OK);
+  CHECK(stats2.glyphs_created, stats.glyphs_created + 1);
+  CHECK(stats2.cache_misses, stats.cache_misses + 1);
+  CHECK(stats2.cache_hits, stats.cache_hits + 1);
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  if(b && w * h > 0) /* The bitmaps of bitmap fonts are not copied */
+    CHECK(stats2.bitmaps_size > 0, true);
+  CHECK(stats2.rasterize_time >= stats.rasterize_time, true);
+  CHECK(stats2.copy_time >= stats.copy_time, true);
+  CHECK(font_glyph_ref_put(glyph2), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_system_get_stats(sys, &stats), OK);
+  CHECK(stats.ft_allocated_size > 0, true);
+  CHECK(stats.ft_allocations_count > 0, true);
+  CHECK(stats.glyphs_created >= stats2.glyphs_created, true);
+  CHECK(font_rsrc_create(sys, path, &font2), OK);
+  CHECK(font_rsrc_ref_put(font2), OK);
+  font2 = NULL;
+  CHECK(font_system_get_stats(sys, &stats2), OK);
+  /* Released FreeType blocks remain counted */
+  CHECK(stats2.ft_allocations_count > stats.ft_allocations_count, true);
+
+  /* Trace hooks */
+  memset(&trace, 0, sizeof(trace));
+  trace.font = font;
+  trace.is_valid = true;
+  hooks.begin = trace_begin;
+  hooks.end = trace_end;
+  hooks.data = &trace;
+  CHECK(font_system_set_trace_hooks(NULL, &hooks), BAD_ARG);
+  CHECK(font_system_set_trace_hooks(sys, &hooks), OK);
+  CHECK(font_rsrc_load(font, path), OK);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_glyph_get_bitmap(glyph, false, NULL, NULL, NULL, NULL), OK);
+  CHECK(font_glyph_get_bitmap(glyph, false, NULL, NULL, NULL, NULL), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_get_glyphs
+    (font, text, 26, true, descs, NULL, NULL, NULL), OK); /* One request */
+  CHECK(font_system_set_trace_hooks(sys, NULL), OK);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(trace.is_valid, true);
+  CHECK(trace.is_nested, false);
+  CHECK(trace.nbegins[FONT_TRACE_LOAD], 1);
+  CHECK(trace.nbegins[FONT_TRACE_GET_GLYPH], 2);
+  CHECK(trace.nbegins[FONT_TRACE_GET_BITMAP], 2);
+  CHECK(memcmp(trace.nbegins, trace.nends, sizeof(trace.nends)), 0);
+
+  /* Text measurement and layout */
+  CHECK(font_rsrc_measure_text(NULL, L"ab", 2, &metrics), BAD_ARG);
+  CHECK(font_rsrc_measure_text(font, NULL, 2, &metrics), BAD_ARG);
+  CHECK(font_rsrc_measure_text(font, L"ab", 2, NULL), BAD_ARG);
+  CHECK(font_rsrc_measure_text(font, NULL, 0, &metrics), OK);
+  CHECK(metrics.width, 0);
+  CHECK(metrics.height, 0);
+  CHECK(metrics.lines_count, 0);
+
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_glyph_get_desc(glyph, &desc), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_get_line_space(font, &i), OK);
+  CHECK(font_rsrc_measure_text(font, L"a", 1, &metrics), OK);
+  CHECK(metrics.width, desc.width);
+  CHECK(metrics.height, i);
+  CHECK(metrics.lines_count, 1);
+  CHECK(metrics.bbox.x_min, desc.bbox.x_min);
+  CHECK(metrics.bbox.y_min, desc.bbox.y_min);
+  CHECK(metrics.bbox.x_max, desc.bbox.x_max);
+  CHECK(metrics.bbox.y_max, desc.bbox.y_max);
+
+  CHECK(font_rsrc_layout_text(font, L"ab\nab", 5, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_layout_text(font, L"ab\nab", 5, positions, NULL), OK);
+  CHECK(font_rsrc_layout_text(font, L"ab\nab", 5, positions, &metrics), OK);
+  CHECK(metrics.lines_count, 2);
+  CHECK(metrics.height, 2 * i);
+  CHECK(positions[0].character, L'a');
+  CHECK(positions[0].x, 0);
+  CHECK(positions[0].y, 0);
+  CHECK(positions[2].character, L'\n');
+  CHECK(positions[3].x, 0);
+  CHECK(positions[3].y, -i);
+  CHECK(positions[4].x, positions[1].x);
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  if(!b) /* Bitmap fonts have no kerning */
+    CHECK(positions[1].x, desc.width);
+  CHECK(font_rsrc_measure_text(font, L"ab\nab", 5, &metrics2), OK);
+  CHECK(memcmp(&metrics, &metrics2, sizeof(metrics)), 0);
+  CHECK(metrics.bbox.y_min <= -i, true);
+  CHECK(metrics.bbox.y_max > 0, true);
+
+  /* Text rendering */
+  memset(a8, 0, sizeof(a8));
+  target.pixels = a8[0];
+  target.width = 128;
+  target.height = 64;
+  target.stride = 128;
+  target.format = FONT_FORMAT_A8;
+  target.clip.x_min = target.clip.y_min = 0;
+  target.clip.x_max = 128;
+  target.clip.y_max = 64;
+  CHECK(font_rsrc_draw_text(NULL, L"a", 1, true, white, &target, 8, 40),
+    BAD_ARG);
+  CHECK(font_rsrc_draw_text(font, NULL, 1, true, white, &target, 8, 40),
+    BAD_ARG);
+  CHECK(font_rsrc_draw_text(font, L"a", 1, true, NULL, &target, 8, 40),
+    BAD_ARG);
+  CHECK(font_rsrc_draw_text(font, L"a", 1, true, white, NULL, 8, 40), BAD_ARG);
+  CHECK(font_rsrc_draw_glyphs(font, NULL, 1, true, white, &target, 8, 40),
+    BAD_ARG);
+  target.stride = 127;
+  CHECK(font_rsrc_draw_text(font, L"a", 1, true, white, &target, 8, 40),
+    BAD_ARG);
+  target.stride = 128;
+  target.format = FONT_FORMAT_A1;
+  CHECK(font_rsrc_draw_text(font, L"a", 1, true, white, &target, 8, 40),
+    BAD_ARG);
+  target.format = FONT_FORMAT_A8;
+  CHECK(font_rsrc_draw_text(font, NULL, 0, true, white, &target, 8, 40), OK);
+
+  /* An opaque white glyph drawn over black writes its coverage */
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_glyph_get_desc(glyph, &desc), OK);
+  CHECK(font_glyph_write_bitmap(glyph, true, FONT_FORMAT_A8, a8[1], 128,
+    8 + desc.bbox.x_min, 40 - desc.bbox.y_max), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_draw_text(font, L"a", 1, true, white, &target, 8, 40), OK);
+  CHECK(memcmp(a8[0], a8[1], sizeof(a8[0])), 0);
+
+  /* Color blending over an RGBA8 surface */
+  for(i = 0; i < 128 * 64; ++i) {
+    rgba8[i*4+0] = rgba8[i*4+1] = rgba8[i*4+2] = 0;
+    rgba8[i*4+3] = 255;
+  }
+  target.pixels = rgba8;
+  target.stride = 128 * 4;
+  target.format = FONT_FORMAT_RGBA8;
+  CHECK(font_rsrc_draw_text(font, L"a", 1, true, orange, &target, 8, 40), OK);
+  for(i = 0, j = 0; i < 128 * 64; ++i) {
+    const unsigned int a = div255((unsigned int)a8[1][i] * orange[3]);
+    j += rgba8[i*4+0] != div255(orange[0] * a)
+      || rgba8[i*4+1] != div255(orange[1] * a)
+      || rgba8[i*4+2] != 0
+      || rgba8[i*4+3] != 255;
+  }
+  CHECK(j, 0);
+
+  /* Glyph runs laid out by the caller */
+  target.pixels = a8[0];
+  target.stride = 128;
+  target.format = FONT_FORMAT_A8;
+  memset(a8, 0, sizeof(a8));
+  CHECK(font_rsrc_draw_text(font, L"ab\nab", 5, false, white, &target, 4, 20),
+    OK);
+  CHECK(font_rsrc_layout_text(font, L"ab\nab", 5, positions, NULL), OK);
+  target.pixels = a8[1];
+  CHECK(font_rsrc_draw_glyphs(font, positions, 5, false, white, &target, 4,
+    20), OK);
+  CHECK(memcmp(a8[0], a8[1], sizeof(a8[0])), 0);
+  for(i = 0, j = 0; i < 128 * 64; ++i)
+    j += a8[0][i] != 0 && a8[0][i] != 255; /* Monochrome glyphs */
+  CHECK(j, 0);
+
+  /* Pen fractions are rounded to the nearest subpixel phase */
+  for(i = 0; i < 5; ++i) {
+    positions[i].x -= 1;
+    positions[i].x_frac = 63; /* Rounded up to the next pixel */
+  }
+  memset(a8[1], 0, sizeof(a8[1]));
+  CHECK(font_rsrc_draw_glyphs(font, positions, 5, false, white, &target, 4,
+    20), OK);
+  CHECK(memcmp(a8[0], a8[1], sizeof(a8[0])), 0);
+  for(i = 0; i < 5; ++i) {
+    positions[i].x += 1;
+    positions[i].x_frac = 32; /* Half a pixel */
+  }
+  memset(a8[1], 0, sizeof(a8[1]));
+  CHECK(font_rsrc_draw_glyphs(font, positions, 5, true, white, &target, 4,
+    20), OK);
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  if(b) { /* Drawn with the glyphs of the half pixel phase */
+    for(i = 0, j = 0; i < 128 * 64; ++i)
+      j += a8[1][i] != 0;
+    CHECK(j > 0, true);
+  } else { /* Drawn at the next pixel */
+    target.pixels = a8[0];
+    memset(a8[0], 0, sizeof(a8[0]));
+    CHECK(font_rsrc_draw_text(font, L"ab\nab", 5, true, white, &target, 5,
+      20), OK);
+    CHECK(memcmp(a8[0], a8[1], sizeof(a8[0])), 0);
+  }
+
+  /* Clipping */
+  memset(a8, 0, sizeof(a8));
+  target.pixels = a8[0];
+  CHECK(font_rsrc_draw_text(font, text, 26, true, white, &target, -3, 30), OK);
+  target.pixels = a8[1];
+  target.clip.x_min = 20;
+  target.clip.x_max = 50;
+  target.clip.y_min = 25;
+  target.clip.y_max = 200;
+  CHECK(font_rsrc_draw_text(font, text, 26, true, white, &target, -3, 30), OK);
+  for(i = 0, j = 0; i < 128 * 64; ++i) {
+    const int px = i % 128, py = i / 128;
+    const bool is_in = px >= 20 && px < 50 && py >= 25;
+    j += a8[1][i] != (is_in ? a8[0][i] : 0);
+  }
+  CHECK(j, 0);
+  target.clip.x_max = target.clip.x_min; /* Empty clip rectangle */
+  memset(a8[1], 0, sizeof(a8[1]));
+  CHECK(font_rsrc_draw_text(font, text, 26, true, white, &target, 0, 30), OK);
+  for(i = 0, j = 0; i < 128 * 64; ++i)
+    j += a8[1][i] != 0;
+  CHECK(j, 0);
+  target.clip.x_min = target.clip.y_min = -100;
+  target.clip.x_max = target.clip.y_max = 1000; /* Clamped to the surface */
+  CHECK(font_rsrc_draw_text(font, text, 26, true, white, &target, -7, 2), OK);
+  CHECK(font_rsrc_draw_text(font, text, 26, true, white, &target, 100, 70),
+    OK);
+
+  /* Signed distance field */
+  CHECK(font_rsrc_get_glyph(font, L'O', &glyph), OK);
+  CHECK(font_glyph_get_sdf(NULL, 4, &w, &h, NULL), BAD_ARG);
+  CHECK(font_glyph_get_sdf(glyph, 0, &w, &h, NULL), BAD_ARG);
+  CHECK(font_glyph_get_sdf(glyph, FONT_SDF_MAX_SPREAD + 1, &w, &h, NULL),
+    BAD_ARG);
+  CHECK(font_glyph_get_bitmap(glyph, true, &i, &j, &Bpp, NULL), OK);
+  CHECK(font_glyph_get_sdf(glyph, 4, &w, &h, NULL), OK);
+  CHECK(w, i + 8);
+  CHECK(h, j + 8);
+  buffer = MEM_ALLOC(&mem_default_allocator, (size_t)(w * h));
+  NCHECK(buffer, NULL);
+  CHECK(font_glyph_get_sdf(glyph, 4, NULL, NULL, buffer), OK);
+  CHECK(buffer[0] < 16, true); /* Corners lie `spread' pixels outside */
+  CHECK(buffer[w * h - 1] < 16, true);
+  for(i = 0, j = 0; i < w * h; ++i) {
+    if(buffer[i] > 128)
+      ++j;
+  }
+  NCHECK(j, 0); /* Some pixels lie inside of the glyph */
+  /* The field is computed once per spread */
+  CHECK(font_rsrc_get_stats(font, &stats), OK);
+  buffer2 = MEM_ALLOC(&mem_default_allocator, (size_t)(w * h));
+  NCHECK(buffer2, NULL);
+  CHECK(font_glyph_get_sdf(glyph, 4, NULL, NULL, buffer2), OK);
+  CHECK(memcmp(buffer, buffer2, (size_t)(w * h)), 0);
+  CHECK(font_rsrc_get_stats(font, &stats2), OK);
+  CHECK(stats2.bitmaps_size, stats.bitmaps_size);
+  CHECK(font_glyph_get_sdf(glyph, 2, &i, &j, NULL), OK);
+  CHECK(i, w - 4);
+  CHECK(j, h - 4);
+  CHECK(font_rsrc_get_stats(font, &stats2), OK);
+  CHECK(stats2.bitmaps_size > stats.bitmaps_size, true);
+  MEM_FREE(&mem_default_allocator, buffer2);
+  buffer2 = NULL;
+  MEM_FREE(&mem_default_allocator, buffer);
+  buffer = NULL;
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_get_glyph(font, L' ', &glyph), OK);
+  CHECK(font_glyph_get_sdf(glyph, 4, &w, &h, NULL), OK);
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  if(b) /* Bitmap fonts store the empty cell of the space glyph */
+    CHECK(w * h, 0);
+  CHECK(font_glyph_ref_put(glyph), OK);
+
+  /* Pre-rendering */
+  ranges[0].first = 32;
+  ranges[0].last = 126;
+  ranges[1].first = 160;
+  ranges[1].last = 255;
+  CHECK(font_rsrc_prerender(NULL, ranges, 2, 0, 1, NULL, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_prerender(font, NULL, 2, 0, 1, NULL, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_prerender(font, ranges, 2, 1<<16, 1, NULL, NULL, NULL),
+    BAD_ARG);
+  CHECK(font_rsrc_prerender(font, ranges, 2,
+    FONT_PRERENDER_SDF(FONT_SDF_MAX_SPREAD + 1), 1, NULL, NULL, NULL),
+    BAD_ARG);
+  ranges[2].first = 64;
+  ranges[2].last = 63;
+  CHECK(font_rsrc_prerender(font, ranges, 3, 0, 1, NULL, NULL, NULL), BAD_ARG);
+  ranges[2].first = (wchar_t)INT_MIN;
+  ranges[2].last = (wchar_t)INT_MAX;
+  CHECK(font_rsrc_prerender(font, ranges, 3, 0, 1, NULL, NULL, NULL), BAD_ARG);
+  CHECK(font_rsrc_prerender(font, NULL, 0, 0, 1, NULL, NULL, NULL), OK);
+  CHECK(font_rsrc_prerender(font, ranges, 2, 0, 0, NULL, NULL, NULL), OK);
+
+  memset(&progress, 0, sizeof(progress));
+  progress.ncalls_max = SIZE_MAX;
+  progress.is_monotonic = true;
+  CHECK(font_rsrc_prerender(font, ranges, 2,
+    FONT_PRERENDER_MONO|FONT_PRERENDER_ANTIALIASED, 4, NULL,
+    track_progress, &progress), OK);
+  CHECK(progress.is_monotonic, true);
+  CHECK(progress.nchars, 95 + 96);
+  CHECK(progress.ndone, progress.nchars);
+  NCHECK(progress.ncalls, 0);
+  CHECK(font_rsrc_get_glyph(font, L'a', &glyph), OK);
+  CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, NULL), OK);
+  CHECK(font_glyph_ref_put(glyph), OK);
+  CHECK(font_rsrc_prerender(font, ranges, 2,
+    FONT_PRERENDER_ANTIALIASED|FONT_PRERENDER_SDF(4), 4, NULL, NULL, NULL), OK);
+
+  memset(&progress, 0, sizeof(progress));
+  progress.ncalls_max = 1;
+  progress.is_monotonic = true;
+  CHECK(font_rsrc_prerender(font, ranges, 2, FONT_PRERENDER_ANTIALIASED, 1,
+    NULL, track_progress, &progress), OK);
+  CHECK(progress.ncalls, 1);
+  CHECK(progress.ndone < progress.nchars, true);
+
+  /* Fonts loaded from the same path or from memory */
+  CHECK(font_rsrc_create(sys, path, &font2), OK);
+  CHECK(font_rsrc_load(font2, "/nonexistent/font.ttf") == OK, false);
+  CHECK(font_rsrc_load(font2, path), OK);
+  CHECK(font_rsrc_get_glyph(font2, L'a', &glyph), OK);
+  CHECK(font_glyph_get_desc(glyph, &desc), OK);
+  CHECK(desc.character, L'a');
+  CHECK(font_glyph_ref_put(glyph), OK);
+
+  fp = fopen(path, "rb");
+  NCHECK(fp, NULL);
+  CHECK(fseek(fp, 0, SEEK_END), 0);
+  file_size = (size_t)ftell(fp);
+  CHECK(fseek(fp, 0, SEEK_SET), 0);
+  file = MEM_ALLOC(&mem_default_allocator, file_size);
+  NCHECK(file, NULL);
+  CHECK(fread(file, 1, file_size, fp), file_size);
+  fclose(fp);
+  CHECK(font_rsrc_load_memory(NULL, file, file_size), BAD_ARG);
+  CHECK(font_rsrc_load_memory(font2, NULL, file_size), BAD_ARG);
+  CHECK(font_rsrc_load_memory(font2, file, 0), BAD_ARG);
+  CHECK(font_rsrc_load_memory(font2, file, file_size), OK);
+  CHECK(font_rsrc_get_glyph(font2, L'a', &glyph), OK);
+  CHECK(font_glyph_get_desc(glyph, &desc), OK);
+  CHECK(desc.character, L'a');
+  CHECK(font_glyph_ref_put(glyph), OK);
+
+  /* Fonts loaded from user streams */
+  memset(&mem_stream, 0, sizeof(mem_stream));
+  mem_stream.data = file;
+  mem_stream.size = file_size;
+  stream.read = read_memory_stream;
+  stream.release = release_memory_stream;
+  stream.size = file_size;
+  stream.data = &mem_stream;
+  CHECK(font_rsrc_create(sys, NULL, &font3), OK);
+  CHECK(font_rsrc_load_stream(NULL, &stream), BAD_ARG);
+  CHECK(font_rsrc_load_stream(font3, NULL), BAD_ARG);
+  stream.read = NULL;
+  CHECK(font_rsrc_load_stream(font3, &stream), BAD_ARG);
+  stream.read = read_memory_stream;
+  stream.size = 0;
+  CHECK(font_rsrc_load_stream(font3, &stream), BAD_ARG);
+  stream.size = 64; /* Truncated font */
+  CHECK(font_rsrc_load_stream(font3, &stream) == OK, false);
+  CHECK(mem_stream.nreleases, 0); /* Not released on failure */
+  stream.size = file_size;
+  mem_stream.nbytes_read = 0;
+  CHECK(font_rsrc_load_stream(font3, &stream), OK);
+  for(i = 32; i < 127; ++i) {
+    struct font_glyph_desc desc2;
+    unsigned char* bitmap = NULL;
+    CHECK(font_rsrc_get_glyph(font2, (wchar_t)i, &glyph), OK);
+    CHECK(font_rsrc_get_glyph(font3, (wchar_t)i, &glyph2), OK);
+    CHECK(font_glyph_get_desc(glyph, &desc), OK);
+    CHECK(font_glyph_get_desc(glyph2, &desc2), OK);
+    CHECK(memcmp(&desc, &desc2, sizeof(desc)), 0);
+    descs[i - 32] = desc2;
+    CHECK(font_glyph_get_bitmap(glyph, true, &w, &h, &Bpp, NULL), OK);
+    bitmap = MEM_ALLOC(&mem_default_allocator, (size_t)(w*h*Bpp) * 2 + 1);
+    NCHECK(bitmap, NULL);
+    CHECK(font_glyph_get_bitmap(glyph, true, NULL, NULL, NULL, bitmap), OK);
+    CHECK(font_glyph_get_bitmap
+      (glyph2, true, NULL, NULL, NULL, bitmap + w*h*Bpp), OK);
+    CHECK(memcmp(bitmap, bitmap + w*h*Bpp, (size_t)(w*h*Bpp)), 0);
+    MEM_FREE(&mem_default_allocator, bitmap);
+    CHECK(font_glyph_ref_put(glyph), OK);
+    CHECK(font_glyph_ref_put(glyph2), OK);
+  }
+  CHECK(mem_stream.nbytes_read <= file_size, true); /* Each page read once */
+  CHECK(font_rsrc_set_glyph_cache_size(font3, 4096), OK);
+  {
+    pthread_t threads[NTHREADS];
+    struct thread_data data[NTHREADS];
+    for(i = 0; i < NTHREADS; ++i) {
+      data[i].font = font3;
+      data[i].descs = descs;
+      data[i].nerrors = 0;
+      CHECK(pthread_create
+        (threads + i, NULL, get_glyphs_concurrently, data + i), 0);
+    }
+    for(i = 0; i < NTHREADS; ++i) {
+      CHECK(pthread_join(threads[i], NULL), 0);
+      CHECK(data[i].nerrors, 0);
+    }
+  }
+  CHECK(mem_stream.nreleases, 0);
+  CHECK(font_rsrc_load_memory(font3, file, file_size), OK);
+  CHECK(mem_stream.nreleases, 1); /* Released on reload */
+  CHECK(font_rsrc_load_stream(font3, &stream), OK);
+  CHECK(font_rsrc_ref_put(font3), OK);
+  CHECK(mem_stream.nreleases, 2); /* Released with the font */
+
+  CHECK(font_rsrc_ref_put(font2), OK);
+  MEM_FREE(&mem_default_allocator, file);
+
   CHECK(font_rsrc_ref_get(NULL), BAD_ARG);
   CHECK(font_rsrc_ref_get(font), OK);
   CHECK(font_rsrc_ref_put(NULL), BAD_ARG);
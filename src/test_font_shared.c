@@ -0,0 +1,245 @@
+#include "font_rsrc.h"
+#include <snlsys/mem_allocator.h>
+#include <snlsys/snlsys.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define OK FONT_NO_ERROR
+#define BAD_ARG FONT_INVALID_ARGUMENT
+#define MEM_ERR FONT_MEMORY_ERROR
+
+struct memory_stream {
+  unsigned char* data;
+  size_t size;
+  bool is_broken; /* Fail the reads */
+};
+
+static size_t
+read_memory_stream
+  (void* data, const size_t offset, void* buffer, const size_t size)
+{
+  struct memory_stream* stream = data;
+  size_t n = 0;
+  if(stream->is_broken || offset >= stream->size)
+    return 0;
+  n = stream->size - offset < size ? stream->size - offset : size;
+  memcpy(buffer, stream->data + offset, n);
+  return n;
+}
+
+/* Publish the printable ASCII glyphs from another process */
+static void
+publish_glyphs(const char* name, const char* path)
+{
+  struct font_shared_glyph glyph;
+  struct font_system* sys = NULL;
+  struct font_rsrc* font = NULL;
+  struct font_shared_cache* cache = NULL;
+  int i = 0;
+
+  CHECK(font_system_create(NULL, &sys), OK);
+  CHECK(font_rsrc_create(sys, path, &font), OK);
+  CHECK(font_shared_cache_create(sys, name, 512, 1 << 20, &cache), OK);
+  for(i = 32; i < 127; ++i) {
+    CHECK(font_shared_cache_get_glyph(cache, font, (wchar_t)i, true, &glyph),
+      OK);
+    CHECK(font_shared_cache_get_glyph(cache, font, (wchar_t)i, false, &glyph),
+      OK);
+  }
+  CHECK(font_shared_cache_ref_put(cache), OK);
+  CHECK(font_rsrc_ref_put(font), OK);
+  CHECK(font_system_ref_put(sys), OK);
+}
+
+int
+main(int argc, char** argv)
+{
+  char name[64];
+  char name2[64];
+  unsigned char buffer[256 * 256];
+  struct font_shared_glyph shared, shared2;
+  struct font_stream stream;
+  struct memory_stream mem_stream;
+  struct font_glyph_desc desc;
+  struct font_stats stats;
+  struct font_system* sys = NULL;
+  struct font_system* sys2 = NULL;
+  struct font_rsrc* font = NULL;
+  struct font_rsrc* font2 = NULL;
+  struct font_shared_cache* cache = NULL;
+  struct font_shared_cache* cache2 = NULL;
+  struct font_glyph* glyph = NULL;
+  FILE* fp = NULL;
+  pid_t pid = 0;
+  int status = 0;
+  int w = 0, h = 0, Bpp = 0;
+  int i = 0;
+  int j = 0;
+  bool b = false;
+
+  if(argc != 2) {
+    printf("usage: %s FONT\n", argv[0]);
+    goto error;
+  }
+  /* Tests of the different fonts may run concurrently */
+  NCHECK(snprintf(name, sizeof(name), "/font-rsrc-test-%d", (int)getpid()),
+    (int)sizeof(name));
+  NCHECK(snprintf(name2, sizeof(name2), "/font-rsrc-test2-%d", (int)getpid()),
+    (int)sizeof(name2));
+
+  CHECK(font_system_create(NULL, &sys), OK);
+  CHECK(font_rsrc_create(sys, argv[1], &font), OK);
+
+  CHECK(font_shared_cache_create(NULL, name, 512, 1 << 20, &cache), BAD_ARG);
+  CHECK(font_shared_cache_create(sys, NULL, 512, 1 << 20, &cache), BAD_ARG);
+  CHECK(font_shared_cache_create(sys, name, 0, 1 << 20, &cache), BAD_ARG);
+  CHECK(font_shared_cache_create(sys, name, 512, 0, &cache), BAD_ARG);
+  CHECK(font_shared_cache_create(sys, name, 512, 1 << 20, NULL), BAD_ARG);
+  CHECK(font_shared_cache_create(sys, "/a/b", 512, 1 << 20, &cache), BAD_ARG);
+  CHECK(font_shared_cache_unlink(NULL), BAD_ARG);
+  CHECK(font_shared_cache_unlink(name), BAD_ARG); /* Not created */
+
+  /* Glyphs published by another process are read without rasterization */
+  pid = fork();
+  NCHECK(pid, -1);
+  if(pid == 0) {
+    publish_glyphs(name, argv[1]);
+    _exit(0);
+  }
+  CHECK(waitpid(pid, &status, 0), pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, true);
+
+  /* The sizes of an existing object are kept */
+  CHECK(font_shared_cache_create(sys, name, 1, 1, &cache), OK);
+  CHECK(font_shared_cache_get_glyph(NULL, font, L'a', true, &shared), BAD_ARG);
+  CHECK(font_shared_cache_get_glyph(cache, NULL, L'a', true, &shared), BAD_ARG);
+  CHECK(font_shared_cache_get_glyph(cache, font, L'a', true, NULL), BAD_ARG);
+  CHECK(font_rsrc_create(sys, NULL, &font2), OK);
+  CHECK(font_shared_cache_get_glyph(cache, font2, L'a', true, &shared),
+    BAD_ARG); /* No face */
+  CHECK(font_rsrc_ref_put(font2), OK);
+  CHECK(font_system_create(NULL, &sys2), OK);
+  CHECK(font_rsrc_create(sys2, argv[1], &font2), OK);
+  CHECK(font_shared_cache_get_glyph(cache, font2, L'a', true, &shared),
+    BAD_ARG); /* Other system */
+  CHECK(font_rsrc_ref_put(font2), OK);
+  CHECK(font_system_ref_put(sys2), OK);
+
+  for(i = 32; i < 127; ++i) {
+    CHECK(font_shared_cache_get_glyph
+      (cache, font, (wchar_t)i, true, &shared), OK);
+    CHECK(shared.desc.character, (wchar_t)i);
+  }
+  CHECK(font_rsrc_get_stats(font, &stats), OK);
+  CHECK(stats.glyphs_created, 0);
+
+  /* Shared glyphs match the glyphs of the font */
+  for(i = 32; i < 127; ++i) {
+    for(j = 0; j < 2; ++j) {
+      b = j != 0;
+      CHECK(font_shared_cache_get_glyph
+        (cache, font, (wchar_t)i, b, &shared), OK);
+      CHECK(font_rsrc_get_glyph(font, (wchar_t)i, &glyph), OK);
+      CHECK(font_glyph_get_desc(glyph, &desc), OK);
+      CHECK(memcmp(&desc, &shared.desc, sizeof(desc)), 0);
+      CHECK(font_glyph_get_bitmap(glyph, b, &w, &h, &Bpp, NULL), OK);
+      CHECK(shared.bitmap.width, w);
+      CHECK(shared.bitmap.height, h);
+      if(!w || !h) {
+        CHECK(shared.bitmap.pixels, NULL);
+      } else {
+        CHECK(Bpp, 1);
+        CHECK((size_t)(w * h) <= sizeof(buffer), true);
+        CHECK(font_glyph_get_bitmap(glyph, b, NULL, NULL, NULL, buffer), OK);
+        CHECK(memcmp(shared.bitmap.pixels, buffer, (size_t)(w * h)), 0);
+      }
+      CHECK(font_glyph_ref_put(glyph), OK);
+    }
+  }
+  CHECK(font_shared_cache_get_glyph
+    (cache, font, (wchar_t)0x10FFFF, true, &shared), BAD_ARG);
+
+  /* The mappings of a same object share their glyphs */
+  CHECK(font_shared_cache_create(sys, name, 512, 1 << 20, &cache2), OK);
+  CHECK(font_shared_cache_get_glyph(cache, font, L'e', true, &shared), OK);
+  CHECK(font_shared_cache_get_glyph(cache2, font, L'e', true, &shared2), OK);
+  CHECK(memcmp(&shared.desc, &shared2.desc, sizeof(shared.desc)), 0);
+  CHECK(shared.bitmap.width, shared2.bitmap.width);
+  CHECK(shared.bitmap.height, shared2.bitmap.height);
+  NCHECK(shared.bitmap.pixels, shared2.bitmap.pixels);
+  CHECK(memcmp(shared.bitmap.pixels, shared2.bitmap.pixels,
+    (size_t)(shared.bitmap.width * shared.bitmap.height)), 0);
+  CHECK(font_shared_cache_ref_put(cache2), OK);
+
+  /* Glyphs are keyed by the font size */
+  CHECK(font_rsrc_is_scalable(font, &b), OK);
+  if(b) {
+    CHECK(font_shared_cache_get_glyph(cache, font, L'H', true, &shared), OK);
+    CHECK(font_rsrc_set_size(font, 48, 48), OK);
+    CHECK(font_shared_cache_get_glyph(cache, font, L'H', true, &shared2), OK);
+    CHECK(shared.bitmap.height < shared2.bitmap.height, true);
+  }
+
+  /* A stream that cannot be read is not keyed */
+  fp = fopen(argv[1], "rb");
+  NCHECK(fp, NULL);
+  CHECK(fseek(fp, 0, SEEK_END), 0);
+  mem_stream.size = (size_t)ftell(fp);
+  CHECK(fseek(fp, 0, SEEK_SET), 0);
+  mem_stream.data = MEM_ALLOC(&mem_default_allocator, mem_stream.size);
+  NCHECK(mem_stream.data, NULL);
+  CHECK(fread(mem_stream.data, 1, mem_stream.size, fp), mem_stream.size);
+  CHECK(fclose(fp), 0);
+  mem_stream.is_broken = false;
+  stream.read = read_memory_stream;
+  stream.release = NULL;
+  stream.size = mem_stream.size;
+  stream.data = &mem_stream;
+  CHECK(font_rsrc_create(sys, NULL, &font2), OK);
+  CHECK(font_rsrc_load_stream(font2, &stream), OK);
+  mem_stream.is_broken = true;
+  CHECK(font_shared_cache_get_glyph(cache, font2, L'a', true, &shared),
+    FONT_INTERNAL_ERROR);
+  mem_stream.is_broken = false;
+  CHECK(font_shared_cache_get_glyph(cache, font2, L'a', true, &shared), OK);
+  CHECK(font_rsrc_ref_put(font2), OK);
+  MEM_FREE(&mem_default_allocator, mem_stream.data);
+
+  /* The object outlives its mappings until it is unlinked */
+  CHECK(font_shared_cache_ref_get(NULL), BAD_ARG);
+  CHECK(font_shared_cache_ref_get(cache), OK);
+  CHECK(font_shared_cache_ref_put(NULL), BAD_ARG);
+  CHECK(font_shared_cache_ref_put(cache), OK);
+  CHECK(font_shared_cache_ref_put(cache), OK);
+  CHECK(font_shared_cache_unlink(name), OK);
+  CHECK(font_shared_cache_unlink(name), BAD_ARG);
+
+  /* Full cache */
+  CHECK(font_shared_cache_create(sys, name2, 4, 4096, &cache), OK);
+  for(i = 32; i < 127; ++i) {
+    const enum font_error err = font_shared_cache_get_glyph
+      (cache, font, (wchar_t)i, true, &shared);
+    if(err != OK) {
+      CHECK(err, MEM_ERR);
+      break;
+    }
+  }
+  CHECK(i < 127, true);
+  CHECK(font_shared_cache_get_glyph(cache, font, L' ', true, &shared), OK);
+  CHECK(font_shared_cache_ref_put(cache), OK);
+  CHECK(font_shared_cache_unlink(name2), OK);
+
+  CHECK(font_rsrc_ref_put(font), OK);
+  CHECK(font_system_ref_put(sys), OK);
+
+  CHECK(MEM_ALLOCATED_SIZE(&mem_default_allocator), 0);
+  return 0;
+
+error:
+  return -1;
+}